@@ -0,0 +1,902 @@
+/*
+ * =============================================================================
+ * LOAD GENERATOR - THROUGHPUT, HANDSHAKE RATE AND LATENCY PERCENTILES
+ * =============================================================================
+ * Build and run with:   make bench && ./.bin/loadgen [options]
+ *
+ * Opens --connections sockets (spread over --threads event loops, the same
+ * epoll/kqueue wrapper the server uses) and keeps each one busy with one
+ * request at a time:
+ *
+ *     keep-alive (default)    connect, handshake, then request after request
+ *     --close                 a new connection (and TLS handshake) per request
+ *
+ * TLS is the default, with client.crt/client.key for the server's mutual
+ * TLS; --resume reuses TLS sessions so handshakes can be abbreviated.
+ *
+ * Latencies are recorded in an HdrHistogram-style log-linear histogram:
+ * 64 linear sub-buckets per power of two, so every value is kept to within
+ * ~1.6% and p99.9 is as precise as p50, with constant memory per thread.
+ * =============================================================================
+ */
+
+#include <stdio.h>          // printf, fprintf
+#include <stdlib.h>         // calloc, exit, strtol
+#include <string.h>         // memcmp, memchr, strcmp, strlen
+#include <strings.h>        // strncasecmp
+#include <errno.h>          // errno, EAGAIN, EINPROGRESS
+#include <fcntl.h>          // fcntl, O_NONBLOCK
+#include <unistd.h>         // read, write, close
+#include <pthread.h>        // pthread_create, pthread_join
+#include <signal.h>         // signal, SIGPIPE
+#include <time.h>           // clock_gettime
+#include <netdb.h>          // getaddrinfo
+#include <sys/socket.h>     // socket, connect
+#include <netinet/in.h>     // IPPROTO_TCP
+#include <netinet/tcp.h>    // TCP_NODELAY
+#include <arpa/inet.h>      // inet_pton
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+#include "event_loop.h"
+
+#define MAX_THREADS 64
+#define RESPONSE_HEAD_SIZE 16384    // Response headers must fit in this
+#define GRACE_MS 5000               // How long in-flight requests may finish after the deadline
+
+// -----------------------------------------------------------------------------
+// Histogram
+// -----------------------------------------------------------------------------
+
+#define SUB_BUCKET_BITS 7                           // 2^7 = 128 exact values at the bottom
+#define SUB_BUCKET_HALF (1 << (SUB_BUCKET_BITS - 1))
+#define HISTOGRAM_BUCKETS ((64 - SUB_BUCKET_BITS + 2) * SUB_BUCKET_HALF)
+
+/*
+ * STRUCT: histogram
+ * PURPOSE: Counts of nanosecond values in log-linear buckets
+ * WHY: Values below 128 are exact. Above that, each power of two is split
+ *      into 64 equal steps - the relative error stays below 1/64 however
+ *      large the value, like HdrHistogram with two significant digits.
+ */
+struct histogram {
+    uint64_t counts[HISTOGRAM_BUCKETS];
+    uint64_t total;
+    uint64_t max;
+};
+
+static int histogram_index(uint64_t value) {
+    int highest_bit, shift;
+
+    if (value < (1 << SUB_BUCKET_BITS)) {
+        return (int)value;
+    }
+    highest_bit = 63 - __builtin_clzll(value);
+    shift = highest_bit - SUB_BUCKET_BITS + 1;
+    // value >> shift is in [64, 128): shift * 64 + it continues where the
+    // previous power of two stopped
+    return shift * SUB_BUCKET_HALF + (int)(value >> shift);
+}
+
+/*
+ * FUNCTION: histogram_value
+ * RETURNS: The largest value that lands in bucket `index` (reporting the
+ *          top of a bucket never makes latency look better than it was)
+ */
+static uint64_t histogram_value(int index) {
+    int shift;
+
+    if (index < (1 << SUB_BUCKET_BITS)) {
+        return (uint64_t)index;
+    }
+    shift = index / SUB_BUCKET_HALF - 1;
+    return (((uint64_t)(index - shift * SUB_BUCKET_HALF) + 1) << shift) - 1;
+}
+
+static void histogram_record(struct histogram *histogram, uint64_t value) {
+    histogram->counts[histogram_index(value)]++;
+    histogram->total++;
+    if (value > histogram->max) {
+        histogram->max = value;
+    }
+}
+
+static void histogram_merge(struct histogram *into, const struct histogram *from) {
+    int i;
+
+    for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        into->counts[i] += from->counts[i];
+    }
+    into->total += from->total;
+    if (from->max > into->max) {
+        into->max = from->max;
+    }
+}
+
+static uint64_t histogram_percentile(const struct histogram *histogram, double percentile) {
+    uint64_t wanted = (uint64_t)((double)histogram->total * percentile / 100.0 + 0.5);
+    uint64_t seen = 0;
+    int i;
+
+    if (wanted == 0) {
+        wanted = 1;
+    }
+    for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += histogram->counts[i];
+        if (seen >= wanted) {
+            uint64_t value = histogram_value(i);
+            return value < histogram->max ? value : histogram->max;
+        }
+    }
+    return histogram->max;
+}
+
+// -----------------------------------------------------------------------------
+// Options
+// -----------------------------------------------------------------------------
+
+static struct {
+    const char *host;
+    const char *port;
+    int connections;
+    int threads;
+    int duration;           // Seconds (ignored when requests is set)
+    long requests;          // Total requests, 0 = run for duration
+    int use_tls;
+    int keep_alive;         // 0 = one connection per request
+    int resume;             // 1 = offer the last TLS session again
+    const char *path;
+    const char *cert_file;
+    const char *key_file;
+    const char *ca_file;
+} options = {
+    .host = "127.0.0.1",
+    .port = "8080",
+    .connections = 50,
+    .threads = 1,
+    .duration = 10,
+    .requests = 0,
+    .use_tls = 1,
+    .keep_alive = 1,
+    .resume = 0,
+    .path = "/",
+    .cert_file = "client.crt",
+    .key_file = "client.key",
+    .ca_file = "ca.crt"
+};
+
+static void usage(const char *program) {
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  --host HOST           Server address (default 127.0.0.1)\n"
+        "  --port N              Server port (default 8080)\n"
+        "  --connections N       Concurrent connections (default 50)\n"
+        "  --threads N           Event-loop threads sharing them (default 1)\n"
+        "  --duration SEC        How long to run (default 10)\n"
+        "  --requests N          Stop after N requests instead\n"
+        "  --path PATH           URL to request (default /)\n"
+        "  --close               One connection per request (measures handshakes)\n"
+        "  --no-tls              Plain HTTP\n"
+        "  --resume              Resume TLS sessions on reconnect\n"
+        "  --cert FILE / --key FILE   Client certificate (default client.crt/.key)\n"
+        "  --ca FILE             CA for the server certificate (default ca.crt)\n",
+        program);
+    exit(EXIT_FAILURE);
+}
+
+static long parse_number(const char *option, const char *value, long min, long max) {
+    char *end;
+    long number = strtol(value, &end, 10);
+
+    if (*value == '\0' || *end != '\0' || number < min || number > max) {
+        fprintf(stderr, "Invalid %s value: %s\n", option, value);
+        exit(EXIT_FAILURE);
+    }
+    return number;
+}
+
+static void parse_args(int argc, char **argv) {
+    int i;
+
+    for (i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+
+        if (strcmp(arg, "--close") == 0) {
+            options.keep_alive = 0;
+            continue;
+        }
+        if (strcmp(arg, "--no-tls") == 0) {
+            options.use_tls = 0;
+            continue;
+        }
+        if (strcmp(arg, "--resume") == 0) {
+            options.resume = 1;
+            continue;
+        }
+        if (!value) {
+            usage(argv[0]);
+        }
+        i++;
+
+        if (strcmp(arg, "--host") == 0) {
+            options.host = value;
+        } else if (strcmp(arg, "--port") == 0) {
+            options.port = value;
+        } else if (strcmp(arg, "--connections") == 0) {
+            options.connections = (int)parse_number(arg, value, 1, 100000);
+        } else if (strcmp(arg, "--threads") == 0) {
+            options.threads = (int)parse_number(arg, value, 1, MAX_THREADS);
+        } else if (strcmp(arg, "--duration") == 0) {
+            options.duration = (int)parse_number(arg, value, 1, 86400);
+        } else if (strcmp(arg, "--requests") == 0) {
+            options.requests = parse_number(arg, value, 1, 1000000000L);
+        } else if (strcmp(arg, "--path") == 0) {
+            options.path = value;
+        } else if (strcmp(arg, "--cert") == 0) {
+            options.cert_file = value;
+        } else if (strcmp(arg, "--key") == 0) {
+            options.key_file = value;
+        } else if (strcmp(arg, "--ca") == 0) {
+            options.ca_file = value;
+        } else {
+            usage(argv[0]);
+        }
+    }
+    if (options.threads > options.connections) {
+        options.threads = options.connections;
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Clients
+// -----------------------------------------------------------------------------
+
+enum client_state {
+    CLIENT_CONNECTING,      // TCP connect in progress
+    CLIENT_HANDSHAKE,       // TLS handshake in progress
+    CLIENT_SENDING,         // Request partly written
+    CLIENT_RECEIVING,       // Waiting for (the rest of) the response
+    CLIENT_DONE             // Finished - no more requests
+};
+
+struct loader;
+
+struct client {
+    event_handler handler;          // MUST be first (see event_loop.h)
+    struct loader *loader;
+    SSL *ssl;
+    enum client_state state;
+    int events;
+    uint64_t connect_start_ns;
+    uint64_t request_start_ns;
+    size_t sent;
+    size_t received;                // Head bytes in buffer
+    size_t head_length;             // 0 until the blank line was seen
+    uint64_t body_expected;
+    uint64_t body_received;
+    int server_closes;              // Response said "Connection: close"
+    char buffer[RESPONSE_HEAD_SIZE];
+};
+
+/*
+ * STRUCT: loader
+ * PURPOSE: One thread's share of the clients, with its own counters and
+ *          histograms (merged after the run - no locking while measuring)
+ */
+struct loader {
+    pthread_t thread;
+    event_loop *loop;
+    struct client *clients;
+    int count;
+    int active;                     // Clients not DONE
+    long budget;                    // Requests left to start (-1 = unlimited)
+    uint64_t deadline_ns;
+    uint64_t end_ns;                // When the last response arrived
+    SSL_SESSION *session;           // Offered again with --resume
+
+    uint64_t requests;
+    uint64_t non_2xx;
+    uint64_t errors;
+    uint64_t connect_failures;      // Reported once, not per client
+    uint64_t connects;
+    uint64_t handshakes;
+    uint64_t resumed;
+    uint64_t bytes;
+    struct histogram latency;       // Request written -> response complete
+    struct histogram handshake;     // connect() -> TLS handshake complete
+};
+
+static struct addrinfo *server_address;
+static SSL_CTX *tls_context;
+static char request_text[1024];
+static size_t request_length;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void client_connect(struct client *client);
+
+static void client_want(struct client *client, int events) {
+    if (client->events != events) {
+        event_loop_modify(client->loader->loop, &client->handler, events);
+        client->events = events;
+    }
+}
+
+static void client_disconnect(struct client *client) {
+    if (client->handler.fd < 0) {
+        return;
+    }
+    event_loop_remove(client->loader->loop, &client->handler);
+    if (client->ssl) {
+        SSL_shutdown(client->ssl);      // Best effort: lets the server cache the session
+        SSL_free(client->ssl);
+        client->ssl = NULL;
+    }
+    close(client->handler.fd);
+    client->handler.fd = -1;
+}
+
+static void client_finish(struct client *client) {
+    client_disconnect(client);
+    client->state = CLIENT_DONE;
+    client->loader->active--;
+}
+
+/*
+ * FUNCTION: run_over
+ * RETURNS: 1 once no more requests should start (budget used up or deadline)
+ */
+static int run_over(const struct loader *loader) {
+    return loader->budget == 0 || now_ns() >= loader->deadline_ns;
+}
+
+/*
+ * FUNCTION: start_request
+ * RETURNS: 1 to carry on sending, -1 if the client is done
+ */
+static int start_request(struct client *client) {
+    if (run_over(client->loader)) {
+        client_finish(client);
+        return -1;
+    }
+    if (client->loader->budget > 0) {
+        client->loader->budget--;
+    }
+    client->state = CLIENT_SENDING;
+    client->sent = 0;
+    client->received = 0;
+    client->head_length = 0;
+    client->body_received = 0;
+    client->request_start_ns = now_ns();
+    return 1;
+}
+
+/*
+ * FUNCTION: reconnect
+ * PURPOSE: Replace the connection with a new one, unless the run is over
+ */
+static void reconnect(struct client *client) {
+    client_disconnect(client);
+    if (run_over(client->loader)) {
+        client_finish(client);
+    } else {
+        client_connect(client);
+    }
+}
+
+/*
+ * FUNCTION: client_failed
+ * PURPOSE: Count an error and carry on with a fresh connection
+ */
+static void client_failed(struct client *client) {
+    client->loader->errors++;
+    reconnect(client);
+}
+
+static void client_connect(struct client *client) {
+    struct loader *loader = client->loader;
+    int fd = socket(server_address->ai_family, SOCK_STREAM, 0);
+    int on = 1;
+
+    client->connect_start_ns = now_ns();
+    loader->connects++;
+    if (fd < 0) {
+        perror("socket");
+        client_finish(client);
+        return;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+    client->handler.fd = fd;
+    client->state = CLIENT_CONNECTING;
+    client->events = EVENT_WRITE;
+    if (event_loop_add(loader->loop, &client->handler, EVENT_WRITE) < 0) {
+        perror("event_loop_add");
+        close(fd);
+        client->handler.fd = -1;
+        client_finish(client);
+        return;
+    }
+    if (connect(fd, server_address->ai_addr, server_address->ai_addrlen) < 0 &&
+        errno != EINPROGRESS) {
+        perror("connect");
+        client_finish(client);
+    }
+    // Connected or not, writability tells us when it's settled
+}
+
+/*
+ * FUNCTION: ssl_want
+ * RETURNS: EVENT_READ / EVENT_WRITE to wait for, 0 on a real error
+ */
+static int ssl_want(struct client *client, int result) {
+    switch (SSL_get_error(client->ssl, result)) {
+    case SSL_ERROR_WANT_READ:
+        return EVENT_READ;
+    case SSL_ERROR_WANT_WRITE:
+        return EVENT_WRITE;
+    default:
+        return 0;
+    }
+}
+
+static int on_connected(struct client *client) {
+    int error = 0;
+    socklen_t length = sizeof(error);
+
+    struct sockaddr_storage peer;
+    socklen_t peer_length = sizeof(peer);
+
+    // A stale event for the previous socket may arrive first: only a
+    // socket with a peer has finished connecting
+    if (getpeername(client->handler.fd, (struct sockaddr *)&peer, &peer_length) < 0) {
+        getsockopt(client->handler.fd, SOL_SOCKET, SO_ERROR, &error, &length);
+        if (error == 0) {
+            return 0;
+        }
+        if (client->loader->connect_failures++ == 0) {
+            fprintf(stderr, "connect: %s\n", strerror(error));
+        }
+        client->loader->errors++;
+        client_finish(client);      // Server down - retrying would just spin
+        return -1;
+    }
+
+    if (!options.use_tls) {
+        return start_request(client);
+    }
+
+    client->ssl = SSL_new(tls_context);
+    SSL_set_app_data(client->ssl, client);
+    SSL_set_fd(client->ssl, client->handler.fd);
+    {
+        unsigned char address[16];
+        // SNI carries names only, never IP addresses
+        if (inet_pton(AF_INET, options.host, address) != 1 &&
+            inet_pton(AF_INET6, options.host, address) != 1) {
+            SSL_set_tlsext_host_name(client->ssl, options.host);
+        }
+    }
+    if (options.resume && client->loader->session) {
+        SSL_set_session(client->ssl, client->loader->session);
+    }
+    client->state = CLIENT_HANDSHAKE;
+    return 1;
+}
+
+static int do_handshake(struct client *client) {
+    struct loader *loader = client->loader;
+    int result = SSL_connect(client->ssl);
+
+    if (result != 1) {
+        int want = ssl_want(client, result);
+        if (!want) {
+            ERR_print_errors_fp(stderr);
+            client_failed(client);
+            return -1;
+        }
+        client_want(client, want);
+        return 0;
+    }
+
+    histogram_record(&loader->handshake, now_ns() - client->connect_start_ns);
+    loader->handshakes++;
+    loader->resumed += SSL_session_reused(client->ssl);
+    return start_request(client);
+}
+
+static int do_send(struct client *client) {
+    while (client->sent < request_length) {
+        ssize_t bytes;
+
+        if (client->ssl) {
+            bytes = SSL_write(client->ssl, request_text + client->sent, (int)(request_length - client->sent));
+            if (bytes <= 0) {
+                int want = ssl_want(client, (int)bytes);
+                if (!want) {
+                    client_failed(client);
+                    return -1;
+                }
+                client_want(client, want);
+                return 0;
+            }
+        } else {
+            bytes = write(client->handler.fd, request_text + client->sent, request_length - client->sent);
+            if (bytes < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                    client_want(client, EVENT_WRITE);
+                    return 0;
+                }
+                client_failed(client);
+                return -1;
+            }
+        }
+        client->sent += (size_t)bytes;
+    }
+    client->state = CLIENT_RECEIVING;
+    client_want(client, EVENT_READ);
+    return 1;
+}
+
+/*
+ * FUNCTION: parse_head
+ * PURPOSE: Status, Content-Length and Connection of a complete response head
+ * RETURNS: 0 on success, -1 if it isn't a usable HTTP/1.x response
+ */
+static int parse_head(struct client *client) {
+    const char *line = client->buffer;
+    const char *end = client->buffer + client->head_length;
+    int have_length = 0;
+
+    if (client->head_length < 12 || memcmp(line, "HTTP/1.", 7) != 0) {
+        return -1;
+    }
+    if (line[9] != '2') {
+        client->loader->non_2xx++;
+    }
+    client->server_closes = 0;
+
+    while ((line = memchr(line, '\n', (size_t)(end - line))) != NULL && ++line < end) {
+        if (strncasecmp(line, "Content-Length:", 15) == 0) {
+            client->body_expected = strtoull(line + 15, NULL, 10);
+            have_length = 1;
+        } else if (strncasecmp(line, "Connection:", 11) == 0) {
+            const char *value = line + 11;
+            while (*value == ' ') {
+                value++;
+            }
+            client->server_closes = strncasecmp(value, "close", 5) == 0;
+        }
+    }
+    return have_length ? 0 : -1;
+}
+
+/*
+ * FUNCTION: response_complete
+ * PURPOSE: Record the request and start the next one (same or new connection)
+ * RETURNS: 1 to send the next request right away, -1 otherwise
+ */
+static int response_complete(struct client *client) {
+    struct loader *loader = client->loader;
+    uint64_t now = now_ns();
+
+    histogram_record(&loader->latency, now - client->request_start_ns);
+    loader->requests++;
+    loader->end_ns = now;
+
+    if (options.keep_alive && !client->server_closes) {
+        return start_request(client);
+    }
+    reconnect(client);
+    return -1;
+}
+
+static int do_receive(struct client *client) {
+    while (1) {
+        char discard[16384];
+        char *dest = client->head_length ? discard : client->buffer + client->received;
+        size_t space = client->head_length ? sizeof(discard) : sizeof(client->buffer) - client->received;
+        ssize_t bytes;
+
+        if (space == 0) {
+            fprintf(stderr, "Response headers larger than %d bytes\n", RESPONSE_HEAD_SIZE);
+            client_failed(client);
+            return -1;
+        }
+
+        if (client->ssl) {
+            bytes = SSL_read(client->ssl, dest, (int)space);
+            if (bytes <= 0) {
+                int want = ssl_want(client, (int)bytes);
+                if (!want) {
+                    client_failed(client);
+                    return -1;
+                }
+                client_want(client, want);
+                return 0;
+            }
+        } else {
+            bytes = read(client->handler.fd, dest, space);
+            if (bytes <= 0) {
+                if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+                    client_want(client, EVENT_READ);
+                    return 0;
+                }
+                client_failed(client);
+                return -1;
+            }
+        }
+        client->loader->bytes += (uint64_t)bytes;
+
+        if (client->head_length) {
+            client->body_received += (uint64_t)bytes;
+        } else {
+            size_t i, start = client->received >= 3 ? client->received - 3 : 0;
+
+            client->received += (size_t)bytes;
+            for (i = start; i + 4 <= client->received; i++) {
+                if (memcmp(client->buffer + i, "\r\n\r\n", 4) == 0) {
+                    client->head_length = i + 4;
+                    break;
+                }
+            }
+            if (!client->head_length) {
+                continue;
+            }
+            if (parse_head(client) < 0) {
+                fprintf(stderr, "Unusable response (no Content-Length?)\n");
+                client_failed(client);
+                return -1;
+            }
+            client->body_received = client->received - client->head_length;
+        }
+
+        if (client->body_received >= client->body_expected) {
+            return response_complete(client);
+        }
+    }
+}
+
+static void client_on_event(event_handler *handler, int events) {
+    struct client *client = (struct client *)handler;  // handler is the first member
+    int result = 1;
+
+    (void)events;   // The calls below report errors themselves
+
+    while (result == 1) {
+        switch (client->state) {
+        case CLIENT_CONNECTING:
+            result = on_connected(client);
+            break;
+        case CLIENT_HANDSHAKE:
+            result = do_handshake(client);
+            break;
+        case CLIENT_SENDING:
+            result = do_send(client);
+            break;
+        case CLIENT_RECEIVING:
+            result = do_receive(client);
+            break;
+        case CLIENT_DONE:
+            return;
+        }
+    }
+}
+
+/*
+ * FUNCTION: remember_session
+ * PURPOSE: OpenSSL callback for each new session (TLS 1.3 sends them as
+ *          tickets after the handshake) - keep the latest for --resume
+ * RETURNS: 1 = we took the reference
+ */
+static int remember_session(SSL *ssl, SSL_SESSION *session) {
+    struct client *client = SSL_get_app_data(ssl);
+
+    if (client->loader->session) {
+        SSL_SESSION_free(client->loader->session);
+    }
+    client->loader->session = session;
+    return 1;
+}
+
+static void *loader_main(void *arg) {
+    struct loader *loader = arg;
+    uint64_t hard_stop = loader->deadline_ns + (uint64_t)GRACE_MS * 1000000ULL;
+    int i;
+
+    for (i = 0; i < loader->count; i++) {
+        struct client *client = &loader->clients[i];
+        client->loader = loader;
+        client->handler.fd = -1;
+        client->handler.on_event = client_on_event;
+        client->ssl = NULL;
+        client_connect(client);
+    }
+
+    while (loader->active > 0) {
+        if (event_loop_run_once(loader->loop, 100) < 0 && errno != EINTR) {
+            perror("event_loop_run_once");
+            break;
+        }
+        if (now_ns() > hard_stop) {
+            // Stuck requests are errors, not latency samples
+            for (i = 0; i < loader->count; i++) {
+                if (loader->clients[i].state != CLIENT_DONE) {
+                    loader->errors++;
+                    client_finish(&loader->clients[i]);
+                }
+            }
+        }
+    }
+    return NULL;
+}
+
+// -----------------------------------------------------------------------------
+// Setup and report
+// -----------------------------------------------------------------------------
+
+static SSL_CTX *create_tls_context(void) {
+    SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+
+    if (!ctx) {
+        return NULL;
+    }
+    // The server asks for a client certificate (mutual TLS)
+    if (SSL_CTX_use_certificate_file(ctx, options.cert_file, SSL_FILETYPE_PEM) <= 0 ||
+        SSL_CTX_use_PrivateKey_file(ctx, options.key_file, SSL_FILETYPE_PEM) <= 0 ||
+        SSL_CTX_load_verify_locations(ctx, options.ca_file, NULL) <= 0) {
+        SSL_CTX_free(ctx);
+        return NULL;
+    }
+    // Chain only: test certificates rarely name 127.0.0.1
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+
+    if (options.resume) {
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+        SSL_CTX_sess_set_new_cb(ctx, remember_session);
+    }
+    return ctx;
+}
+
+static void print_duration(uint64_t ns) {
+    if (ns < 10000) {
+        printf(" %7lluns", (unsigned long long)ns);
+    } else if (ns < 10000000) {
+        printf(" %7.1fus", (double)ns / 1e3);
+    } else if (ns < 10000000000ULL) {
+        printf(" %7.2fms", (double)ns / 1e6);
+    } else {
+        printf(" %7.2fs ", (double)ns / 1e9);
+    }
+}
+
+static void print_percentiles(const char *title, const struct histogram *histogram) {
+    static const double percentiles[] = { 50, 90, 99, 99.9, 99.99 };
+    size_t i;
+
+    if (histogram->total == 0) {
+        return;
+    }
+    printf("%s (%llu samples)\n", title, (unsigned long long)histogram->total);
+    printf("        p50       p90       p99     p99.9    p99.99       max\n");
+    for (i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); i++) {
+        print_duration(histogram_percentile(histogram, percentiles[i]));
+    }
+    print_duration(histogram->max);
+    printf("\n");
+}
+
+int main(int argc, char **argv) {
+    static struct loader loaders[MAX_THREADS];
+    static struct loader total;
+    struct addrinfo hints = { 0 };
+    struct client *clients;
+    uint64_t start, end = 0;
+    double seconds;
+    int i, error, first = 0;
+
+    parse_args(argc, argv);
+    signal(SIGPIPE, SIG_IGN);   // A server closing on us is an error count, not a crash
+
+    hints.ai_socktype = SOCK_STREAM;
+    error = getaddrinfo(options.host, options.port, &hints, &server_address);
+    if (error != 0) {
+        fprintf(stderr, "%s: %s\n", options.host, gai_strerror(error));
+        return EXIT_FAILURE;
+    }
+    if (options.use_tls && !(tls_context = create_tls_context())) {
+        ERR_print_errors_fp(stderr);
+        return EXIT_FAILURE;
+    }
+
+    request_length = (size_t)snprintf(request_text, sizeof(request_text),
+                                      "GET %s HTTP/1.1\r\nHost: %s:%s\r\n%s\r\n",
+                                      options.path, options.host, options.port,
+                                      options.keep_alive ? "" : "Connection: close\r\n");
+    if (request_length >= sizeof(request_text)) {
+        fprintf(stderr, "--path is too long\n");
+        return EXIT_FAILURE;
+    }
+
+    clients = calloc((size_t)options.connections, sizeof(*clients));
+    if (!clients) {
+        perror("calloc");
+        return EXIT_FAILURE;
+    }
+
+    printf("%d %s connections to %s:%s%s over %d thread%s, %s, ",
+           options.connections, options.use_tls ? "TLS" : "plain", options.host, options.port,
+           options.path, options.threads, options.threads == 1 ? "" : "s",
+           options.keep_alive ? "keep-alive" : "one request per connection");
+    if (options.requests) {
+        printf("%ld requests\n", options.requests);
+    } else {
+        printf("%d s\n", options.duration);
+    }
+    fflush(stdout);
+
+    start = now_ns();
+    for (i = 0; i < options.threads; i++) {
+        struct loader *loader = &loaders[i];
+        int count = options.connections / options.threads + (i < options.connections % options.threads);
+
+        loader->clients = clients + first;
+        loader->count = count;
+        loader->active = count;
+        first += count;
+        loader->budget = -1;
+        if (options.requests) {
+            loader->budget = options.requests / options.threads + (i < options.requests % options.threads);
+        }
+        loader->deadline_ns = options.requests ? UINT64_MAX / 2 : start + (uint64_t)options.duration * 1000000000ULL;
+        loader->loop = event_loop_create();
+        if (!loader->loop || pthread_create(&loader->thread, NULL, loader_main, loader) != 0) {
+            perror("Unable to start load thread");
+            return EXIT_FAILURE;
+        }
+    }
+
+    for (i = 0; i < options.threads; i++) {
+        struct loader *loader = &loaders[i];
+
+        pthread_join(loader->thread, NULL);
+        total.requests += loader->requests;
+        total.non_2xx += loader->non_2xx;
+        total.errors += loader->errors;
+        total.connects += loader->connects;
+        total.handshakes += loader->handshakes;
+        total.resumed += loader->resumed;
+        total.bytes += loader->bytes;
+        histogram_merge(&total.latency, &loader->latency);
+        histogram_merge(&total.handshake, &loader->handshake);
+        if (loader->end_ns > end) {
+            end = loader->end_ns;
+        }
+    }
+
+    seconds = end > start ? (double)(end - start) / 1e9 : 0;
+    if (seconds <= 0) {
+        fprintf(stderr, "No responses received\n");
+        return EXIT_FAILURE;
+    }
+    printf("\n");
+    printf("Requests:    %llu in %.2f s = %.0f req/s (%.1f MB/s)\n",
+           (unsigned long long)total.requests, seconds, (double)total.requests / seconds,
+           (double)total.bytes / seconds / 1e6);
+    printf("Connections: %llu", (unsigned long long)total.connects);
+    if (options.use_tls) {
+        printf(", %llu handshakes = %.0f/s (%llu resumed)", (unsigned long long)total.handshakes,
+               (double)total.handshakes / seconds, (unsigned long long)total.resumed);
+    }
+    printf("\nErrors:      %llu (non-2xx responses: %llu)\n\n",
+           (unsigned long long)total.errors, (unsigned long long)total.non_2xx);
+    print_percentiles("Request latency", &total.latency);
+    print_percentiles("Connect + TLS handshake", &total.handshake);
+    return total.errors > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,66 @@
+#!/bin/sh
+# =============================================================================
+# PGO TRAINING RUN - LOAD FOR THE INSTRUMENTED SERVER (make pgo-generate)
+# =============================================================================
+# The compiler can only lay the hot paths out well if it knows which paths
+# are hot. This runs the instrumented .bin/tinyserver under the load
+# generator, so the profile comes from the requests it will really serve:
+#
+#   - keep-alive and one request per connection over plain HTTP
+#   - a static file from --root (file cache, compression negotiation)
+#   - the same over mutual TLS - full and resumed handshakes - if the
+#     certificates are in the current directory (see README)
+#
+# The counters are written when the server exits, so every run ends with
+# SIGTERM and a clean shutdown, never kill -9.
+#
+# Settings: PGO_PORT (default 18080), PGO_SECONDS per run (default 5)
+# =============================================================================
+
+set -e
+
+SERVER=./.bin/tinyserver
+LOADGEN=./.bin/loadgen
+PORT=${PGO_PORT:-18080}
+DURATION=${PGO_SECONDS:-5}
+
+# serve ARGS... - start the server in the background
+serve() {
+    "$SERVER" --port "$PORT" --workers 2 "$@" > /dev/null &
+    pid=$!
+    sleep 1
+}
+
+# stop - shut the server down cleanly, so it writes its profile
+stop() {
+    kill -TERM "$pid"
+    wait "$pid" || true
+}
+
+# load ARGS... - one load generator run, just the summary
+load() {
+    echo "  loadgen $*"
+    "$LOADGEN" --port "$PORT" --duration "$DURATION" "$@" | grep -E "^(Requests|Errors):" | sed 's/^/    /'
+}
+
+echo "Training: plain HTTP"
+serve --no-tls
+load --no-tls
+load --no-tls --close --connections 8
+stop
+
+echo "Training: static files"
+serve --no-tls --root .
+load --no-tls --path /README.md
+stop
+
+if [ -f server.crt ] && [ -f server.key ] && [ -f ca.crt ] && [ -f client.crt ] && [ -f client.key ]; then
+    echo "Training: mutual TLS"
+    serve
+    load
+    load --close --resume --connections 8
+    load --close --connections 8
+    stop
+else
+    echo "Training: no certificates here - skipping mutual TLS"
+fi
@@ -0,0 +1,143 @@
+/*
+ * =============================================================================
+ * ACCESS LOG - ONE LINE PER REQUEST, WRITTEN BY A THREAD OF ITS OWN
+ * =============================================================================
+ * A write() to a log file can block for a long time (a full disk queue, an
+ * NFS hiccup), and an event loop that blocks stops serving everybody. So
+ * workers never touch the log file:
+ *
+ *   worker 0 --> [ ring of fixed-size records ] --+
+ *   worker 1 --> [ ring of fixed-size records ] --+--> log thread --> write()
+ *   worker 2 --> [ ring of fixed-size records ] --+    (64 KB at a time)
+ *
+ *   - a worker copies a few numbers and the request line into the next
+ *     free record of its own ring - no formatting, no system call, no lock
+ *     (one writer and one reader per ring, see struct access_log)
+ *   - the log thread turns records into text and writes them in big batches
+ *   - if the disk is so slow that a ring fills up, new records are dropped
+ *     and counted instead of waiting: the server stays fast, the log has a gap
+ *
+ * Lines use the Common Log Format most log tools understand:
+ *
+ *   192.0.2.7 - - [14/Oct/2026:09:30:00 +0000] "GET /index.html HTTP/1.1" 200 5120
+ *
+ * Failed TLS handshakes go through the same rings to stderr, thinned out by
+ * --error-log-sample and --error-log-rate: a scanner hammering the port
+ * must not turn into millions of log lines.
+ * =============================================================================
+ */
+
+#ifndef TINYSERVER_ACCESS_LOG_H
+#define TINYSERVER_ACCESS_LOG_H
+
+#include <stdint.h>         // uint64_t
+#include <time.h>           // time_t
+#include <sys/socket.h>     // struct sockaddr
+
+#include "metrics.h"        // METRICS_CACHE_LINE, enum handshake_failure
+#include "output.h"
+
+#define ACCESS_LOG_RECORD 256       // Bytes per record (4 cache lines)
+#define ACCESS_LOG_TEXT 208         // Request line bytes kept (longer = cut)
+
+enum access_record_kind {
+    ACCESS_RECORD_REQUEST,          // A request was answered
+    ACCESS_RECORD_HANDSHAKE         // A TLS handshake failed
+};
+
+enum access_protocol {
+    ACCESS_HTTP_1_0,
+    ACCESS_HTTP_1_1,
+    ACCESS_HTTP_2
+};
+
+/*
+ * STRUCT: log_peer
+ * PURPOSE: Client address in raw form - turned into text by the log thread
+ */
+struct log_peer {
+    uint8_t family;                 // AF_INET, AF_INET6 or 0 (unknown)
+    uint8_t address[16];
+};
+
+struct access_record {
+    int64_t time;                   // Wall clock second
+    uint64_t value;                 // Request: bytes sent; handshake: OpenSSL error code
+    uint32_t suppressed;            // Handshake: failures not logged since the last one
+    uint16_t status;                // Request: HTTP status; handshake: handshake_failure
+    uint8_t kind;                   // enum access_record_kind
+    uint8_t protocol;               // enum access_protocol
+    struct log_peer peer;
+    uint16_t text_length;
+    char text[ACCESS_LOG_TEXT];     // "METHOD /path?query"
+};
+
+_Static_assert(sizeof(struct access_record) == ACCESS_LOG_RECORD, "access_record size");
+
+/*
+ * STRUCT: access_log
+ * PURPOSE: One worker's ring of records, shared with the log thread
+ * RULE: head is written only by the worker, tail only by the log thread.
+ *       Each sits on its own cache line so the two never slow each other down
+ */
+struct access_log {
+    struct access_record *records;  // size records, size a power of two
+    uint64_t mask;                  // size - 1
+    uint64_t tail_seen;             // Worker's last look at tail (saves reloads)
+    uint64_t error_second;          // Rate limit: the second being counted
+    uint32_t error_count;           //   failures logged within it
+    uint32_t error_skipped;         //   failures not logged since the last line
+    uint64_t error_seen;            // Sampling: failures so far
+    uint64_t head __attribute__((aligned(METRICS_CACHE_LINE)));    // Next record to fill
+    uint64_t tail __attribute__((aligned(METRICS_CACHE_LINE)));    // Next record to write out
+} __attribute__((aligned(METRICS_CACHE_LINE)));
+
+/*
+ * FUNCTION: access_log_create
+ * PURPOSE: Allocate one worker's ring and register it with the log thread
+ * RULE: Call before access_log_start() (the list is not locked)
+ * RETURNS: The ring, or NULL on failure
+ */
+struct access_log *access_log_create(void);
+
+/*
+ * FUNCTION: access_log_start
+ * PURPOSE: Open --access-log (if set) and start the thread that writes the rings
+ * RETURNS: 0 on success, -1 on failure
+ */
+int access_log_start(void);
+
+/*
+ * FUNCTION: access_log_stop
+ * PURPOSE: Write out every record still in the rings and stop the log thread
+ * RULE: Once the workers are gone - records logged afterwards are lost
+ */
+void access_log_stop(void);
+
+/*
+ * FUNCTION: access_log_peer
+ * PURPOSE: Keep the client address from accept() in raw form
+ */
+void access_log_peer(struct log_peer *peer, const struct sockaddr *address);
+
+/*
+ * FUNCTION: access_log_request
+ * PURPOSE: Log one answered request, read back from what was queued for it
+ * PARAMETER: output - the queue; part/length - its part count and length
+ *            before the answer was pushed (the status line is the next part)
+ * RETURNS: 0 if logged or logging is off, -1 if the ring was full (dropped)
+ */
+int access_log_request(struct access_log *log, time_t now, const struct log_peer *peer,
+                       enum access_protocol protocol, const char *method, size_t method_length,
+                       const char *url, size_t url_length,
+                       const struct output_queue *output, int part, size_t length);
+
+/*
+ * FUNCTION: access_log_handshake
+ * PURPOSE: Log a failed TLS handshake, if sampling and the rate limit allow
+ * RETURNS: 0 if logged or skipped on purpose, -1 if the ring was full (dropped)
+ */
+int access_log_handshake(struct access_log *log, time_t now, const struct log_peer *peer,
+                         enum handshake_failure reason, unsigned long error);
+
+#endif // TINYSERVER_ACCESS_LOG_H
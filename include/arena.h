@@ -0,0 +1,52 @@
+/*
+ * =============================================================================
+ * ARENA - BUMP ALLOCATOR FOR PER-REQUEST DATA
+ * =============================================================================
+ * Small bits of data made while answering requests (header values, numbers
+ * turned into text) all die at the same moment: when the responses have
+ * been sent. So instead of malloc()/free() for each one, they are cut from
+ * one block by moving a pointer forward, and arena_reset() releases them
+ * all at once:
+ *
+ *     [ used | used | used |          free          ]
+ *                          ^ used
+ * =============================================================================
+ */
+
+#ifndef TINYSERVER_ARENA_H
+#define TINYSERVER_ARENA_H
+
+#include <stddef.h>     // size_t
+
+struct arena {
+    char *base;         // Memory the arena hands out (owned by the caller)
+    size_t size;
+    size_t used;
+};
+
+/*
+ * FUNCTION: arena_init
+ * PURPOSE: Hand out memory from [base, base + size)
+ */
+void arena_init(struct arena *arena, void *base, size_t size);
+
+/*
+ * FUNCTION: arena_alloc
+ * PURPOSE: Cut `size` bytes (aligned to `align`, a power of two) from the arena
+ * RETURNS: The memory, or NULL if the arena is full
+ */
+void *arena_alloc(struct arena *arena, size_t size, size_t align);
+
+/*
+ * FUNCTION: arena_room
+ * PURPOSE: Check whether `size` unaligned bytes would still fit
+ */
+int arena_room(const struct arena *arena, size_t size);
+
+/*
+ * FUNCTION: arena_reset
+ * PURPOSE: Release everything allocated so far in one go
+ */
+void arena_reset(struct arena *arena);
+
+#endif // TINYSERVER_ARENA_H
@@ -0,0 +1,158 @@
+/*
+ * =============================================================================
+ * COMPRESS - gzip AND brotli RESPONSES, PRECOMPRESSED STATIC FILES
+ * =============================================================================
+ * Text compresses to a fraction of its size, and bandwidth costs more than
+ * CPU - but only if the CPU is spent once per file, not once per request.
+ *
+ * The client lists what it can decode in Accept-Encoding; we answer with
+ * brotli if it takes that (smaller), else gzip, else the bytes as they are:
+ *
+ *     Accept-Encoding: gzip, deflate, br   -->  Content-Encoding: br
+ *     Accept-Encoding: gzip;q=1, br;q=0    -->  Content-Encoding: gzip
+ *
+ * Static files are never compressed while a client waits. A file's
+ * compressed variants come from:
+ *   1. FILE.br / FILE.gz next to it (made at deploy time), or
+ *   2. with --compress-cache DIR, variants a background thread built the
+ *      first time the file was asked for. Until they exist the file goes
+ *      out uncompressed; from then on it is sendfile() of the variant.
+ *
+ * Small in-memory answers from handlers (the echo page, for instance) are
+ * compressed as they are queued: the encoder is fed one body part after
+ * the other, and anything under --compress-min bytes isn't worth the work.
+ * Streamed answers (stream.h) keep an encoder for their whole life and
+ * flush it after every piece.
+ * =============================================================================
+ */
+
+#ifndef TINYSERVER_COMPRESS_H
+#define TINYSERVER_COMPRESS_H
+
+#include <stddef.h>         // size_t
+#include <sys/stat.h>       // struct stat
+#include <sys/uio.h>        // struct iovec
+#include <zlib.h>           // z_stream
+#include <brotli/encode.h>  // BrotliEncoderState
+
+#include "router.h"
+
+#define COMPRESS_FILE_MAX (64 << 20)    // Bigger files are never precompressed
+
+// gzip and brotli levels: the most the format offers for files (built once),
+// cheap settings for answers compressed per request
+#define COMPRESS_GZIP_BEST 9
+#define COMPRESS_GZIP_FAST 5
+#define COMPRESS_BROTLI_BEST 11
+#define COMPRESS_BROTLI_FAST 4
+
+enum content_encoding {
+    ENCODING_IDENTITY = 0,
+    ENCODING_GZIP = 1,
+    ENCODING_BROTLI = 2
+};
+
+// Bit masks of encodings, as returned by compress_accepted()
+#define ACCEPT_GZIP (1 << ENCODING_GZIP)
+#define ACCEPT_BROTLI (1 << ENCODING_BROTLI)
+
+/*
+ * STRUCT: compressor
+ * PURPOSE: One gzip or brotli stream, fed and drained piece by piece
+ */
+struct compressor {
+    enum content_encoding encoding;
+    z_stream zlib;                  // ENCODING_GZIP
+    BrotliEncoderState *brotli;     // ENCODING_BROTLI
+};
+
+/*
+ * FUNCTION: compressor_start
+ * PURPOSE: Set up a stream - best = 1 for the smallest output, 0 for speed
+ * RETURNS: 0 on success, -1 if out of memory
+ */
+int compressor_start(struct compressor *compressor, enum content_encoding encoding, int best);
+
+#define COMPRESS_FLUSH 2    // compressor_run(): out with everything so far
+
+/*
+ * FUNCTION: compressor_run
+ * PURPOSE: Compress from *input into *output, moving both forward
+ * PARAMETER: finish - 1 once all input has been passed: flush everything.
+ *            COMPRESS_FLUSH: the client gets all input so far, in a stream
+ *            that goes on (costs a few bytes - for streamed answers)
+ * RETURNS: 1 when finished (all output written - after COMPRESS_FLUSH, all
+ *          there is so far), 0 when it needs more input or output room,
+ *          -1 on error
+ */
+int compressor_run(struct compressor *compressor, const unsigned char **input, size_t *input_length,
+                   unsigned char **output, size_t *output_room, int finish);
+
+/*
+ * FUNCTION: compressor_end
+ * PURPOSE: Free the stream's memory
+ */
+void compressor_end(struct compressor *compressor);
+
+/*
+ * FUNCTION: compress_accepted
+ * PURPOSE: The encodings the client takes (ACCEPT_* bits, 0 = none)
+ * RULE: Always 0 with --no-compress
+ */
+int compress_accepted(const struct http_request *request, const char *data);
+
+/*
+ * FUNCTION: compress_worthwhile
+ * PURPOSE: Whether a body of this type compresses at all (text, JSON, SVG...)
+ * WHY: Images, video and fonts are compressed already - trying again only
+ *      burns CPU and often makes them bigger
+ */
+int compress_worthwhile(const struct segment *content_type);
+
+/*
+ * Headers for the answer: which encoding it uses, and that the choice
+ * depended on Accept-Encoding (so caches keep one copy per encoding)
+ */
+const struct segment *compress_header(enum content_encoding encoding);
+extern const struct segment compress_vary;
+
+/*
+ * FUNCTION: compress_queue_body
+ * PURPOSE: Queue a complete answer whose body lies in memory, compressed if
+ *          the type, the size and the client allow it
+ * PARAMETER: body/count - the body's buffers (they stay referenced when it
+ *            goes out as it is)
+ * RETURNS: 1 if queued, 0 if the output queue has no room left for it
+ * RULE: At most RESPONSE_MAX_PARTS - 4 body buffers. The compressed copy
+ *       lives in the output queue's scratch area - an answer that doesn't
+ *       compress into what is left there is sent uncompressed
+ */
+int compress_queue_body(const struct http_context *context, const struct segment *status,
+                        const struct segment *content_type, const struct iovec *body, int count);
+
+/*
+ * FUNCTION: compress_cache_start
+ * PURPOSE: Start the thread that builds variants into config.compress_cache
+ * RETURNS: 0 on success (or nothing to do), -1 on failure
+ */
+int compress_cache_start(void);
+
+/*
+ * FUNCTION: compress_cache_stop
+ * PURPOSE: Stop the builder thread (a half-written variant is thrown away)
+ */
+void compress_cache_stop(void);
+
+/*
+ * FUNCTION: compress_open_variant
+ * PURPOSE: Open the best compressed variant of a file that the client takes
+ * PARAMETERS: path - the file (opened by the caller), info - its fstat()
+ *             accepted - ACCEPT_* bits from compress_accepted()
+ * RETURNS: The variant's fd (*encoding and *size set), or -1 if there is
+ *          none yet - then one is built in the background, if enabled
+ * RULE: Worker threads only ever open files here, they never compress
+ */
+int compress_open_variant(const char *path, size_t path_length, const struct stat *info, int accepted,
+                          enum content_encoding *encoding, size_t *size);
+
+#endif // TINYSERVER_COMPRESS_H
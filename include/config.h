@@ -0,0 +1,94 @@
+/*
+ * =============================================================================
+ * CONFIG - RUNTIME SETTINGS FROM THE COMMAND LINE
+ * =============================================================================
+ * All tunable settings live in one struct so every module reads them the
+ * same way. The values are filled in once at startup by config_parse_args()
+ * and are read-only afterwards, so worker threads can read them freely.
+ * =============================================================================
+ */
+
+#ifndef TINYSERVER_CONFIG_H
+#define TINYSERVER_CONFIG_H
+
+#define MAX_WORKERS 256     // Upper limit for --workers
+#define MAX_SNI_HOSTS 32    // Upper limit for --sni
+#define MAX_UPSTREAMS 32    // Upper limit for --upstream
+
+// One --sni HOST:CERT:KEY virtual host
+struct sni_host {
+    const char *name;        // Hostname, may start with "*." (one label wildcard)
+    const char *cert_file;
+    const char *key_file;
+};
+
+struct server_config {
+    int port;                // TCP port to listen on
+    int listen_backlog;      // Accept queue length of each listening socket
+    int defer_accept;        // Seconds to wait for the first data (0 = off, Linux)
+    int fastopen;            // TCP Fast Open queue length (0 = off)
+    int tcp_nodelay;         // 1 = disable Nagle on accepted sockets
+    int rcvbuf;              // SO_RCVBUF in bytes (0 = kernel autotuning)
+    int sndbuf;              // SO_SNDBUF in bytes (0 = kernel autotuning)
+    int accept_batch;        // Clients accepted per listener wakeup
+    int use_tls;             // 1 = use TLS/SSL, 0 = plain HTTP
+    const char *cert_file;   // Server certificate (PEM)
+    const char *key_file;    // Its private key (PEM)
+    const char *ca_file;     // CA that client certificates must chain to
+    const char *crl_file;    // Revoked client certificates (PEM CRLs, NULL = none)
+    int verify_cache_size;   // Verified client certificates remembered per context (0 = off)
+    struct sni_host sni_hosts[MAX_SNI_HOSTS];
+    int sni_count;
+    int worker_count;        // Event-loop threads (0 on the command line = one per core)
+    int keepalive_timeout;   // Seconds an idle connection may stay open
+    int keepalive_requests;  // Requests served before a connection is closed
+    int handshake_timeout;   // Seconds from accept to a finished TLS handshake
+    int header_timeout;      // Seconds from a request's first byte to its last header
+    int worker_connections;  // Open connections per worker (0 = no limit)
+    int max_connections;     // Open connections in total (0 = no limit)
+    int max_handshakes;      // TLS handshakes in progress per worker (0 = no limit)
+    int drain_timeout;       // Seconds connections get to finish on shutdown
+    int session_cache_size;  // TLS sessions kept for resumption (0 = no cache)
+    int session_timeout;     // Seconds a TLS session stays resumable
+    int session_tickets;     // 1 = issue stateless session tickets
+    int ticket_key_lifetime; // Seconds before a new ticket key takes over
+    int http2;               // 1 = offer HTTP/2 via ALPN (TLS only)
+    int ktls;                // 1 = let the kernel do TLS record encryption
+    int ocsp_stapling;       // 1 = staple OCSP answers to handshakes (see ocsp.h)
+    const char *ocsp_url;    // Responder for all certificates (NULL = their own)
+    int handshake_threads;   // Crypto threads for TLS handshakes (0 = inline)
+    int max_headers;         // Header lines allowed per request
+    int max_header_size;     // Bytes allowed for request line + headers
+    int max_body_size;       // MB a request body may have (0 = no limit)
+    const char *document_root; // Directory served as static files (NULL = echo page)
+    int compress;            // 1 = gzip/brotli for clients that take it
+    int compress_min_size;   // Smaller in-memory bodies go out uncompressed
+    const char *compress_cache; // Where compressed file variants are built (NULL = off)
+    int file_cache_size;     // MB of small static files kept in memory (0 = off)
+    const char *upstreams[MAX_UPSTREAMS]; // HOST:PORT backends for the proxy (see proxy.h)
+    int upstream_count;
+    const char *proxy_prefix; // Requests under this path go to the backends
+    int balance_hash;        // 1 = consistent hash of the URL, 0 = least connections
+    int upstream_keepalive;  // Idle connections kept per backend and worker
+    int upstream_timeout;    // Seconds a request may wait for its backend
+    int health_interval;     // Seconds between backend health checks (0 = none)
+    const char *health_path; // What a health check asks for
+    int io_uring;            // 1 = serve plain HTTP through io_uring (Linux)
+    int metrics_port;        // Admin port for GET /metrics (0 = off)
+    const char *metrics_address; // Address it listens on (loopback by default)
+    const char *access_log;  // Access log file, "-" = stdout (NULL = off)
+    int access_log_buffer;   // Records each worker may have waiting for the log thread
+    int error_log_sample;    // Log one of every N failed handshakes
+    int error_log_rate;      // At most N handshake errors per second per worker (0 = all)
+};
+
+// The one and only configuration (defined in config.c)
+extern struct server_config config;
+
+/*
+ * FUNCTION: config_parse_args
+ * PURPOSE: Fill in the global config from argv (exits on invalid input)
+ */
+void config_parse_args(int argc, char **argv);
+
+#endif // TINYSERVER_CONFIG_H
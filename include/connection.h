@@ -0,0 +1,204 @@
+/*
+ * =============================================================================
+ * CONNECTION - PER-CLIENT STATE MACHINE
+ * =============================================================================
+ * With non-blocking sockets a client can't be served "top to bottom" in one
+ * go: any read or write may return "not ready yet". So each client remembers
+ * WHERE it is in its life and picks up from there on the next event:
+ *
+ *     HANDSHAKE --> READING --> WRITING --> CLOSING --> LINGERING
+ *     (TLS only)       ^            |
+ *                      +------------+  keep-alive: wait for the next request
+ *
+ * Pipelining: a client may send several requests without waiting for the
+ * answers. Every complete request found in request_buffer gets its response
+ * appended to the output queue in arrival order, so answers go back in order.
+ * Requests are parsed in place (see http_parser.h) - request_start simply
+ * moves forward past each one that has been answered.
+ *
+ * Queued responses may point straight into request_buffer (method, URL), so
+ * nothing is read into it - and it is never compacted - until the output
+ * queue is empty again.
+ *
+ * Request bodies stream through body_buffer, one more pool buffer held only
+ * while a body comes in: everything behind the headers moves there, each
+ * piece is decoded and handed to the route (see router.h), and only then
+ * is more read from the client. A route that can't take a piece yet (its
+ * output queue is full) stops the reading until the queue has been sent -
+ * TCP flow control passes that back to the client, so an upload of any
+ * size needs no more memory than a small request. Input that came in
+ * behind a body goes back to request_buffer once the output queue is empty.
+ *
+ * A streamed answer (see stream.h) is made in stream_buffer, one piece each
+ * time everything queued has been sent; requests pipelined behind it wait
+ * until its last piece is queued. A route waiting for somebody else (fill
+ * said STREAM_WAIT, a body handler 0 with nothing queued) leaves the
+ * connection "waiting": no events at all until it calls stream_wake().
+ *
+ * Reads and writes go through a "transport" (plain socket or TLS, see
+ * connection.c), so the rest of the code exists once for both.
+ *
+ * Memory: connection objects and both I/O buffers come from the worker's
+ * pools (see pool.h). The buffers are only held while they are in use, so
+ * an idle keep-alive connection costs just the connection object itself.
+ *
+ * With --io-uring (plain HTTP on Linux, see uring.h) the same states are
+ * driven by completions instead of readiness: a receive or send is queued,
+ * and connection_on_completion() carries on once the kernel has done it.
+ * =============================================================================
+ */
+
+#ifndef TINYSERVER_CONNECTION_H
+#define TINYSERVER_CONNECTION_H
+
+#include <stddef.h>         // size_t
+#include <stdint.h>         // uint64_t
+#include <sys/socket.h>     // struct msghdr
+#include <openssl/ssl.h>    // SSL
+
+#include "access_log.h"
+#include "crypto_pool.h"
+#include "event_loop.h"
+#include "http_parser.h"
+#include "metrics.h"
+#include "output.h"
+#include "stream.h"
+#include "timer_wheel.h"
+#include "uring.h"
+
+#define BUFFER_SIZE 4096        // Size of buffer for HTTP requests
+#define TLS_RECORD_SIZE 16384   // Largest TLS record payload
+
+struct worker;
+struct h2_session;
+struct transport;
+
+enum connection_state {
+    CONN_HANDSHAKE,     // TLS handshake in progress
+    CONN_READING,       // Waiting for the full request headers
+    CONN_WRITING,       // Sending the queued response(s)
+    CONN_CLOSING,       // TLS close_notify being sent
+    CONN_LINGERING,     // Our side is shut, draining input until the client closes
+    CONN_CLOSED         // Socket closed, memory freed after this loop pass
+};
+
+enum body_state {
+    BODY_IDLE,          // No body being received
+    BODY_STREAMING,     // Coming in and handed to the route piece by piece
+    BODY_RECEIVED       // All handed over - the answer waits for output room
+};
+
+typedef struct connection connection;
+
+struct connection {
+    event_handler handler;          // MUST be first (see event_loop.h)
+    struct worker *worker;          // Event loop thread that owns us
+    SSL *ssl;                       // NULL in plain HTTP mode
+    const struct transport *transport;  // Plain or TLS reads and writes (connection.c)
+    int tls_failed;                 // 1 = fatal TLS error, no clean shutdown
+    int ktls;                       // 1 = the kernel encrypts what we send
+    int offloaded;                  // 1 = a crypto thread owns us right now
+    struct crypto_task handshake;   // Handshake step run on the crypto pool
+    int handshake_status;           //   its result: 1 done, 0 waiting, -1 failed
+    int handshake_want;             //   EVENT_READ / EVENT_WRITE when waiting
+    enum handshake_failure handshake_failure;   //   why it failed (for metrics)
+    unsigned long handshake_error;  //   first OpenSSL error of a failure (for the log)
+    uint64_t accepted_us;           // Start of the handshake_time metric
+    struct log_peer peer;           // Client address (for the log)
+    enum connection_state state;
+    int events;                     // Events currently registered with the loop
+
+    char *request_buffer;           // BUFFER_SIZE bytes, NULL while idle
+    size_t request_start;           // Where the request being parsed begins
+    size_t request_length;          // End of the bytes received so far
+    struct http_request request;    // Parser state + slices of the current request
+
+    enum body_state body;           // Of the current request
+    char *body_buffer;              // BUFFER_SIZE bytes while a body comes in, NULL otherwise
+    size_t body_start;              //   decoded bytes for the route: body_ready from body_start
+    size_t body_ready;
+    size_t body_raw;                //   received bytes not yet decoded: body_raw to body_length
+    size_t body_length;
+    uint64_t body_remaining;        //   Content-Length bytes not yet received
+    uint64_t body_received;         //   decoded so far (against --max-body)
+    struct http_chunked chunked;    //   decoder for Transfer-Encoding: chunked
+    void *body_state;               //   the route's own slot (http_context.state)
+
+    struct output_queue output;     // Responses waiting to be sent
+    char *tls_buffer;               // TLS_RECORD_SIZE bytes, NULL when not writing
+    size_t tls_pending;             // Bytes in tls_buffer not yet accepted by SSL_write
+    int corked;                     // 1 = TCP_CORK/TCP_NOPUSH is on
+    struct http_streamer streamer;  // Answer still being made (fill = NULL: none)
+    char *stream_buffer;            //   TLS_RECORD_SIZE bytes for its pieces, NULL otherwise
+    int waiting;                    // 1 = stopped until the route calls stream_wake()
+
+    struct h2_session *h2;          // Set when ALPN chose HTTP/2 (see http2.h)
+
+    int uring;                      // 1 = served through io_uring, fd is a table slot
+    int uring_ops;                  //   requests in flight - memory stays until 0
+    int uring_linked;               //   a shutdown is linked behind the send
+    size_t uring_sending;           //   bytes the send in flight carries
+    struct msghdr uring_message;    //   its buffer list (points into output)
+
+    int responses_pending;          // Queued responses not yet sent completely
+    uint64_t response_start_us;     //   when the first of them was queued
+
+    int keep_alive;                 // 0 = close once the queued responses are sent
+    int requests_served;            // Counted against config.keepalive_requests
+
+    struct timer timer;             // In the worker's wheel (see worker_deadline)
+    uint64_t deadline_ms;           //   when we give up on the client
+    uint64_t header_deadline_ms;    //   fixed when a request's first bytes came, 0 = none
+
+    connection *open_prev;          // Links in the worker's open list
+    connection *open_next;
+    connection *next_closed;        // Link in the worker's deferred-free list
+};
+
+/*
+ * FUNCTION: connection_create
+ * PURPOSE: Wrap a freshly accepted (non-blocking) socket and start serving it
+ * PARAMETER: peer - client address from accept(), NULL if unknown
+ * RETURNS: New connection, or NULL if it could not be set up (fd is closed)
+ */
+connection *connection_create(struct worker *worker, int fd, const struct sockaddr *peer);
+
+/*
+ * FUNCTION: connection_create_uring
+ * PURPOSE: connection_create() for a socket accepted by io_uring
+ * PARAMETER: file - its slot in the ring's descriptor table
+ * RETURNS: New connection, or NULL if it could not be set up (slot is closed)
+ */
+connection *connection_create_uring(struct worker *worker, int file);
+
+/*
+ * FUNCTION: connection_on_completion
+ * PURPOSE: A receive, send or shutdown queued for this connection finished
+ */
+void connection_on_completion(connection *conn, const struct uring_completion *completion);
+
+/*
+ * FUNCTION: connection_close
+ * PURPOSE: Stop watching the socket, close it and queue the memory for freeing
+ * WHY: Other events for this connection may still be pending in the current
+ *      batch, so the memory must stay valid until the batch is finished.
+ *      With io_uring the kernel may even still be using the buffers, so
+ *      they are only released once the last queued request has completed.
+ */
+void connection_close(connection *conn);
+
+/*
+ * FUNCTION: connection_drain
+ * PURPOSE: The worker is shutting down: close now if idle, otherwise after
+ *          the answers in progress (see worker_drain)
+ */
+void connection_drain(connection *conn);
+
+/*
+ * FUNCTION: connection_resume
+ * PURPOSE: Carry on with a connection its route left waiting (stream_wake)
+ * RULE: Worker thread only; the connection may be closed by the time it returns
+ */
+void connection_resume(connection *conn);
+
+#endif // TINYSERVER_CONNECTION_H
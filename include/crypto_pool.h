@@ -0,0 +1,53 @@
+/*
+ * =============================================================================
+ * CRYPTO POOL - TLS HANDSHAKES OFF THE EVENT LOOP THREADS
+ * =============================================================================
+ * The expensive part of a TLS handshake is public-key crypto (the ECDHE key
+ * exchange and the certificate signature): around a millisecond of pure CPU.
+ * Done on an event loop thread, every established connection of that worker
+ * waits while it runs - and after a deploy, hundreds of clients reconnect
+ * at once.
+ *
+ * So handshake steps run on a separate pool of crypto threads instead:
+ *
+ *     worker:  client readable -> stop watching it -> crypto_pool_submit()
+ *     crypto:  SSL_accept() ... -> worker_complete()
+ *     worker:  wakes up -> task->done() -> watch the client again
+ *
+ * While a task is out, only the crypto thread touches the connection; the
+ * queue's mutex makes its changes visible to the worker that gets it back.
+ * =============================================================================
+ */
+
+#ifndef TINYSERVER_CRYPTO_POOL_H
+#define TINYSERVER_CRYPTO_POOL_H
+
+struct worker;
+
+struct crypto_task {
+    void (*run)(struct crypto_task *task);     // Called on a crypto thread
+    void (*done)(struct crypto_task *task);    // Called back on the worker thread
+    struct worker *worker;                      // Worker that gets the task back
+    struct crypto_task *next;                   // Link in the pool / worker queues
+};
+
+/*
+ * FUNCTION: crypto_pool_start
+ * PURPOSE: Start `threads` crypto threads (0 = no pool, run tasks inline)
+ * RETURNS: 0 on success, -1 on failure
+ */
+int crypto_pool_start(int threads);
+
+/*
+ * FUNCTION: crypto_pool_enabled
+ * RETURNS: 1 if tasks should be submitted, 0 if the caller runs them itself
+ */
+int crypto_pool_enabled(void);
+
+/*
+ * FUNCTION: crypto_pool_submit
+ * PURPOSE: Queue a task; run() is called on the next free crypto thread
+ */
+void crypto_pool_submit(struct crypto_task *task);
+
+#endif // TINYSERVER_CRYPTO_POOL_H
@@ -0,0 +1,100 @@
+/*
+ * =============================================================================
+ * EVENT LOOP - ONE THREAD, MANY SOCKETS
+ * =============================================================================
+ * A thin wrapper over the operating system's readiness notification API:
+ *   - Linux: epoll
+ *   - macOS / BSD: kqueue
+ *
+ * Instead of blocking in accept()/read() for one client at a time, every
+ * socket is switched to non-blocking mode and registered here. The loop then
+ * sleeps until ANY socket is ready and calls that socket's handler.
+ * =============================================================================
+ */
+
+#ifndef TINYSERVER_EVENT_LOOP_H
+#define TINYSERVER_EVENT_LOOP_H
+
+#include <stdint.h>     // uint64_t
+#include <time.h>       // time_t
+
+// Readiness flags (can be OR'ed together)
+#define EVENT_READ  0x01    // Socket has data to read (or a pending accept)
+#define EVENT_WRITE 0x02    // Socket has room in its send buffer
+#define EVENT_ERROR 0x04    // Socket hung up or reported an error
+
+typedef struct event_loop event_loop;
+typedef struct event_handler event_handler;
+
+/*
+ * STRUCT: event_handler
+ * PURPOSE: Anything that owns a file descriptor and wants to be woken up
+ * RULE: Embed this as the FIRST member of your own struct
+ * WHY: The callback can then cast the handler pointer back to the outer struct
+ */
+struct event_handler {
+    int fd;                                               // Watched descriptor
+    void (*on_event)(event_handler *handler, int events); // Called when ready
+};
+
+/*
+ * FUNCTION: event_loop_create
+ * PURPOSE: Create a new epoll/kqueue instance
+ * RETURNS: Loop pointer, or NULL on failure (errno is set)
+ */
+event_loop *event_loop_create(void);
+
+/*
+ * FUNCTION: event_loop_add / event_loop_modify / event_loop_remove
+ * PURPOSE: Start watching, change the watched events, or stop watching a handler
+ * RETURNS: 0 on success, -1 on failure (errno is set)
+ */
+int event_loop_add(event_loop *loop, event_handler *handler, int events);
+int event_loop_modify(event_loop *loop, event_handler *handler, int events);
+int event_loop_remove(event_loop *loop, event_handler *handler);
+
+/*
+ * FUNCTION: event_loop_run_once
+ * PURPOSE: Wait up to timeout_ms (-1 = forever) and dispatch ready handlers
+ * RETURNS: Number of dispatched events, or -1 on failure
+ */
+int event_loop_run_once(event_loop *loop, int timeout_ms);
+
+/*
+ * FUNCTION: event_loop_now
+ * PURPOSE: Monotonic time in milliseconds, cached when the loop last woke up
+ * WHY: Handlers need "now" for timeouts; reading the cached value is free,
+ *      while asking the kernel for every event would add up
+ */
+uint64_t event_loop_now(const event_loop *loop);
+
+/*
+ * FUNCTION: event_loop_wall_time
+ * PURPOSE: Wall-clock time in seconds, cached like event_loop_now()
+ * WHY: For things like the HTTP Date header, which only change once a second
+ */
+time_t event_loop_wall_time(const event_loop *loop);
+
+/*
+ * FUNCTION: event_loop_tick
+ * PURPOSE: Refresh the cached clocks without waiting for events
+ * WHY: For a thread that sleeps somewhere else (io_uring) but still uses
+ *      event_loop_now() for its timeouts
+ */
+void event_loop_tick(event_loop *loop);
+
+/*
+ * FUNCTION: event_loop_fd
+ * PURPOSE: The epoll/kqueue descriptor - readable while a handler is ready
+ * WHY: So a thread that sleeps somewhere else (io_uring) can still find
+ *      out when the loop has an event for it
+ */
+int event_loop_fd(const event_loop *loop);
+
+/*
+ * FUNCTION: event_loop_free
+ * PURPOSE: Close the epoll/kqueue descriptor and release the loop
+ */
+void event_loop_free(event_loop *loop);
+
+#endif // TINYSERVER_EVENT_LOOP_H
@@ -0,0 +1,139 @@
+/*
+ * =============================================================================
+ * FILE CACHE - HOT STATIC FILES KEPT IN MEMORY
+ * =============================================================================
+ * Serving a small file from disk costs open(), fstat() and close() for every
+ * request, plus a read or sendfile() of data that rarely changes. The file
+ * cache keeps a copy of each small file that was asked for, together with
+ * everything its answer needs: the compressed variants (see compress.h) and
+ * ready-made ETag / Last-Modified headers. A hit costs no system call at all,
+ * and "If-None-Match" is answered with 304 from the entry alone.
+ *
+ *     request ----> shard = hash(path) ----> entry? ---- yes --> answer
+ *                                              |
+ *                                              no --> open, read, insert
+ *
+ * Sharing: the cache is split into FILE_CACHE_SHARDS shards by path hash,
+ * each with its own lock, LRU list and share of --file-cache, so workers
+ * only meet when they want the same shard at the same moment.
+ *
+ * Lifetime: an entry is counted - one reference from its shard, one from
+ * every answer still being sent from it. Evicting or invalidating an entry
+ * only takes it out of its shard; the memory goes once the last answer is
+ * out, so a client in the middle of a download never notices.
+ *
+ * Freshness (Linux): every directory with a cached file is watched with
+ * inotify, and a change to a file (or its .br/.gz) drops its entry at once.
+ * Elsewhere entries are checked with stat() at most once a second.
+ * =============================================================================
+ */
+
+#ifndef TINYSERVER_FILE_CACHE_H
+#define TINYSERVER_FILE_CACHE_H
+
+#include <stddef.h>         // size_t
+#include <stdint.h>         // uint64_t
+#include <time.h>           // time_t
+#include <sys/stat.h>       // struct stat
+
+#include "compress.h"
+#include "output.h"
+#include "response.h"
+
+#define FILE_CACHE_SHARDS 16        // Power of two
+#define FILE_CACHE_BUCKETS 1024     // Hash buckets per shard (power of two)
+#define FILE_CACHE_FILE_MAX (1 << 20)   // Bigger files are always read from disk
+#define FILE_TAGS_MAX 128
+
+/*
+ * STRUCT: file_tags
+ * PURPOSE: The validators of one version of a file - what If-None-Match and
+ *          If-Modified-Since are compared with - and their header lines
+ */
+struct file_tags {
+    char etag[48];                  // "\"<mtime>-<size>\"", with "-br"/"-gz" for a variant
+    size_t etag_length;
+    char last_modified[32];         // "Tue, 14 Oct 2026 09:30:00 GMT"
+    size_t last_modified_length;
+    char header[FILE_TAGS_MAX];     // "ETag: ...\r\nLast-Modified: ...\r\n"
+    size_t header_length;
+};
+
+/*
+ * STRUCT: file_version
+ * PURPOSE: One representation of a cached file: as it is, or compressed
+ */
+struct file_version {
+    char *data;                     // NULL = no such variant
+    size_t size;
+    struct file_tags tags;
+};
+
+/*
+ * STRUCT: file_entry
+ * PURPOSE: A cached file. Everything but the links is read-only once built
+ */
+struct file_entry {
+    struct output_hold hold;        // MUST be first: queued answers release it
+    int references;                 // Shard + answers in flight (atomic)
+    uint64_t hash;
+    char *path;
+    size_t path_length;
+    size_t cost;                    // Bytes counted against --file-cache
+    dev_t device;                   // Which file version this is
+    ino_t inode;
+    time_t mtime;
+    time_t checked;                 // Last stat() (where there is no inotify)
+    const struct segment *content_type;
+    struct file_version versions[3];    // By enum content_encoding
+    struct file_entry *bucket_next;     // Links in the shard (under its lock)
+    struct file_entry *lru_prev;
+    struct file_entry *lru_next;
+};
+
+/*
+ * FUNCTION: file_tags_build
+ * PURPOSE: Format the validators of a file version (also for uncached files)
+ */
+void file_tags_build(struct file_tags *tags, const struct stat *info, enum content_encoding encoding);
+
+/*
+ * FUNCTION: file_cache_start
+ * PURPOSE: Set up the shards and, on Linux, the thread reading inotify events
+ * RETURNS: 0 on success (or with --file-cache 0), -1 on failure
+ */
+int file_cache_start(void);
+
+/*
+ * FUNCTION: file_cache_get
+ * PURPOSE: Look a file up by its full path
+ * RETURNS: The entry with a reference for the caller, or NULL on a miss -
+ *          then *ticket is what file_cache_add() needs afterwards
+ */
+struct file_entry *file_cache_get(const char *path, size_t length, uint64_t *ticket);
+
+/*
+ * FUNCTION: file_cache_add
+ * PURPOSE: Cache a file the caller just opened after a miss
+ * PARAMETERS: ticket - from the file_cache_get() that missed; if the file
+ *             changed since, it isn't cached (it may be half-written)
+ *             fd/info - the open file and its fstat(); fd stays the caller's
+ * RETURNS: The new entry with a reference for the caller, or NULL if the
+ *          file isn't cached (too big, changed, out of memory, cache off)
+ */
+struct file_entry *file_cache_add(const char *path, size_t length, uint64_t ticket, int fd,
+                                  const struct stat *info, const struct segment *content_type);
+
+/*
+ * FUNCTION: file_cache_release
+ * PURPOSE: Drop a reference; the last one frees the entry
+ */
+void file_cache_release(struct file_entry *entry);
+
+/*
+ * FUNCTION: file_cache_invalidate
+ * PURPOSE: Forget a file (it changed, or got a new compressed variant)
+ */
+void file_cache_invalidate(const char *path, size_t length);
+
+#endif // TINYSERVER_FILE_CACHE_H
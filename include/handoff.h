@@ -0,0 +1,71 @@
+/*
+ * =============================================================================
+ * HANDOFF - A NEW BINARY TAKES OVER WITHOUT DROPPING A CLIENT
+ * =============================================================================
+ * Stopping the old server and starting the new one leaves a gap in which
+ * the port is closed (clients get "connection refused") and the new server
+ * starts with no TLS ticket keys (every returning client does a full
+ * handshake). Instead, on SIGUSR2:
+ *
+ *      old process                              new process
+ *      -----------                              -----------
+ *      socketpair(), fork(), exec(argv)  --->   starts up, TINYSERVER_HANDOFF_FD
+ *      sendmsg(listening sockets          --->  set in its environment
+ *              as SCM_RIGHTS + ticket keys)      workers accept on THOSE sockets
+ *      drains its connections, exits     <---   "ready"
+ *
+ * SCM_RIGHTS hands over the sockets themselves, not copies: both processes
+ * accept from the same queues while they overlap, so no client is refused
+ * and none that is waiting in a queue is lost. If the new binary fails
+ * before it says ready, the old one just keeps serving.
+ * =============================================================================
+ */
+
+#ifndef TINYSERVER_HANDOFF_H
+#define TINYSERVER_HANDOFF_H
+
+#include <sys/types.h>      // pid_t
+
+/*
+ * FUNCTION: handoff_receive
+ * PURPOSE: At startup: if an old process started us, take its sockets and keys
+ * RULE: Call before creating any listening socket or thread
+ * RETURNS: 1 if we are taking over, 0 on a normal start, -1 on failure
+ */
+int handoff_receive(void);
+
+/*
+ * FUNCTION: handoff_listener
+ * RETURNS: The inherited listening socket for worker `index`, or -1 if
+ *          there is none for it (it must create one)
+ */
+int handoff_listener(int index);
+
+/*
+ * FUNCTION: handoff_metrics_socket
+ * RETURNS: The inherited metrics port socket, or -1
+ */
+int handoff_metrics_socket(void);
+
+/*
+ * FUNCTION: handoff_restore_keys
+ * PURPOSE: Adopt the old process's TLS ticket keys
+ * RULE: After the TLS contexts are set up (tls_session.h)
+ */
+void handoff_restore_keys(void);
+
+/*
+ * FUNCTION: handoff_ready
+ * PURPOSE: Tell the old process we are accepting, so it can start draining
+ * WHY: Also closes inherited sockets no worker took (--workers went down)
+ */
+void handoff_ready(void);
+
+/*
+ * FUNCTION: handoff_upgrade
+ * PURPOSE: Start argv again as a new process and hand it our sockets
+ * RETURNS: The new process once it is accepting, -1 if it failed (we carry on)
+ */
+pid_t handoff_upgrade(char *const argv[], const int *listeners, int count, int metrics);
+
+#endif // TINYSERVER_HANDOFF_H
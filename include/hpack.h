@@ -0,0 +1,115 @@
+/*
+ * =============================================================================
+ * HPACK - HTTP/2 HEADER COMPRESSION (RFC 7541)
+ * =============================================================================
+ * HTTP/1.1 sends every header as text, again and again on every request of
+ * a connection. HTTP/2 compresses header blocks instead:
+ *
+ *     static table    61 common fields everybody knows (":method: GET",
+ *                     "content-type", ...) - sent as a one-byte index
+ *     dynamic table   fields seen earlier on this connection, newest first,
+ *                     limited to 4096 bytes - a repeated
+ *                     "user-agent: Mozilla/5.0 ..." costs one byte too
+ *     Huffman code    a fixed code for the remaining literal text, ~30%
+ *                     shorter for typical header values
+ *
+ * Each side of a connection has two tables: one to decode what the peer
+ * sends and one to encode what we send. Both ends update their copy of a
+ * table in the same order, so every header block must be decoded - even the
+ * ones we are going to refuse - or the tables drift apart.
+ * =============================================================================
+ */
+
+#ifndef TINYSERVER_HPACK_H
+#define TINYSERVER_HPACK_H
+
+#include <stddef.h>         // size_t
+#include <stdint.h>         // uint16_t
+
+#include "http_parser.h"    // struct http_header
+
+#define HPACK_TABLE_SIZE 4096                       // Protocol default, we never go above it
+#define HPACK_ENTRY_OVERHEAD 32                     // Per-entry cost the RFC adds to its size
+#define HPACK_MAX_ENTRIES (HPACK_TABLE_SIZE / HPACK_ENTRY_OVERHEAD)
+
+struct hpack_entry {
+    uint16_t offset;        // Name starts at data + offset, the value follows it
+    uint16_t name_length;
+    uint16_t value_length;
+};
+
+/*
+ * STRUCT: hpack_table
+ * PURPOSE: One dynamic table - entries oldest first, their bytes packed in data
+ * WHY: Evicting the oldest entries then is a single memmove() of what's left
+ */
+struct hpack_table {
+    struct hpack_entry entries[HPACK_MAX_ENTRIES];
+    int count;
+    size_t size;            // Size as the RFC counts it (bytes + 32 per entry)
+    size_t max_size;        // Current limit (<= HPACK_TABLE_SIZE)
+    size_t used;            // Bytes of data in use
+    size_t pending_size;    // Encoder only: new limit still to be announced
+    size_t pending_min;     //   and the smallest limit since the last announcement
+    int resize_pending;
+    char data[HPACK_TABLE_SIZE];
+};
+
+/*
+ * STRUCT: hpack_fields
+ * PURPOSE: Where hpack_decode() puts the decoded fields
+ * RULE: Names and values are copied into buffer and recorded as slices
+ *       relative to it - the same shape as the HTTP/1.1 parser's output
+ */
+struct hpack_fields {
+    char *buffer;
+    size_t size;
+    size_t length;          // Bytes of buffer used
+    struct http_header *fields;
+    int max_fields;
+    int count;
+    int truncated;          // 1 = more fields/bytes than room (all were still decoded)
+};
+
+/*
+ * FUNCTION: hpack_table_init
+ * PURPOSE: Empty table with the protocol's default size limit
+ */
+void hpack_table_init(struct hpack_table *table);
+
+/*
+ * FUNCTION: hpack_decode
+ * PURPOSE: Decode one complete header block, updating the decoder table
+ * RETURNS: 0 on success, -1 on a compression error (the connection must end)
+ */
+int hpack_decode(struct hpack_table *table, const unsigned char *block, size_t length,
+                 struct hpack_fields *out);
+
+/*
+ * FUNCTION: hpack_encoder_resize
+ * PURPOSE: The peer changed SETTINGS_HEADER_TABLE_SIZE - shrink/grow our
+ *          encoder table (never above HPACK_TABLE_SIZE)
+ * RULE: The change is announced at the start of the next header block
+ */
+void hpack_encoder_resize(struct hpack_table *table, size_t size);
+
+/*
+ * FUNCTION: hpack_encode_start
+ * PURPOSE: Begin a header block (writes any pending table size update)
+ * RETURNS: Bytes written, or -1 if `room` was too small
+ */
+int hpack_encode_start(struct hpack_table *table, unsigned char *out, size_t room);
+
+/*
+ * FUNCTION: hpack_encode_field
+ * PURPOSE: Append one field, as an index when either table has it
+ * PARAMETERS: name must be lower case
+ *             index - 1 = add it to the dynamic table (its value repeats),
+ *                     0 = values that change every time (Content-Length)
+ * RETURNS: Bytes written, or -1 if `room` was too small
+ */
+int hpack_encode_field(struct hpack_table *table, unsigned char *out, size_t room,
+                       const char *name, size_t name_length,
+                       const char *value, size_t value_length, int index);
+
+#endif // TINYSERVER_HPACK_H
@@ -0,0 +1,185 @@
+/*
+ * =============================================================================
+ * HTTP/2 - MANY REQUESTS MULTIPLEXED OVER ONE TLS CONNECTION (RFC 9113)
+ * =============================================================================
+ * HTTP/1.1 answers requests strictly one after another, so browsers open six
+ * connections per site - six TCP and TLS handshakes. HTTP/2 cuts the
+ * connection into numbered "streams" instead, one per request, and sends
+ * everything as small binary frames that can interleave freely:
+ *
+ *     +-----------------------------------------------+
+ *     |                 Length (24)                   |   9-byte frame header
+ *     +---------------+---------------+---------------+
+ *     |   Type (8)    |   Flags (8)   |
+ *     +-+-------------+---------------+-------------------------------+
+ *     |R|                 Stream Identifier (31)                      |
+ *     +=+=============================================================+
+ *     |                   Frame Payload (0...)                      ...
+ *     +---------------------------------------------------------------+
+ *
+ *     client: HEADERS(1) HEADERS(3) HEADERS(5)     three requests at once
+ *     server: HEADERS(3) DATA(3) HEADERS(1) DATA(5) DATA(1) ...
+ *
+ * It is chosen during the TLS handshake: the client offers "h2" via ALPN,
+ * and if we pick it the first bytes after the handshake are HTTP/2.
+ *
+ * Headers are HPACK-compressed (see hpack.h). Flow control keeps a fast
+ * sender from flooding a slow receiver: every DATA byte uses up a window,
+ * for the connection and for its stream, that the receiver reopens with
+ * WINDOW_UPDATE once it has made room.
+ *
+ * Requests are answered by the same handlers as HTTP/1.1 (echo page, static
+ * files): their HTTP/1.1 answer is translated on the spot - the head becomes
+ * an HPACK-coded HEADERS frame, the body is sent as DATA frames. Request
+ * bodies are not used yet; they are read and dropped. A streamed answer
+ * (see stream.h) is made piece by piece into the stream's stream_buffer,
+ * whenever the last piece has been sent and the windows have room.
+ *
+ * Memory of a stream (its headers, small body, file) may be referenced by
+ * frames in the output queue. So a finished stream keeps its slot until the
+ * queue has been sent completely, and only then is the slot reused.
+ * =============================================================================
+ */
+
+#ifndef TINYSERVER_HTTP2_H
+#define TINYSERVER_HTTP2_H
+
+#include <stddef.h>         // size_t
+#include <stdint.h>         // uint32_t, int64_t
+#include <sys/types.h>      // off_t
+
+#include "connection.h"
+#include "hpack.h"
+#include "http_parser.h"
+
+#define H2_MAX_STREAMS 32           // SETTINGS_MAX_CONCURRENT_STREAMS we announce
+#define H2_FRAME_HEADER 9
+#define H2_MAX_FRAME 16384          // Largest frame payload we accept (protocol default)
+#define H2_INPUT_SIZE (H2_FRAME_HEADER + H2_MAX_FRAME)
+#define H2_HEADER_BLOCK 8192        // Largest header block split over CONTINUATION frames
+#define H2_STREAM_BUFFER 1024       // Response HEADERS frame + a small in-memory body
+#define H2_WINDOW 65535             // Initial flow-control window in both directions
+#define H2_SEND_BATCH 65536         // DATA queued per write round - keeps streams interleaved
+#define H2_PSEUDO_HEADERS 4         // :method :scheme :authority :path
+
+enum h2_stream_state {
+    H2_STREAM_FREE,         // Slot unused
+    H2_STREAM_SENDING,      // Response body still to be sent
+    H2_STREAM_DONE          // Everything queued, slot freed once it is sent
+                            //   and the request (body) has ended too
+};
+
+struct h2_stream {
+    uint32_t id;
+    enum h2_stream_state state;
+    int remote_closed;          // 1 = the client sent END_STREAM
+    int64_t send_window;        // DATA bytes the client lets us send on this stream
+    int64_t recv_window;        // DATA bytes we still accept on it
+    size_t body_start;          // In-memory body: buffer[body_start .. body_end)
+    size_t body_end;
+    struct output_file file;    // File body, fd -1 and no data if none (owned by the stream)
+    uint64_t file_remaining;
+    struct http_streamer streamer;  // Streamed body (fill = NULL: none, or it is over)
+    char *stream_buffer;        //   TLS_RECORD_SIZE bytes, the piece [stream_start .. stream_end)
+    size_t stream_start;
+    size_t stream_end;
+    int stream_queued;          //   1 = frames in the output queue still point at the piece
+    uint64_t start_us;          // When the request was complete (metrics)
+    char buffer[H2_STREAM_BUFFER];
+};
+
+struct h2_session {
+    struct hpack_table decoder;         // Client's header blocks
+    struct hpack_table encoder;         // Our header blocks
+    int preface_received;               // The 24-byte client preface
+    int settings_received;              // Its first SETTINGS frame
+    uint32_t peer_max_frame;            // SETTINGS_MAX_FRAME_SIZE of the client
+    uint32_t peer_initial_window;       // SETTINGS_INITIAL_WINDOW_SIZE of the client
+    int64_t send_window;                // Connection-level windows
+    int64_t recv_window;
+    uint32_t last_stream_id;            // Highest stream the client opened
+    int goaway_sent;                    // 1 = no new streams accepted
+    int goaway_received;                // 1 = the client opens no new streams
+    int failed;                         // 1 = connection error, close after GOAWAY
+    int active_streams;                 // Slots not FREE
+    int next_stream;                    // Round-robin start for DATA frames
+
+    // Header block being received (HEADERS + CONTINUATION frames)
+    uint32_t header_stream;             // Its stream
+    int header_flags;                   // Flags of its HEADERS frame
+    int header_kind;                    // What to do with it once complete
+    int continuation;                   // 1 = CONTINUATION frames must follow
+    size_t header_block_length;
+    unsigned char header_block[H2_HEADER_BLOCK];
+
+    size_t input_start;                 // Unprocessed bytes: input[start .. length)
+    size_t input_length;
+    unsigned char input[H2_INPUT_SIZE]; // Always holds at least one whole frame
+
+    // The request being answered (decoded fields point into decoded)
+    char decoded[BUFFER_SIZE + 8];
+    struct http_header fields[HTTP_MAX_HEADERS + H2_PSEUDO_HEADERS];
+    struct http_request request;
+
+    struct h2_stream streams[H2_MAX_STREAMS];
+};
+
+/*
+ * FUNCTION: h2_session_start
+ * PURPOSE: Switch a connection to HTTP/2 (ALPN chose "h2") and queue our SETTINGS
+ * RETURNS: 0 on success, -1 on failure
+ */
+int h2_session_start(connection *conn);
+
+/*
+ * FUNCTION: h2_input_space
+ * PURPOSE: Where the next bytes read from the client go, and how many fit
+ * RETURNS: Free space (0 = process the frames already there first)
+ */
+size_t h2_input_space(struct h2_session *session, char **dest);
+
+/*
+ * FUNCTION: h2_input_received
+ * PURPOSE: Account for `bytes` read into the space from h2_input_space()
+ */
+void h2_input_received(struct h2_session *session, size_t bytes);
+
+/*
+ * FUNCTION: h2_process
+ * PURPOSE: Handle every complete frame received so far, answer new requests
+ *          and queue as much DATA as the flow-control windows allow
+ * RETURNS: 0 to carry on, -1 to close right away (the client isn't HTTP/2)
+ * RULE: Stops early when the output queue is full - call again once it has
+ *       been sent
+ */
+int h2_process(connection *conn);
+
+/*
+ * FUNCTION: h2_drain
+ * PURPOSE: Send GOAWAY (no error) if not sent yet: the client finishes the
+ *          streams it has open and takes new requests elsewhere
+ */
+void h2_drain(connection *conn);
+
+/*
+ * FUNCTION: h2_finished
+ * RETURNS: 1 once the connection should close (after a GOAWAY, with every
+ *          stream answered and sent), 0 otherwise
+ */
+int h2_finished(const struct h2_session *session);
+
+/*
+ * FUNCTION: h2_waiting
+ * PURPOSE: Whether a stream is being answered in pieces (see stream.h)
+ * WHY: It may be waiting for a backend - that's no idle connection
+ */
+int h2_waiting(const struct h2_session *session);
+
+/*
+ * FUNCTION: h2_session_end
+ * PURPOSE: Close every stream's file and give the session back to the pool
+ * RULE: Discard the output queue first - it may still reference the files
+ */
+void h2_session_end(connection *conn);
+
+#endif // TINYSERVER_HTTP2_H
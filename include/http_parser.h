@@ -0,0 +1,162 @@
+/*
+ * =============================================================================
+ * HTTP PARSER - INCREMENTAL, ZERO-COPY REQUEST PARSING
+ * =============================================================================
+ * Parses an HTTP/1.x request line and headers straight out of the receive
+ * buffer. Nothing is copied: every field is recorded as a "slice" - an
+ * offset and a length relative to the first byte of the request.
+ *
+ *     GET /search?q=tiny HTTP/1.1\r\n       method  = {0, 3}
+ *     Host: example.com\r\n                 path    = {4, 7}
+ *     \r\n                                  query   = {12, 6}
+ *                                           version = {19, 8}
+ *
+ * The parser is a state machine that remembers where it stopped, so when a
+ * request arrives in several pieces each call only looks at the new bytes.
+ * Because slices are relative to the request start, the caller may move the
+ * unfinished request to the front of its buffer between calls.
+ *
+ * Once the headers are in, the parser also says how the body (if any) is
+ * framed: "Content-Length: N" bytes, or "Transfer-Encoding: chunked",
+ * which http_chunked_decode() strips as it streams in:
+ *
+ *     5\r\nhello\r\n6\r\n world\r\n0\r\n\r\n   -->   hello world
+ * =============================================================================
+ */
+
+#ifndef TINYSERVER_HTTP_PARSER_H
+#define TINYSERVER_HTTP_PARSER_H
+
+#include <stddef.h>     // size_t
+#include <stdint.h>     // uint32_t
+
+#define HTTP_MAX_HEADERS 64     // Hard upper limit for --max-headers
+
+struct http_slice {
+    uint32_t offset;    // Bytes from the start of the request
+    uint32_t length;
+};
+
+struct http_header {
+    struct http_slice name;
+    struct http_slice value;    // Leading/trailing whitespace removed
+};
+
+enum http_parse_result {
+    HTTP_PARSE_INCOMPLETE,      // Need more bytes
+    HTTP_PARSE_DONE,            // Request line and all headers parsed
+    HTTP_PARSE_ERROR            // Malformed (400) or too large (431)
+};
+
+enum http_parse_error {
+    HTTP_ERROR_NONE,
+    HTTP_ERROR_BAD_REQUEST,     // Syntax error -> 400 Bad Request
+    HTTP_ERROR_TOO_LARGE,       // Over a limit -> 431 Request Header Fields Too Large
+    HTTP_ERROR_NOT_IMPLEMENTED  // Transfer-Encoding we can't decode -> 501 Not Implemented
+};
+
+enum http_body_framing {
+    HTTP_BODY_NONE,             // No body (or "Content-Length: 0")
+    HTTP_BODY_LENGTH,           // content_length bytes follow the headers
+    HTTP_BODY_CHUNKED           // Chunks follow, up to a zero-size one
+};
+
+struct http_limits {
+    int max_headers;            // Headers per request (<= HTTP_MAX_HEADERS)
+    size_t max_header_size;     // Bytes for request line + headers
+};
+
+struct http_request {
+    // Results (valid once http_parse() returned HTTP_PARSE_DONE)
+    struct http_slice method;
+    struct http_slice path;
+    struct http_slice query;    // Without the '?', length 0 if none
+    struct http_slice version;  // e.g. "HTTP/1.1"
+    int minor_version;          // 1 for HTTP/1.1, 0 for HTTP/1.0
+    struct http_header headers[HTTP_MAX_HEADERS];
+    int header_count;
+    size_t header_length;       // Request line + headers + blank line
+    enum http_body_framing body;
+    uint64_t content_length;    // HTTP_BODY_LENGTH only
+
+    // Parser bookkeeping (private)
+    int state;
+    size_t position;            // Next byte to examine
+    size_t mark;                // Start of the token being parsed
+    enum http_parse_error error;
+};
+
+/*
+ * FUNCTION: http_parser_init
+ * PURPOSE: Reset a request so it can parse the next message
+ */
+void http_parser_init(struct http_request *request);
+
+/*
+ * FUNCTION: http_parse
+ * PURPOSE: Continue parsing with everything received so far
+ * PARAMETERS: data/length - the request from its first byte up to the last
+ *             byte received (earlier bytes must be passed again, unchanged)
+ * RETURNS: HTTP_PARSE_INCOMPLETE, HTTP_PARSE_DONE or HTTP_PARSE_ERROR
+ */
+enum http_parse_result http_parse(struct http_request *request, const char *data,
+                                  size_t length, const struct http_limits *limits);
+
+/*
+ * FUNCTION: http_find_header
+ * PURPOSE: Look up a header by (case-insensitive) name
+ * RETURNS: The header, or NULL if the request doesn't have it
+ */
+const struct http_header *http_find_header(const struct http_request *request,
+                                           const char *data, const char *name);
+
+/*
+ * FUNCTION: http_header_has_token
+ * PURPOSE: Check a comma-separated header for a token, e.g. Connection: close
+ * RULE: Header names and these tokens are case-insensitive in HTTP
+ */
+int http_header_has_token(const struct http_request *request, const char *data,
+                          const char *name, const char *token);
+
+/*
+ * FUNCTION: http_valid_token / http_valid_target / http_valid_field_value
+ * PURPOSE: The checks http_parse() makes on a method or header name, a path
+ *          or query, and a header value - for requests that reach the
+ *          handlers another way (HTTP/2)
+ * RETURNS: 1 if length bytes at data are allowed there, else 0
+ */
+int http_valid_token(const char *data, size_t length);
+int http_valid_target(const char *data, size_t length);
+int http_valid_field_value(const char *data, size_t length);
+
+/*
+ * STRUCT: http_chunked
+ * PURPOSE: Where the chunked decoder stopped - one per body being received
+ */
+struct http_chunked {
+    int state;
+    uint64_t remaining;         // Data bytes left in the current chunk
+    int digits;                 // Hex digits of its size seen so far
+};
+
+/*
+ * FUNCTION: http_chunked_init
+ * PURPOSE: Get ready for a new chunked body
+ */
+void http_chunked_init(struct http_chunked *chunked);
+
+/*
+ * FUNCTION: http_chunked_decode
+ * PURPOSE: Decode the next received bytes of a chunked body, in place
+ * PARAMETERS: data/length - bytes received and not yet passed in before
+ *             *used - set to how many of them were consumed
+ *             *decoded - set to how many body bytes now start at data[0]
+ * RETURNS: HTTP_PARSE_INCOMPLETE (all input used, more to come),
+ *          HTTP_PARSE_DONE (last chunk and trailers over - the bytes from
+ *          data[*used] on belong to the next request) or HTTP_PARSE_ERROR
+ * RULE: Trailer fields are skipped, not parsed
+ */
+enum http_parse_result http_chunked_decode(struct http_chunked *chunked, char *data, size_t length,
+                                           size_t *used, size_t *decoded);
+
+#endif // TINYSERVER_HTTP_PARSER_H
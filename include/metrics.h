@@ -0,0 +1,135 @@
+/*
+ * =============================================================================
+ * METRICS - PER-WORKER COUNTERS, SCRAPED IN PROMETHEUS FORMAT
+ * =============================================================================
+ * Counting must cost next to nothing on the hot path, so:
+ *
+ *   - every worker has its own block of counters and only that worker
+ *     thread ever writes it (one writer = no locks, no atomic read-modify-
+ *     write instructions - an increment is a plain add)
+ *   - each block starts on its own cache line and is padded to a whole
+ *     number of them, so two workers never write to the same line (that
+ *     "false sharing" would bounce the line between their cores)
+ *   - the admin thread adds the blocks up only when /metrics is scraped
+ *
+ * Loads and stores use relaxed atomics: on 64-bit CPUs they compile to
+ * ordinary moves, but a reader can never see half of a counter.
+ *
+ *     curl http://127.0.0.1:9100/metrics        (with --metrics-port 9100)
+ * =============================================================================
+ */
+
+#ifndef TINYSERVER_METRICS_H
+#define TINYSERVER_METRICS_H
+
+#include <stdint.h>         // uint64_t
+
+#define METRICS_CACHE_LINE 64
+#define METRICS_BUCKETS 15          // Latency bucket bounds, +Inf not counted
+
+/*
+ * Why a TLS handshake failed, as far as OpenSSL tells us
+ */
+enum handshake_failure {
+    HANDSHAKE_FAILED_CERTIFICATE,   // Client certificate missing or not trusted
+    HANDSHAKE_FAILED_PROTOCOL,      // Version/cipher mismatch, or not TLS at all
+    HANDSHAKE_FAILED_CLOSED,        // Client hung up or reset midway
+    HANDSHAKE_FAILED_TIMEOUT,       // Gave up waiting (--handshake-timeout)
+    HANDSHAKE_FAILED_OTHER,
+    HANDSHAKE_FAILURE_REASONS
+};
+
+/*
+ * Why a client was turned away right after accept
+ */
+enum rejection {
+    REJECTED_LIMIT,                 // --worker-connections / --max-connections reached
+    REJECTED_HANDSHAKES,            // --max-handshakes TLS handshakes already running
+    REJECTED_DESCRIPTORS,           // Out of file descriptors
+    REJECTION_REASONS
+};
+
+/*
+ * STRUCT: metrics_histogram
+ * PURPOSE: Latencies counted per bucket (upper bounds in metrics.c), plus
+ *          the total - what a Prometheus histogram needs
+ * RULE: Buckets hold plain counts; the cumulative "le" view is made when scraped
+ */
+struct metrics_histogram {
+    uint64_t buckets[METRICS_BUCKETS + 1];  // Last one: above every bound
+    uint64_t sum_us;
+    uint64_t count;
+};
+
+struct metrics {
+    uint64_t accepts;               // Connections accepted
+    uint64_t closes;                // Connections closed
+    uint64_t rejected[REJECTION_REASONS];   // Turned away instead (not in accepts)
+    uint64_t header_timeouts;       // Closed for sending request headers too slowly
+    uint64_t handshakes;            // TLS handshakes completed
+    uint64_t handshakes_resumed;    //   of which resumed a session
+    uint64_t handshake_failures[HANDSHAKE_FAILURE_REASONS];
+    uint64_t http2_connections;     // Handshakes that chose HTTP/2
+    uint64_t bytes_in;              // Application bytes (decrypted)
+    uint64_t bytes_out;
+    uint64_t requests_http1;
+    uint64_t requests_http2;
+    uint64_t log_dropped;           // Log records lost to a full ring
+    struct metrics_histogram handshake_time;    // accept -> handshake done
+    struct metrics_histogram response_time;     // request parsed -> response sent
+} __attribute__((aligned(METRICS_CACHE_LINE)));
+
+/*
+ * FUNCTION: metric_add
+ * PURPOSE: counter += amount, by the counter's one writer thread
+ * WHY: A relaxed load + store instead of an atomic add: no lock prefix,
+ *      no cache line ownership dance - there is no other writer to lose to
+ */
+static inline void metric_add(uint64_t *counter, uint64_t amount) {
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + amount, __ATOMIC_RELAXED);
+}
+
+/*
+ * FUNCTION: metrics_create
+ * PURPOSE: Allocate a zeroed, cache-line aligned block for one worker and
+ *          register it for scraping
+ * RULE: Call before metrics_serve() starts (the list is not locked)
+ * RETURNS: The block, or NULL on failure
+ */
+struct metrics *metrics_create(void);
+
+/*
+ * FUNCTION: metrics_observe
+ * PURPOSE: Count one latency in a histogram (same single-writer rule)
+ */
+void metrics_observe(struct metrics_histogram *histogram, uint64_t microseconds);
+
+/*
+ * FUNCTION: metrics_now_us
+ * PURPOSE: Monotonic clock in microseconds, for measuring latencies
+ */
+uint64_t metrics_now_us(void);
+
+/*
+ * FUNCTION: metrics_failure_name
+ * RETURNS: Short name of a handshake_failure ("certificate", "protocol"...)
+ */
+const char *metrics_failure_name(enum handshake_failure reason);
+
+/*
+ * FUNCTION: metrics_serve
+ * PURPOSE: Answer GET /metrics on its own address and port, from a thread
+ *          of its own (so a scrape never delays a worker)
+ * PARAMETER: inherited - listening socket handed over by the process we
+ *            replace (see handoff.h), or -1 to open one
+ * RETURNS: 0 on success, -1 if the admin socket could not be set up
+ */
+int metrics_serve(const char *address, int port, int inherited);
+
+/*
+ * FUNCTION: metrics_socket
+ * RETURNS: The admin listening socket, -1 if metrics are off
+ */
+int metrics_socket(void);
+
+#endif // TINYSERVER_METRICS_H
@@ -0,0 +1,62 @@
+/*
+ * =============================================================================
+ * OCSP STAPLING - CERTIFICATE STATUS SENT ALONG WITH THE CERTIFICATE
+ * =============================================================================
+ * A client that wants to know whether our certificate was revoked has to ask
+ * the CA's OCSP responder - one more DNS lookup, connection and round trip
+ * before its first request, to a server that may be slow or far away. With
+ * stapling we ask instead, and hand the CA's signed answer out with every
+ * handshake (the "status_request" TLS extension):
+ *
+ *     refresh thread --POST--> CA's OCSP responder
+ *           |
+ *           v
+ *     cached response (DER) ----copy----> every handshake asking for it
+ *
+ * The handshake never waits for the responder: it only copies whatever is
+ * cached, or staples nothing if there is no valid answer yet. A thread
+ * fetches the answer at startup and again halfway through its validity
+ * (thisUpdate .. nextUpdate), so a new one is in place long before the old
+ * one expires; a failed fetch is retried a minute later. An answer that did
+ * expire anyway is no longer stapled - a stale answer is worse than none.
+ *
+ * Which responder: the OCSP URL in the certificate (Authority Information
+ * Access), or --ocsp-url for all certificates. The issuer, needed to name
+ * the certificate in the request and to check the answer's signature, is
+ * taken from the rest of the certificate file or from --ca.
+ *
+ * Reloads: answers are kept per certificate, not per SSL_CTX, so a SIGHUP
+ * that loads the same certificate again keeps stapling without a new fetch.
+ * =============================================================================
+ */
+
+#ifndef TINYSERVER_OCSP_H
+#define TINYSERVER_OCSP_H
+
+#include <openssl/ssl.h>    // SSL_CTX
+
+#define OCSP_RESPONSE_MAX (64 * 1024)   // Bigger answers from a responder are refused
+#define OCSP_FETCH_TIMEOUT 10           // Seconds the responder gets to answer
+#define OCSP_RETRY_DELAY 60             // Seconds before a failed fetch is retried
+
+/*
+ * FUNCTION: ocsp_configure
+ * PURPOSE: Staple the status of ctx's certificate to its handshakes
+ * PARAMETERS: ctx - context with its certificate and --ca already loaded
+ *             cert_file - where the certificate came from (may hold the issuer)
+ * RETURNS: 0 on success - also when the certificate can't be stapled (it
+ *          names no responder, or its issuer is missing - reported) - or -1
+ *          on failure (OpenSSL errors are queued)
+ * RULE: Safe from any thread (SIGHUP reloads call it on the watcher thread)
+ */
+int ocsp_configure(SSL_CTX *ctx, const char *cert_file);
+
+/*
+ * FUNCTION: ocsp_start
+ * PURPOSE: Start the thread fetching the answers (unless --no-ocsp)
+ * RETURNS: Number of certificates stapled so far, or -1 on failure
+ * RULE: After tls_context_watch_sighup() (see tls_context.h)
+ */
+int ocsp_start(void);
+
+#endif // TINYSERVER_OCSP_H
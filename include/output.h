@@ -0,0 +1,190 @@
+/*
+ * =============================================================================
+ * OUTPUT QUEUE - RESPONSES AS A LIST OF BUFFERS, SENT WITH writev()
+ * =============================================================================
+ * Instead of copying headers and body into one big buffer (which also caps
+ * the response size), the queue just remembers WHERE each piece is:
+ *
+ *     iov[0] -> "HTTP/1.1 200 OK\r\n..."     (static, prebuilt)
+ *     iov[1] -> "Date: ...Content-Length: 143\r\n\r\n"  (copied into scratch)
+ *     iov[2] -> "<!DOCTYPE html>..."         (static, prebuilt)
+ *     iov[3] -> "GET"                        (points into the request buffer)
+ *
+ * writev() sends all of them with ONE system call. When the kernel only takes
+ * part of the data, output_consume() moves past exactly the bytes that were
+ * sent and the rest goes out on the next write event.
+ *
+ * A part can also be a range of an open file. Those are sent with
+ * sendfile(): the kernel copies straight from the page cache to the socket
+ * and the file bytes never pass through our memory. A file held in the
+ * file cache (see file_cache.h) is a file part too, but its bytes come from
+ * the cached copy - and the cache entry is held until the part is sent.
+ * =============================================================================
+ */
+
+#ifndef TINYSERVER_OUTPUT_H
+#define TINYSERVER_OUTPUT_H
+
+#include <stddef.h>     // size_t
+#include <sys/types.h>  // off_t, ssize_t
+#include <sys/uio.h>    // struct iovec, writev
+
+#include "arena.h"
+#include "response.h"
+
+#define OUTPUT_MAX_PARTS 128    // Buffers queued at once
+#define OUTPUT_WRITEV_MAX 64    // Buffers per writev() call (below any IOV_MAX)
+#define OUTPUT_SCRATCH 1024     // Room for small per-response values
+
+/*
+ * STRUCT: output_hold
+ * PURPOSE: Something a queued part keeps alive; release() runs once the part
+ *          has been sent or dropped (embed it in the thing being held)
+ */
+struct output_hold {
+    void (*release)(struct output_hold *hold);
+};
+
+/*
+ * STRUCT: output_file
+ * PURPOSE: Where a file part reads from (its iovec has iov_base == NULL and
+ *          iov_len = bytes still to send)
+ */
+struct output_file {
+    int fd;                     // -1 for a cached file
+    off_t offset;               // Next byte of the file to send
+    int owned;                  // 1 = closed by the queue once sent
+    const char *data;           // Cached file: its bytes (NULL = read fd)
+    struct output_hold *hold;   //   released once sent, NULL = not ours
+};
+
+struct output_queue {
+    struct iovec parts[OUTPUT_MAX_PARTS];
+    struct output_file files[OUTPUT_MAX_PARTS];   // Used only for file parts
+    int first;                  // Index of the first unsent part
+    int count;                  // Parts in use (first..count-1 unsent)
+    int file_count;             // Unsent file parts
+    size_t length;              // Unsent bytes
+    struct arena arena;         // Per-request bytes, released when all is sent
+    char scratch[OUTPUT_SCRATCH];   // Memory behind the arena
+};
+
+/*
+ * FUNCTION: output_init
+ * PURPOSE: Empty the queue
+ */
+void output_init(struct output_queue *queue);
+
+/*
+ * FUNCTION: output_push
+ * PURPOSE: Queue a buffer by reference (it must stay valid until sent)
+ * RETURNS: 0 on success, -1 if the queue is full
+ */
+int output_push(struct output_queue *queue, const void *data, size_t length);
+
+/*
+ * FUNCTION: output_push_copy
+ * PURPOSE: Queue a copy of a short-lived buffer, made in the scratch area
+ * RETURNS: 0 on success, -1 if the queue or its scratch area is full
+ */
+int output_push_copy(struct output_queue *queue, const void *data, size_t length);
+
+/*
+ * FUNCTION: output_push_file
+ * PURPOSE: Queue `length` bytes of a file starting at `offset`
+ * RETURNS: 0 on success, -1 if the queue is full
+ * RULE: The queue owns fd from now on (even on failure it is closed)
+ */
+int output_push_file(struct output_queue *queue, int fd, off_t offset, size_t length);
+
+/*
+ * FUNCTION: output_push_file_ref
+ * PURPOSE: Like output_push_file(), but the caller keeps owning fd
+ * RULE: fd must stay open until the part has been sent or discarded
+ * WHY: HTTP/2 sends one file as many DATA frames, each a part of its own
+ */
+int output_push_file_ref(struct output_queue *queue, int fd, off_t offset, size_t length);
+
+/*
+ * FUNCTION: output_push_cached
+ * PURPOSE: Queue `length` bytes of a cached file starting at `offset`; they
+ *          go out like a file part, from data instead of a descriptor
+ * PARAMETER: hold - released once the part is sent or dropped (even when
+ *            queuing fails), NULL = the caller keeps data alive
+ * RETURNS: 0 on success, -1 if the queue is full
+ */
+int output_push_cached(struct output_queue *queue, const char *data, off_t offset, size_t length,
+                       struct output_hold *hold);
+
+/*
+ * FUNCTION: output_take_file
+ * PURPOSE: Remove the file part at the front of the queue and hand it over
+ * RETURNS: A copy of it (fd, data and hold now belong to the caller) with
+ *          *length set, or 0 if the front part isn't a file
+ * RULE: Only for parts queued with output_push_file() or output_push_cached()
+ */
+int output_take_file(struct output_queue *queue, struct output_file *file, size_t *length);
+
+/*
+ * FUNCTION: output_has_room
+ * PURPOSE: Check up front whether `parts` more parts with `scratch` copied
+ *          bytes would fit, so a response is queued completely or not at all
+ */
+int output_has_room(const struct output_queue *queue, int parts, size_t scratch);
+
+/*
+ * FUNCTION: output_push_response
+ * PURPOSE: Queue every part of a response; its own scratch bytes are copied
+ * RETURNS: 0 on success, -1 if it doesn't fit (nothing is queued)
+ */
+int output_push_response(struct output_queue *queue, const struct response *response);
+
+/*
+ * FUNCTION: output_send
+ * PURPOSE: One system call's worth of sending: writev() of up to
+ *          OUTPUT_WRITEV_MAX memory parts, or sendfile() of a file part
+ * RETURNS: Bytes sent, or -1 with errno set (EAGAIN = socket buffer full)
+ */
+ssize_t output_send(struct output_queue *queue, int fd);
+
+/*
+ * FUNCTION: output_front_file
+ * PURPOSE: Peek at the first unsent part if it is a file part
+ * RETURNS: The file and its remaining length, or NULL for a memory part
+ */
+const struct output_file *output_front_file(const struct output_queue *queue, size_t *length);
+
+/*
+ * FUNCTION: output_gather
+ * PURPOSE: Copy up to `size` queued bytes into `buffer` and consume them,
+ *          stopping at the next file part unless read_files is set
+ * WHY: TLS encrypts whole records, so small parts are merged first (one
+ *      SSL_write per part would produce one tiny record per part). File
+ *      parts are read with pread() - there is no zero-copy path through
+ *      user-space TLS.
+ * RETURNS: Bytes copied, or 0 with errno set if reading a file failed
+ */
+size_t output_gather(struct output_queue *queue, char *buffer, size_t size, int read_files);
+
+/*
+ * FUNCTION: output_consume
+ * PURPOSE: Drop `bytes` from the front of the queue (after a partial write)
+ */
+void output_consume(struct output_queue *queue, size_t bytes);
+
+/*
+ * FUNCTION: output_discard
+ * PURPOSE: Drop everything still queued and close its files
+ */
+void output_discard(struct output_queue *queue);
+
+/*
+ * FUNCTION: socket_cork
+ * PURPOSE: Hold back partial TCP packets (on = 1) or flush them (on = 0)
+ * WHY: When a response needs several system calls, corking lets the kernel
+ *      fill whole packets instead of sending a small one after each call.
+ *      Linux calls this TCP_CORK, macOS/BSD call it TCP_NOPUSH.
+ */
+void socket_cork(int fd, int on);
+
+#endif // TINYSERVER_OUTPUT_H
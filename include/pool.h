@@ -0,0 +1,59 @@
+/*
+ * =============================================================================
+ * POOL - FIXED-SIZE OBJECT ALLOCATOR (SLAB + FREE LIST)
+ * =============================================================================
+ * Connections and I/O buffers come and go thousands of times per second, but
+ * they always have the same size. A pool carves them out of big "slabs" and
+ * keeps returned objects on a free list:
+ *
+ *     free_list -> [obj] -> [obj] -> [obj] -> NULL
+ *
+ * Getting an object pops the list, returning one pushes it back - a couple
+ * of pointer moves instead of a trip through malloc(). Memory handed out is
+ * NOT zeroed; the caller sets what it uses.
+ *
+ * RULE: A pool belongs to one worker thread, so there is no locking at all.
+ * =============================================================================
+ */
+
+#ifndef TINYSERVER_POOL_H
+#define TINYSERVER_POOL_H
+
+#include <stddef.h>     // size_t
+
+struct pool_slab;
+
+struct pool {
+    size_t object_size;         // Rounded up so every object stays aligned
+    size_t objects_per_slab;
+    void *free_list;            // Free objects, linked through their first word
+    struct pool_slab *slabs;    // Every slab allocated so far
+    size_t in_use;              // Objects currently handed out
+};
+
+/*
+ * FUNCTION: pool_init
+ * PURPOSE: Set up an empty pool (no memory is allocated until the first get)
+ */
+void pool_init(struct pool *pool, size_t object_size, size_t objects_per_slab);
+
+/*
+ * FUNCTION: pool_get
+ * PURPOSE: Take an object from the pool, growing it by a slab if it is empty
+ * RETURNS: The object (contents undefined), or NULL if out of memory
+ */
+void *pool_get(struct pool *pool);
+
+/*
+ * FUNCTION: pool_put
+ * PURPOSE: Give an object back for reuse (NULL is ignored)
+ */
+void pool_put(struct pool *pool, void *object);
+
+/*
+ * FUNCTION: pool_destroy
+ * PURPOSE: Free every slab - all objects must have been returned
+ */
+void pool_destroy(struct pool *pool);
+
+#endif // TINYSERVER_POOL_H
@@ -0,0 +1,66 @@
+/*
+ * =============================================================================
+ * PROXY - REQUESTS PASSED ON TO BACKEND SERVERS
+ * =============================================================================
+ * With --upstream HOST:PORT (once per backend) every request under --proxy
+ * PREFIX is sent on to a backend, and its answer back to the client:
+ *
+ *     client --TLS/h2/HTTP/1.x--> worker --HTTP/1.1 keep-alive--> backend
+ *
+ * Connecting costs a round trip (and the backend a socket), so nothing is
+ * thrown away after one request. Each worker keeps up to
+ * --upstream-keepalive idle connections per backend and takes one of them
+ * for the next request; only when none is left is a new one opened. A
+ * connection the backend closed while idle is noticed (it turns readable)
+ * and dropped, and a request that didn't even get a status line back on a
+ * reused connection - the backend closed it at that very moment - is tried
+ * once more on a fresh one.
+ *
+ * Which backend: the one with the fewest requests in progress over all
+ * workers (--balance least), or a consistent hash of the URL (--balance
+ * hash), so each URL keeps hitting the same backend and its caches, and
+ * only 1/N of them move when a backend comes or goes.
+ *
+ * Health: a thread asks every backend for --health-path every
+ * --health-interval seconds; one that doesn't answer, or answers 5xx, gets
+ * no requests until it answers again. A backend that refuses a connection
+ * is taken out at once, without waiting for the next check.
+ *
+ * Nothing blocks: the backend's socket sits in the worker's event loop next
+ * to the clients, the answer is streamed (see stream.h) exactly as fast as
+ * the client takes it, and request bodies go out as fast as the backend
+ * takes them (see router.h) - a slow side slows the other one down instead
+ * of filling memory.
+ * =============================================================================
+ */
+
+#ifndef TINYSERVER_PROXY_H
+#define TINYSERVER_PROXY_H
+
+#include "router.h"
+
+struct worker;
+
+/*
+ * FUNCTION: proxy_start
+ * PURPOSE: Resolve the backends and start the health check thread
+ * RETURNS: 0 on success (or without --upstream), -1 on failure
+ * RULE: Before the workers start
+ */
+int proxy_start(void);
+
+/*
+ * FUNCTION: proxy_handler / proxy_body
+ * PURPOSE: The route (handler and body handler) that passes requests on
+ */
+int proxy_handler(const struct http_context *context, void *arg);
+int proxy_body(const struct http_context *context, void *arg, const char *chunk, size_t length);
+
+/*
+ * FUNCTION: proxy_collect
+ * PURPOSE: Free the backend connections closed during the last batch of events
+ * WHY: Another event for one of them may still be waiting in that batch
+ */
+void proxy_collect(struct worker *w);
+
+#endif // TINYSERVER_PROXY_H
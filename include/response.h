@@ -0,0 +1,136 @@
+/*
+ * =============================================================================
+ * RESPONSE - PREBUILT RESPONSE SEGMENTS
+ * =============================================================================
+ * Almost every byte of our responses is the same for every request: the
+ * status line, the headers, most of the HTML page. Formatting all of that
+ * with sprintf() for every request (and measuring it with strlen() three
+ * times) is wasted work.
+ *
+ * Instead, every fixed piece is a "segment" whose length is known at compile
+ * time. A response is just a list of segments (pointers + lengths, the same
+ * layout as struct iovec) with the few variable parts - method, URL, the
+ * Content-Length digits and the Date header - slotted in between.
+ * =============================================================================
+ */
+
+#ifndef TINYSERVER_RESPONSE_H
+#define TINYSERVER_RESPONSE_H
+
+#include <stddef.h>     // size_t
+#include <stdint.h>     // uint64_t
+#include <time.h>       // time_t
+#include <sys/uio.h>    // struct iovec
+
+#include "arena.h"
+
+#define RESPONSE_MAX_PARTS 12
+#define RESPONSE_SCRATCH 320    // Copied header bytes (Date, lengths, ranges...)
+
+struct segment {
+    const char *data;
+    size_t length;
+};
+
+// Length computed by the compiler - no strlen() at run time
+#define SEGMENT(literal) { literal, sizeof(literal) - 1 }
+
+/*
+ * STRUCT: http_date
+ * PURPOSE: The "Date: ...\r\n" header, formatted at most once per second
+ * RULE: One per worker thread - no locking needed
+ */
+struct http_date {
+    time_t second;          // Wall-clock second the header was built for
+    char header[48];        // "Date: Tue, 14 Oct 2026 09:30:00 GMT\r\n"
+    size_t length;
+};
+
+/*
+ * STRUCT: response
+ * PURPOSE: A complete response as a gather list of ready-made buffers
+ * RULE: Don't copy it by value - a part may point into its arena. The output
+ *       queue copies those parts, so a response can be a temporary.
+ */
+struct response {
+    struct iovec parts[RESPONSE_MAX_PARTS];
+    int count;
+    size_t length;              // Sum of all part lengths
+    struct arena arena;                 // Hands out the copied header bytes
+    char scratch[RESPONSE_SCRATCH];     // Memory behind the arena
+};
+
+/*
+ * FUNCTION: http_date_update
+ * PURPOSE: Rebuild the Date header if the second has changed
+ * WHY: Called by the event loop after every wakeup, so requests just copy it
+ */
+void http_date_update(struct http_date *date, time_t now);
+
+/*
+ * Building a response, in order:
+ *   response_start()        status line
+ *   response_add*()         fixed headers by reference (prebuilt segments)
+ *   response_copy*()        variable headers, copied into the scratch area
+ *   response_end_headers()  Date, Content-Length, Connection, blank line
+ *   response_add*()         the body, if it lives in memory
+ * RULE: At most RESPONSE_MAX_PARTS parts and RESPONSE_SCRATCH copied bytes
+ */
+void response_start(struct response *response, const struct segment *status);
+void response_add(struct response *response, const void *data, size_t length);
+void response_add_segment(struct response *response, const struct segment *segment);
+void response_copy(struct response *response, const void *data, size_t length);
+void response_copy_number(struct response *response, uint64_t value);
+void response_end_headers(struct response *response, const struct http_date *date,
+                          int keep_alive, uint64_t body_length);
+
+/*
+ * FUNCTION: response_end_stream_headers
+ * PURPOSE: response_end_headers() for a body of unknown length (see stream.h)
+ */
+void response_end_stream_headers(struct response *response, const struct http_date *date, int keep_alive);
+
+/*
+ * FUNCTION: response_empty
+ * PURPOSE: A complete response with headers only (e.g. 404) that, unlike the
+ *          canned ones below, keeps the connection open if allowed
+ */
+void response_empty(struct response *response, const struct http_date *date,
+                    const struct segment *status, int keep_alive);
+
+/*
+ * FUNCTION: response_echo_body
+ * PURPOSE: The "Method: ... URL: ..." page as prebuilt segments and the two
+ *          fields in between
+ * RETURNS: Number of buffers written to body (RESPONSE_ECHO_PARTS)
+ * RULE: method/url must stay valid until the response has been consumed
+ */
+#define RESPONSE_ECHO_PARTS 5
+int response_echo_body(struct iovec *body, int tls,
+                       const char *method, size_t method_length,
+                       const char *url, size_t url_length);
+
+/*
+ * Status lines for response_start() / response_empty()
+ */
+extern const struct segment status_200;
+extern const struct segment status_206;
+extern const struct segment status_304;
+extern const struct segment status_403;
+extern const struct segment status_404;
+extern const struct segment status_405;
+extern const struct segment status_416;
+
+extern const struct segment content_type_html;
+
+/*
+ * Complete canned responses (status line, headers and empty body)
+ */
+extern const struct segment response_100;     // Interim: "go ahead and send the body"
+extern const struct segment response_400;
+extern const struct segment response_413;
+extern const struct segment response_431;
+extern const struct segment response_501;
+extern const struct segment response_503;     // Written straight to a client we turn away
+
+#endif // TINYSERVER_RESPONSE_H
@@ -0,0 +1,142 @@
+/*
+ * =============================================================================
+ * ROUTER - WHICH HANDLER ANSWERS A REQUEST
+ * =============================================================================
+ * Handlers are registered for a method and a path prefix before the workers
+ * start, and every request - HTTP/1.x or HTTP/2, TLS or plain - goes to the
+ * one with the longest prefix that matches:
+ *
+ *     router_add("GET", "/api/", api_handler, NULL);
+ *     router_add(NULL,  "/",     static_file_handler, NULL);   (any method)
+ *
+ *     GET /api/users   -->  api_handler
+ *     GET /index.html  -->  static_file_handler
+ *
+ * The prefixes are kept in a radix trie: each edge holds a whole run of
+ * characters, so "/api/" and "/assets/" share one "/a" edge and a lookup
+ * compares a few labels instead of every registered prefix. Once
+ * registration is over, router_finish() lays the trie out as one array with
+ * the children of each node next to each other - a lookup walks through a
+ * handful of neighbouring 16-byte nodes, not pointers all over the heap.
+ *
+ * A handler queues its whole answer on the output queue it is given, the
+ * same one for both protocols (HTTP/2 translates it afterwards) - or just
+ * the head, with stream_start(), and makes the body piece by piece while it
+ * goes out (see stream.h).
+ *
+ * Request bodies (HTTP/1.x) are never collected in memory. A route can
+ * take one piece by piece, as it comes off the network, with a body
+ * handler; the answer is queued once the last piece has been handed over:
+ *
+ *     router_add_body("PUT", "/upload/", upload_done, upload_chunk, NULL);
+ *
+ *     headers --> upload_chunk(4 KB) --> upload_chunk(4 KB) ... --> upload_done
+ *
+ * For routes without one the body is read and thrown away.
+ * =============================================================================
+ */
+
+#ifndef TINYSERVER_ROUTER_H
+#define TINYSERVER_ROUTER_H
+
+#include "http_parser.h"
+#include "output.h"
+#include "response.h"
+
+#define ROUTER_METHOD_MAX 15        // Longest method name a route can ask for
+
+struct http_streamer;
+struct log_peer;
+struct worker;
+
+/*
+ * STRUCT: http_context
+ * PURPOSE: Everything a handler needs to answer one request
+ */
+struct http_context {
+    struct output_queue *output;        // Where the answer goes
+    const struct http_date *date;
+    const char *data;                   // First byte of the request (all slices are relative to it)
+    const struct http_request *request;
+    int keep_alive;                     // 1 = the connection stays open afterwards
+    int tls;                            // 1 = the client came in over TLS
+    uint64_t body_length;               // Body bytes received so far (all, once the handler runs)
+    void **state;                       // The request's slot for the route's own use, NULL at first
+    struct http_streamer *streamer;     // Where a streamed answer is left (see stream.h)
+    int body_ignored;                   // 1 = a body follows that no handler gets (HTTP/2)
+    struct worker *worker;              // The thread serving the request
+    const struct log_peer *peer;        // The client's address
+};
+
+/*
+ * TYPE: http_handler
+ * PURPOSE: Queue the complete answer to one request
+ * RULE: Runs on a worker thread - never block. Check output_has_room() before
+ *       queuing anything: returning 0 means "no room yet", and the request
+ *       is handed over again once the queue has been sent
+ * RETURNS: 1 if queued, 0 if the output queue has no room left for it
+ */
+typedef int (*http_handler)(const struct http_context *context, void *arg);
+
+/*
+ * TYPE: http_body_handler
+ * PURPOSE: Take the next piece of a request body as it streams in
+ * PARAMETERS: chunk/length - decoded body bytes (at most one pool buffer),
+ *             valid only during the call. chunk = NULL: the client went
+ *             away before the body was complete - free what *state holds
+ * RULE: Same as for handlers: never block, and return 0 only when the
+ *       output queue has no room for what it wants to queue. The same piece
+ *       comes again once the queue has been sent, and nothing more is read
+ *       from the client meanwhile - a slow consumer slows the sender down.
+ *       A handler that waits for something else instead (a backend taking
+ *       the body, say) calls stream_wake(context->streamer) once it can
+ *       take the piece
+ * RETURNS: 1 if taken, 0 to be handed it again later
+ */
+typedef int (*http_body_handler)(const struct http_context *context, void *arg,
+                                 const char *chunk, size_t length);
+
+/*
+ * FUNCTION: router_add
+ * PURPOSE: Send requests for `method` (NULL = any) whose path starts with
+ *          `prefix` to handler(context, arg)
+ * RULE: Only before router_finish() - the table is read-only afterwards
+ * RETURNS: 0 on success, -1 if the route is invalid or already taken
+ */
+int router_add(const char *method, const char *prefix, http_handler handler, void *arg);
+
+/*
+ * FUNCTION: router_add_body
+ * PURPOSE: router_add() for a route that also takes request bodies
+ */
+int router_add_body(const char *method, const char *prefix, http_handler handler,
+                    http_body_handler body, void *arg);
+
+/*
+ * FUNCTION: router_finish
+ * PURPOSE: Lay the trie out for lookups. Call once, before the workers start
+ * RETURNS: 0 on success, -1 on failure
+ */
+int router_finish(void);
+
+/*
+ * FUNCTION: router_dispatch
+ * PURPOSE: Hand a request to its handler, or answer 404/405 if none fits
+ * RETURNS: 1 if queued, 0 if the output queue has no room left for it
+ */
+int router_dispatch(const struct http_context *context);
+
+/*
+ * FUNCTION: router_dispatch_body
+ * PURPOSE: Hand a piece of a request body to its route's body handler
+ * RETURNS: 1 if taken (or thrown away - the route has none), 0 to retry
+ */
+int router_dispatch_body(const struct http_context *context, const char *chunk, size_t length);
+
+/*
+ * FUNCTION: echo_handler
+ * PURPOSE: The built-in page that shows the method and URL it was asked for
+ */
+int echo_handler(const struct http_context *context, void *arg);
+
+#endif // TINYSERVER_ROUTER_H
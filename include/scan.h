@@ -0,0 +1,64 @@
+/*
+ * =============================================================================
+ * SCAN - VECTORIZED DELIMITER SEARCH FOR THE HTTP PARSER
+ * =============================================================================
+ * Most of the time spent parsing a request goes into one question:
+ * "where is the next space / ':' / '?' / newline?". Checking one byte at a
+ * time is slow, so modern CPUs let us compare 16 or 32 bytes at once:
+ *
+ *   - x86:  SSE4.2 (PCMPESTRI, 16 bytes) or AVX2 (32 bytes)
+ *   - ARM:  NEON (16 bytes) - always present on Apple Silicon / AArch64
+ *   - else: plain C, one byte at a time
+ *
+ * The best version for the CPU we are running on is picked the first time
+ * scan3() is called ("runtime dispatch"), so one binary runs everywhere.
+ * =============================================================================
+ */
+
+#ifndef TINYSERVER_SCAN_H
+#define TINYSERVER_SCAN_H
+
+#include <stddef.h>     // size_t
+
+/*
+ * TYPE: scan3_fn
+ * PURPOSE: Find the first byte equal to a, b or c in data[position..end)
+ * RETURNS: Its index, or end if none of them occurs
+ * RULE: Never reads outside data[position..end)
+ */
+typedef size_t (*scan3_fn)(const char *data, size_t position, size_t end,
+                           char a, char b, char c);
+
+/*
+ * FUNCTION POINTER: scan3
+ * PURPOSE: The fastest implementation available on this CPU
+ */
+extern scan3_fn scan3;
+
+/*
+ * FUNCTION: scan_implementation_name
+ * PURPOSE: Name of the implementation scan3 uses ("avx2", "sse4.2", ...)
+ */
+const char *scan_implementation_name(void);
+
+/*
+ * The individual implementations, for the benchmark (bench/scan_bench.c).
+ * Only call the SIMD ones after checking scan_available().
+ */
+size_t scan3_scalar(const char *data, size_t position, size_t end, char a, char b, char c);
+#if defined(__x86_64__) || defined(__i386__)
+size_t scan3_sse42(const char *data, size_t position, size_t end, char a, char b, char c);
+size_t scan3_avx2(const char *data, size_t position, size_t end, char a, char b, char c);
+#endif
+#if defined(__aarch64__) || defined(__ARM_NEON)
+size_t scan3_neon(const char *data, size_t position, size_t end, char a, char b, char c);
+#endif
+
+/*
+ * FUNCTION: scan_available
+ * PURPOSE: Check whether the CPU supports an implementation by name
+ * RETURNS: 1 if it can be called, 0 if not
+ */
+int scan_available(const char *name);
+
+#endif // TINYSERVER_SCAN_H
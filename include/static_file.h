@@ -0,0 +1,41 @@
+/*
+ * =============================================================================
+ * STATIC FILE - SERVING FILES FROM THE DOCUMENT ROOT
+ * =============================================================================
+ * With --root DIR, GET and HEAD requests are answered with files below DIR:
+ *
+ *     GET /css/site.css  -->  DIR/css/site.css
+ *     GET /docs/         -->  DIR/docs/index.html
+ *
+ * The URL is percent-decoded and any ".." path segment is refused, so a
+ * request can never climb out of the document root.
+ *
+ * The file body is queued as a file part of the output queue: in plain HTTP
+ * mode it goes out with sendfile(), straight from the page cache to the
+ * socket. A single "Range: bytes=first-last" is honored with a 206 answer,
+ * which lets clients resume downloads and seek in media files.
+ *
+ * Text files go out as their .br or .gz variant to clients that take it
+ * (see compress.h) - still a file part, still sendfile().
+ *
+ * Small files are answered from memory (see file_cache.h). Every answer
+ * carries an ETag and Last-Modified, so a client that already has the file
+ * gets a 304 for "If-None-Match" / "If-Modified-Since" and no body.
+ * =============================================================================
+ */
+
+#ifndef TINYSERVER_STATIC_FILE_H
+#define TINYSERVER_STATIC_FILE_H
+
+#include "router.h"
+
+/*
+ * FUNCTION: static_file_handler
+ * PURPOSE: Queue the answer to one request: the file, a range of it, or an
+ *          error status (304, 403, 404, 405, 416)
+ * PARAMETER: arg - unused, the directory is config.document_root
+ * RETURNS: 1 if queued, 0 if the output queue has no room left for it
+ */
+int static_file_handler(const struct http_context *context, void *arg);
+
+#endif // TINYSERVER_STATIC_FILE_H
@@ -0,0 +1,133 @@
+/*
+ * =============================================================================
+ * STREAM - ANSWERS SENT WHILE THEY ARE BEING MADE
+ * =============================================================================
+ * A handler normally queues its whole answer at once, with the
+ * Content-Length in front - so a big or generated answer (a report, a log
+ * tail, a long listing) only starts to go out once its last byte exists.
+ *
+ * Instead a handler can queue just the head and leave a "fill" function
+ * behind. The connection calls it for the next piece whenever everything
+ * queued before has been sent:
+ *
+ *     stream_start(context, &status_200, &report_type, report_fill, report);
+ *
+ *     HTTP/1.1 200 OK
+ *     Transfer-Encoding: chunked           queue sent --> report_fill()
+ *                                                     --> "3ff6\r\n<16374 bytes>\r\n"
+ *     ...                                  queue sent --> report_fill() = 0
+ *                                                     --> "0\r\n\r\n"
+ *
+ * Backpressure comes for free: a client that reads slowly leaves the socket
+ * full, the queue doesn't empty, and fill isn't called - the answer is made
+ * exactly as fast as the client takes it, whether it goes out with write(),
+ * SSL_write() or io_uring. Each piece is made in one pool buffer per
+ * streamed answer. Over HTTP/2 the pieces become DATA frames, as fast as
+ * flow control allows; an HTTP/1.0 client can't take chunks, so it gets the
+ * bytes as they are and the connection closes at the end.
+ *
+ * An answer that depends on somebody else (a backend, see proxy.h) can't
+ * even say its status yet. stream_defer() leaves everything to fill, the
+ * head included, and fill may answer STREAM_WAIT: nothing yet. The
+ * connection then sleeps - no events, no polling - until the producer
+ * calls stream_wake(). A body handler that returns 0 with nothing queued
+ * is woken the same way.
+ * =============================================================================
+ */
+
+#ifndef TINYSERVER_STREAM_H
+#define TINYSERVER_STREAM_H
+
+#include <stddef.h>         // size_t
+#include <stdint.h>         // uint64_t, UINT64_MAX
+
+#include "router.h"
+
+#define STREAM_CHUNK_HEAD 8     // Room for the chunk size line in front of a piece
+#define STREAM_HEAD_END 64      // Room the server adds behind a deferred head
+#define STREAM_WAIT (-2)        // fill: nothing yet, stream_wake() follows
+#define STREAM_LENGTH_UNKNOWN UINT64_MAX
+#define STREAM_PIECE 16384      // Room fill gets when its answer is compressed
+
+/*
+ * TYPE: stream_fill
+ * PURPOSE: Write the next piece of a streamed answer into buffer
+ * PARAMETERS: buffer/room - where it goes. buffer = NULL: the client went
+ *             away (or the answer was for HEAD) - free state and stop
+ * RULE: Runs on a worker thread - never block
+ * RETURNS: > 0 bytes written, 0 = the answer is complete, -1 = failure
+ *          (the client sees a broken answer), STREAM_WAIT = nothing yet.
+ *          After 0 or -1 it isn't called again, so free state before
+ *          returning either
+ */
+typedef int (*stream_fill)(void *state, char *buffer, size_t room);
+
+/*
+ * STRUCT: http_streamer
+ * PURPOSE: The streamed answer a connection or HTTP/2 stream is sending
+ */
+struct http_streamer {
+    stream_fill fill;           // NULL = none (or it is over)
+    void *state;
+    int chunked;                // 0 = the body ends when the connection closes
+    int keep_alive;             // What a deferred head says about the connection
+    int head;                   // 1 = fill makes the head next (stream_defer)
+    uint64_t length;            // Set by fill with a deferred head: the body's
+    int bodyless;               //   length if known, or 1 = there is no body
+    void *owner;                // The connection, for stream_wake()
+};
+
+/*
+ * FUNCTION: stream_start
+ * PURPOSE: Queue the head of a streamed answer and leave fill(state) to
+ *          make its body - gzip or brotli compressed on the way, if the
+ *          type and the client allow it (see compress.h)
+ * PARAMETER: content_type - header segment, or NULL for none (never
+ *            compressed)
+ * RETURNS: 1 if started, 0 if the output queue has no room yet (then fill
+ *          isn't called - the handler is simply asked again later)
+ */
+int stream_start(const struct http_context *context, const struct segment *status,
+                 const struct segment *content_type, stream_fill fill, void *state);
+
+/*
+ * FUNCTION: stream_defer
+ * PURPOSE: Answer with whatever fill(state) makes, head first
+ * RULE: fill's first piece is the status line and headers, each ending in
+ *       CRLF - but without the blank line, framing (Content-Length,
+ *       Transfer-Encoding) or Connection header, which the server adds.
+ *       Before returning it, fill sets streamer->length or ->bodyless if
+ *       it knows them. HEAD requests are fill's business here: it must set
+ *       bodyless. Over HTTP/2 the head has to fit H2_STREAM_BUFFER
+ * RETURNS: 1 (nothing is queued yet, so there's always room)
+ */
+int stream_defer(const struct http_context *context, stream_fill fill, void *state);
+
+/*
+ * FUNCTION: stream_wake
+ * PURPOSE: fill returned STREAM_WAIT (or a body handler 0) and now has
+ *          something: let the connection carry on
+ * RULE: Only from the worker thread serving the request, and not from
+ *       inside fill or a handler. It may call fill before returning - make
+ *       it the last thing the caller does with its state
+ */
+void stream_wake(struct http_streamer *streamer);
+
+/*
+ * FUNCTION: stream_next
+ * PURPOSE: Make the next piece of an HTTP/1.x streamed answer in buffer
+ *          and queue it, framed as a chunk if the client takes those
+ * PARAMETER: size - of buffer (the piece gets its framing in there too)
+ * RETURNS: 1 if something was queued, 0 if the answer is over, -1 on
+ *          failure, STREAM_WAIT if fill has nothing yet
+ * RULE: buffer must not be in the output queue any more
+ */
+int stream_next(struct http_streamer *streamer, char *buffer, size_t size, struct output_queue *output);
+
+/*
+ * FUNCTION: stream_abort
+ * PURPOSE: Stop a streamed answer halfway (the client is gone)
+ */
+void stream_abort(struct http_streamer *streamer);
+
+#endif // TINYSERVER_STREAM_H
@@ -0,0 +1,100 @@
+/*
+ * =============================================================================
+ * TIMER WHEEL - MANY TIMEOUTS, O(1) EACH
+ * =============================================================================
+ * Every connection has a deadline (finish the handshake, finish the request
+ * headers, say something before the idle timeout), and they are set, moved
+ * and cancelled all the time. A sorted structure would cost O(log n) per
+ * change; a timer wheel costs O(1):
+ *
+ *     level 0:  64 slots of 1 tick  (16 ms)     ->  ~1 s ahead
+ *     level 1:  64 slots of 64 ticks            ->  ~1 min ahead
+ *     level 2:  64 slots of 64^2 ticks          ->  ~1 hour ahead
+ *     level 3:  64 slots of 64^3 ticks          ->  ~3 days ahead
+ *
+ * A timer goes into the slot of its expiry tick on the finest level that
+ * reaches that far. Every 64 ticks the next slot of level 1 is emptied into
+ * level 0 (and so on up), so timers drift down as their time approaches and
+ * fire from level 0 - at most one tick late, never early.
+ *
+ * Timers are embedded in their owner (no allocation) and one wheel belongs
+ * to one worker thread (no locking).
+ * =============================================================================
+ */
+
+#ifndef TINYSERVER_TIMER_WHEEL_H
+#define TINYSERVER_TIMER_WHEEL_H
+
+#include <stdint.h>         // uint64_t
+
+#define TIMER_TICK_MS 16
+#define TIMER_LEVELS 4
+#define TIMER_SLOT_BITS 6
+#define TIMER_SLOTS (1 << TIMER_SLOT_BITS)
+
+struct timer {
+    struct timer *next;
+    struct timer **prev_next;       // Whatever points at us (NULL = not pending)
+    uint64_t expires;               // Tick it fires at
+    unsigned slot;                  // level * TIMER_SLOTS + slot, or the due list
+};
+
+struct timer_wheel {
+    uint64_t tick;                  // Next tick to process - all before it have fired
+    uint64_t pending;               // Timers in the wheel or due
+    uint64_t occupied[TIMER_LEVELS];    // Bit per non-empty slot
+    struct timer *slots[TIMER_LEVELS * TIMER_SLOTS + 1];    // + the due list
+};
+
+/*
+ * FUNCTION: timer_wheel_init
+ * PURPOSE: Start an empty wheel at the current time
+ */
+void timer_wheel_init(struct timer_wheel *wheel, uint64_t now_ms);
+
+/*
+ * FUNCTION: timer_init
+ * PURPOSE: Mark an embedded timer as not pending
+ */
+static inline void timer_init(struct timer *timer) {
+    timer->prev_next = 0;
+}
+
+static inline int timer_pending(const struct timer *timer) {
+    return timer->prev_next != 0;
+}
+
+// When a pending timer fires (its deadline rounded up to a whole tick)
+static inline uint64_t timer_expires_ms(const struct timer *timer) {
+    return timer->expires * TIMER_TICK_MS;
+}
+
+/*
+ * FUNCTION: timer_start
+ * PURPOSE: (Re)schedule a timer for the absolute time expires_ms
+ */
+void timer_start(struct timer_wheel *wheel, struct timer *timer, uint64_t expires_ms);
+
+/*
+ * FUNCTION: timer_stop
+ * PURPOSE: Unschedule a timer (nothing happens if it isn't pending)
+ */
+void timer_stop(struct timer_wheel *wheel, struct timer *timer);
+
+/*
+ * FUNCTION: timer_wheel_expire
+ * PURPOSE: Take the next timer due by now_ms off the wheel
+ * RETURNS: The timer (no longer pending), or NULL when none is due
+ */
+struct timer *timer_wheel_expire(struct timer_wheel *wheel, uint64_t now_ms);
+
+/*
+ * FUNCTION: timer_wheel_timeout
+ * PURPOSE: How long the event loop may sleep before the wheel needs a look
+ * RETURNS: Milliseconds (0 = now), -1 if no timer is pending
+ * WHY: Cheap, not exact: when nothing is due on level 0 soon it answers
+ *      "the next cascade", so a lone far-away timer costs a wakeup per ~1 s
+ */
+int timer_wheel_timeout(const struct timer_wheel *wheel, uint64_t now_ms);
+
+#endif // TINYSERVER_TIMER_WHEEL_H
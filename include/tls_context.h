@@ -0,0 +1,72 @@
+/*
+ * =============================================================================
+ * TLS CONTEXT - CERTIFICATE RELOAD AND SNI VIRTUAL HOSTS
+ * =============================================================================
+ * Certificates expire and get rotated. Restarting the server for that would
+ * drop every connection, so instead:
+ *
+ *     kill -HUP <pid>   -->   build a complete new SSL_CTX set in the
+ *                             background, then swap it in for NEW clients
+ *
+ * Clients already connected keep using the context they started with.
+ * OpenSSL reference-counts every SSL_CTX, and each SSL object holds a
+ * reference, so an old context is freed by itself when its last connection
+ * goes away. If the new certificates fail to load, the old set stays.
+ *
+ * SNI: a client names the host it wants in its first handshake message
+ * (server_name). With --sni HOST:CERT:KEY the server keeps one extra context
+ * per hostname and switches to it before sending a certificate, so one
+ * process serves several sites. Unknown names get the default certificate.
+ * =============================================================================
+ */
+
+#ifndef TINYSERVER_TLS_CONTEXT_H
+#define TINYSERVER_TLS_CONTEXT_H
+
+#include <openssl/ssl.h>    // SSL_CTX, SSL
+
+/*
+ * TYPE: tls_context_builder
+ * PURPOSE: Create a fully configured SSL_CTX for one certificate/key pair
+ * RETURNS: The context, or NULL on failure (errors already printed)
+ */
+typedef SSL_CTX *(*tls_context_builder)(const char *cert_file, const char *key_file);
+
+/*
+ * FUNCTION: tls_context_load
+ * PURPOSE: Build the first context set (default + SNI hosts from config)
+ * RETURNS: 0 on success, -1 on failure
+ */
+int tls_context_load(tls_context_builder build);
+
+/*
+ * FUNCTION: tls_context_reload
+ * PURPOSE: Build a new context set and make it the one new clients get
+ * RETURNS: 0 on success, -1 on failure (the current set stays in use)
+ */
+int tls_context_reload(void);
+
+/*
+ * FUNCTION: tls_context_watch_sighup
+ * PURPOSE: Reload on every SIGHUP, from a thread of its own
+ * RULE: Call before starting any other thread - SIGHUP is blocked in the
+ *       caller and every thread it creates, so only the watcher receives it
+ * RETURNS: 0 on success, -1 on failure
+ */
+int tls_context_watch_sighup(void);
+
+/*
+ * FUNCTION: tls_context_free
+ * PURPOSE: Drop the current context set at shutdown
+ * RULE: Only once no worker can call tls_context_new_ssl() any more
+ */
+void tls_context_free(void);
+
+/*
+ * FUNCTION: tls_context_new_ssl
+ * PURPOSE: Create the SSL object for a new client from the current context
+ * RETURNS: SSL object, or NULL on failure
+ */
+SSL *tls_context_new_ssl(void);
+
+#endif // TINYSERVER_TLS_CONTEXT_H
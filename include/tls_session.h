@@ -0,0 +1,49 @@
+/*
+ * =============================================================================
+ * TLS SESSION RESUMPTION - SESSION CACHE AND SESSION TICKETS
+ * =============================================================================
+ * A full mutual-TLS handshake costs expensive public-key crypto on both sides
+ * (key exchange, server signature, client certificate verification). When a
+ * client reconnects it can skip all of that by "resuming" its old session:
+ *
+ *   - Session cache: the server remembers recent sessions by ID (at most
+ *     --session-cache, least recently used go first). There is one cache per
+ *     process, shared by every worker and every SSL_CTX (--sni hosts, the
+ *     contexts a SIGHUP reload builds), so a client can resume anywhere.
+ *   - Session tickets: the server encrypts the session state and hands it to
+ *     the client to keep ("stateless" - no server memory needed). The ticket
+ *     key is made once per process and rotated regularly; older keys are kept
+ *     for a while so tickets issued just before a rotation still work.
+ *
+ * Neither is reset by building a context: reloading certificates keeps
+ * every client's session.
+ * =============================================================================
+ */
+
+#ifndef TINYSERVER_TLS_SESSION_H
+#define TINYSERVER_TLS_SESSION_H
+
+#include <openssl/ssl.h>    // SSL_CTX
+
+/*
+ * FUNCTION: tls_session_configure
+ * PURPOSE: Enable the session cache and/or tickets on ctx according to config
+ * RETURNS: 0 on success, -1 on failure (OpenSSL errors are queued)
+ */
+int tls_session_configure(SSL_CTX *ctx);
+
+#define TLS_SESSION_KEYS_MAX 512    // Room tls_session_export_keys() may need
+
+/*
+ * FUNCTION: tls_session_export_keys / tls_session_import_keys
+ * PURPOSE: Copy the ticket keys to a process taking over from this one
+ *          (see handoff.h), so tickets issued by the old process still work
+ * RULE: Import after tls_session_configure() - the first one generates a key,
+ *       which the imported set replaces
+ * RETURNS: export: bytes written to data (0 if tickets are off);
+ *          import: 0 on success, -1 if data isn't a key set we understand
+ */
+size_t tls_session_export_keys(unsigned char *data, size_t space);
+int tls_session_import_keys(const unsigned char *data, size_t length);
+
+#endif // TINYSERVER_TLS_SESSION_H
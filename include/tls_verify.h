@@ -0,0 +1,46 @@
+/*
+ * =============================================================================
+ * TLS VERIFY - CLIENT CERTIFICATE CACHE AND REVOKED SERIALS
+ * =============================================================================
+ * Every mutual-TLS handshake makes OpenSSL build the client's chain up to
+ * --ca and check a signature per link - for the same few thousand client
+ * certificates, over and over. So each SSL_CTX remembers which certificates
+ * it already verified:
+ *
+ *     client certificate --SHA-256--> cache? -- yes --> accepted
+ *                                        |
+ *                                        no --> chain + signatures --> revoked? --> cache it
+ *
+ * What a hit skips is only the chain work: the client still proves it holds
+ * the certificate's private key (CertificateVerify) in every handshake. A
+ * fingerprint covers the whole certificate, signature included, so a hit
+ * is the very certificate that passed before. An entry lasts until the
+ * first certificate in its chain expires, and the least recently used one
+ * makes room when --verify-cache is full. Failures are never cached.
+ *
+ * Revocation: the CRLs in --crl (PEM, several in one file are fine, each
+ * signed by a --ca certificate) are indexed by issuer and serial in a hash
+ * set - one lookup per certificate of a chain, however long the lists are.
+ *
+ * Lifetime: cache and set belong to one SSL_CTX (as ex_data) and go with
+ * it. A SIGHUP reload builds new contexts, so new CA or CRL files never
+ * meet verdicts reached with the old ones - the set never changes under a
+ * cached entry, which is why a hit needs no revocation check.
+ * =============================================================================
+ */
+
+#ifndef TINYSERVER_TLS_VERIFY_H
+#define TINYSERVER_TLS_VERIFY_H
+
+#include <openssl/ssl.h>    // SSL_CTX
+
+/*
+ * FUNCTION: tls_verify_configure
+ * PURPOSE: Install the cached verification (and the --crl check) on ctx
+ * RETURNS: 0 on success (or with neither switched on), -1 on failure
+ *          (a CRL that doesn't load or isn't from --ca is reported)
+ * RULE: After the --ca certificates are loaded into ctx
+ */
+int tls_verify_configure(SSL_CTX *ctx);
+
+#endif // TINYSERVER_TLS_VERIFY_H
@@ -0,0 +1,140 @@
+/*
+ * =============================================================================
+ * URING - A SMALL io_uring WRAPPER (LINUX), NO LIBURING NEEDED
+ * =============================================================================
+ * epoll only says "this socket is ready"; the read() or write() that follows
+ * is still one system call each. io_uring turns that around: we write
+ * requests ("receive on connection 7", "send these buffers") into a ring
+ * shared with the kernel, and it writes back completions into a second
+ * ring. One io_uring_enter() call submits everything queued and waits for
+ * whatever finished - however many connections that covers.
+ *
+ *      worker                          kernel
+ *      ------                          ------
+ *      SQ  [recv 7][send 3][...]  -->  does the I/O
+ *      CQ  [3: 270 bytes][7: ...] <--  one entry per finished request
+ *
+ * What the server uses (all present since Linux 5.19):
+ *   - multishot accept: one request keeps accepting clients until cancelled
+ *   - registered ("direct") descriptors: accepted sockets go straight into
+ *     a table inside the ring, so each operation skips the fd lookup and
+ *     there is no regular fd to close() later
+ *   - a provided buffer ring: receives take a buffer from a shared pool
+ *     only when data actually arrives, so idle connections hold none
+ *   - linked requests: "send, then shut down" is queued in one go
+ *
+ * Everything here is the mechanics; connection.c and worker.c decide what
+ * to submit. Other systems get stubs that report io_uring as unavailable.
+ * =============================================================================
+ */
+
+#ifndef TINYSERVER_URING_H
+#define TINYSERVER_URING_H
+
+#include <stddef.h>         // size_t
+#include <stdint.h>         // uint64_t, uintptr_t
+
+struct msghdr;
+
+#define URING_ENTRIES 1024          // Submission queue size (completion queue is twice that)
+#define URING_FILES 16384           // Registered descriptors = connections per worker
+                                    //   (at most the open files limit)
+#define URING_BUFFERS 512           // Provided receive buffers per worker (power of two)
+
+/*
+ * What a completion belongs to. Stored in the low bits of its user_data next
+ * to a pointer (worker or connection, both at least 8-byte aligned).
+ * 0 marks requests whose completion is ignored (cancel, close).
+ */
+enum uring_tag {
+    URING_TAG_NONE,
+    URING_TAG_ACCEPT,
+    URING_TAG_RECV,
+    URING_TAG_SEND,
+    URING_TAG_SHUTDOWN,
+    URING_TAG_WAKE,
+    URING_TAG_LOOP              // The event loop has something (backend sockets)
+};
+
+#define URING_TAG_MASK 7
+
+static inline uint64_t uring_data(void *owner, enum uring_tag tag) {
+    return (uint64_t)(uintptr_t)owner | (uint64_t)tag;
+}
+
+static inline void *uring_owner(uint64_t data) {
+    return (void *)(uintptr_t)(data & ~(uint64_t)URING_TAG_MASK);
+}
+
+static inline enum uring_tag uring_tag(uint64_t data) {
+    return (enum uring_tag)(data & URING_TAG_MASK);
+}
+
+struct uring;
+
+struct uring_completion {
+    uint64_t data;          // user_data of the request
+    int result;             // Like a system call: >= 0 success, -errno failure
+    int more;               // 1 = a multishot request keeps going
+    int buffer;             // Provided buffer holding received data, -1 if none
+};
+
+/*
+ * FUNCTION: uring_create
+ * PURPOSE: Set up a ring with a sparse descriptor table and a provided
+ *          buffer ring of URING_BUFFERS buffers of buffer_size bytes
+ * RULE: Call uring_enable() on the thread that will use it
+ * RETURNS: The ring, or NULL if this kernel can't do all of the above
+ */
+struct uring *uring_create(size_t buffer_size);
+
+/*
+ * FUNCTION: uring_enable
+ * PURPOSE: Start the ring on the calling thread
+ * WHY: The ring is created with "only one thread submits" - which lets the
+ *      kernel skip locking - so it must be bound to the worker thread, not
+ *      to main() which created it
+ * RETURNS: 0 on success, -1 on failure
+ */
+int uring_enable(struct uring *ring);
+
+/*
+ * Queue requests - nothing reaches the kernel before the next uring_wait().
+ * `file` is an index into the registered descriptor table.
+ */
+void uring_accept(struct uring *ring, int listen_fd, uint64_t data);
+void uring_poll(struct uring *ring, int fd, uint64_t data);     // Once readable; a regular fd
+void uring_recv(struct uring *ring, int file, size_t length, uint64_t data);
+void uring_sendmsg(struct uring *ring, int file, const struct msghdr *message, int link, uint64_t data);
+void uring_send(struct uring *ring, int file, const void *buffer, size_t length, int link, uint64_t data);
+void uring_shutdown(struct uring *ring, int file, uint64_t data);
+void uring_cancel(struct uring *ring, int file);
+void uring_cancel_request(struct uring *ring, uint64_t data);     // The one queued with this data
+void uring_close(struct uring *ring, int file);
+void uring_reject(struct uring *ring, int file, const void *buffer, size_t length);    // Send, then close
+
+/*
+ * FUNCTION: uring_wait
+ * PURPOSE: Submit what is queued and wait for at least one completion
+ * PARAMETER: timeout_ms - how long to wait at most (-1 = forever)
+ * RETURNS: 0 on success (also on timeout), -1 on failure
+ */
+int uring_wait(struct uring *ring, int timeout_ms);
+
+/*
+ * FUNCTION: uring_next
+ * PURPOSE: Take the next completion off the ring
+ * RETURNS: 1 if *completion was filled, 0 if there are none left
+ */
+int uring_next(struct uring *ring, struct uring_completion *completion);
+
+/*
+ * FUNCTION: uring_buffer / uring_buffer_recycle
+ * PURPOSE: Where a provided buffer is, and hand it back to the kernel
+ * RULE: Recycle every buffer a completion gave you, as soon as possible -
+ *       receives on all connections draw from the same pool
+ */
+const char *uring_buffer(const struct uring *ring, int buffer);
+void uring_buffer_recycle(struct uring *ring, int buffer);
+
+#endif // TINYSERVER_URING_H
@@ -0,0 +1,139 @@
+/*
+ * =============================================================================
+ * WORKER - ONE EVENT LOOP AND ITS LISTENING SOCKET
+ * =============================================================================
+ * A worker owns everything one event-loop thread touches: the loop itself,
+ * the listening socket and every connection accepted from it.
+ *
+ * With --workers N there are N of these, each on its own thread pinned to its
+ * own CPU core and each with its own SO_REUSEPORT listening socket. Workers
+ * share nothing on the hot path, so they never wait for each other.
+ * =============================================================================
+ */
+
+#ifndef TINYSERVER_WORKER_H
+#define TINYSERVER_WORKER_H
+
+#include <pthread.h>        // pthread_t
+
+#include "access_log.h"
+#include "event_loop.h"
+#include "connection.h"
+#include "crypto_pool.h"
+#include "metrics.h"
+#include "pool.h"
+#include "response.h"
+#include "timer_wheel.h"
+#include "uring.h"
+
+typedef struct worker worker;
+
+struct proxy_pool;
+
+struct worker {
+    event_handler listener;         // Listening socket (callback = accept)
+    event_loop *loop;               // epoll/kqueue instance
+    struct uring *uring;            // io_uring instead of the loop (NULL = off)
+    int accept_paused;              // 1 = descriptor table full, accept again after a close
+    int accept_armed;               // 1 = a multishot accept is in the ring
+    connection *closed;             // Connections waiting to be freed
+    struct timer_wheel timers;      // Every connection's deadline
+    struct timer accept_timer;      // Resumes accepting after a failure
+    int connections;                // Open connections (--worker-connections)
+    int handshakes;                 // Of which are still in the TLS handshake
+    int reserve_fd;                 // Spare descriptor for turning clients away
+    connection *open;               // Every open connection (for draining)
+    int drain_requested;            // Set by worker_drain(), from any thread
+    int draining;                   // 1 = no more accepting or keep-alive
+    int drain_expired;              // 1 = --drain-timeout passed, close the rest
+    struct timer drain_timer;       //   when that happens
+    struct http_date date;          // Cached Date header for our responses
+    struct metrics *metrics;        // Our counters - only this thread writes them
+    struct access_log *log;         // Our log ring - only this thread fills it
+    struct pool connection_pool;    // connection objects
+    struct pool buffer_pool;        // BUFFER_SIZE request buffers
+    struct pool record_pool;        // TLS_RECORD_SIZE record buffers
+    struct pool h2_pool;            // HTTP/2 sessions (~80 KB each)
+    struct proxy_pool *proxy;       // Backend connections (see proxy.h), NULL until used
+    event_handler wake;             // Readable when crypto tasks came back
+    int wake_write_fd;              // Where worker_complete() signals wake
+    pthread_mutex_t completed_lock; // Guards completed (other threads push)
+    struct crypto_task *completed;  // Finished crypto tasks, newest first
+    int id;                         // 0 .. worker_count - 1
+    pthread_t thread;               // Thread running worker_run()
+};
+
+/*
+ * FUNCTION: worker_init
+ * PURPOSE: Create the event loop and register the listening socket with it
+ * RETURNS: 0 on success, -1 on failure
+ */
+int worker_init(worker *w, int id, int listen_fd);
+
+/*
+ * FUNCTION: worker_run
+ * PURPOSE: Run the event loop (on the calling thread) until drained
+ */
+void worker_run(worker *w);
+
+/*
+ * FUNCTION: worker_start
+ * PURPOSE: Start a thread pinned to CPU core (id % cores) that runs worker_run()
+ * RETURNS: 0 on success, -1 on failure
+ */
+int worker_start(worker *w);
+
+/*
+ * FUNCTION: worker_join
+ * PURPOSE: Wait for a worker thread to finish
+ */
+void worker_join(worker *w);
+
+/*
+ * FUNCTION: worker_complete
+ * PURPOSE: Hand a finished crypto task back to its worker (from any thread)
+ * WHY: Only the worker thread may touch its connections and event loop,
+ *      so the task's done() callback runs there, after a wakeup
+ */
+void worker_complete(worker *w, struct crypto_task *task);
+
+/*
+ * FUNCTION: worker_drain
+ * PURPOSE: Stop accepting and let the connections finish, then return from
+ *          worker_run() - at the latest --drain-timeout later (any thread)
+ * WHY: Idle keep-alive connections are closed right away, busy ones after
+ *      the response in progress (with "Connection: close", or GOAWAY for
+ *      HTTP/2), so no client sees its request cut off
+ */
+void worker_drain(worker *w);
+
+/*
+ * FUNCTION: worker_deadline
+ * PURPOSE: Close the connection if it is still open at deadline_ms
+ * WHY: Called after nearly every event, so moving a deadline LATER only
+ *      updates conn->deadline_ms - the timer checks it when it fires and
+ *      goes back into the wheel. Only an earlier deadline touches the wheel.
+ */
+void worker_deadline(worker *w, connection *conn, uint64_t deadline_ms);
+
+/*
+ * FUNCTION: worker_hold
+ * PURPOSE: Stop the connection's timer while another thread owns it
+ */
+void worker_hold(worker *w, connection *conn);
+
+/*
+ * FUNCTION: worker_forget
+ * PURPOSE: A connection closed: stop its timer, take it off the open list
+ *          and free its place under --worker-connections and --max-connections
+ */
+void worker_forget(worker *w, connection *conn);
+
+/*
+ * FUNCTION: set_nonblocking
+ * PURPOSE: Make reads/writes on fd return immediately instead of waiting
+ * RETURNS: 0 on success, -1 on failure
+ */
+int set_nonblocking(int fd);
+
+#endif // TINYSERVER_WORKER_H
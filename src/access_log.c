@@ -0,0 +1,433 @@
+/*
+ * =============================================================================
+ * ACCESS LOG IMPLEMENTATION - PER-WORKER RINGS, BATCHING LOG THREAD
+ * =============================================================================
+ */
+
+#include <stdio.h>          // snprintf, fprintf, perror
+#include <stdlib.h>         // posix_memalign
+#include <string.h>         // memcpy, memset, strerror
+#include <errno.h>          // errno, EINTR
+#include <fcntl.h>          // open, O_APPEND
+#include <unistd.h>         // write, STDOUT_FILENO, STDERR_FILENO
+#include <time.h>           // gmtime_r, strftime, nanosleep
+#include <pthread.h>        // pthread_create, pthread_join
+#include <netinet/in.h>     // sockaddr_in, sockaddr_in6, IN6_IS_ADDR_V4MAPPED
+#include <arpa/inet.h>      // inet_ntop
+#include <openssl/err.h>    // ERR_error_string_n
+
+#include "access_log.h"
+#include "config.h"
+
+#define LOG_BATCH 65536             // Bytes collected before a write()
+#define LOG_LINE_MAX 1280           // Longest line (request text escaped 4x)
+#define LOG_IDLE_NS 10000000        // Nap when every ring is empty (10 ms)
+#define LOG_RING_QUIET 64           // Ring size with --access-log off (errors only)
+
+// One ring per worker, filled in before the log thread starts
+static struct access_log *registered[MAX_WORKERS];
+static int registered_count;
+
+/*
+ * STRUCT: batch
+ * PURPOSE: Formatted lines waiting to be written to one file with one write()
+ */
+struct batch {
+    int fd;
+    int failed;                     // 1 = write() failed, said so once already
+    size_t length;
+    char data[LOG_BATCH];
+};
+
+static struct batch access_batch = { -1, 0, 0, { 0 } };
+static struct batch error_batch = { STDERR_FILENO, 0, 0, { 0 } };
+
+static pthread_t log_thread;
+static int log_thread_started;
+static int stopping;                // Set by access_log_stop()
+
+struct access_log *access_log_create(void) {
+    size_t size = LOG_RING_QUIET;
+    struct access_log *log;
+
+    if (registered_count == MAX_WORKERS) {
+        return NULL;
+    }
+    if (config.access_log) {
+        // Round up to a power of two so a slot is head & mask, not head % size
+        size = 1;
+        while (size < (size_t)config.access_log_buffer) {
+            size <<= 1;
+        }
+    }
+    if (posix_memalign((void **)&log, METRICS_CACHE_LINE, sizeof(*log)) != 0) {
+        return NULL;
+    }
+    memset(log, 0, sizeof(*log));
+    if (posix_memalign((void **)&log->records, METRICS_CACHE_LINE, size * sizeof(struct access_record)) != 0) {
+        free(log);
+        return NULL;
+    }
+    log->mask = size - 1;
+    registered[registered_count++] = log;
+    return log;
+}
+
+void access_log_peer(struct log_peer *peer, const struct sockaddr *address) {
+    peer->family = 0;
+    if (!address) {
+        return;
+    }
+    if (address->sa_family == AF_INET) {
+        const struct sockaddr_in *in = (const struct sockaddr_in *)address;
+        peer->family = AF_INET;
+        memcpy(peer->address, &in->sin_addr, 4);
+    } else if (address->sa_family == AF_INET6) {
+        const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)address;
+        // IPv4 clients of a dual-stack socket show up as ::ffff:a.b.c.d
+        if (IN6_IS_ADDR_V4MAPPED(&in6->sin6_addr)) {
+            peer->family = AF_INET;
+            memcpy(peer->address, in6->sin6_addr.s6_addr + 12, 4);
+        } else {
+            peer->family = AF_INET6;
+            memcpy(peer->address, &in6->sin6_addr, 16);
+        }
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Worker side: fill a slot, then publish it
+// -----------------------------------------------------------------------------
+
+/*
+ * FUNCTION: reserve
+ * PURPOSE: The next free record of the ring, or NULL if it is full
+ * WHY: tail is only re-read when the copy we have says "full" - most
+ *      records are reserved without touching the log thread's cache line
+ */
+static struct access_record *reserve(struct access_log *log) {
+    uint64_t head = __atomic_load_n(&log->head, __ATOMIC_RELAXED);
+
+    if (head - log->tail_seen > log->mask) {
+        log->tail_seen = __atomic_load_n(&log->tail, __ATOMIC_ACQUIRE);
+        if (head - log->tail_seen > log->mask) {
+            return NULL;
+        }
+    }
+    return &log->records[head & log->mask];
+}
+
+/*
+ * FUNCTION: publish
+ * PURPOSE: Hand the reserved record to the log thread
+ * RULE: Release order - the record's contents become visible before the new head
+ */
+static void publish(struct access_log *log) {
+    uint64_t head = __atomic_load_n(&log->head, __ATOMIC_RELAXED);
+    __atomic_store_n(&log->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * FUNCTION: queued_status
+ * PURPOSE: Read the status code back from a status line ("HTTP/1.1 404 ...")
+ * RETURNS: The code, or 0 if the part isn't a status line
+ */
+static int queued_status(const struct output_queue *output, int part) {
+    const char *line;
+
+    if (part >= output->count || !output->parts[part].iov_base || output->parts[part].iov_len < 12) {
+        return 0;
+    }
+    line = output->parts[part].iov_base;
+    if (memcmp(line, "HTTP/1.", 7) != 0 || line[8] != ' ') {
+        return 0;
+    }
+    return (line[9] - '0') * 100 + (line[10] - '0') * 10 + (line[11] - '0');
+}
+
+int access_log_request(struct access_log *log, time_t now, const struct log_peer *peer,
+                       enum access_protocol protocol, const char *method, size_t method_length,
+                       const char *url, size_t url_length,
+                       const struct output_queue *output, int part, size_t length) {
+    struct access_record *record;
+    size_t text_length = 0;
+
+    if (!config.access_log) {
+        return 0;
+    }
+    record = reserve(log);
+    if (!record) {
+        return -1;
+    }
+
+    record->kind = ACCESS_RECORD_REQUEST;
+    record->protocol = (uint8_t)protocol;
+    record->time = (int64_t)now;
+    record->status = (uint16_t)queued_status(output, part);
+    record->value = output->length - length;
+    record->peer = *peer;
+
+    // "METHOD url", cut to fit - the log thread escapes it
+    if (method_length > 0) {
+        if (method_length > ACCESS_LOG_TEXT - 1) {
+            method_length = ACCESS_LOG_TEXT - 1;
+        }
+        memcpy(record->text, method, method_length);
+        record->text[method_length] = ' ';
+        text_length = method_length + 1;
+        if (url_length > ACCESS_LOG_TEXT - text_length) {
+            url_length = ACCESS_LOG_TEXT - text_length;
+        }
+        memcpy(record->text + text_length, url, url_length);
+        text_length += url_length;
+    }
+    record->text_length = (uint16_t)text_length;
+
+    publish(log);
+    return 0;
+}
+
+int access_log_handshake(struct access_log *log, time_t now, const struct log_peer *peer,
+                         enum handshake_failure reason, unsigned long error) {
+    struct access_record *record;
+
+    // Sampling: one of every --error-log-sample failures
+    if (log->error_seen++ % (uint64_t)config.error_log_sample != 0) {
+        log->error_skipped++;
+        return 0;
+    }
+    // Rate limit: at most --error-log-rate lines per second (0 = no limit)
+    if (config.error_log_rate) {
+        if ((uint64_t)now != log->error_second) {
+            log->error_second = (uint64_t)now;
+            log->error_count = 0;
+        }
+        if (log->error_count >= (uint32_t)config.error_log_rate) {
+            log->error_skipped++;
+            return 0;
+        }
+        log->error_count++;
+    }
+
+    record = reserve(log);
+    if (!record) {
+        log->error_skipped++;
+        return -1;
+    }
+    record->kind = ACCESS_RECORD_HANDSHAKE;
+    record->time = (int64_t)now;
+    record->status = (uint16_t)reason;
+    record->value = error;
+    record->suppressed = log->error_skipped;
+    record->peer = *peer;
+    record->text_length = 0;
+    log->error_skipped = 0;
+
+    publish(log);
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+// Log thread: format, batch, write
+// -----------------------------------------------------------------------------
+
+/*
+ * FUNCTION: flush
+ * PURPOSE: Write a batch out, however long the disk takes
+ * WHY: Only this thread waits for it - workers keep filling their rings
+ */
+static void flush(struct batch *batch) {
+    const char *data = batch->data;
+    size_t length = batch->length;
+
+    while (length > 0) {
+        ssize_t bytes = write(batch->fd, data, length);
+        if (bytes < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (!batch->failed && batch->fd != STDERR_FILENO) {
+                fprintf(stderr, "Unable to write access log: %s\n", strerror(errno));
+            }
+            batch->failed = 1;
+            break;      // Lose these lines rather than retry forever
+        }
+        data += bytes;
+        length -= (size_t)bytes;
+    }
+    batch->length = 0;
+}
+
+/*
+ * FUNCTION: format_time
+ * PURPOSE: "14/Oct/2026:09:30:00 +0000" for a second, cached like the Date header
+ */
+static const char *format_time(int64_t second) {
+    static int64_t cached = -1;
+    static char text[32];
+
+    if (second != cached) {
+        time_t t = (time_t)second;
+        struct tm tm;
+        gmtime_r(&t, &tm);
+        strftime(text, sizeof(text), "%d/%b/%Y:%H:%M:%S +0000", &tm);
+        cached = second;
+    }
+    return text;
+}
+
+static void format_peer(const struct log_peer *peer, char *out, size_t size) {
+    if (!peer->family || !inet_ntop(peer->family, peer->address, out, (socklen_t)size)) {
+        snprintf(out, size, "-");
+    }
+}
+
+/*
+ * FUNCTION: escape
+ * PURPOSE: Copy client-supplied text, with quotes, backslashes and control
+ *          bytes written as \xHH
+ * WHY: A request line is whatever the client sent - unescaped, a crafted
+ *      one could forge extra log lines or break the quoting
+ */
+static size_t escape(char *out, const char *text, size_t length) {
+    static const char hex[] = "0123456789abcdef";
+    size_t i, n = 0;
+
+    for (i = 0; i < length; i++) {
+        unsigned char c = (unsigned char)text[i];
+        if (c < 0x20 || c >= 0x7f || c == '"' || c == '\\') {
+            out[n++] = '\\';
+            out[n++] = 'x';
+            out[n++] = hex[c >> 4];
+            out[n++] = hex[c & 15];
+        } else {
+            out[n++] = (char)c;
+        }
+    }
+    return n;
+}
+
+static void format_request(struct batch *batch, const struct access_record *record) {
+    static const char *const versions[] = { "HTTP/1.0", "HTTP/1.1", "HTTP/2.0" };
+    char *line = batch->data + batch->length;
+    char peer[INET6_ADDRSTRLEN];
+    size_t n;
+
+    format_peer(&record->peer, peer, sizeof(peer));
+    n = (size_t)snprintf(line, LOG_LINE_MAX, "%s - - [%s] \"", peer, format_time(record->time));
+    if (record->text_length > 0) {
+        n += escape(line + n, record->text, record->text_length);
+        n += (size_t)snprintf(line + n, LOG_LINE_MAX - n, " %s\"", versions[record->protocol]);
+    } else {
+        n += (size_t)snprintf(line + n, LOG_LINE_MAX - n, "-\"");     // Unparsable request
+    }
+    n += (size_t)snprintf(line + n, LOG_LINE_MAX - n, " %u %llu\n",
+                          (unsigned)record->status, (unsigned long long)record->value);
+    batch->length += n;
+}
+
+static void format_handshake(struct batch *batch, const struct access_record *record) {
+    char peer[INET6_ADDRSTRLEN], error[256];
+    int n;
+
+    format_peer(&record->peer, peer, sizeof(peer));
+    ERR_error_string_n((unsigned long)record->value, error, sizeof(error));
+    n = snprintf(batch->data + batch->length, LOG_LINE_MAX, "[%s] TLS handshake from %s failed (%s): %s",
+                 format_time(record->time), peer,
+                 metrics_failure_name((enum handshake_failure)record->status), error);
+    if (record->suppressed) {
+        n += snprintf(batch->data + batch->length + n, LOG_LINE_MAX - (size_t)n,
+                      " [%u more since the last one not logged]", record->suppressed);
+    }
+    batch->data[batch->length + (size_t)n] = '\n';
+    batch->length += (size_t)n + 1;
+}
+
+/*
+ * FUNCTION: drain
+ * PURPOSE: Format every record a worker has published so far
+ * RETURNS: How many there were
+ */
+static uint64_t drain(struct access_log *log) {
+    uint64_t head = __atomic_load_n(&log->head, __ATOMIC_ACQUIRE);
+    uint64_t tail = log->tail;
+    uint64_t count = head - tail;
+
+    while (tail != head) {
+        const struct access_record *record = &log->records[tail & log->mask];
+        struct batch *batch = record->kind == ACCESS_RECORD_REQUEST ? &access_batch : &error_batch;
+
+        if (batch->length + LOG_LINE_MAX > sizeof(batch->data)) {
+            flush(batch);
+        }
+        if (record->kind == ACCESS_RECORD_REQUEST) {
+            format_request(batch, record);
+        } else {
+            format_handshake(batch, record);
+        }
+        // Give the slot back record by record, so a worker waiting on a
+        // full ring gets room before the (slow) write
+        tail++;
+        __atomic_store_n(&log->tail, tail, __ATOMIC_RELEASE);
+    }
+    return count;
+}
+
+static void *log_thread_main(void *arg) {
+    const struct timespec idle = { 0, LOG_IDLE_NS };
+
+    (void)arg;
+
+    while (1) {
+        uint64_t records = 0;
+        int i;
+
+        for (i = 0; i < registered_count; i++) {
+            records += drain(registered[i]);
+        }
+        // Caught up: write what is there and wait for more. Under load the
+        // batches fill up and are written whole, one write() per 64 KB
+        if (records == 0) {
+            flush(&access_batch);
+            flush(&error_batch);
+            if (__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+                break;      // Caught up after being told to stop
+            }
+            nanosleep(&idle, NULL);
+        }
+    }
+    return NULL;
+}
+
+int access_log_start(void) {
+    int error;
+
+    if (config.access_log) {
+        if (strcmp(config.access_log, "-") == 0) {
+            access_batch.fd = STDOUT_FILENO;
+        } else {
+            access_batch.fd = open(config.access_log, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+            if (access_batch.fd < 0) {
+                perror(config.access_log);
+                return -1;
+            }
+        }
+    }
+
+    error = pthread_create(&log_thread, NULL, log_thread_main, NULL);
+    if (error != 0) {
+        fprintf(stderr, "Unable to start log thread: %s\n", strerror(error));
+        return -1;
+    }
+    log_thread_started = 1;
+    return 0;
+}
+
+void access_log_stop(void) {
+    if (!log_thread_started) {
+        return;
+    }
+    __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+    pthread_join(log_thread, NULL);
+    log_thread_started = 0;
+}
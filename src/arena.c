@@ -0,0 +1,34 @@
+/*
+ * =============================================================================
+ * ARENA IMPLEMENTATION
+ * =============================================================================
+ */
+
+#include <stdint.h>     // uintptr_t
+
+#include "arena.h"
+
+void arena_init(struct arena *arena, void *base, size_t size) {
+    arena->base = base;
+    arena->size = size;
+    arena->used = 0;
+}
+
+void *arena_alloc(struct arena *arena, size_t size, size_t align) {
+    uintptr_t start = (uintptr_t)(arena->base + arena->used);
+    size_t padding = (size_t)(-start & (align - 1));
+
+    if (padding + size > arena->size - arena->used) {
+        return NULL;
+    }
+    arena->used += padding + size;
+    return (void *)(start + padding);
+}
+
+int arena_room(const struct arena *arena, size_t size) {
+    return size <= arena->size - arena->used;
+}
+
+void arena_reset(struct arena *arena) {
+    arena->used = 0;
+}
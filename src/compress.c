@@ -0,0 +1,632 @@
+/*
+ * =============================================================================
+ * COMPRESS IMPLEMENTATION - ENCODERS, NEGOTIATION, THE VARIANT BUILDER
+ * =============================================================================
+ * A built variant is named after the exact version of the file it was made
+ * from, so a changed file simply has no variant yet - nothing is ever
+ * served stale and nothing needs invalidating:
+ *
+ *     DIR/<device>-<inode>-<size>-<mtime>.br
+ *
+ * Variants are written under a temporary name and renamed into place, so a
+ * worker never opens a half-written one (not even one from the other
+ * process during an upgrade).
+ * =============================================================================
+ */
+
+#include <stdio.h>          // snprintf, fprintf
+#include <string.h>         // memcmp, memset, strlen, strerror
+#include <strings.h>        // strncasecmp
+#include <errno.h>          // errno, EEXIST
+#include <fcntl.h>          // open
+#include <limits.h>         // PATH_MAX
+#include <unistd.h>         // read, write, close, unlink, getpid
+#include <pthread.h>        // pthread_create, mutex, cond
+
+#include "compress.h"
+#include "config.h"
+#include "file_cache.h"
+
+#define COMPRESS_QUEUE 32           // Files waiting for the builder
+#define COMPRESS_CHUNK 65536        // Bytes read and written per step
+
+static const struct segment header_gzip = SEGMENT("Content-Encoding: gzip\r\n");
+static const struct segment header_brotli = SEGMENT("Content-Encoding: br\r\n");
+static const char *const extensions[] = { NULL, "gz", "br" };
+
+const struct segment compress_vary = SEGMENT("Vary: Accept-Encoding\r\n");
+
+// -----------------------------------------------------------------------------
+// Encoders
+// -----------------------------------------------------------------------------
+
+int compressor_start(struct compressor *compressor, enum content_encoding encoding, int best) {
+    compressor->encoding = encoding;
+    compressor->brotli = NULL;
+
+    if (encoding == ENCODING_GZIP) {
+        // 16 + window bits = a gzip wrapper instead of zlib's own. Answers
+        // compressed per request are small, so a small window loses nothing
+        memset(&compressor->zlib, 0, sizeof(compressor->zlib));
+        return deflateInit2(&compressor->zlib, best ? COMPRESS_GZIP_BEST : COMPRESS_GZIP_FAST,
+                            Z_DEFLATED, 16 + (best ? 15 : 13), best ? 9 : 6,
+                            Z_DEFAULT_STRATEGY) == Z_OK ? 0 : -1;
+    }
+
+    compressor->brotli = BrotliEncoderCreateInstance(NULL, NULL, NULL);
+    if (!compressor->brotli) {
+        return -1;
+    }
+    BrotliEncoderSetParameter(compressor->brotli, BROTLI_PARAM_QUALITY,
+                              best ? COMPRESS_BROTLI_BEST : COMPRESS_BROTLI_FAST);
+    BrotliEncoderSetParameter(compressor->brotli, BROTLI_PARAM_LGWIN, best ? 22 : 16);
+    return 0;
+}
+
+int compressor_run(struct compressor *compressor, const unsigned char **input, size_t *input_length,
+                   unsigned char **output, size_t *output_room, int finish) {
+    if (compressor->encoding == ENCODING_GZIP) {
+        z_stream *stream = &compressor->zlib;
+        int result;
+
+        stream->next_in = (Bytef *)*input;
+        stream->avail_in = (uInt)*input_length;
+        stream->next_out = *output;
+        stream->avail_out = (uInt)*output_room;
+        result = deflate(stream, finish == COMPRESS_FLUSH ? Z_SYNC_FLUSH : finish ? Z_FINISH : Z_NO_FLUSH);
+
+        *input = stream->next_in;
+        *input_length = stream->avail_in;
+        *output = stream->next_out;
+        *output_room = stream->avail_out;
+        if (result == Z_STREAM_END) {
+            return 1;
+        }
+        if (finish == COMPRESS_FLUSH && (result == Z_OK || result == Z_BUF_ERROR)) {
+            // Room left over means deflate got everything out - and
+            // Z_BUF_ERROR that the last call did already
+            return stream->avail_in == 0 && (stream->avail_out > 0 || result == Z_BUF_ERROR) ? 1 : 0;
+        }
+        // Z_BUF_ERROR only means "no progress possible right now"
+        return result == Z_OK || result == Z_BUF_ERROR ? 0 : -1;
+    }
+
+    if (!BrotliEncoderCompressStream(compressor->brotli,
+                                     finish == COMPRESS_FLUSH ? BROTLI_OPERATION_FLUSH :
+                                     finish ? BROTLI_OPERATION_FINISH : BROTLI_OPERATION_PROCESS,
+                                     input_length, input, output_room, output, NULL)) {
+        return -1;
+    }
+    if (finish == COMPRESS_FLUSH) {
+        return *input_length == 0 && !BrotliEncoderHasMoreOutput(compressor->brotli) ? 1 : 0;
+    }
+    return finish && BrotliEncoderIsFinished(compressor->brotli) ? 1 : 0;
+}
+
+void compressor_end(struct compressor *compressor) {
+    if (compressor->encoding == ENCODING_GZIP) {
+        deflateEnd(&compressor->zlib);
+    } else if (compressor->brotli) {
+        BrotliEncoderDestroyInstance(compressor->brotli);
+        compressor->brotli = NULL;
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Accept-Encoding and content types
+// -----------------------------------------------------------------------------
+
+/*
+ * FUNCTION: quality_positive
+ * PURPOSE: Whether a "q=" weight is above zero ("0", "0.0", "0.000" are not)
+ */
+static int quality_positive(const char *text, size_t length) {
+    size_t i;
+
+    for (i = 0; i < length && ((text[i] >= '0' && text[i] <= '9') || text[i] == '.'); i++) {
+        if (text[i] >= '1' && text[i] <= '9') {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * FUNCTION: coding_bit
+ * RETURNS: The ACCEPT_* bit of a content coding, -1 for "*", 0 for others
+ */
+static int coding_bit(const char *name, size_t length) {
+    if (length == 1 && name[0] == '*') {
+        return -1;
+    }
+    if (length == 2 && strncasecmp(name, "br", 2) == 0) {
+        return ACCEPT_BROTLI;
+    }
+    if ((length == 4 && strncasecmp(name, "gzip", 4) == 0) ||
+        (length == 6 && strncasecmp(name, "x-gzip", 6) == 0)) {
+        return ACCEPT_GZIP;
+    }
+    return 0;
+}
+
+int compress_accepted(const struct http_request *request, const char *data) {
+    const struct http_header *header;
+    const char *value;
+    size_t length, i = 0;
+    int accepted = 0, refused = 0, wildcard = 0;
+
+    if (!config.compress || !(header = http_find_header(request, data, "Accept-Encoding"))) {
+        return 0;
+    }
+    value = data + header->value.offset;
+    length = header->value.length;
+
+    // "gzip, deflate;q=0.5, br;q=0, *;q=0.1"
+    while (i < length) {
+        size_t name_start, name_end;
+        int positive = 1, bit;
+
+        while (i < length && (value[i] == ' ' || value[i] == '\t' || value[i] == ',')) {
+            i++;
+        }
+        name_start = i;
+        while (i < length && value[i] != ';' && value[i] != ',' && value[i] != ' ' && value[i] != '\t') {
+            i++;
+        }
+        name_end = i;
+
+        // Parameters up to the next comma - only q= means anything here
+        while (i < length && value[i] != ',') {
+            if ((value[i] == 'q' || value[i] == 'Q') && i + 1 < length && value[i + 1] == '=' &&
+                i > name_end && (value[i - 1] == ';' || value[i - 1] == ' ')) {
+                positive = quality_positive(value + i + 2, length - i - 2);
+            }
+            i++;
+        }
+
+        if (name_end == name_start) {
+            continue;
+        }
+        bit = coding_bit(value + name_start, name_end - name_start);
+        if (bit < 0) {
+            wildcard = positive;
+        } else if (positive) {
+            accepted |= bit;
+        } else {
+            refused |= bit;
+        }
+    }
+
+    // "*" stands for every coding the client didn't name
+    if (wildcard) {
+        accepted |= (ACCEPT_GZIP | ACCEPT_BROTLI) & ~refused;
+    }
+    return accepted & ~refused;
+}
+
+int compress_worthwhile(const struct segment *content_type) {
+    static const char *const compressible[] = {
+        "text/", "application/json", "application/javascript", "application/xml",
+        "image/svg+xml", "image/x-icon", "application/wasm"
+    };
+    static const char prefix[] = "Content-Type: ";
+    const char *type = content_type->data + sizeof(prefix) - 1;
+    size_t i;
+
+    if (!config.compress || content_type->length < sizeof(prefix) - 1 ||
+        memcmp(content_type->data, prefix, sizeof(prefix) - 1) != 0) {
+        return 0;
+    }
+    for (i = 0; i < sizeof(compressible) / sizeof(compressible[0]); i++) {
+        size_t length = strlen(compressible[i]);
+        if (content_type->length - (sizeof(prefix) - 1) >= length &&
+            memcmp(type, compressible[i], length) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+const struct segment *compress_header(enum content_encoding encoding) {
+    return encoding == ENCODING_BROTLI ? &header_brotli : &header_gzip;
+}
+
+// -----------------------------------------------------------------------------
+// In-memory answers
+// -----------------------------------------------------------------------------
+
+/*
+ * FUNCTION: compress_parts
+ * PURPOSE: Compress a list of buffers into out, one buffer after the other
+ * RETURNS: Compressed length, or 0 if it doesn't fit into `room`
+ */
+static size_t compress_parts(enum content_encoding encoding, const struct iovec *body, int count,
+                             unsigned char *out, size_t room) {
+    struct compressor compressor;
+    unsigned char *next = out;
+    size_t left = room, none = 0;
+    const unsigned char *empty = NULL;
+    int done = 0, i;
+
+    if (compressor_start(&compressor, encoding, 0) < 0) {
+        return 0;
+    }
+    for (i = 0; i < count && done == 0; i++) {
+        const unsigned char *input = body[i].iov_base;
+        size_t length = body[i].iov_len;
+
+        while (length > 0 && left > 0 && done == 0) {
+            done = compressor_run(&compressor, &input, &length, &next, &left, 0);
+        }
+        if (length > 0) {
+            done = -1;      // Out of room
+        }
+    }
+    while (done == 0 && left > 0) {
+        done = compressor_run(&compressor, &empty, &none, &next, &left, 1);
+    }
+    compressor_end(&compressor);
+    return done == 1 ? room - left : 0;
+}
+
+int compress_queue_body(const struct http_context *context, const struct segment *status,
+                        const struct segment *content_type, const struct iovec *body, int count) {
+    struct output_queue *output = context->output;
+    enum content_encoding encoding = ENCODING_IDENTITY;
+    unsigned char packed[OUTPUT_SCRATCH];
+    size_t length = 0, packed_length = 0;
+    int worthwhile = compress_worthwhile(content_type);
+    struct response response;
+    int i;
+
+    if (!output_has_room(output, RESPONSE_MAX_PARTS, RESPONSE_SCRATCH)) {
+        return 0;
+    }
+    for (i = 0; i < count; i++) {
+        length += body[i].iov_len;
+    }
+
+    if (worthwhile && length >= (size_t)config.compress_min_size && length > 1) {
+        int accepted = compress_accepted(context->request, context->data);
+        encoding = accepted & ACCEPT_BROTLI ? ENCODING_BROTLI :
+                   accepted & ACCEPT_GZIP ? ENCODING_GZIP : ENCODING_IDENTITY;
+    }
+    if (encoding != ENCODING_IDENTITY) {
+        // Only worth sending if it came out smaller
+        packed_length = compress_parts(encoding, body, count, packed,
+                                       length - 1 < sizeof(packed) ? length - 1 : sizeof(packed));
+        if (packed_length == 0 ||
+            !output_has_room(output, RESPONSE_MAX_PARTS + 1, RESPONSE_SCRATCH + packed_length)) {
+            encoding = ENCODING_IDENTITY;
+        }
+    }
+
+    response_start(&response, status);
+    response_add_segment(&response, content_type);
+    if (worthwhile) {
+        response_add_segment(&response, &compress_vary);
+    }
+    if (encoding != ENCODING_IDENTITY) {
+        response_add_segment(&response, compress_header(encoding));
+        response_end_headers(&response, context->date, context->keep_alive, packed_length);
+        output_push_response(output, &response);
+        output_push_copy(output, packed, packed_length);
+        return 1;
+    }
+
+    response_end_headers(&response, context->date, context->keep_alive, length);
+    for (i = 0; i < count; i++) {
+        response_add(&response, body[i].iov_base, body[i].iov_len);
+    }
+    output_push_response(output, &response);
+    return 1;
+}
+
+// -----------------------------------------------------------------------------
+// The variant builder
+// -----------------------------------------------------------------------------
+
+/*
+ * STRUCT: build_job
+ * PURPOSE: One version of one file whose variants are missing
+ */
+struct build_job {
+    dev_t device;
+    ino_t inode;
+    off_t size;
+    time_t mtime;
+    char path[PATH_MAX];
+};
+
+// Jobs queued by the workers; the one being built stays at the head until it
+// is done, so a file asked for again meanwhile isn't queued twice
+static pthread_mutex_t jobs_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jobs_ready = PTHREAD_COND_INITIALIZER;
+static struct build_job jobs[COMPRESS_QUEUE];
+static int job_head;
+static int job_count;
+
+static pthread_t builder_thread;
+static int builder_started;
+static int stopping;                // Set by compress_cache_stop()
+static int cache_failed;            // Writing variants failed - stop trying
+
+static int same_version(const struct stat *info, dev_t device, ino_t inode, off_t size, time_t mtime) {
+    return info->st_dev == device && info->st_ino == inode && info->st_size == size &&
+           info->st_mtime == mtime;
+}
+
+static int variant_name(char *out, size_t size, dev_t device, ino_t inode, off_t size_bytes,
+                        time_t mtime, enum content_encoding encoding) {
+    int length = snprintf(out, size, "%s/%llx-%llx-%llx-%llx.%s", config.compress_cache,
+                          (unsigned long long)device, (unsigned long long)inode,
+                          (unsigned long long)size_bytes, (unsigned long long)mtime,
+                          extensions[encoding]);
+    return length > 0 && (size_t)length < size ? 0 : -1;
+}
+
+static int write_all(int fd, const unsigned char *data, size_t length) {
+    while (length > 0) {
+        ssize_t written = write(fd, data, length);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += written;
+        length -= (size_t)written;
+    }
+    return 0;
+}
+
+/*
+ * FUNCTION: build_variant
+ * PURPOSE: Compress the open file `source` into `name`, chunk by chunk
+ * RETURNS: 0 on success (or when stopping), -1 if writing failed
+ */
+static int build_variant(int source, const char *name, enum content_encoding encoding) {
+    static unsigned char input[COMPRESS_CHUNK], output[COMPRESS_CHUNK];   // Builder thread only
+    struct compressor compressor;
+    char temporary[PATH_MAX + 32];
+    int fd, done = 0, failed = 0;
+
+    if (snprintf(temporary, sizeof(temporary), "%s.%d.tmp", name, (int)getpid()) >= (int)sizeof(temporary)) {
+        return -1;
+    }
+    fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+    if (compressor_start(&compressor, encoding, 1) < 0) {
+        close(fd);
+        unlink(temporary);
+        return -1;
+    }
+
+    lseek(source, 0, SEEK_SET);
+    while (done == 0 && !failed && !__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+        ssize_t got = read(source, input, sizeof(input));
+        const unsigned char *next_in = input;
+        size_t length = got > 0 ? (size_t)got : 0;
+        int finish = got == 0;
+
+        if (got < 0) {
+            failed = errno != EINTR;
+            continue;
+        }
+        // Drain the encoder whenever the output chunk fills up
+        do {
+            unsigned char *next_out = output;
+            size_t room = sizeof(output);
+
+            done = compressor_run(&compressor, &next_in, &length, &next_out, &room, finish);
+            if (done < 0 || write_all(fd, output, sizeof(output) - room) < 0) {
+                failed = 1;
+            }
+            if (room > 0 && length == 0 && !finish) {
+                break;
+            }
+        } while (done == 0 && !failed);
+    }
+    compressor_end(&compressor);
+
+    if (close(fd) < 0) {
+        failed = 1;
+    }
+    if (failed || done != 1 || rename(temporary, name) < 0) {
+        unlink(temporary);
+        return failed ? -1 : 0;
+    }
+    return 0;
+}
+
+/*
+ * FUNCTION: build
+ * PURPOSE: Build every missing variant of one file version
+ */
+static void build(const struct build_job *job) {
+    static const enum content_encoding encodings[] = { ENCODING_BROTLI, ENCODING_GZIP };
+    char name[PATH_MAX];
+    struct stat info;
+    size_t i;
+    int source = open(job->path, O_RDONLY | O_CLOEXEC);
+
+    // The file may have changed since it was queued - then that version is
+    // gone and the new one gets queued when it is asked for
+    if (source < 0) {
+        return;
+    }
+    if (fstat(source, &info) < 0 || !same_version(&info, job->device, job->inode, job->size, job->mtime)) {
+        close(source);
+        return;
+    }
+
+    for (i = 0; i < sizeof(encodings) / sizeof(encodings[0]); i++) {
+        if (variant_name(name, sizeof(name), job->device, job->inode, job->size, job->mtime, encodings[i]) < 0 ||
+            access(name, F_OK) == 0) {
+            continue;
+        }
+        if (build_variant(source, name, encodings[i]) < 0) {
+            fprintf(stderr, "Unable to write compressed variants to %s: %s - no longer building them\n",
+                    config.compress_cache, strerror(errno));
+            __atomic_store_n(&cache_failed, 1, __ATOMIC_RELEASE);
+            break;
+        }
+    }
+    close(source);
+
+    // A cached copy of the file was made without them - it gets them now
+    file_cache_invalidate(job->path, strlen(job->path));
+}
+
+static void *builder_main(void *arg) {
+    (void)arg;
+
+    while (1) {
+        struct build_job *job;
+
+        pthread_mutex_lock(&jobs_lock);
+        while (job_count == 0 && !stopping) {
+            pthread_cond_wait(&jobs_ready, &jobs_lock);
+        }
+        if (stopping) {
+            pthread_mutex_unlock(&jobs_lock);
+            return NULL;
+        }
+        job = &jobs[job_head];      // Workers only ever write past the tail
+        pthread_mutex_unlock(&jobs_lock);
+
+        build(job);
+
+        pthread_mutex_lock(&jobs_lock);
+        job_head = (job_head + 1) % COMPRESS_QUEUE;
+        job_count--;
+        pthread_mutex_unlock(&jobs_lock);
+    }
+}
+
+/*
+ * FUNCTION: submit
+ * PURPOSE: Queue a file version for the builder, unless it is queued already
+ * WHY: A full queue just drops the job - the file is asked for again later
+ */
+static void submit(const char *path, size_t path_length, const struct stat *info) {
+    int i;
+
+    if (path_length >= PATH_MAX) {
+        return;
+    }
+    pthread_mutex_lock(&jobs_lock);
+    for (i = 0; i < job_count; i++) {
+        const struct build_job *job = &jobs[(job_head + i) % COMPRESS_QUEUE];
+        if (same_version(info, job->device, job->inode, job->size, job->mtime)) {
+            pthread_mutex_unlock(&jobs_lock);
+            return;
+        }
+    }
+    if (job_count < COMPRESS_QUEUE) {
+        struct build_job *job = &jobs[(job_head + job_count) % COMPRESS_QUEUE];
+        job->device = info->st_dev;
+        job->inode = info->st_ino;
+        job->size = info->st_size;
+        job->mtime = info->st_mtime;
+        memcpy(job->path, path, path_length + 1);
+        job_count++;
+        pthread_cond_signal(&jobs_ready);
+    }
+    pthread_mutex_unlock(&jobs_lock);
+}
+
+int compress_cache_start(void) {
+    int error;
+
+    if (!config.compress || !config.compress_cache) {
+        return 0;
+    }
+    if (mkdir(config.compress_cache, 0755) < 0 && errno != EEXIST) {
+        perror(config.compress_cache);
+        return -1;
+    }
+    error = pthread_create(&builder_thread, NULL, builder_main, NULL);
+    if (error != 0) {
+        fprintf(stderr, "Unable to start compression thread: %s\n", strerror(error));
+        return -1;
+    }
+    builder_started = 1;
+    return 0;
+}
+
+void compress_cache_stop(void) {
+    if (!builder_started) {
+        return;
+    }
+    pthread_mutex_lock(&jobs_lock);
+    __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+    pthread_cond_signal(&jobs_ready);
+    pthread_mutex_unlock(&jobs_lock);
+    pthread_join(builder_thread, NULL);
+    builder_started = 0;
+}
+
+// -----------------------------------------------------------------------------
+// Finding a variant
+// -----------------------------------------------------------------------------
+
+/*
+ * FUNCTION: open_variant
+ * PURPOSE: Open one candidate if it is a usable variant of the file
+ * RULE: A variant older than its file is stale, and one that isn't smaller
+ *       saves nothing
+ */
+static int open_variant(const char *name, const struct stat *original, size_t *size) {
+    struct stat info;
+    int fd = open(name, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0) {
+        return -1;
+    }
+    if (fstat(fd, &info) < 0 || !S_ISREG(info.st_mode) || info.st_mtime < original->st_mtime ||
+        info.st_size >= original->st_size) {
+        close(fd);
+        return -1;
+    }
+    *size = (size_t)info.st_size;
+    return fd;
+}
+
+int compress_open_variant(const char *path, size_t path_length, const struct stat *info, int accepted,
+                          enum content_encoding *encoding, size_t *size) {
+    static const enum content_encoding preference[] = { ENCODING_BROTLI, ENCODING_GZIP };
+    int cache = builder_started && !__atomic_load_n(&cache_failed, __ATOMIC_ACQUIRE);
+    char name[PATH_MAX];
+    size_t i;
+
+    for (i = 0; i < sizeof(preference) / sizeof(preference[0]); i++) {
+        int fd = -1;
+
+        if (!(accepted & (1 << preference[i]))) {
+            continue;
+        }
+        if (cache && variant_name(name, sizeof(name), info->st_dev, info->st_ino, info->st_size,
+                                  info->st_mtime, preference[i]) == 0) {
+            fd = open_variant(name, info, size);
+        }
+        // FILE.br / FILE.gz shipped next to the file
+        if (fd < 0 && path_length + 4 < sizeof(name)) {
+            memcpy(name, path, path_length);
+            name[path_length] = '.';
+            memcpy(name + path_length + 1, extensions[preference[i]], 3);
+            fd = open_variant(name, info, size);
+        }
+        if (fd >= 0) {
+            *encoding = preference[i];
+            return fd;
+        }
+    }
+
+    if (cache && info->st_size <= COMPRESS_FILE_MAX) {
+        submit(path, path_length, info);
+    }
+    return -1;
+}
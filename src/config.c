@@ -0,0 +1,372 @@
+/*
+ * =============================================================================
+ * CONFIG IMPLEMENTATION - COMMAND LINE PARSING
+ * =============================================================================
+ */
+
+#include <stdio.h>      // printf, fprintf
+#include <stdlib.h>     // strtol, exit, realpath
+#include <string.h>     // strcmp, strchr, strdup
+#include <unistd.h>     // sysconf
+
+#include "config.h"
+#include "connection.h"     // BUFFER_SIZE
+#include "http_parser.h"    // HTTP_MAX_HEADERS
+
+// Defaults used when an option is not given on the command line
+struct server_config config = {
+    .port = 8080,
+    .listen_backlog = 511,          // Same as nginx; the kernel caps it at somaxconn
+    .defer_accept = 0,
+    .fastopen = 0,
+    .tcp_nodelay = 1,               // Responses are corked, Nagle only adds delay
+    .rcvbuf = 0,
+    .sndbuf = 0,
+    .accept_batch = 64,
+    .use_tls = 1,
+    .cert_file = "server.crt",
+    .key_file = "server.key",
+    .ca_file = "ca.crt",
+    .crl_file = NULL,
+    .verify_cache_size = 10000,
+    .sni_count = 0,
+    .worker_count = 1,
+    .keepalive_timeout = 5,         // seconds
+    .keepalive_requests = 100,
+    .handshake_timeout = 10,        // seconds, from accept
+    .header_timeout = 10,           // seconds, from a request's first byte
+    .worker_connections = 0,
+    .max_connections = 0,
+    .max_handshakes = 0,
+    .drain_timeout = 30,            // seconds
+    .session_cache_size = 20480,    // OpenSSL's own default
+    .session_timeout = 300,         // seconds
+    .session_tickets = 1,
+    .ticket_key_lifetime = 3600,    // seconds
+    .http2 = 1,
+    .ktls = 0,
+    .ocsp_stapling = 1,
+    .ocsp_url = NULL,
+    .handshake_threads = -1,        // -1 = same as the worker count
+    .max_headers = 32,
+    .max_header_size = BUFFER_SIZE,
+    .max_body_size = 1024,          // MB
+    .document_root = NULL,
+    .compress = 1,
+    .compress_min_size = 256,       // Below that, headers outweigh the savings
+    .compress_cache = NULL,
+    .file_cache_size = 64,          // MB
+    .upstream_count = 0,
+    .proxy_prefix = "/",
+    .balance_hash = 0,
+    .upstream_keepalive = 32,
+    .upstream_timeout = 60,         // seconds
+    .health_interval = 5,           // seconds
+    .health_path = "/",
+    .io_uring = 0,
+    .metrics_port = 0,
+    .metrics_address = "127.0.0.1", // Counters are nobody else's business
+    .access_log = NULL,
+    .access_log_buffer = 4096,      // 1 MB per worker - seconds of a stalled disk
+    .error_log_sample = 1,
+    .error_log_rate = 10
+};
+
+static void usage(const char *program) {
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  --port N                  TCP port to listen on (default 8080)\n"
+        "  --backlog N               Accept queue length per listening socket\n"
+        "                            (default 511, capped by the kernel's somaxconn)\n"
+        "  --defer-accept SEC        Only wake up for clients that sent data\n"
+        "                            (Linux TCP_DEFER_ACCEPT, default 0 = off)\n"
+        "  --fastopen N              TCP Fast Open queue length (default 0 = off)\n"
+        "  --no-nodelay              Leave Nagle's algorithm on for client sockets\n"
+        "  --rcvbuf BYTES            Socket receive buffer (default 0 = kernel autotuning)\n"
+        "  --sndbuf BYTES            Socket send buffer (default 0 = kernel autotuning)\n"
+        "  --accept-batch N          Clients accepted per wakeup (default 64)\n"
+        "  --io-uring                Plain HTTP through io_uring instead of epoll (Linux)\n"
+        "  --no-tls                  Serve plain HTTP instead of HTTPS\n"
+        "  --cert FILE               Server certificate (default server.crt)\n"
+        "  --key FILE                Server private key (default server.key)\n"
+        "  --ca FILE                 CA for client certificates (default ca.crt)\n"
+        "  --crl FILE                Refuse client certificates revoked by these CRLs (PEM)\n"
+        "  --verify-cache N          Verified client certificates remembered (default 10000, 0 = off)\n"
+        "  --sni HOST:CERT:KEY       Extra certificate for clients asking for HOST\n"
+        "                            (repeatable; HOST may be *.example.com)\n"
+        "  --workers N               Event-loop threads (0 = one per core, default 1)\n"
+        "  --keepalive-timeout SEC   Close idle connections after SEC seconds (default 5)\n"
+        "  --keepalive-requests N    Close a connection after N requests\n"
+        "                            (default 100, 1 = no keep-alive)\n"
+        "  --handshake-timeout SEC   Time a client gets to finish the TLS handshake (default 10)\n"
+        "  --header-timeout SEC      Time a client gets to send a request's headers (default 10)\n"
+        "  --worker-connections N    Open connections per worker (default 0 = no limit)\n"
+        "  --max-connections N       Open connections for the whole server (default 0 = no limit)\n"
+        "  --max-handshakes N        TLS handshakes in progress per worker (default 0 = no limit)\n"
+        "  --drain-timeout SEC       On SIGTERM/SIGUSR2, wait up to SEC for connections to finish (default 30)\n"
+        "  --session-cache N         TLS sessions cached for resumption\n"
+        "                            (default 20480, 0 = no server-side cache)\n"
+        "  --session-timeout SEC     How long a TLS session can be resumed (default 300)\n"
+        "  --no-session-tickets      Don't issue stateless TLS session tickets\n"
+        "  --ticket-key-lifetime SEC Rotate the session ticket key every SEC seconds\n"
+        "                            (default 3600)\n"
+        "  --no-http2                Only offer HTTP/1.1 to TLS clients (no ALPN \"h2\")\n"
+        "  --ktls                    Use kernel TLS when available (files via SSL_sendfile)\n"
+        "  --no-ocsp                 Don't staple OCSP answers to TLS handshakes\n"
+        "  --ocsp-url URL            OCSP responder to ask (default: the one in the certificate)\n"
+        "  --handshake-threads N     Threads doing TLS handshake crypto\n"
+        "                            (default = --workers, 0 = on the event loop threads)\n"
+        "  --max-headers N           Header lines allowed per request (default 32)\n"
+        "  --max-header-size BYTES   Size limit for request line + headers\n"
+        "                            (default and maximum 4096)\n"
+        "  --max-body MB             Size limit for request bodies (default 1024, 0 = no limit)\n"
+        "  --root DIR                Serve static files from DIR instead of the echo page\n"
+        "  --no-compress             Never answer with gzip or brotli\n"
+        "  --compress-min BYTES      Compress in-memory bodies from BYTES on (default 256)\n"
+        "  --compress-cache DIR      Build .br/.gz variants of static files in DIR\n"
+        "                            (default: only use FILE.br/FILE.gz next to FILE)\n"
+        "  --file-cache MB           Memory for caching small static files (default 64, 0 = off)\n"
+        "  --upstream HOST:PORT      Pass requests on to this backend (repeatable)\n"
+        "  --proxy PREFIX            Only pass on requests under PREFIX (default /)\n"
+        "  --balance least|hash      Pick the backend with the fewest requests in progress,\n"
+        "                            or by a consistent hash of the URL (default least)\n"
+        "  --upstream-keepalive N    Idle backend connections kept per backend and worker\n"
+        "                            (default 32)\n"
+        "  --upstream-timeout SEC    Time a request may wait for its backend (default 60)\n"
+        "  --health-interval SEC     Check the backends every SEC seconds (default 5, 0 = off)\n"
+        "  --health-path PATH        What the health check asks for (default /)\n"
+        "  --metrics-port N          Serve Prometheus metrics on GET /metrics at port N\n"
+        "  --metrics-address ADDR    Address for the metrics port (default 127.0.0.1)\n"
+        "  --access-log FILE         Log every request to FILE (\"-\" = stdout, default off)\n"
+        "  --access-log-buffer N     Log records buffered per worker (default 4096)\n"
+        "  --error-log-sample N      Log one of every N failed TLS handshakes (default 1)\n"
+        "  --error-log-rate N        At most N handshake errors/second/worker (default 10, 0 = no limit)\n",
+        program);
+    exit(EXIT_FAILURE);
+}
+
+/*
+ * FUNCTION: parse_sni
+ * PURPOSE: Split "HOST:CERT:KEY" into a new SNI host entry
+ */
+static void parse_sni(const char *value) {
+    struct sni_host *host;
+    char *copy, *cert, *key;
+
+    if (config.sni_count == MAX_SNI_HOSTS) {
+        fprintf(stderr, "Too many --sni hosts (maximum %d)\n", MAX_SNI_HOSTS);
+        exit(EXIT_FAILURE);
+    }
+    copy = strdup(value);   // Kept for the life of the program
+    cert = copy ? strchr(copy, ':') : NULL;
+    key = cert ? strchr(cert + 1, ':') : NULL;
+    if (!key || cert == copy || key == cert + 1 || key[1] == '\0') {
+        fprintf(stderr, "Invalid --sni value (expected HOST:CERT:KEY): %s\n", value);
+        exit(EXIT_FAILURE);
+    }
+    *cert++ = '\0';
+    *key++ = '\0';
+
+    host = &config.sni_hosts[config.sni_count++];
+    host->name = copy;
+    host->cert_file = cert;
+    host->key_file = key;
+}
+
+/*
+ * FUNCTION: parse_int
+ * PURPOSE: Convert an option value to an int, rejecting junk and out-of-range values
+ * RULE: Never trust user input - atoi() would silently turn "abc" into 0
+ */
+static int parse_int(const char *option, const char *value, long min, long max) {
+    char *end;
+    long number = strtol(value, &end, 10);
+
+    if (*value == '\0' || *end != '\0' || number < min || number > max) {
+        fprintf(stderr, "Invalid %s value: %s\n", option, value);
+        exit(EXIT_FAILURE);
+    }
+    return (int)number;
+}
+
+void config_parse_args(int argc, char **argv) {
+    int i;
+
+    for (i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+
+        if (strcmp(arg, "--no-tls") == 0) {
+            // Check for --no-tls flag to disable SSL/TLS
+            config.use_tls = 0;
+            printf("TLS disabled - running as plain HTTP server\n");
+            continue;
+        }
+        if (strcmp(arg, "--no-session-tickets") == 0) {
+            config.session_tickets = 0;
+            continue;
+        }
+        if (strcmp(arg, "--no-http2") == 0) {
+            config.http2 = 0;
+            continue;
+        }
+        if (strcmp(arg, "--ktls") == 0) {
+            config.ktls = 1;
+            continue;
+        }
+        if (strcmp(arg, "--no-ocsp") == 0) {
+            config.ocsp_stapling = 0;
+            continue;
+        }
+        if (strcmp(arg, "--io-uring") == 0) {
+            config.io_uring = 1;
+            continue;
+        }
+        if (strcmp(arg, "--no-compress") == 0) {
+            config.compress = 0;
+            continue;
+        }
+        if (strcmp(arg, "--no-nodelay") == 0) {
+            config.tcp_nodelay = 0;
+            continue;
+        }
+
+        // Every other option takes a value
+        if (!value) {
+            usage(argv[0]);
+        }
+        i++;
+
+        if (strcmp(arg, "--port") == 0) {
+            config.port = parse_int(arg, value, 1, 65535);
+        } else if (strcmp(arg, "--backlog") == 0) {
+            config.listen_backlog = parse_int(arg, value, 1, 65535);
+        } else if (strcmp(arg, "--defer-accept") == 0) {
+            config.defer_accept = parse_int(arg, value, 0, 3600);
+        } else if (strcmp(arg, "--fastopen") == 0) {
+            config.fastopen = parse_int(arg, value, 0, 65535);
+        } else if (strcmp(arg, "--rcvbuf") == 0) {
+            config.rcvbuf = parse_int(arg, value, 0, 64 * 1024 * 1024);
+        } else if (strcmp(arg, "--sndbuf") == 0) {
+            config.sndbuf = parse_int(arg, value, 0, 64 * 1024 * 1024);
+        } else if (strcmp(arg, "--accept-batch") == 0) {
+            config.accept_batch = parse_int(arg, value, 1, 4096);
+        } else if (strcmp(arg, "--workers") == 0) {
+            config.worker_count = parse_int(arg, value, 0, MAX_WORKERS);
+        } else if (strcmp(arg, "--handshake-threads") == 0) {
+            config.handshake_threads = parse_int(arg, value, 0, MAX_WORKERS);
+        } else if (strcmp(arg, "--keepalive-timeout") == 0) {
+            config.keepalive_timeout = parse_int(arg, value, 1, 3600);
+        } else if (strcmp(arg, "--keepalive-requests") == 0) {
+            config.keepalive_requests = parse_int(arg, value, 1, 1000000);
+        } else if (strcmp(arg, "--handshake-timeout") == 0) {
+            config.handshake_timeout = parse_int(arg, value, 1, 3600);
+        } else if (strcmp(arg, "--header-timeout") == 0) {
+            config.header_timeout = parse_int(arg, value, 1, 3600);
+        } else if (strcmp(arg, "--worker-connections") == 0) {
+            config.worker_connections = parse_int(arg, value, 0, 10000000);
+        } else if (strcmp(arg, "--max-connections") == 0) {
+            config.max_connections = parse_int(arg, value, 0, 100000000);
+        } else if (strcmp(arg, "--max-handshakes") == 0) {
+            config.max_handshakes = parse_int(arg, value, 0, 10000000);
+        } else if (strcmp(arg, "--drain-timeout") == 0) {
+            config.drain_timeout = parse_int(arg, value, 0, 86400);
+        } else if (strcmp(arg, "--session-cache") == 0) {
+            config.session_cache_size = parse_int(arg, value, 0, 10000000);
+        } else if (strcmp(arg, "--session-timeout") == 0) {
+            config.session_timeout = parse_int(arg, value, 1, 86400);
+        } else if (strcmp(arg, "--ticket-key-lifetime") == 0) {
+            config.ticket_key_lifetime = parse_int(arg, value, 60, 86400);
+        } else if (strcmp(arg, "--max-headers") == 0) {
+            config.max_headers = parse_int(arg, value, 1, HTTP_MAX_HEADERS);
+        } else if (strcmp(arg, "--max-header-size") == 0) {
+            config.max_header_size = parse_int(arg, value, 64, BUFFER_SIZE);
+        } else if (strcmp(arg, "--max-body") == 0) {
+            config.max_body_size = parse_int(arg, value, 0, 1 << 24);
+        } else if (strcmp(arg, "--cert") == 0) {
+            config.cert_file = value;
+        } else if (strcmp(arg, "--key") == 0) {
+            config.key_file = value;
+        } else if (strcmp(arg, "--ca") == 0) {
+            config.ca_file = value;
+        } else if (strcmp(arg, "--crl") == 0) {
+            config.crl_file = value;
+        } else if (strcmp(arg, "--verify-cache") == 0) {
+            config.verify_cache_size = parse_int(arg, value, 0, 10000000);
+        } else if (strcmp(arg, "--sni") == 0) {
+            parse_sni(value);
+        } else if (strcmp(arg, "--ocsp-url") == 0) {
+            config.ocsp_url = value;
+        } else if (strcmp(arg, "--root") == 0) {
+            // Resolved once, so mapped paths never depend on the working directory
+            config.document_root = realpath(value, NULL);
+            if (!config.document_root) {
+                perror(value);
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(arg, "--compress-min") == 0) {
+            config.compress_min_size = parse_int(arg, value, 0, 1 << 30);
+        } else if (strcmp(arg, "--compress-cache") == 0) {
+            config.compress_cache = value;
+        } else if (strcmp(arg, "--file-cache") == 0) {
+            config.file_cache_size = parse_int(arg, value, 0, 1 << 20);
+        } else if (strcmp(arg, "--upstream") == 0) {
+            if (config.upstream_count == MAX_UPSTREAMS) {
+                fprintf(stderr, "Too many --upstream backends (maximum %d)\n", MAX_UPSTREAMS);
+                exit(EXIT_FAILURE);
+            }
+            config.upstreams[config.upstream_count++] = value;
+        } else if (strcmp(arg, "--proxy") == 0) {
+            if (value[0] != '/') {
+                fprintf(stderr, "Invalid --proxy value (expected a path): %s\n", value);
+                exit(EXIT_FAILURE);
+            }
+            config.proxy_prefix = value;
+        } else if (strcmp(arg, "--balance") == 0) {
+            if (strcmp(value, "least") != 0 && strcmp(value, "hash") != 0) {
+                fprintf(stderr, "Invalid --balance value (expected least or hash): %s\n", value);
+                exit(EXIT_FAILURE);
+            }
+            config.balance_hash = strcmp(value, "hash") == 0;
+        } else if (strcmp(arg, "--upstream-keepalive") == 0) {
+            config.upstream_keepalive = parse_int(arg, value, 0, 100000);
+        } else if (strcmp(arg, "--upstream-timeout") == 0) {
+            config.upstream_timeout = parse_int(arg, value, 1, 86400);
+        } else if (strcmp(arg, "--health-interval") == 0) {
+            config.health_interval = parse_int(arg, value, 0, 86400);
+        } else if (strcmp(arg, "--health-path") == 0) {
+            config.health_path = value;
+        } else if (strcmp(arg, "--metrics-port") == 0) {
+            config.metrics_port = parse_int(arg, value, 1, 65535);
+        } else if (strcmp(arg, "--metrics-address") == 0) {
+            config.metrics_address = value;
+        } else if (strcmp(arg, "--access-log") == 0) {
+            config.access_log = value;
+        } else if (strcmp(arg, "--access-log-buffer") == 0) {
+            config.access_log_buffer = parse_int(arg, value, 16, 1 << 20);
+        } else if (strcmp(arg, "--error-log-sample") == 0) {
+            config.error_log_sample = parse_int(arg, value, 1, 1000000);
+        } else if (strcmp(arg, "--error-log-rate") == 0) {
+            config.error_log_rate = parse_int(arg, value, 0, 1000000);
+        } else {
+            usage(argv[0]);
+        }
+    }
+
+    if (config.worker_count == 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        // More cores than workers we can have: use as many as we can
+        if (cores > MAX_WORKERS) {
+            cores = MAX_WORKERS;
+        }
+        config.worker_count = cores > 0 ? (int)cores : 1;
+    }
+    if (config.handshake_threads < 0) {
+        config.handshake_threads = config.worker_count;
+    }
+    // OpenSSL does its own socket I/O, which io_uring can't take over
+    if (config.io_uring && config.use_tls) {
+        fprintf(stderr, "io_uring serves plain HTTP only - using the event loop for TLS\n");
+        config.io_uring = 0;
+    }
+}
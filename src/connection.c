@@ -0,0 +1,1670 @@
+/*
+ * =============================================================================
+ * CONNECTION IMPLEMENTATION - NON-BLOCKING HANDSHAKE, READ, WRITE, CLOSE
+ * =============================================================================
+ * Every step below follows the same pattern:
+ *   1. Try the operation
+ *   2. If it finished, move to the next state and keep going
+ *   3. If the socket is "not ready", tell the event loop what we are waiting
+ *      for (read or write) and return - we'll be called again later
+ * =============================================================================
+ */
+
+#include <stdio.h>          // perror
+#include <stddef.h>         // offsetof
+#include <string.h>         // memmove, memcmp
+#include <errno.h>          // errno, EAGAIN
+#include <unistd.h>         // read, close
+#include <sys/socket.h>     // shutdown
+#include <openssl/err.h>    // ERR_print_errors_fp, ERR_peek_error
+#include <openssl/x509.h>   // X509_V_OK
+
+#include "config.h"
+#include "connection.h"
+#include "http2.h"
+#include "response.h"
+#include "router.h"
+#include "tls_context.h"
+#include "worker.h"
+
+static void connection_on_event(event_handler *handler, int events);
+
+/*
+ * FUNCTION: connection_want
+ * PURPOSE: Tell the event loop which readiness we are waiting for
+ * WHY: Skipping the system call when nothing changed keeps the hot path cheap
+ */
+static void connection_want(connection *conn, int events) {
+    if (conn->events == events) {
+        return;
+    }
+    if (event_loop_modify(conn->worker->loop, &conn->handler, events) < 0) {
+        perror("Unable to update connection events");
+        connection_close(conn);
+        return;
+    }
+    conn->events = events;
+}
+
+/*
+ * FUNCTION: ssl_want
+ * PURPOSE: Translate an OpenSSL "try again" error into the event to wait for
+ * RETURNS: EVENT_READ / EVENT_WRITE, or 0 if the error is fatal
+ * WHY: A TLS read may need to WRITE (e.g. renegotiation) and vice versa, so we
+ *      must ask OpenSSL rather than assume
+ */
+static int ssl_want(connection *conn, int result) {
+    switch (SSL_get_error(conn->ssl, result)) {
+    case SSL_ERROR_WANT_READ:
+        return EVENT_READ;
+    case SSL_ERROR_WANT_WRITE:
+        return EVENT_WRITE;
+    case SSL_ERROR_ZERO_RETURN:
+        return 0;           // Client said goodbye properly (close_notify)
+    default:
+        conn->tls_failed = 1;
+        return 0;
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Transports: the only code that knows whether the bytes are encrypted
+// -----------------------------------------------------------------------------
+
+/*
+ * STRUCT: transport
+ * PURPOSE: How bytes get on and off the socket - as they are, or through TLS
+ * WHY: Everything above the socket (parsing, handlers, the output queue,
+ *      HTTP/2 framing) is the same for both, so it is written once and only
+ *      calls through here. "*want" is the event to wait for when one says 0.
+ */
+struct transport {
+    // > 0 bytes read, 0 = nothing yet (wait for *want), -1 = EOF or failure
+    int (*read)(connection *conn, char *dest, size_t space, int *want);
+    // 1 = some of the output queue was sent, 0 = wait for *want, -1 = failure
+    int (*write)(connection *conn, int *want);
+    // 1 = done, 0 = wait for *want (only TLS has something to say goodbye)
+    int (*shutdown)(connection *conn, int *want);
+    // Guess whether the queued output goes out in more than one call
+    int (*several_writes)(const connection *conn);
+};
+
+static int plain_read(connection *conn, char *dest, size_t space, int *want) {
+    ssize_t bytes = read(conn->handler.fd, dest, space);
+
+    if (bytes > 0) {
+        return (int)bytes;
+    }
+    if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        *want = EVENT_READ;
+        return 0;
+    }
+    return -1;      // 0 = client closed the connection
+}
+
+static int plain_write(connection *conn, int *want) {
+    ssize_t bytes = output_send(&conn->output, conn->handler.fd);
+
+    if (bytes < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            *want = EVENT_WRITE;
+            return 0;
+        }
+        return -1;
+    }
+    metric_add(&conn->worker->metrics->bytes_out, (uint64_t)bytes);
+    return 1;
+}
+
+static int plain_shutdown(connection *conn, int *want) {
+    (void)conn;
+    (void)want;
+    return 1;
+}
+
+static int plain_several_writes(const connection *conn) {
+    // File parts are sent with their own sendfile() call
+    return conn->output.file_count > 0 ||
+           conn->output.count - conn->output.first > OUTPUT_WRITEV_MAX;
+}
+
+static int tls_read(connection *conn, char *dest, size_t space, int *want) {
+    int bytes = SSL_read(conn->ssl, dest, (int)space);
+
+    if (bytes > 0) {
+        return bytes;
+    }
+    *want = ssl_want(conn, bytes);
+    return *want ? 0 : -1;
+}
+
+/*
+ * FUNCTION: sendfile_tls
+ * PURPOSE: Send the file part at the front of the queue through kernel TLS
+ * RETURNS: 1 if some of it was sent, 0 if waiting, -1 on failure
+ * WHY: The kernel encrypts straight from the page cache - no read into our
+ *      memory and no user-space encryption
+ */
+static int sendfile_tls(connection *conn, int *want) {
+#ifdef SSL_OP_ENABLE_KTLS
+    size_t length;
+    const struct output_file *file = output_front_file(&conn->output, &length);
+    ossl_ssize_t bytes;
+
+    // A cached file is already in memory: one record straight from the copy
+    if (file->data) {
+        bytes = SSL_write(conn->ssl, file->data + file->offset,
+                          (int)(length < TLS_RECORD_SIZE ? length : TLS_RECORD_SIZE));
+    } else {
+        bytes = SSL_sendfile(conn->ssl, file->fd, file->offset, length, 0);
+    }
+
+    if (bytes <= 0) {
+        *want = ssl_want(conn, (int)bytes);
+        return *want ? 0 : -1;
+    }
+    output_consume(&conn->output, (size_t)bytes);
+    metric_add(&conn->worker->metrics->bytes_out, (uint64_t)bytes);
+    return 1;
+#else
+    (void)conn;
+    (void)want;
+    return -1;      // Never called: conn->ktls can't be set without kTLS
+#endif
+}
+
+/*
+ * FUNCTION: tls_write
+ * PURPOSE: Merge queued parts into one TLS record and hand it to OpenSSL
+ * RETURNS: 1 if the record was sent, 0 if waiting, -1 on failure
+ * RULE: After "want read/write" SSL_write must be retried with the SAME
+ *       bytes, which is why they stay in tls_buffer until accepted
+ */
+static int tls_write(connection *conn, int *want) {
+    int bytes;
+
+    if (conn->tls_pending == 0) {
+        size_t length;
+        if (conn->ktls && output_front_file(&conn->output, &length)) {
+            return sendfile_tls(conn, want);
+        }
+        if (!conn->tls_buffer) {
+            conn->tls_buffer = pool_get(&conn->worker->record_pool);
+            if (!conn->tls_buffer) {
+                perror("Unable to allocate TLS record buffer");
+                return -1;
+            }
+        }
+        // With kTLS files are left for sendfile_tls(); otherwise they are read
+        conn->tls_pending = output_gather(&conn->output, conn->tls_buffer, TLS_RECORD_SIZE, !conn->ktls);
+        if (conn->tls_pending == 0) {
+            perror("Unable to read file");
+            return -1;
+        }
+    }
+
+    bytes = SSL_write(conn->ssl, conn->tls_buffer, (int)conn->tls_pending);
+    if (bytes <= 0) {
+        *want = ssl_want(conn, bytes);
+        return *want ? 0 : -1;
+    }
+    conn->tls_pending = 0;
+    metric_add(&conn->worker->metrics->bytes_out, (uint64_t)bytes);
+    return 1;
+}
+
+/*
+ * FUNCTION: tls_shutdown
+ * WHY: SSL_shutdown sends the TLS "close_notify" alert; we don't wait for the
+ *      client's reply, but we do wait until our alert is actually sent
+ */
+static int tls_shutdown(connection *conn, int *want) {
+    int result = SSL_shutdown(conn->ssl);
+
+    if (result < 0 && ssl_want(conn, result) == EVENT_WRITE) {
+        *want = EVENT_WRITE;
+        return 0;
+    }
+    return 1;
+}
+
+static int tls_several_writes(const connection *conn) {
+    return conn->tls_pending + conn->output.length > TLS_RECORD_SIZE ||
+           (conn->ktls && conn->output.file_count > 0);
+}
+
+static const struct transport plain_transport = {
+    plain_read, plain_write, plain_shutdown, plain_several_writes
+};
+
+static const struct transport tls_transport = {
+    tls_read, tls_write, tls_shutdown, tls_several_writes
+};
+
+/*
+ * FUNCTION: response_queued
+ * PURPOSE: Count an HTTP/1.1 response; its time runs until do_write() has
+ *          sent everything queued
+ */
+static void response_queued(connection *conn) {
+    metric_add(&conn->worker->metrics->requests_http1, 1);
+    if (conn->responses_pending++ == 0) {
+        conn->response_start_us = metrics_now_us();
+    }
+}
+
+/*
+ * FUNCTION: log_request
+ * PURPOSE: Hand the response just queued to the access log
+ * PARAMETER: part/length - output queue part count and length before it
+ */
+static void log_request(connection *conn, const char *data, const struct http_request *request,
+                        int part, size_t length) {
+    // The URL is the path plus "?query" - they sit next to each other in data
+    size_t url_length = request->path.length + (request->query.length ? request->query.length + 1 : 0);
+    worker *w = conn->worker;
+
+    if (access_log_request(w->log, event_loop_wall_time(w->loop), &conn->peer,
+                           request->minor_version >= 1 ? ACCESS_HTTP_1_1 : ACCESS_HTTP_1_0,
+                           data ? data + request->method.offset : NULL, data ? request->method.length : 0,
+                           data ? data + request->path.offset : NULL, data ? url_length : 0,
+                           &conn->output, part, length) < 0) {
+        metric_add(&w->metrics->log_dropped, 1);
+    }
+}
+
+/*
+ * FUNCTION: make_context
+ * PURPOSE: What the route gets to see of one request
+ * PARAMETER: data - first byte of the request (all slices are relative to it)
+ */
+static void make_context(connection *conn, const char *data, const struct http_request *request,
+                         struct http_context *context) {
+    struct http_date *date = &conn->worker->date;
+    int keep_alive;
+
+    // HTTP/1.1 keeps the connection open unless the client says "close";
+    // HTTP/1.0 closes it unless the client explicitly asks for "keep-alive"
+    if (request->minor_version >= 1) {
+        keep_alive = !http_header_has_token(request, data, "Connection", "close");
+    } else {
+        keep_alive = http_header_has_token(request, data, "Connection", "keep-alive");
+    }
+    if (conn->requests_served + 1 >= config.keepalive_requests || conn->worker->draining) {
+        keep_alive = 0;     // Limit reached (or shutting down) - this is the last one
+    }
+
+    // Cheap check: only reformats when the loop's clock entered a new second
+    http_date_update(date, event_loop_wall_time(conn->worker->loop));
+
+    context->output = &conn->output;
+    context->date = date;
+    context->data = data;
+    context->request = request;
+    context->keep_alive = keep_alive;
+    context->tls = conn->ssl != NULL;
+    context->body_length = conn->body_received;
+    context->state = &conn->body_state;
+    context->streamer = &conn->streamer;
+    context->body_ignored = 0;
+    context->worker = conn->worker;
+    context->peer = &conn->peer;
+}
+
+/*
+ * FUNCTION: queue_response
+ * PURPOSE: Append the answer for one parsed request to the output queue,
+ *          from whichever handler the router picks
+ * PARAMETER: data - first byte of the request (all slices are relative to it)
+ * RETURNS: 1 if queued, 0 if the output queue has no room left for it
+ */
+static int queue_response(connection *conn, const char *data, const struct http_request *request) {
+    struct http_context context;
+    int part = conn->output.count;
+    size_t length = conn->output.length;
+
+    make_context(conn, data, request, &context);
+    if (!router_dispatch(&context)) {
+        return 0;   // Didn't fit - send what is queued first, then retry
+    }
+    conn->requests_served++;
+    // A streamed answer without chunks ends where the connection does
+    conn->keep_alive = context.keep_alive && (!conn->streamer.fill || conn->streamer.chunked);
+    response_queued(conn);
+    log_request(conn, data, request, part, length);
+    return 1;
+}
+
+/*
+ * FUNCTION: queue_error
+ * PURPOSE: Append a canned error response and close afterwards
+ * RETURNS: 1 if queued, 0 if the output queue has no room left for it
+ */
+static int queue_error(connection *conn, const struct segment *response) {
+    int part = conn->output.count;
+    size_t length = conn->output.length;
+
+    if (output_push(&conn->output, response->data, response->length) < 0) {
+        return 0;
+    }
+    conn->keep_alive = 0;
+    response_queued(conn);
+    log_request(conn, NULL, &conn->request, part, length);     // No usable request line
+    return 1;
+}
+
+// -----------------------------------------------------------------------------
+// Request bodies: streamed through body_buffer, never collected
+// -----------------------------------------------------------------------------
+
+/*
+ * FUNCTION: end_body
+ * PURPOSE: The current request's body is over - answered, or given up on
+ * PARAMETER: aborted - 1 if it never arrived in full: the route hears about
+ *            it (to free its state), and input behind it is dropped
+ */
+static void end_body(connection *conn, const char *data, int aborted) {
+    if (aborted && conn->body != BODY_IDLE) {
+        struct http_context context;
+        make_context(conn, data, &conn->request, &context);
+        router_dispatch_body(&context, NULL, 0);
+    }
+    conn->body = BODY_IDLE;
+    conn->body_ready = 0;
+    conn->body_received = 0;
+    conn->body_state = NULL;
+    if (aborted) {
+        conn->body_raw = conn->body_length;
+    }
+    // Input for the next request may still wait here (see take_leftover)
+    if (conn->body_raw == conn->body_length) {
+        pool_put(&conn->worker->buffer_pool, conn->body_buffer);
+        conn->body_buffer = NULL;
+        conn->body_raw = conn->body_length = 0;
+    }
+}
+
+/*
+ * FUNCTION: refuse_body
+ * PURPOSE: Answer with an error instead of taking the body, then close
+ * WHY: Where a broken body ends is anybody's guess, so nothing after it
+ *      can be parsed - the connection is closed even if the error doesn't
+ *      fit in the output queue
+ */
+static void refuse_body(connection *conn, const char *data, const struct segment *response) {
+    queue_error(conn, response);
+    conn->keep_alive = 0;
+    end_body(conn, data, 1);
+}
+
+/*
+ * FUNCTION: start_body
+ * PURPOSE: A request's headers are in and a body follows - get ready for it
+ * RETURNS: 0 on success, -1 if the request was refused
+ */
+static int start_body(connection *conn, const char *data) {
+    const struct http_request *request = &conn->request;
+    uint64_t limit = (uint64_t)config.max_body_size << 20;
+    size_t behind = conn->request_length - conn->request_start - request->header_length;
+
+    if (limit && request->body == HTTP_BODY_LENGTH && request->content_length > limit) {
+        refuse_body(conn, data, &response_413);
+        return -1;
+    }
+    // Left over from before? take_leftover() always empties it first
+    if (!conn->body_buffer) {
+        conn->body_buffer = pool_get(&conn->worker->buffer_pool);
+        if (!conn->body_buffer) {
+            perror("Unable to allocate body buffer");
+            refuse_body(conn, data, &response_503);
+            return -1;
+        }
+    }
+
+    // Whatever came in behind the headers is body (and maybe more requests)
+    memcpy(conn->body_buffer, data + request->header_length, behind);
+    conn->request_length -= behind;
+    conn->body_raw = 0;
+    conn->body_length = behind;
+    conn->body_start = conn->body_ready = 0;
+    conn->body_remaining = request->content_length;
+    conn->body_received = 0;
+    conn->body_state = NULL;
+    http_chunked_init(&conn->chunked);
+    conn->body = BODY_STREAMING;
+
+    // A client that asked first waits for our go-ahead before sending the
+    // body (best effort: it goes ahead on its own after a second or so)
+    if (behind == 0 && request->minor_version >= 1 &&
+        http_header_has_token(request, data, "Expect", "100-continue")) {
+        output_push(&conn->output, response_100.data, response_100.length);
+    }
+    return 0;
+}
+
+/*
+ * FUNCTION: stream_body
+ * PURPOSE: Decode what has come of the body and hand it to the route
+ * RETURNS: 1 once all of it has been handed over, 0 while waiting for more
+ *          input (or for output room), -1 if the request was refused
+ */
+static int stream_body(connection *conn, const char *data) {
+    uint64_t limit = (uint64_t)config.max_body_size << 20;
+
+    while (1) {
+        size_t available = conn->body_length - conn->body_raw;
+
+        if (conn->body_ready > 0) {
+            struct http_context context;
+
+            make_context(conn, data, &conn->request, &context);
+            if (!router_dispatch_body(&context, conn->body_buffer + conn->body_start, conn->body_ready)) {
+                // Same piece again once the output queue is sent - or, with
+                // nothing queued, once the route wakes us (see do_read)
+                return 0;
+            }
+            conn->body_ready = 0;
+        }
+        if (conn->body == BODY_RECEIVED) {
+            return 1;
+        }
+        if (available == 0) {
+            return 0;
+        }
+
+        conn->body_start = conn->body_raw;
+        if (conn->request.body == HTTP_BODY_LENGTH) {
+            conn->body_ready = available < conn->body_remaining ? available : (size_t)conn->body_remaining;
+            conn->body_raw += conn->body_ready;
+            conn->body_remaining -= conn->body_ready;
+            if (conn->body_remaining == 0) {
+                conn->body = BODY_RECEIVED;
+            }
+        } else {
+            size_t used;
+            enum http_parse_result result = http_chunked_decode(&conn->chunked, conn->body_buffer + conn->body_raw,
+                                                                available, &used, &conn->body_ready);
+            if (result == HTTP_PARSE_ERROR) {
+                refuse_body(conn, data, &response_400);
+                return -1;
+            }
+            conn->body_raw += used;
+            if (result == HTTP_PARSE_DONE) {
+                conn->body = BODY_RECEIVED;
+            }
+        }
+
+        conn->body_received += conn->body_ready;
+        if (limit && conn->body_received > limit) {
+            refuse_body(conn, data, &response_413);
+            return -1;
+        }
+    }
+}
+
+/*
+ * FUNCTION: take_leftover
+ * PURPOSE: Move input that came in behind a body over to request_buffer
+ * RETURNS: 1 if there was any
+ * RULE: Only with an empty output queue - answers sent from request_buffer
+ *       may still point into it. It is empty too, so everything fits.
+ */
+static int take_leftover(connection *conn) {
+    size_t leftover = conn->body_length - conn->body_raw;
+
+    if (conn->body != BODY_IDLE || leftover == 0 || conn->request_length > 0 || conn->output.length > 0) {
+        return 0;
+    }
+    if (!conn->request_buffer) {
+        conn->request_buffer = pool_get(&conn->worker->buffer_pool);
+        if (!conn->request_buffer) {
+            return 0;       // Stays where it is, the next read tries again
+        }
+    }
+    memcpy(conn->request_buffer, conn->body_buffer + conn->body_raw, leftover);
+    conn->request_length = leftover;
+    conn->body_raw = conn->body_length;
+    end_body(conn, NULL, 0);    // Gives the body buffer back
+    return 1;
+}
+
+/*
+ * FUNCTION: process_requests
+ * PURPOSE: Answer every complete request waiting in request_buffer, in order
+ * WHY: With pipelining one read can contain several requests
+ */
+static void process_requests(connection *conn) {
+    struct http_limits limits;
+
+    if (conn->request_start == conn->request_length) {
+        return;     // Nothing new to parse (the buffer may not even exist)
+    }
+
+    limits.max_headers = config.max_headers;
+    limits.max_header_size = config.max_header_size;
+
+    // The next answer may only be queued behind a streamed one once it's complete
+    while (conn->keep_alive && !conn->streamer.fill) {
+        const char *data = conn->request_buffer + conn->request_start;
+        size_t length = conn->request_length - conn->request_start;
+        enum http_parse_result result = http_parse(&conn->request, data, length, &limits);
+
+        if (result == HTTP_PARSE_INCOMPLETE) {
+            break;
+        }
+        if (result == HTTP_PARSE_ERROR) {
+            queue_error(conn, conn->request.error == HTTP_ERROR_TOO_LARGE ? &response_431 :
+                              conn->request.error == HTTP_ERROR_NOT_IMPLEMENTED ? &response_501 : &response_400);
+            break;
+        }
+        if (conn->request.body != HTTP_BODY_NONE) {
+            if (conn->body == BODY_IDLE && start_body(conn, data) < 0) {
+                break;
+            }
+            if (stream_body(conn, data) <= 0) {
+                break;  // Waiting for more of it, or refused
+            }
+        }
+        if (!queue_response(conn, data, &conn->request)) {
+            break;  // Parsed request stays DONE until there is room
+        }
+        if (conn->request.body != HTTP_BODY_NONE) {
+            end_body(conn, data, 0);
+        }
+
+        // Skip past this request - no bytes are moved
+        conn->request_start += conn->request.header_length;
+        conn->header_deadline_ms = 0;   // The next request gets its own
+        http_parser_init(&conn->request);
+    }
+
+    if (!conn->keep_alive) {
+        conn->request_start = conn->request_length;     // Ignore anything after
+        if (conn->body == BODY_IDLE) {
+            conn->body_raw = conn->body_length;
+            end_body(conn, NULL, 0);
+        }
+    }
+    if (conn->request_start == conn->request_length) {
+        conn->request_start = conn->request_length = 0; // Buffer empty - rewind
+    }
+}
+
+/*
+ * FUNCTION: input_waiting
+ * PURPOSE: Whether part of a request (or of what follows it) is buffered
+ */
+static int input_waiting(const connection *conn) {
+    return conn->request_length > conn->request_start || conn->body != BODY_IDLE ||
+           conn->body_length > conn->body_raw;
+}
+
+/*
+ * FUNCTION: start_protocol
+ * PURPOSE: The handshake is done - speak whatever ALPN agreed on
+ * RETURNS: 0 on success, -1 on failure
+ * WHY: Clients that don't offer ALPN (or only "http/1.1") get HTTP/1.1
+ */
+static int start_protocol(connection *conn) {
+    struct metrics *metrics = conn->worker->metrics;
+    const unsigned char *protocol;
+    unsigned int length;
+
+    metric_add(&metrics->handshakes, 1);
+    metric_add(&metrics->handshakes_resumed, (uint64_t)SSL_session_reused(conn->ssl));
+    metrics_observe(&metrics->handshake_time, metrics_now_us() - conn->accepted_us);
+
+    conn->worker->handshakes--;
+    conn->state = CONN_READING;
+    SSL_get0_alpn_selected(conn->ssl, &protocol, &length);
+    if (length == 2 && memcmp(protocol, "h2", 2) == 0) {
+        metric_add(&metrics->http2_connections, 1);
+        return h2_session_start(conn);
+    }
+    return 0;
+}
+
+/*
+ * FUNCTION: classify_failure
+ * PURPOSE: Sort a failed SSL_accept() into a handshake_failure reason
+ * RULE: Before the error queue is emptied, on the
+ *       thread that called SSL_accept()
+ */
+static enum handshake_failure classify_failure(connection *conn, int result) {
+    int reason;
+
+    switch (SSL_get_error(conn->ssl, result)) {
+    case SSL_ERROR_SYSCALL:
+    case SSL_ERROR_ZERO_RETURN:
+        return HANDSHAKE_FAILED_CLOSED;
+    case SSL_ERROR_SSL:
+        break;
+    default:
+        return HANDSHAKE_FAILED_OTHER;
+    }
+
+    reason = ERR_GET_REASON(ERR_peek_error());
+    if (SSL_get_verify_result(conn->ssl) != X509_V_OK ||
+        reason == SSL_R_PEER_DID_NOT_RETURN_A_CERTIFICATE ||
+        reason == SSL_R_CERTIFICATE_VERIFY_FAILED) {
+        return HANDSHAKE_FAILED_CERTIFICATE;
+    }
+    switch (reason) {
+    case SSL_R_WRONG_VERSION_NUMBER:
+    case SSL_R_UNSUPPORTED_PROTOCOL:
+    case SSL_R_NO_PROTOCOLS_AVAILABLE:
+    case SSL_R_VERSION_TOO_LOW:
+    case SSL_R_NO_SHARED_CIPHER:
+    case SSL_R_HTTP_REQUEST:        // Plain HTTP sent to the TLS port
+        return HANDSHAKE_FAILED_PROTOCOL;
+    default:
+        return HANDSHAKE_FAILED_OTHER;
+    }
+}
+
+/*
+ * FUNCTION: handshake_step
+ * PURPOSE: Advance the TLS handshake as far as the socket allows
+ * RETURNS: 1 if it finished, 0 if waiting (*want says for what), -1 on failure
+ * RULE: May run on a crypto thread - it only touches this connection, and
+ *       SSL_get_error() must be read on the thread that made the call
+ */
+static int handshake_step(connection *conn, int *want) {
+    int result = SSL_accept(conn->ssl);
+
+    if (result == 1) {
+        // Set when --ktls is on and the kernel took over for this cipher
+        conn->ktls = BIO_get_ktls_send(SSL_get_wbio(conn->ssl)) > 0;
+        return 1;
+    }
+
+    *want = ssl_want(conn, result);
+    if (!*want) {
+        conn->handshake_failure = classify_failure(conn, result);
+        // Logged later on the worker (see handshake_failed), so keep just
+        // the first error - it names the cause - and empty the queue
+        conn->handshake_error = ERR_peek_error();
+        ERR_clear_error();
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * FUNCTION: handshake_failed
+ * PURPOSE: Count a failed handshake, and log it if OpenSSL said why
+ * RULE: On the worker thread - its metrics and log ring have one writer
+ * WHY: Clients that just disconnect leave no error behind; logging those
+ *      too would mostly record port scanners and load balancer probes
+ */
+static void handshake_failed(connection *conn) {
+    worker *w = conn->worker;
+
+    metric_add(&w->metrics->handshake_failures[conn->handshake_failure], 1);
+    if (conn->handshake_error &&
+        access_log_handshake(w->log, event_loop_wall_time(w->loop), &conn->peer,
+                             conn->handshake_failure, conn->handshake_error) < 0) {
+        metric_add(&w->metrics->log_dropped, 1);
+    }
+}
+
+static void handshake_run(struct crypto_task *task) {
+    connection *conn = (connection *)((char *)task - offsetof(connection, handshake));
+    ERR_clear_error();      // See connection_on_event()
+    conn->handshake_status = handshake_step(conn, &conn->handshake_want);
+}
+
+/*
+ * FUNCTION: handshake_done
+ * PURPOSE: Back on the worker thread: watch the client again and carry on
+ */
+static void handshake_done(struct crypto_task *task) {
+    connection *conn = (connection *)((char *)task - offsetof(connection, handshake));
+    int events = conn->handshake_status == 0 ? conn->handshake_want : EVENT_READ;
+
+    conn->offloaded = 0;
+    worker_deadline(conn->worker, conn, conn->deadline_ms);    // Time away counts
+    if (conn->worker->drain_expired) {
+        connection_close(conn);     // Shutting down, and out of time
+        return;
+    }
+
+    conn->events = events;
+    if (conn->handshake_status < 0) {
+        handshake_failed(conn);
+        connection_close(conn);
+        return;
+    }
+    if (event_loop_add(conn->worker->loop, &conn->handler, events) < 0) {
+        connection_close(conn);
+        return;
+    }
+
+    if (conn->handshake_status == 1) {
+        if (start_protocol(conn) < 0) {
+            connection_close(conn);
+            return;
+        }
+        // The request may already sit decrypted inside OpenSSL, where the
+        // event loop can't see it - so go and read right away
+        connection_on_event(&conn->handler, EVENT_READ);
+    }
+}
+
+/*
+ * FUNCTION: do_handshake
+ * RETURNS: 1 if the handshake finished, 0 if waiting, -1 on failure
+ * WHY: With crypto threads the step is handed off: the socket is taken out of
+ *      the event loop (so no event can touch the connection meanwhile) and
+ *      handshake_done() puts it back
+ */
+static int do_handshake(connection *conn) {
+    int result, want = 0;
+
+    if (crypto_pool_enabled()) {
+        event_loop_remove(conn->worker->loop, &conn->handler);
+        worker_hold(conn->worker, conn);        // Can't expire while away
+        conn->offloaded = 1;
+        crypto_pool_submit(&conn->handshake);
+        return 0;
+    }
+
+    result = handshake_step(conn, &want);
+    if (result == 1) {
+        return start_protocol(conn) < 0 ? -1 : 1;
+    } else if (result == 0) {
+        connection_want(conn, want);
+    } else {
+        handshake_failed(conn);
+    }
+    return result;
+}
+
+/*
+ * FUNCTION: release_idle_buffer
+ * PURPOSE: Give the request buffer back to the pool while waiting for input
+ * WHY: Keep-alive connections spend most of their life idle; holding a
+ *      buffer only while a request is partly received (or being answered)
+ *      lets a few buffers serve many connections
+ */
+static void release_idle_buffer(connection *conn) {
+    if (conn->request_length == 0 && conn->output.length == 0) {
+        pool_put(&conn->worker->buffer_pool, conn->request_buffer);
+        conn->request_buffer = NULL;
+    }
+}
+
+/*
+ * FUNCTION: do_read_h2
+ * PURPOSE: do_read() for HTTP/2: read frames, handle them, send the answers
+ * RETURNS: 1 if there is something to send (or it's time to close),
+ *          0 if waiting, -1 on EOF/failure
+ */
+static int do_read_h2(connection *conn) {
+    while (1) {
+        size_t space;
+        char *dest;
+        int bytes, want;
+
+        if (h2_process(conn) < 0) {
+            return -1;
+        }
+        if (conn->output.length > 0) {
+            conn->state = CONN_WRITING;
+            return 1;
+        }
+        if (h2_finished(conn->h2)) {
+            conn->state = CONN_CLOSING;
+            return 1;
+        }
+
+        space = h2_input_space(conn->h2, &dest);
+        bytes = conn->transport->read(conn, dest, space, &want);
+        if (bytes <= 0) {
+            if (bytes < 0) {
+                return -1;
+            }
+            connection_want(conn, want);
+            return 0;
+        }
+        h2_input_received(conn->h2, (size_t)bytes);
+        metric_add(&conn->worker->metrics->bytes_in, (uint64_t)bytes);
+    }
+}
+
+/*
+ * FUNCTION: make_space
+ * PURPOSE: Room at the end of request_buffer for the next read
+ * RETURNS: Bytes free (BUFFER_SIZE while no buffer is held yet), 0 if the
+ *          request being received fills the whole buffer
+ * WHY: Out of room at the end: move the unfinished request to the front.
+ *      Its parsed slices are relative to its own start, so they stay valid.
+ */
+static size_t make_space(connection *conn) {
+    size_t space = BUFFER_SIZE - conn->request_length;
+
+    if (space == 0 && conn->request_start > 0) {
+        conn->request_length -= conn->request_start;
+        memmove(conn->request_buffer, conn->request_buffer + conn->request_start,
+                conn->request_length);
+        conn->request_start = 0;
+        space = BUFFER_SIZE - conn->request_length;
+    }
+    return space;
+}
+
+/*
+ * FUNCTION: input_space
+ * PURPOSE: Where the next bytes from the client go, and how many fit
+ * RETURNS: make_space(), or while a body comes in the room in body_buffer
+ * WHY: What the route has taken of a body is forgotten, so body_buffer
+ *      starts over. A known length is never read past: a request
+ *      pipelined behind the body lands in request_buffer, where it belongs.
+ */
+static size_t input_space(connection *conn, char **dest) {
+    size_t space, keep;
+
+    if (conn->body != BODY_STREAMING) {
+        space = make_space(conn);
+        *dest = conn->request_buffer ? conn->request_buffer + conn->request_length : NULL;
+        return space;
+    }
+
+    // Nothing is read before the route took its piece, so usually all goes
+    keep = conn->body_ready > 0 ? conn->body_start : conn->body_raw;
+    memmove(conn->body_buffer, conn->body_buffer + keep, conn->body_length - keep);
+    conn->body_start = 0;
+    conn->body_raw -= keep;
+    conn->body_length -= keep;
+
+    space = BUFFER_SIZE - conn->body_length;
+    if (conn->request.body == HTTP_BODY_LENGTH && space > conn->body_remaining) {
+        space = (size_t)conn->body_remaining;
+    }
+    *dest = conn->body_buffer + conn->body_length;
+    return space;
+}
+
+/*
+ * FUNCTION: input_received
+ * PURPOSE: Count bytes just placed where input_space() said
+ */
+static void input_received(connection *conn, size_t bytes) {
+    if (conn->body == BODY_STREAMING) {
+        conn->body_length += bytes;
+    } else {
+        conn->request_length += bytes;
+    }
+    metric_add(&conn->worker->metrics->bytes_in, (uint64_t)bytes);
+}
+
+/*
+ * FUNCTION: do_read
+ * RETURNS: 1 if responses are ready to send, 0 if waiting, -1 on EOF/failure
+ */
+static int do_read(connection *conn) {
+    if (conn->h2) {
+        return do_read_h2(conn);
+    }
+
+    while (1) {
+        size_t space;
+        char *dest;
+        int bytes, want;
+
+        // Pipelined requests may already be waiting from an earlier read
+        process_requests(conn);
+        if (conn->output.length > 0 || conn->streamer.fill) {
+            conn->state = CONN_WRITING;
+            return 1;
+        }
+        if (conn->body_ready > 0) {
+            // The route can't take the piece yet and has nothing to send:
+            // it is waiting for somebody else, and wakes us when it's done
+            conn->waiting = 1;
+            connection_want(conn, 0);
+            return 0;
+        }
+        if (take_leftover(conn)) {
+            continue;
+        }
+
+        if (!conn->request_buffer) {
+            conn->request_buffer = pool_get(&conn->worker->buffer_pool);
+            if (!conn->request_buffer) {
+                perror("Unable to allocate request buffer");
+                return -1;
+            }
+        }
+
+        space = input_space(conn, &dest);
+        if (space == 0) {
+            // Headers don't fit in our buffer - refuse instead of guessing
+            queue_error(conn, &response_431);
+            conn->state = CONN_WRITING;
+            return 1;
+        }
+
+        bytes = conn->transport->read(conn, dest, space, &want);
+        if (bytes <= 0) {
+            if (bytes < 0) {
+                return -1;  // Client closed the connection, or it failed
+            }
+            release_idle_buffer(conn);
+            connection_want(conn, want);
+            return 0;
+        }
+
+        input_received(conn, (size_t)bytes);
+    }
+}
+
+/*
+ * FUNCTION: stream_refill
+ * PURPOSE: Everything queued is out: queue the next piece of a streamed answer
+ * RETURNS: 1 if one was queued, 0 if there is nothing more to send, -1 on
+ *          failure, STREAM_WAIT if the route has nothing yet
+ * WHY: Only called once the queue is empty, so stream_buffer can be reused -
+ *      while the client doesn't read, nothing more is made
+ */
+static int stream_refill(connection *conn) {
+    if (!conn->streamer.fill) {
+        return 0;
+    }
+    if (!conn->stream_buffer) {
+        conn->stream_buffer = pool_get(&conn->worker->record_pool);
+        if (!conn->stream_buffer) {
+            perror("Unable to allocate stream buffer");
+            stream_abort(&conn->streamer);
+            return -1;
+        }
+    }
+    return stream_next(&conn->streamer, conn->stream_buffer, TLS_RECORD_SIZE, &conn->output);
+}
+
+/*
+ * FUNCTION: write_finished
+ * PURPOSE: Everything queued has been sent - account for it and move on
+ */
+static void write_finished(connection *conn) {
+    if (conn->corked) {
+        socket_cork(conn->handler.fd, 0);   // Push out the last partial packet
+        conn->corked = 0;
+    }
+    pool_put(&conn->worker->record_pool, conn->tls_buffer);
+    pool_put(&conn->worker->record_pool, conn->stream_buffer);
+    conn->tls_buffer = NULL;
+    conn->stream_buffer = NULL;
+
+    // Every response waiting since response_start_us is out now
+    if (conn->responses_pending > 0) {
+        uint64_t elapsed_us = metrics_now_us() - conn->response_start_us;
+        while (conn->responses_pending > 0) {
+            metrics_observe(&conn->worker->metrics->response_time, elapsed_us);
+            conn->responses_pending--;
+        }
+    }
+
+    // Keep-alive: go back to reading, otherwise say goodbye. Shutting down,
+    // an HTTP/1 connection with nothing more buffered is as good as idle
+    // (see connection_drain) - HTTP/2 finishes its streams after GOAWAY
+    if (conn->worker->draining && !conn->h2 && !input_waiting(conn)) {
+        conn->keep_alive = 0;
+    }
+    conn->state = conn->keep_alive ? CONN_READING : CONN_CLOSING;
+}
+
+/*
+ * FUNCTION: do_write
+ * RETURNS: 1 if every queued response was sent, 0 if waiting, -1 on failure
+ */
+static int do_write(connection *conn) {
+    // Corking costs two system calls, so it's only worth it when the kernel
+    // would otherwise push out a small packet between our writes. Not for a
+    // streamed answer: each piece should leave as soon as it is made
+    if (!conn->corked && !conn->streamer.fill && conn->transport->several_writes(conn)) {
+        socket_cork(conn->handler.fd, 1);
+        conn->corked = 1;
+    }
+
+    while (1) {
+        int want, result;
+
+        if (conn->output.length == 0 && conn->tls_pending == 0) {
+            result = stream_refill(conn);
+            if (result == STREAM_WAIT) {
+                conn->waiting = 1;      // Until stream_wake()
+                connection_want(conn, 0);
+                return 0;
+            }
+            if (result <= 0) {
+                if (result < 0) {
+                    return -1;
+                }
+                break;
+            }
+        }
+        result = conn->transport->write(conn, &want);
+        if (result <= 0) {
+            if (result == 0) {
+                connection_want(conn, want);
+            }
+            return result;
+        }
+        // A partial write just leaves the rest queued - loop and retry
+    }
+
+    write_finished(conn);
+    return 1;
+}
+
+/*
+ * FUNCTION: do_shutdown
+ * RETURNS: 1 when it is safe to close the socket, 0 if waiting
+ */
+static int do_shutdown(connection *conn) {
+    int want;
+
+    if (!conn->transport->shutdown(conn, &want)) {
+        connection_want(conn, want);
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * FUNCTION: do_linger
+ * RETURNS: 0 while the client is still sending, -1 once it is done
+ * WHY: Closing a socket that still has unread input makes the kernel send a
+ *      reset (RST), which can destroy our last response before the client
+ *      reads it. So we stop sending and discard input until the client
+ *      closes too (or the idle timeout gives up on it).
+ */
+static int do_linger(connection *conn) {
+    char discard[512];      // Never looked at, so no buffer from the pool
+
+    while (1) {
+        ssize_t bytes = read(conn->handler.fd, discard, sizeof(discard));
+        if (bytes > 0) {
+            continue;
+        }
+        if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            connection_want(conn, EVENT_READ);
+            return 0;
+        }
+        return -1;
+    }
+}
+
+/*
+ * FUNCTION: update_deadline
+ * PURPOSE: After going as far as we could: how long the client has to do
+ *          its next part
+ * WHY: Most deadlines slide - any activity buys another keep-alive
+ *      timeout. Two don't, or a client sending one byte every few seconds
+ *      would hold the connection forever (slowloris):
+ *        - the handshake must be over --handshake-timeout after accept
+ *        - a request's headers must be complete --header-timeout after its
+ *          first bytes came in
+ */
+static void update_deadline(connection *conn) {
+    uint64_t now = event_loop_now(conn->worker->loop);
+    int timeout;
+
+    if (conn->state == CONN_HANDSHAKE) {
+        return;     // Set once, in connection_create()
+    }
+    if (conn->state == CONN_READING && !conn->h2 && conn->body == BODY_IDLE &&
+        conn->request_length > conn->request_start) {
+        // Part of a request is in: the clock started with its first bytes
+        if (conn->header_deadline_ms == 0) {
+            conn->header_deadline_ms = now + (uint64_t)config.header_timeout * 1000;
+        }
+        worker_deadline(conn->worker, conn, conn->header_deadline_ms);
+        return;
+    }
+    conn->header_deadline_ms = 0;
+    // Waiting for a backend is the route's time, not idle time
+    timeout = conn->waiting || (conn->h2 && h2_waiting(conn->h2)) ? config.upstream_timeout
+                                                                  : config.keepalive_timeout;
+    worker_deadline(conn->worker, conn, now + (uint64_t)timeout * 1000);
+}
+
+/*
+ * FUNCTION: connection_on_event
+ * PURPOSE: Run the state machine as far as it can go without blocking
+ */
+static void connection_on_event(event_handler *handler, int events) {
+    connection *conn = (connection *)handler;  // handler is the first member
+    int result = 1;
+
+    if (conn->offloaded) {
+        return;     // Stale event from this batch - a crypto thread has us
+    }
+    if (conn->waiting) {
+        // Registered for nothing, so this is a hang-up or an error (which
+        // epoll reports regardless) - no reason to wait any longer
+        if (events & EVENT_ERROR) {
+            connection_close(conn);
+        }
+        return;
+    }
+    // Otherwise the I/O calls below report errors and hang-ups themselves
+
+    // SSL_get_error() reads this thread's OpenSSL error queue, so leftovers
+    // from another connection (e.g. a failed best-effort SSL_shutdown) would
+    // make a healthy connection look broken
+    ERR_clear_error();
+
+    while (result == 1) {
+        switch (conn->state) {
+        case CONN_HANDSHAKE:
+            result = do_handshake(conn);
+            break;
+        case CONN_READING:
+            result = do_read(conn);
+            break;
+        case CONN_WRITING:
+            result = do_write(conn);
+            break;
+        case CONN_CLOSING:
+            result = do_shutdown(conn);
+            if (result == 1) {
+                shutdown(conn->handler.fd, SHUT_WR);    // Send our FIN
+                conn->state = CONN_LINGERING;
+            }
+            break;
+        case CONN_LINGERING:
+            result = do_linger(conn);
+            break;
+        case CONN_CLOSED:
+            return;
+        }
+
+        if (conn->state == CONN_CLOSED) {
+            return;     // connection_want() failed and already closed us
+        }
+    }
+
+    if (result < 0) {
+        connection_close(conn);
+    } else if (!conn->offloaded) {
+        update_deadline(conn);
+    }
+}
+
+// -----------------------------------------------------------------------------
+// io_uring path (plain HTTP): the kernel does the I/O, we handle completions
+// -----------------------------------------------------------------------------
+
+static void uring_receive(connection *conn);
+static void uring_write(connection *conn);
+
+/*
+ * FUNCTION: uring_read
+ * PURPOSE: Answer what is in request_buffer, or ask for more
+ * WHY: Pipelined requests may still wait there from an earlier receive
+ */
+static void uring_read(connection *conn) {
+    do {
+        process_requests(conn);
+    } while (take_leftover(conn));
+    if (conn->output.length > 0 || conn->streamer.fill) {
+        conn->state = CONN_WRITING;
+        uring_write(conn);
+    } else if (conn->body_ready > 0) {
+        conn->waiting = 1;          // See do_read()
+    } else {
+        uring_receive(conn);
+    }
+}
+
+/*
+ * FUNCTION: uring_receive
+ * PURPOSE: Queue a receive for the next bytes from the client
+ * WHY: The receive names no buffer - the kernel takes one from the worker's
+ *      provided buffer ring when data arrives. A keep-alive connection that
+ *      waits for minutes holds no buffer at all, like release_idle_buffer()
+ *      achieves for the event loop.
+ */
+static void uring_receive(connection *conn) {
+    size_t space;
+    char *dest;
+
+    release_idle_buffer(conn);
+    space = input_space(conn, &dest);
+    if (space == 0) {
+        queue_error(conn, &response_431);   // Headers don't fit in our buffer
+        conn->state = CONN_WRITING;
+        uring_write(conn);
+        return;
+    }
+    // Never more than fits, so nothing received has to be held back
+    uring_recv(conn->worker->uring, conn->handler.fd, space, uring_data(conn, URING_TAG_RECV));
+    conn->uring_ops++;
+}
+
+/*
+ * FUNCTION: uring_write
+ * PURPOSE: Queue a send of what is at the front of the output queue, or
+ *          move on once everything is out
+ * WHY: Memory parts go out as one sendmsg() straight from the queue, like
+ *      writev(). A file part is read into the record buffer first - there
+ *      is no sendfile() in io_uring - unless it is cached in memory anyway. When this send finishes the last
+ *      response, the shutdown is linked behind it: one submission, and the
+ *      kernel only runs it once the send has completed in full.
+ */
+static void uring_write(connection *conn) {
+    struct output_queue *output = &conn->output;
+    struct uring *ring = conn->worker->uring;
+    uint64_t data = uring_data(conn, URING_TAG_SEND);
+    const struct output_file *file;
+    size_t length;
+    int last;
+
+    if (output->length == 0) {
+        int more = stream_refill(conn);
+        if (more == STREAM_WAIT) {
+            conn->waiting = 1;      // Nothing in flight until stream_wake()
+            return;
+        }
+        if (more < 0) {
+            connection_close(conn);
+            return;
+        }
+    }
+    if (output->length == 0) {
+        write_finished(conn);
+        if (conn->state == CONN_READING) {
+            uring_read(conn);
+            return;
+        }
+        // Nothing left to link the shutdown to (the last send was short)
+        uring_shutdown(ring, conn->handler.fd, uring_data(conn, URING_TAG_SHUTDOWN));
+        conn->uring_ops++;
+        conn->state = CONN_LINGERING;
+        uring_receive(conn);
+        return;
+    }
+
+    file = output_front_file(output, &length);
+    if (file && file->data) {
+        // A cached file is sent straight from its copy, which the part holds
+        conn->uring_sending = length;
+        last = conn->uring_sending == output->length && !conn->keep_alive && !conn->streamer.fill;
+        uring_send(ring, conn->handler.fd, file->data + file->offset, conn->uring_sending, last, data);
+    } else if (file) {
+        ssize_t bytes;
+
+        if (!conn->tls_buffer) {
+            conn->tls_buffer = pool_get(&conn->worker->record_pool);
+            if (!conn->tls_buffer) {
+                perror("Unable to allocate file buffer");
+                connection_close(conn);
+                return;
+            }
+        }
+        // Not consumed yet: output_consume() advances the file once it is sent
+        bytes = pread(file->fd, conn->tls_buffer, length < TLS_RECORD_SIZE ? length : TLS_RECORD_SIZE,
+                      file->offset);
+        if (bytes <= 0) {
+            perror("Unable to read file");
+            connection_close(conn);
+            return;
+        }
+        conn->uring_sending = (size_t)bytes;
+        last = conn->uring_sending == output->length && !conn->keep_alive && !conn->streamer.fill;
+        uring_send(ring, conn->handler.fd, conn->tls_buffer, conn->uring_sending, last, data);
+    } else {
+        int parts = 0;
+
+        // All memory parts up to the next file part (or the writev limit)
+        conn->uring_sending = 0;
+        while (output->first + parts < output->count && parts < OUTPUT_WRITEV_MAX &&
+               output->parts[output->first + parts].iov_base != NULL) {
+            conn->uring_sending += output->parts[output->first + parts].iov_len;
+            parts++;
+        }
+        conn->uring_message.msg_iov = &output->parts[output->first];
+        conn->uring_message.msg_iovlen = (size_t)parts;
+        last = conn->uring_sending == output->length && !conn->keep_alive && !conn->streamer.fill;
+        uring_sendmsg(ring, conn->handler.fd, &conn->uring_message, last, data);
+    }
+    conn->uring_ops++;
+
+    if (last) {
+        uring_shutdown(ring, conn->handler.fd, uring_data(conn, URING_TAG_SHUTDOWN));
+        conn->uring_ops++;
+    }
+    conn->uring_linked = last;
+}
+
+/*
+ * FUNCTION: uring_received
+ * PURPOSE: Bytes arrived in a provided buffer - append them and answer
+ */
+static void uring_received(connection *conn, const char *data, size_t length) {
+    char *dest;
+
+    if (!conn->request_buffer) {
+        conn->request_buffer = pool_get(&conn->worker->buffer_pool);
+        if (!conn->request_buffer) {
+            perror("Unable to allocate request buffer");
+            connection_close(conn);
+            return;
+        }
+    }
+    // Fits: the receive asked for at most the space input_space() found
+    input_space(conn, &dest);
+    memcpy(dest, data, length);
+    input_received(conn, length);
+    uring_read(conn);
+}
+
+static void release(connection *conn);
+
+/*
+ * FUNCTION: completed
+ * PURPOSE: connection_on_completion() for a connection still being served
+ */
+static void completed(connection *conn, const struct uring_completion *completion) {
+    int result = completion->result;
+
+    switch (uring_tag(completion->data)) {
+    case URING_TAG_RECV:
+        if (result == -ENOBUFS) {
+            uring_receive(conn);    // Pool ran dry this round - recycled ones are back
+        } else if (result <= 0) {
+            connection_close(conn);     // Client closed (0) or the socket failed
+        } else if (conn->state == CONN_LINGERING) {
+            uring_receive(conn);        // Input after our FIN is discarded
+        } else {
+            uring_received(conn, uring_buffer(conn->worker->uring, completion->buffer), (size_t)result);
+        }
+        return;
+
+    case URING_TAG_SEND:
+        if (result <= 0) {
+            connection_close(conn);
+            return;
+        }
+        output_consume(&conn->output, (size_t)result);
+        metric_add(&conn->worker->metrics->bytes_out, (uint64_t)result);
+        if (conn->uring_linked && (size_t)result == conn->uring_sending) {
+            // All sent and the linked shutdown is on its way: drain the input
+            write_finished(conn);
+            conn->state = CONN_LINGERING;
+            uring_receive(conn);
+            return;
+        }
+        // A short send breaks the link (the shutdown is cancelled): go again
+        uring_write(conn);
+        return;
+
+    default:
+        return;     // Shutdown done (or cancelled after a short send)
+    }
+}
+
+void connection_on_completion(connection *conn, const struct uring_completion *completion) {
+    struct uring *ring = conn->worker->uring;
+
+    conn->uring_ops--;
+    if (conn->state != CONN_CLOSED) {
+        completed(conn, completion);
+        if (conn->state != CONN_CLOSED) {
+            update_deadline(conn);
+        }
+    } else if (conn->uring_ops == 0) {
+        release(conn);      // The kernel is done with our memory now
+    }
+    // Copied out (or not needed) - other connections may use it now
+    if (completion->buffer >= 0) {
+        uring_buffer_recycle(ring, completion->buffer);
+    }
+}
+
+/*
+ * FUNCTION: init_connection
+ * PURPOSE: Set every field of a connection fresh from the pool (NOT zeroed)
+ */
+static void init_connection(connection *conn, worker *w, int fd, const struct sockaddr *peer) {
+    conn->handler.fd = fd;
+    conn->handler.on_event = connection_on_event;
+    conn->worker = w;
+    conn->ssl = NULL;
+    conn->tls_failed = 0;
+    conn->ktls = 0;
+    conn->offloaded = 0;
+    conn->handshake.run = handshake_run;
+    conn->handshake.done = handshake_done;
+    conn->handshake.worker = w;
+    conn->request_buffer = NULL;    // Taken from the pool on the first read
+    conn->request_start = 0;
+    conn->request_length = 0;
+    http_parser_init(&conn->request);
+    conn->body = BODY_IDLE;
+    conn->body_buffer = NULL;       // Only while a body comes in
+    conn->body_start = conn->body_ready = 0;
+    conn->body_raw = conn->body_length = 0;
+    conn->body_remaining = conn->body_received = 0;
+    conn->body_state = NULL;
+    output_init(&conn->output);
+    conn->tls_buffer = NULL;
+    conn->tls_pending = 0;
+    conn->corked = 0;
+    conn->streamer.fill = NULL;
+    conn->streamer.owner = conn;
+    conn->stream_buffer = NULL;     // Only while an answer is streamed
+    conn->waiting = 0;
+    conn->h2 = NULL;
+    conn->transport = &plain_transport;
+    conn->uring = 0;
+    conn->uring_ops = 0;
+    conn->uring_linked = 0;
+    conn->uring_sending = 0;
+    memset(&conn->uring_message, 0, sizeof(conn->uring_message));
+    conn->responses_pending = 0;
+    conn->handshake_error = 0;
+    conn->accepted_us = metrics_now_us();
+    access_log_peer(&conn->peer, peer);
+    conn->keep_alive = 1;
+    conn->requests_served = 0;
+    timer_init(&conn->timer);
+    conn->deadline_ms = 0;
+    conn->header_deadline_ms = 0;
+    conn->next_closed = NULL;
+}
+
+connection *connection_create(worker *w, int fd, const struct sockaddr *peer) {
+    connection *conn = pool_get(&w->connection_pool);
+    if (!conn) {
+        perror("Unable to allocate connection");
+        close(fd);
+        return NULL;
+    }
+    init_connection(conn, w, fd, peer);
+
+    if (config.use_tls) {
+        // Create new SSL object for this client connection (from the
+        // certificates that are current right now - see tls_context.h)
+        conn->ssl = tls_context_new_ssl();
+        if (!conn->ssl) {
+            ERR_print_errors_fp(stderr);
+            close(fd);
+            pool_put(&w->connection_pool, conn);
+            return NULL;
+        }
+        // Associate SSL object with client socket
+        SSL_set_fd(conn->ssl, fd);
+        conn->transport = &tls_transport;
+        conn->state = CONN_HANDSHAKE;
+        w->handshakes++;
+    } else {
+        conn->state = CONN_READING;
+    }
+
+    conn->events = EVENT_READ;
+    if (event_loop_add(w->loop, &conn->handler, conn->events) < 0) {
+        perror("Unable to watch client socket");
+        if (conn->ssl) {
+            SSL_free(conn->ssl);
+            w->handshakes--;
+        }
+        close(fd);
+        pool_put(&w->connection_pool, conn);
+        return NULL;
+    }
+
+    // Start the clock - the client must shake hands or send something in time
+    if (conn->state == CONN_HANDSHAKE) {
+        worker_deadline(w, conn, event_loop_now(w->loop) + (uint64_t)config.handshake_timeout * 1000);
+    } else {
+        update_deadline(conn);
+    }
+
+    // The client usually speaks first, so just wait for the first event
+    return conn;
+}
+
+connection *connection_create_uring(worker *w, int file) {
+    connection *conn = pool_get(&w->connection_pool);
+    if (!conn) {
+        perror("Unable to allocate connection");
+        uring_close(w->uring, file);
+        return NULL;
+    }
+    // No address: accepting many clients with one request leaves no room to
+    // return each one's, and a table slot can't be asked with getpeername()
+    init_connection(conn, w, file, NULL);
+    conn->uring = 1;
+    conn->state = CONN_READING;
+
+    update_deadline(conn);
+    uring_receive(conn);
+    return conn;
+}
+
+/*
+ * FUNCTION: release
+ * PURPOSE: Give back the buffers and queue the connection for freeing
+ */
+static void release(connection *conn) {
+    // Only now that nothing runs on it: a slot freed earlier could go to the
+    // next client while a late cancel or linked shutdown still aims at it
+    if (conn->uring) {
+        uring_close(conn->worker->uring, conn->handler.fd);
+    }
+    // A body cut off halfway: the route may hold state for it
+    end_body(conn, conn->request_buffer ? conn->request_buffer + conn->request_start : NULL, 1);
+    stream_abort(&conn->streamer);
+    output_discard(&conn->output);    // Closes any files still being sent
+    if (conn->h2) {
+        h2_session_end(conn);           // After the queue: it borrowed the streams' files
+    }
+
+    // Buffers go back to the pool right away; the connection object itself
+    // is returned by the worker once this batch of events is done
+    pool_put(&conn->worker->buffer_pool, conn->request_buffer);
+    pool_put(&conn->worker->record_pool, conn->tls_buffer);
+    pool_put(&conn->worker->record_pool, conn->stream_buffer);
+    conn->request_buffer = NULL;
+    conn->tls_buffer = NULL;
+    conn->stream_buffer = NULL;
+
+    // Free later - other events in this batch may still point at us
+    conn->next_closed = conn->worker->closed;
+    conn->worker->closed = conn;
+}
+
+void connection_close(connection *conn) {
+    if (conn->state == CONN_CLOSED) {
+        return;
+    }
+    metric_add(&conn->worker->metrics->closes, 1);
+
+    if (conn->uring) {
+        // Stop whatever still waits on the socket; release() frees its slot
+        if (conn->uring_ops > 0) {
+            uring_cancel(conn->worker->uring, conn->handler.fd);
+        }
+    } else {
+        event_loop_remove(conn->worker->loop, &conn->handler);
+    }
+    if (conn->state == CONN_HANDSHAKE) {
+        conn->worker->handshakes--;
+    }
+    worker_forget(conn->worker, conn);
+
+    // Clean up SSL resources only if TLS is enabled
+    if (conn->ssl) {
+        // A session freed without close_notify is dropped from the session
+        // cache, so say goodbye (best effort) unless the TLS layer failed
+        if (!conn->tls_failed && SSL_is_init_finished(conn->ssl)) {
+            SSL_shutdown(conn->ssl);
+        }
+        SSL_free(conn->ssl);
+        conn->ssl = NULL;
+    }
+
+    // Close client socket (always needed)
+    if (!conn->uring) {
+        close(conn->handler.fd);
+    }
+    conn->state = CONN_CLOSED;
+
+    // Sends in flight may still read our buffers: the last one releases them
+    if (conn->uring_ops == 0) {
+        release(conn);
+    }
+}
+
+void connection_drain(connection *conn) {
+    // Mid-handshake (or away on a crypto thread): it finishes, and its
+    // first answer says "Connection: close" - see queue_response()
+    if (conn->offloaded || conn->state == CONN_HANDSHAKE) {
+        return;
+    }
+    if (conn->h2) {
+        h2_drain(conn);
+        if (conn->state == CONN_READING) {
+            connection_on_event(&conn->handler, EVENT_WRITE);  // Send the GOAWAY
+        }
+        return;
+    }
+    // Between requests: nothing to finish. (The request a client may be
+    // sending right now is one it has to retry anyway - keep-alive allows
+    // either side to close an idle connection.) A client that just
+    // connected is about to send its first request, so that one is answered
+    if (conn->state == CONN_READING && conn->requests_served > 0 &&
+        !input_waiting(conn) && conn->output.length == 0) {
+        connection_close(conn);
+    }
+}
+
+void connection_resume(connection *conn) {
+    if (conn->state == CONN_CLOSED) {
+        return;
+    }
+    if (conn->h2) {
+        // Its streams are pumped whenever the session runs - unless it is
+        // sending right now, and then it runs again once that's done
+        if (conn->state == CONN_READING) {
+            connection_on_event(&conn->handler, EVENT_READ);
+        }
+        return;
+    }
+    if (!conn->waiting) {
+        return;
+    }
+    conn->waiting = 0;
+    if (conn->uring) {
+        if (conn->state == CONN_WRITING) {
+            uring_write(conn);
+        } else {
+            uring_read(conn);
+        }
+        return;
+    }
+    connection_on_event(&conn->handler, conn->state == CONN_WRITING ? EVENT_WRITE : EVENT_READ);
+}
@@ -0,0 +1,76 @@
+/*
+ * =============================================================================
+ * CRYPTO POOL IMPLEMENTATION
+ * =============================================================================
+ */
+
+#include <stdio.h>          // fprintf
+#include <string.h>         // strerror
+#include <pthread.h>        // pthread_create, mutex, cond
+
+#include "crypto_pool.h"
+#include "worker.h"
+
+// One shared FIFO queue - handshakes are long enough that the lock is cheap
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_ready = PTHREAD_COND_INITIALIZER;
+static struct crypto_task *queue_head;
+static struct crypto_task *queue_tail;
+static int thread_count;
+
+static void *crypto_thread_main(void *arg) {
+    (void)arg;
+
+    while (1) {
+        struct crypto_task *task;
+
+        pthread_mutex_lock(&queue_lock);
+        while (!queue_head) {
+            pthread_cond_wait(&queue_ready, &queue_lock);
+        }
+        task = queue_head;
+        queue_head = task->next;
+        if (!queue_head) {
+            queue_tail = NULL;
+        }
+        pthread_mutex_unlock(&queue_lock);
+
+        task->run(task);
+        worker_complete(task->worker, task);
+    }
+    return NULL;
+}
+
+int crypto_pool_start(int threads) {
+    int i;
+
+    for (i = 0; i < threads; i++) {
+        pthread_t thread;
+        int error = pthread_create(&thread, NULL, crypto_thread_main, NULL);
+        if (error != 0) {
+            fprintf(stderr, "Unable to start crypto thread: %s\n", strerror(error));
+            return -1;
+        }
+        pthread_detach(thread);
+        thread_count++;
+    }
+    return 0;
+}
+
+int crypto_pool_enabled(void) {
+    return thread_count > 0;
+}
+
+void crypto_pool_submit(struct crypto_task *task) {
+    task->next = NULL;
+
+    pthread_mutex_lock(&queue_lock);
+    if (queue_tail) {
+        queue_tail->next = task;
+    } else {
+        queue_head = task;
+    }
+    queue_tail = task;
+    pthread_cond_signal(&queue_ready);
+    pthread_mutex_unlock(&queue_lock);
+}
@@ -0,0 +1,213 @@
+/*
+ * =============================================================================
+ * EVENT LOOP IMPLEMENTATION (epoll on Linux, kqueue on macOS/BSD)
+ * =============================================================================
+ * Both APIs do the same job: "tell me which of these sockets are ready".
+ * They just spell it differently, so each function below has two versions
+ * selected at compile time with #ifdef.
+ * =============================================================================
+ */
+
+#include <stdlib.h>     // malloc, free
+#include <unistd.h>     // close
+#include <errno.h>      // errno, EINTR
+#include <time.h>       // clock_gettime
+
+#include "event_loop.h"
+
+#if defined(__linux__)
+#include <sys/epoll.h>  // epoll_create1, epoll_ctl, epoll_wait
+#else
+#include <sys/types.h>
+#include <sys/event.h>  // kqueue, kevent
+#include <sys/time.h>
+#endif
+
+// How many ready events we collect per wakeup
+#define MAX_EVENTS 256
+
+struct event_loop {
+    int fd;             // epoll or kqueue descriptor
+    uint64_t now_ms;    // Cached monotonic clock
+    time_t wall_time;   // Cached wall clock (seconds)
+};
+
+/*
+ * FUNCTION: update_clock
+ * PURPOSE: Refresh the cached time right after waking up
+ * WHY: Unlike the wall clock, the monotonic clock never jumps backwards when
+ *      the system time is adjusted, so timeouts stay correct
+ */
+static void update_clock(event_loop *loop) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    loop->now_ms = (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+    loop->wall_time = time(NULL);
+}
+
+void event_loop_tick(event_loop *loop) {
+    update_clock(loop);
+}
+
+uint64_t event_loop_now(const event_loop *loop) {
+    return loop->now_ms;
+}
+
+time_t event_loop_wall_time(const event_loop *loop) {
+    return loop->wall_time;
+}
+
+event_loop *event_loop_create(void) {
+    event_loop *loop = malloc(sizeof(*loop));
+    if (!loop) {
+        return NULL;
+    }
+
+#if defined(__linux__)
+    loop->fd = epoll_create1(EPOLL_CLOEXEC);
+#else
+    loop->fd = kqueue();
+#endif
+
+    if (loop->fd < 0) {
+        free(loop);
+        return NULL;
+    }
+    update_clock(loop);
+    return loop;
+}
+
+#if defined(__linux__)
+
+/*
+ * FUNCTION: to_epoll_events
+ * PURPOSE: Translate our EVENT_* flags into epoll's EPOLL* flags
+ */
+static unsigned int to_epoll_events(int events) {
+    unsigned int result = 0;
+    if (events & EVENT_READ)  result |= EPOLLIN;
+    if (events & EVENT_WRITE) result |= EPOLLOUT;
+    return result;
+}
+
+static int epoll_change(event_loop *loop, int op, event_handler *handler, int events) {
+    struct epoll_event ev;
+    ev.events = to_epoll_events(events);
+    ev.data.ptr = handler;   // Handed back to us by epoll_wait
+    return epoll_ctl(loop->fd, op, handler->fd, &ev);
+}
+
+int event_loop_add(event_loop *loop, event_handler *handler, int events) {
+    return epoll_change(loop, EPOLL_CTL_ADD, handler, events);
+}
+
+int event_loop_modify(event_loop *loop, event_handler *handler, int events) {
+    return epoll_change(loop, EPOLL_CTL_MOD, handler, events);
+}
+
+int event_loop_remove(event_loop *loop, event_handler *handler) {
+    return epoll_ctl(loop->fd, EPOLL_CTL_DEL, handler->fd, NULL);
+}
+
+int event_loop_run_once(event_loop *loop, int timeout_ms) {
+    struct epoll_event ready[MAX_EVENTS];
+    int count, i;
+
+    count = epoll_wait(loop->fd, ready, MAX_EVENTS, timeout_ms);
+    update_clock(loop);
+    if (count < 0) {
+        // A signal interrupted the wait - not an error, just try again later
+        return errno == EINTR ? 0 : -1;
+    }
+
+    for (i = 0; i < count; i++) {
+        event_handler *handler = ready[i].data.ptr;
+        int events = 0;
+
+        if (ready[i].events & EPOLLIN)  events |= EVENT_READ;
+        if (ready[i].events & EPOLLOUT) events |= EVENT_WRITE;
+        if (ready[i].events & (EPOLLERR | EPOLLHUP)) events |= EVENT_ERROR;
+
+        handler->on_event(handler, events);
+    }
+    return count;
+}
+
+#else // kqueue
+
+/*
+ * FUNCTION: kqueue_change
+ * PURPOSE: Register both filters, enabling only the ones that are wanted
+ * WHY: kqueue watches read and write readiness as two separate "filters".
+ *      EV_ADD on an existing filter just updates it, so this works for both
+ *      add and modify without remembering what was registered before.
+ */
+static int kqueue_change(event_loop *loop, event_handler *handler, int events) {
+    struct kevent changes[2];
+
+    EV_SET(&changes[0], handler->fd, EVFILT_READ,
+           EV_ADD | ((events & EVENT_READ) ? EV_ENABLE : EV_DISABLE), 0, 0, handler);
+    EV_SET(&changes[1], handler->fd, EVFILT_WRITE,
+           EV_ADD | ((events & EVENT_WRITE) ? EV_ENABLE : EV_DISABLE), 0, 0, handler);
+
+    return kevent(loop->fd, changes, 2, NULL, 0, NULL);
+}
+
+int event_loop_add(event_loop *loop, event_handler *handler, int events) {
+    return kqueue_change(loop, handler, events);
+}
+
+int event_loop_modify(event_loop *loop, event_handler *handler, int events) {
+    return kqueue_change(loop, handler, events);
+}
+
+int event_loop_remove(event_loop *loop, event_handler *handler) {
+    struct kevent changes[2];
+
+    EV_SET(&changes[0], handler->fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+    EV_SET(&changes[1], handler->fd, EVFILT_WRITE, EV_DELETE, 0, 0, NULL);
+    return kevent(loop->fd, changes, 2, NULL, 0, NULL);
+}
+
+int event_loop_run_once(event_loop *loop, int timeout_ms) {
+    struct kevent ready[MAX_EVENTS];
+    struct timespec timeout, *timeout_ptr = NULL;
+    int count, i;
+
+    if (timeout_ms >= 0) {
+        timeout.tv_sec = timeout_ms / 1000;
+        timeout.tv_nsec = (long)(timeout_ms % 1000) * 1000000L;
+        timeout_ptr = &timeout;
+    }
+
+    count = kevent(loop->fd, NULL, 0, ready, MAX_EVENTS, timeout_ptr);
+    update_clock(loop);
+    if (count < 0) {
+        return errno == EINTR ? 0 : -1;
+    }
+
+    for (i = 0; i < count; i++) {
+        event_handler *handler = ready[i].udata;
+        int events = 0;
+
+        if (ready[i].filter == EVFILT_READ)  events |= EVENT_READ;
+        if (ready[i].filter == EVFILT_WRITE) events |= EVENT_WRITE;
+        if (ready[i].flags & (EV_EOF | EV_ERROR)) events |= EVENT_ERROR;
+
+        handler->on_event(handler, events);
+    }
+    return count;
+}
+
+#endif
+
+int event_loop_fd(const event_loop *loop) {
+    return loop->fd;
+}
+
+void event_loop_free(event_loop *loop) {
+    if (loop) {
+        close(loop->fd);
+        free(loop);
+    }
+}
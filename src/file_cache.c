@@ -0,0 +1,593 @@
+/*
+ * =============================================================================
+ * FILE CACHE IMPLEMENTATION - SHARDS, LRU, REFERENCES, INOTIFY
+ * =============================================================================
+ * Each shard is a chained hash table plus an LRU list, both guarded by the
+ * shard's mutex (a hit moves its entry to the front, so even lookups write).
+ * The lock is held for a few pointer updates - never for I/O.
+ *
+ * A shard also counts "generations": every invalidation bumps it. A worker
+ * that missed reads the file without any lock, and only inserts it if the
+ * generation is still the one it saw before - otherwise the file changed
+ * while it was being read, and that copy may be torn.
+ * =============================================================================
+ */
+
+#include <stdio.h>          // snprintf, fprintf, perror
+#include <stdlib.h>         // malloc, calloc, free
+#include <string.h>         // memcmp, memcpy, strerror
+#include <errno.h>          // errno, EINTR
+#include <limits.h>         // PATH_MAX
+#include <unistd.h>         // pread, close
+#include <pthread.h>        // pthread_mutex_t, pthread_create
+
+#if defined(__linux__)
+#include <sys/inotify.h>    // inotify_init1, inotify_add_watch
+#endif
+
+#include "config.h"
+#include "file_cache.h"
+#include "metrics.h"        // METRICS_CACHE_LINE
+
+#define CHECK_INTERVAL 1    // Seconds between stat() checks without inotify
+
+struct shard {
+    pthread_mutex_t lock;
+    struct file_entry *buckets[FILE_CACHE_BUCKETS];
+    struct file_entry *lru_head;    // Most recently used
+    struct file_entry *lru_tail;    // Evicted first
+    size_t bytes;                   // Cost of the entries in the table
+    size_t budget;
+    uint64_t generation;            // Bumped by every invalidation
+} __attribute__((aligned(METRICS_CACHE_LINE)));
+
+static struct shard *shards;        // NULL = cache off
+
+// Directories being watched (Linux), looked up when an event arrives
+struct watch {
+    int descriptor;
+    char *directory;
+    size_t length;
+};
+
+static pthread_mutex_t watch_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct watch *watches;
+static int watch_count;
+static int watch_capacity;
+static int inotify_fd = -1;         // -1 = check with stat() instead
+
+// -----------------------------------------------------------------------------
+// Validators
+// -----------------------------------------------------------------------------
+
+void file_tags_build(struct file_tags *tags, const struct stat *info, enum content_encoding encoding) {
+    static const char *const suffixes[] = { "", "-gz", "-br" };
+    struct tm utc;
+
+    // The same scheme as most servers: changes with either the time or the size
+    tags->etag_length = (size_t)snprintf(tags->etag, sizeof(tags->etag), "\"%llx-%llx%s\"",
+                                         (unsigned long long)info->st_mtime,
+                                         (unsigned long long)info->st_size, suffixes[encoding]);
+    gmtime_r(&info->st_mtime, &utc);
+    tags->last_modified_length = strftime(tags->last_modified, sizeof(tags->last_modified),
+                                          "%a, %d %b %Y %H:%M:%S GMT", &utc);
+    tags->header_length = (size_t)snprintf(tags->header, sizeof(tags->header),
+                                           "ETag: %s\r\nLast-Modified: %s\r\n",
+                                           tags->etag, tags->last_modified);
+}
+
+// -----------------------------------------------------------------------------
+// Entries and shards
+// -----------------------------------------------------------------------------
+
+static uint64_t hash_path(const char *path, size_t length) {
+    uint64_t hash = 14695981039346656037ULL;    // FNV-1a
+    size_t i;
+
+    for (i = 0; i < length; i++) {
+        hash = (hash ^ (unsigned char)path[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+static struct shard *shard_of(uint64_t hash) {
+    return &shards[hash >> 60 & (FILE_CACHE_SHARDS - 1)];
+}
+
+static struct file_entry **bucket_of(struct shard *shard, uint64_t hash) {
+    return &shard->buckets[hash & (FILE_CACHE_BUCKETS - 1)];
+}
+
+static void free_entry(struct file_entry *entry) {
+    size_t i;
+
+    for (i = 0; i < sizeof(entry->versions) / sizeof(entry->versions[0]); i++) {
+        free(entry->versions[i].data);
+    }
+    free(entry->path);
+    free(entry);
+}
+
+void file_cache_release(struct file_entry *entry) {
+    if (__atomic_sub_fetch(&entry->references, 1, __ATOMIC_ACQ_REL) == 0) {
+        free_entry(entry);
+    }
+}
+
+static void release_hold(struct output_hold *hold) {
+    file_cache_release((struct file_entry *)hold);
+}
+
+static void lru_unlink(struct shard *shard, struct file_entry *entry) {
+    if (entry->lru_prev) {
+        entry->lru_prev->lru_next = entry->lru_next;
+    } else {
+        shard->lru_head = entry->lru_next;
+    }
+    if (entry->lru_next) {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    } else {
+        shard->lru_tail = entry->lru_prev;
+    }
+}
+
+static void lru_push_front(struct shard *shard, struct file_entry *entry) {
+    entry->lru_prev = NULL;
+    entry->lru_next = shard->lru_head;
+    if (shard->lru_head) {
+        shard->lru_head->lru_prev = entry;
+    } else {
+        shard->lru_tail = entry;
+    }
+    shard->lru_head = entry;
+}
+
+static struct file_entry *find(struct shard *shard, uint64_t hash, const char *path, size_t length) {
+    struct file_entry *entry = *bucket_of(shard, hash);
+
+    while (entry && !(entry->hash == hash && entry->path_length == length &&
+                      memcmp(entry->path, path, length) == 0)) {
+        entry = entry->bucket_next;
+    }
+    return entry;
+}
+
+/*
+ * FUNCTION: unlink_entry
+ * PURPOSE: Take an entry out of its shard (lock held)
+ * RETURNS: The entry - the caller drops the shard's reference after unlocking
+ */
+static struct file_entry *unlink_entry(struct shard *shard, struct file_entry *entry) {
+    struct file_entry **link = bucket_of(shard, entry->hash);
+
+    while (*link != entry) {
+        link = &(*link)->bucket_next;
+    }
+    *link = entry->bucket_next;
+    lru_unlink(shard, entry);
+    shard->bytes -= entry->cost;
+    return entry;
+}
+
+struct file_entry *file_cache_get(const char *path, size_t length, uint64_t *ticket) {
+    uint64_t hash;
+    struct shard *shard;
+    struct file_entry *entry;
+
+    if (!shards) {
+        *ticket = 0;
+        return NULL;
+    }
+    hash = hash_path(path, length);
+    shard = shard_of(hash);
+
+    pthread_mutex_lock(&shard->lock);
+    entry = find(shard, hash, path, length);
+    if (entry) {
+        if (entry != shard->lru_head) {
+            lru_unlink(shard, entry);
+            lru_push_front(shard, entry);
+        }
+        __atomic_add_fetch(&entry->references, 1, __ATOMIC_RELAXED);
+    }
+    *ticket = shard->generation;
+    pthread_mutex_unlock(&shard->lock);
+
+    // Without inotify: look at the file again now and then
+    if (entry && __atomic_load_n(&inotify_fd, __ATOMIC_ACQUIRE) < 0) {
+        time_t now = time(NULL);
+        if (now - __atomic_load_n(&entry->checked, __ATOMIC_RELAXED) >= CHECK_INTERVAL) {
+            struct stat info;
+            if (stat(entry->path, &info) < 0 || info.st_dev != entry->device || info.st_ino != entry->inode ||
+                (uint64_t)info.st_size != entry->versions[ENCODING_IDENTITY].size || info.st_mtime != entry->mtime) {
+                file_cache_invalidate(path, length);
+                file_cache_release(entry);
+                return NULL;
+            }
+            __atomic_store_n(&entry->checked, now, __ATOMIC_RELAXED);
+        }
+    }
+    return entry;
+}
+
+void file_cache_invalidate(const char *path, size_t length) {
+    uint64_t hash;
+    struct shard *shard;
+    struct file_entry *entry;
+
+    if (!shards) {
+        return;
+    }
+    hash = hash_path(path, length);
+    shard = shard_of(hash);
+
+    pthread_mutex_lock(&shard->lock);
+    entry = find(shard, hash, path, length);
+    if (entry) {
+        unlink_entry(shard, entry);
+    }
+    shard->generation++;
+    pthread_mutex_unlock(&shard->lock);
+
+    if (entry) {
+        file_cache_release(entry);
+    }
+}
+
+/*
+ * FUNCTION: flush_all
+ * PURPOSE: Forget everything (inotify lost events, or a directory moved)
+ */
+static void flush_all(void) {
+    int i;
+
+    for (i = 0; i < FILE_CACHE_SHARDS; i++) {
+        struct shard *shard = &shards[i];
+        struct file_entry *dropped = NULL;
+
+        pthread_mutex_lock(&shard->lock);
+        while (shard->lru_tail) {
+            struct file_entry *entry = unlink_entry(shard, shard->lru_tail);
+            entry->bucket_next = dropped;
+            dropped = entry;
+        }
+        shard->generation++;
+        pthread_mutex_unlock(&shard->lock);
+
+        while (dropped) {
+            struct file_entry *next = dropped->bucket_next;
+            file_cache_release(dropped);
+            dropped = next;
+        }
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Filling the cache
+// -----------------------------------------------------------------------------
+
+/*
+ * FUNCTION: read_whole
+ * PURPOSE: Read `size` bytes of an open file into a new buffer
+ * RETURNS: The buffer, or NULL if the file is shorter or can't be read
+ */
+static char *read_whole(int fd, size_t size) {
+    char *data = malloc(size > 0 ? size : 1);
+    size_t done = 0;
+
+    while (data && done < size) {
+        ssize_t bytes = pread(fd, data + done, size - done, (off_t)done);
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes <= 0) {
+            free(data);
+            return NULL;
+        }
+        done += (size_t)bytes;
+    }
+    return data;
+}
+
+/*
+ * FUNCTION: watch_directory
+ * PURPOSE: Make sure changes in the directory of `path` reach us
+ * RETURNS: 0 if they do (or there is no inotify), -1 if the directory can't
+ *          be watched - then its files mustn't be cached
+ */
+static int watch_directory(const char *path, size_t length) {
+#if defined(__linux__)
+    size_t directory_length = length;
+    char directory[PATH_MAX];
+    int i, descriptor;
+
+    if (inotify_fd < 0) {
+        return 0;
+    }
+    while (directory_length > 0 && path[directory_length - 1] != '/') {
+        directory_length--;
+    }
+    if (directory_length < 2 || directory_length > sizeof(directory)) {
+        return -1;
+    }
+    directory_length--;     // Without the trailing '/'
+
+    pthread_mutex_lock(&watch_lock);
+    for (i = 0; i < watch_count; i++) {
+        if (watches[i].length == directory_length && memcmp(watches[i].directory, path, directory_length) == 0) {
+            pthread_mutex_unlock(&watch_lock);
+            return 0;
+        }
+    }
+    memcpy(directory, path, directory_length);
+    directory[directory_length] = '\0';
+    descriptor = inotify_add_watch(inotify_fd, directory,
+                                   IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE |
+                                   IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF);
+    if (descriptor >= 0 && watch_count == watch_capacity) {
+        int capacity = watch_capacity ? watch_capacity * 2 : 64;
+        struct watch *grown = realloc(watches, (size_t)capacity * sizeof(*watches));
+        if (grown) {
+            watches = grown;
+            watch_capacity = capacity;
+        }
+    }
+    if (descriptor < 0 || watch_count == watch_capacity ||
+        !(watches[watch_count].directory = malloc(directory_length + 1))) {
+        pthread_mutex_unlock(&watch_lock);
+        return -1;
+    }
+    memcpy(watches[watch_count].directory, directory, directory_length + 1);
+    watches[watch_count].length = directory_length;
+    watches[watch_count].descriptor = descriptor;
+    watch_count++;
+    pthread_mutex_unlock(&watch_lock);
+    return 0;
+#else
+    (void)path;
+    (void)length;
+    return 0;
+#endif
+}
+
+/*
+ * FUNCTION: load_version
+ * PURPOSE: Read a compressed variant into the entry, if there is one and
+ *          the entry still fits into budget with it
+ */
+static void load_version(struct file_entry *entry, const struct stat *info, enum content_encoding wanted,
+                         size_t budget) {
+    struct file_version *version = &entry->versions[wanted];
+    enum content_encoding encoding;
+    size_t size;
+    int fd = compress_open_variant(entry->path, entry->path_length, info, 1 << wanted, &encoding, &size);
+
+    if (fd < 0) {
+        return;
+    }
+    if (entry->cost + size <= budget) {
+        version->data = read_whole(fd, size);
+    }
+    close(fd);
+    if (version->data) {
+        version->size = size;
+        entry->cost += size;
+        file_tags_build(&version->tags, info, wanted);
+    }
+}
+
+struct file_entry *file_cache_add(const char *path, size_t length, uint64_t ticket, int fd,
+                                  const struct stat *info, const struct segment *content_type) {
+    struct file_entry *entry, *existing, *evicted = NULL;
+    struct shard *shard;
+    struct stat now;
+    uint64_t hash;
+
+    if (!shards || info->st_size > FILE_CACHE_FILE_MAX) {
+        return NULL;
+    }
+
+    // A file its shard couldn't hold isn't even read (budgets never change)
+    hash = hash_path(path, length);
+    shard = shard_of(hash);
+    if ((uint64_t)info->st_size + sizeof(*entry) + length > shard->budget) {
+        return NULL;
+    }
+
+    // Watch first, then make sure the path is still the file we have open:
+    // from here on every change reaches us, so nothing can slip in between
+    if (watch_directory(path, length) < 0 || stat(path, &now) < 0 || now.st_dev != info->st_dev ||
+        now.st_ino != info->st_ino || now.st_size != info->st_size || now.st_mtime != info->st_mtime) {
+        return NULL;
+    }
+
+    entry = calloc(1, sizeof(*entry));
+    if (!entry || !(entry->path = malloc(length + 1))) {
+        free(entry);
+        return NULL;
+    }
+    entry->hold.release = release_hold;
+    entry->references = 2;                  // The shard's and the caller's
+    entry->hash = hash;
+    memcpy(entry->path, path, length);
+    entry->path[length] = '\0';
+    entry->path_length = length;
+    entry->device = info->st_dev;
+    entry->inode = info->st_ino;
+    entry->mtime = info->st_mtime;
+    entry->checked = time(NULL);
+    entry->content_type = content_type;
+
+    entry->versions[ENCODING_IDENTITY].data = read_whole(fd, (size_t)info->st_size);
+    if (!entry->versions[ENCODING_IDENTITY].data) {
+        free_entry(entry);
+        return NULL;
+    }
+    entry->versions[ENCODING_IDENTITY].size = (size_t)info->st_size;
+    file_tags_build(&entry->versions[ENCODING_IDENTITY].tags, info, ENCODING_IDENTITY);
+    entry->cost = sizeof(*entry) + length + (size_t)info->st_size;
+    if (compress_worthwhile(content_type) && (uint64_t)info->st_size >= (uint64_t)config.compress_min_size) {
+        load_version(entry, info, ENCODING_GZIP, shard->budget);
+        load_version(entry, info, ENCODING_BROTLI, shard->budget);
+    }
+
+    pthread_mutex_lock(&shard->lock);
+    existing = find(shard, entry->hash, path, length);
+    if (existing || shard->generation != ticket || entry->cost > shard->budget) {
+        // Another worker was faster, or the file changed while we read it
+        if (existing) {
+            __atomic_add_fetch(&existing->references, 1, __ATOMIC_RELAXED);
+        }
+        pthread_mutex_unlock(&shard->lock);
+        free_entry(entry);
+        return existing;
+    }
+
+    // Make room: the least recently used entries go first
+    while (shard->bytes + entry->cost > shard->budget) {
+        struct file_entry *victim = unlink_entry(shard, shard->lru_tail);
+        victim->bucket_next = evicted;
+        evicted = victim;
+    }
+    entry->bucket_next = *bucket_of(shard, entry->hash);
+    *bucket_of(shard, entry->hash) = entry;
+    lru_push_front(shard, entry);
+    shard->bytes += entry->cost;
+    pthread_mutex_unlock(&shard->lock);
+
+    while (evicted) {
+        struct file_entry *next = evicted->bucket_next;
+        file_cache_release(evicted);
+        evicted = next;
+    }
+    return entry;
+}
+
+// -----------------------------------------------------------------------------
+// inotify
+// -----------------------------------------------------------------------------
+
+#if defined(__linux__)
+/*
+ * FUNCTION: invalidate_name
+ * PURPOSE: A name in a watched directory changed - drop the file it is, or
+ *          the file it is a compressed variant of
+ */
+static void invalidate_name(int descriptor, const char *name) {
+    char path[PATH_MAX];
+    size_t name_length = strlen(name);
+    size_t length = 0;
+    int i;
+
+    pthread_mutex_lock(&watch_lock);
+    for (i = 0; i < watch_count; i++) {
+        if (watches[i].descriptor == descriptor) {
+            if (watches[i].length + 1 + name_length < sizeof(path)) {
+                memcpy(path, watches[i].directory, watches[i].length);
+                path[watches[i].length] = '/';
+                memcpy(path + watches[i].length + 1, name, name_length);
+                length = watches[i].length + 1 + name_length;
+            }
+            break;
+        }
+    }
+    pthread_mutex_unlock(&watch_lock);
+    if (length == 0) {
+        return;
+    }
+
+    file_cache_invalidate(path, length);
+    if (length > 3 && (memcmp(path + length - 3, ".br", 3) == 0 || memcmp(path + length - 3, ".gz", 3) == 0)) {
+        file_cache_invalidate(path, length - 3);
+    }
+}
+
+/*
+ * FUNCTION: forget_watch
+ * PURPOSE: The kernel dropped a watch (its directory is gone)
+ */
+static void forget_watch(int descriptor) {
+    int i;
+
+    pthread_mutex_lock(&watch_lock);
+    for (i = 0; i < watch_count; i++) {
+        if (watches[i].descriptor == descriptor) {
+            free(watches[i].directory);
+            watches[i] = watches[--watch_count];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&watch_lock);
+}
+
+static void *watch_thread_main(void *arg) {
+    char buffer[65536] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    (void)arg;
+    while (1) {
+        ssize_t bytes = read(inotify_fd, buffer, sizeof(buffer));
+        ssize_t offset = 0;
+
+        if (bytes <= 0) {
+            if (bytes < 0 && errno == EINTR) {
+                continue;
+            }
+            // Events can't be read any more, so nothing cached can be trusted
+            perror("inotify");
+            __atomic_store_n(&inotify_fd, -1, __ATOMIC_RELEASE);
+            flush_all();
+            return NULL;
+        }
+        while (offset < bytes) {
+            const struct inotify_event *event = (const struct inotify_event *)(buffer + offset);
+            offset += (ssize_t)sizeof(*event) + event->len;
+
+            if (event->mask & IN_Q_OVERFLOW) {
+                flush_all();            // We lost events - start from scratch
+            } else if (event->mask & IN_IGNORED) {
+                forget_watch(event->wd);
+            } else if ((event->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) ||
+                       ((event->mask & IN_ISDIR) && (event->mask & (IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE)))) {
+                flush_all();            // A whole tree moved: every path below it changed
+            } else if (event->len > 0) {
+                invalidate_name(event->wd, event->name);
+            }
+        }
+    }
+}
+#endif
+
+int file_cache_start(void) {
+    size_t budget = (size_t)config.file_cache_size << 20;
+    int i;
+
+    if (budget == 0 || !config.document_root) {
+        return 0;
+    }
+    if (posix_memalign((void **)&shards, METRICS_CACHE_LINE, FILE_CACHE_SHARDS * sizeof(*shards)) != 0) {
+        shards = NULL;
+        perror("Unable to allocate the file cache");
+        return -1;
+    }
+    memset(shards, 0, FILE_CACHE_SHARDS * sizeof(*shards));
+    for (i = 0; i < FILE_CACHE_SHARDS; i++) {
+        pthread_mutex_init(&shards[i].lock, NULL);
+        shards[i].budget = budget / FILE_CACHE_SHARDS;
+    }
+
+#if defined(__linux__)
+    inotify_fd = inotify_init1(IN_CLOEXEC);
+    if (inotify_fd < 0) {
+        perror("inotify - checking cached files with stat() instead");
+    } else {
+        pthread_t thread;
+        int error = pthread_create(&thread, NULL, watch_thread_main, NULL);
+        if (error != 0) {
+            fprintf(stderr, "Unable to start the file watch thread: %s\n", strerror(error));
+            return -1;
+        }
+        pthread_detach(thread);     // Blocks in read() until the process exits
+    }
+#endif
+    return 0;
+}
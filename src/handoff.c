@@ -0,0 +1,330 @@
+/*
+ * =============================================================================
+ * HANDOFF IMPLEMENTATION - ONE MESSAGE OVER A SOCKETPAIR
+ * =============================================================================
+ * The old process sends one message: a small header, the ticket keys, and
+ * every listening socket as SCM_RIGHTS ancillary data. The new process
+ * answers with one byte once its workers run. The header says which socket
+ * is which:
+ *
+ *     "TSH1" | listeners (4) | metrics socket follows (4) | key bytes (4) | keys
+ *     SCM_RIGHTS: listener 0 .. listener n-1 [, metrics]
+ * =============================================================================
+ */
+
+#include <stdio.h>          // fprintf, perror, snprintf
+#include <stdlib.h>         // getenv, unsetenv, malloc, free, atoi
+#include <string.h>         // memcpy, memcmp, strchr, strncmp
+#include <errno.h>          // errno, EINTR
+#include <fcntl.h>          // fcntl, FD_CLOEXEC
+#include <poll.h>           // poll
+#include <signal.h>         // sigprocmask, kill, SIGKILL
+#include <unistd.h>         // fork, execve, execvp, close, read, write
+#include <sys/socket.h>     // socketpair, sendmsg, recvmsg, SCM_RIGHTS
+#include <sys/wait.h>       // waitpid
+#include <netinet/in.h>     // sockaddr_in, ntohs
+#include <arpa/inet.h>      // htonl, ntohl
+
+#include "config.h"
+#include "handoff.h"
+#include "tls_session.h"
+
+#define HANDOFF_ENV "TINYSERVER_HANDOFF_FD"
+#define HANDOFF_MAGIC "TSH1"
+#define HANDOFF_READY 'R'
+#define HANDOFF_TIMEOUT_MS 30000    // For the new process to start accepting
+#define HANDOFF_MAX_SOCKETS (MAX_WORKERS + 1)
+
+extern char **environ;
+
+struct handoff_header {
+    char magic[4];
+    uint32_t listeners;             // All in network byte order
+    uint32_t metrics;               // 1 = the last socket is the metrics port
+    uint32_t key_length;
+};
+
+// What the new process received (handoff_receive)
+static int channel = -1;
+static int listeners[MAX_WORKERS];
+static int listener_count;
+static int metrics_socket = -1;
+static unsigned char keys[TLS_SESSION_KEYS_MAX];
+static size_t key_length;
+
+// -----------------------------------------------------------------------------
+// New process
+// -----------------------------------------------------------------------------
+
+static void set_cloexec(int fd) {
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+}
+
+/*
+ * FUNCTION: listens_on_port
+ * PURPOSE: An inherited socket is only reused if it is on the port we want
+ * WHY: The new binary may have been started with a different --port
+ */
+static int listens_on_port(int fd, int port) {
+    struct sockaddr_in addr;
+    socklen_t length = sizeof(addr);
+
+    return getsockname(fd, (struct sockaddr *)&addr, &length) == 0 &&
+           addr.sin_family == AF_INET && ntohs(addr.sin_port) == port;
+}
+
+int handoff_receive(void) {
+    const char *text = getenv(HANDOFF_ENV);
+    struct handoff_header header;
+    union {
+        struct cmsghdr align;
+        char space[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_SOCKETS)];
+    } control;
+    unsigned char data[sizeof(header) + TLS_SESSION_KEYS_MAX];
+    struct iovec part = { data, sizeof(data) };
+    struct msghdr message;
+    struct cmsghdr *cmsg;
+    int fds[HANDOFF_MAX_SOCKETS];
+    int fd_count = 0, i;
+    ssize_t bytes;
+
+    if (!text) {
+        return 0;
+    }
+    channel = atoi(text);
+    unsetenv(HANDOFF_ENV);      // Not for a process WE might start later
+    set_cloexec(channel);
+
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &part;
+    message.msg_iovlen = 1;
+    message.msg_control = control.space;
+    message.msg_controllen = sizeof(control.space);
+    do {
+        bytes = recvmsg(channel, &message, 0);
+    } while (bytes < 0 && errno == EINTR);
+
+    for (cmsg = CMSG_FIRSTHDR(&message); cmsg; cmsg = CMSG_NXTHDR(&message, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            fd_count = (int)((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+            memcpy(fds, CMSG_DATA(cmsg), (size_t)fd_count * sizeof(int));
+        }
+    }
+    for (i = 0; i < fd_count; i++) {
+        set_cloexec(fds[i]);
+    }
+
+    if (bytes < (ssize_t)sizeof(header) || (message.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+        fprintf(stderr, "Handoff: incomplete message from the old process\n");
+        return -1;
+    }
+    memcpy(&header, data, sizeof(header));
+    header.listeners = ntohl(header.listeners);
+    header.metrics = ntohl(header.metrics);
+    header.key_length = ntohl(header.key_length);
+    if (memcmp(header.magic, HANDOFF_MAGIC, 4) != 0 || header.listeners > MAX_WORKERS ||
+        header.metrics > 1 || (int)(header.listeners + header.metrics) != fd_count ||
+        header.key_length != (size_t)bytes - sizeof(header)) {
+        fprintf(stderr, "Handoff: the old process speaks another protocol\n");
+        return -1;
+    }
+
+    listener_count = (int)header.listeners;
+    memcpy(listeners, fds, (size_t)listener_count * sizeof(int));
+    metrics_socket = header.metrics ? fds[listener_count] : -1;
+    key_length = header.key_length;
+    memcpy(keys, data + sizeof(header), key_length);
+    return 1;
+}
+
+int handoff_listener(int index) {
+    if (index >= listener_count || listeners[index] < 0 || !listens_on_port(listeners[index], config.port)) {
+        return -1;
+    }
+    return listeners[index];
+}
+
+int handoff_metrics_socket(void) {
+    return metrics_socket;
+}
+
+void handoff_restore_keys(void) {
+    if (key_length > 0 && tls_session_import_keys(keys, key_length) < 0) {
+        fprintf(stderr, "Handoff: ticket keys not understood - starting with new ones\n");
+    }
+    memset(keys, 0, sizeof(keys));
+    key_length = 0;
+}
+
+void handoff_ready(void) {
+    char ready = HANDOFF_READY;
+    int i;
+
+    if (channel < 0) {
+        return;
+    }
+    // Sockets no worker took: their clients go to the sockets we do use,
+    // once the old process closes its copies
+    for (i = config.worker_count; i < listener_count; i++) {
+        close(listeners[i]);
+    }
+    if (listener_count > config.worker_count) {
+        fprintf(stderr, "Handoff: %d listening sockets inherited for %d workers - "
+                "clients queued on the others are dropped\n", listener_count, config.worker_count);
+    }
+    if (write(channel, &ready, 1) != 1) {
+        perror("Handoff: unable to tell the old process");
+    }
+    close(channel);
+    channel = -1;
+}
+
+// -----------------------------------------------------------------------------
+// Old process
+// -----------------------------------------------------------------------------
+
+/*
+ * FUNCTION: build_environment
+ * PURPOSE: Our environment plus TINYSERVER_HANDOFF_FD=fd, for the new process
+ * WHY: Built before fork(): in the child of a threaded process only
+ *      async-signal-safe calls are allowed until exec, and malloc() isn't one
+ */
+static char **build_environment(int fd, char *entry, size_t size) {
+    char **env;
+    int count = 0, i, used = 0;
+
+    while (environ[count]) {
+        count++;
+    }
+    env = malloc((size_t)(count + 2) * sizeof(*env));
+    if (!env) {
+        return NULL;
+    }
+    for (i = 0; i < count; i++) {
+        if (strncmp(environ[i], HANDOFF_ENV "=", sizeof(HANDOFF_ENV)) != 0) {
+            env[used++] = environ[i];
+        }
+    }
+    snprintf(entry, size, "%s=%d", HANDOFF_ENV, fd);
+    env[used++] = entry;
+    env[used] = NULL;
+    return env;
+}
+
+static int send_sockets(int fd, const int *sockets, int count, int metrics) {
+    union {
+        struct cmsghdr align;
+        char space[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_SOCKETS)];
+    } control;
+    unsigned char data[sizeof(struct handoff_header) + TLS_SESSION_KEYS_MAX];
+    struct handoff_header header;
+    struct iovec part;
+    struct msghdr message;
+    struct cmsghdr *cmsg;
+    size_t length = config.use_tls
+        ? tls_session_export_keys(data + sizeof(header), TLS_SESSION_KEYS_MAX) : 0;
+    int total = count + (metrics >= 0);
+    ssize_t sent;
+
+    memcpy(header.magic, HANDOFF_MAGIC, 4);
+    header.listeners = htonl((uint32_t)count);
+    header.metrics = htonl(metrics >= 0 ? 1 : 0);
+    header.key_length = htonl((uint32_t)length);
+    memcpy(data, &header, sizeof(header));
+    part.iov_base = data;
+    part.iov_len = sizeof(header) + length;
+
+    memset(&message, 0, sizeof(message));
+    memset(&control, 0, sizeof(control));
+    message.msg_iov = &part;
+    message.msg_iovlen = 1;
+    message.msg_control = control.space;
+    message.msg_controllen = CMSG_SPACE(sizeof(int) * (size_t)total);
+    cmsg = CMSG_FIRSTHDR(&message);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * (size_t)total);
+    memcpy(CMSG_DATA(cmsg), sockets, sizeof(int) * (size_t)count);
+    if (metrics >= 0) {
+        memcpy(CMSG_DATA(cmsg) + sizeof(int) * (size_t)count, &metrics, sizeof(int));
+    }
+
+    do {
+        sent = sendmsg(fd, &message, 0);      // SIGPIPE is ignored (main)
+    } while (sent < 0 && errno == EINTR);
+    memset(data, 0, sizeof(data));     // The keys
+    return sent == (ssize_t)part.iov_len ? 0 : -1;
+}
+
+/*
+ * FUNCTION: wait_until_ready
+ * RETURNS: 0 once the new process said so, -1 if it exited or timed out
+ */
+static int wait_until_ready(int fd) {
+    struct pollfd watch = { fd, POLLIN, 0 };
+    char ready = 0;
+    int result;
+
+    do {
+        result = poll(&watch, 1, HANDOFF_TIMEOUT_MS);
+    } while (result < 0 && errno == EINTR);
+    if (result <= 0) {
+        return -1;
+    }
+    return read(fd, &ready, 1) == 1 && ready == HANDOFF_READY ? 0 : -1;
+}
+
+pid_t handoff_upgrade(char *const argv[], const int *sockets, int count, int metrics) {
+    char entry[sizeof(HANDOFF_ENV) + 16];
+    char **env;
+    int pair[2];
+    pid_t child;
+
+    if (count > MAX_WORKERS) {
+        return -1;
+    }
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0) {
+        perror("Upgrade: unable to create the handoff socket");
+        return -1;
+    }
+    set_cloexec(pair[0]);       // Ours - only pair[1] survives exec
+    env = build_environment(pair[1], entry, sizeof(entry));
+    if (!env) {
+        close(pair[0]);
+        close(pair[1]);
+        return -1;
+    }
+
+    child = fork();
+    if (child == 0) {
+        // Signals we sigwait() for are blocked - the new process must not
+        // start out with them blocked too
+        sigset_t none;
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, NULL);
+        if (strchr(argv[0], '/')) {
+            execve(argv[0], argv, env);
+        } else {
+            environ = env;
+            execvp(argv[0], argv);
+        }
+        _exit(127);
+    }
+    free(env);
+    close(pair[1]);
+    if (child < 0) {
+        perror("Upgrade: unable to start the new process");
+        close(pair[0]);
+        return -1;
+    }
+
+    if (send_sockets(pair[0], sockets, count, metrics) < 0 || wait_until_ready(pair[0]) < 0) {
+        fprintf(stderr, "Upgrade: the new process did not take over - keeping on\n");
+        kill(child, SIGKILL);
+        waitpid(child, NULL, 0);
+        close(pair[0]);
+        return -1;
+    }
+    close(pair[0]);
+    return child;
+}
@@ -0,0 +1,732 @@
+/*
+ * =============================================================================
+ * HPACK IMPLEMENTATION - TABLES, INTEGERS, STRINGS AND HUFFMAN CODING
+ * =============================================================================
+ */
+
+#include <string.h>         // memcpy, memmove, memcmp
+
+#include "hpack.h"
+
+#define HPACK_STATIC_COUNT 61
+
+// -----------------------------------------------------------------------------
+// Static table (RFC 7541 Appendix A)
+// -----------------------------------------------------------------------------
+
+struct hpack_static {
+    const char *name;
+    size_t name_length;
+    const char *value;
+    size_t value_length;
+};
+
+#define STATIC(name, value) { name, sizeof(name) - 1, value, sizeof(value) - 1 }
+
+static const struct hpack_static static_table[HPACK_STATIC_COUNT] = {
+    STATIC(":authority", ""),
+    STATIC(":method", "GET"),
+    STATIC(":method", "POST"),
+    STATIC(":path", "/"),
+    STATIC(":path", "/index.html"),
+    STATIC(":scheme", "http"),
+    STATIC(":scheme", "https"),
+    STATIC(":status", "200"),
+    STATIC(":status", "204"),
+    STATIC(":status", "206"),
+    STATIC(":status", "304"),
+    STATIC(":status", "400"),
+    STATIC(":status", "404"),
+    STATIC(":status", "500"),
+    STATIC("accept-charset", ""),
+    STATIC("accept-encoding", "gzip, deflate"),
+    STATIC("accept-language", ""),
+    STATIC("accept-ranges", ""),
+    STATIC("accept", ""),
+    STATIC("access-control-allow-origin", ""),
+    STATIC("age", ""),
+    STATIC("allow", ""),
+    STATIC("authorization", ""),
+    STATIC("cache-control", ""),
+    STATIC("content-disposition", ""),
+    STATIC("content-encoding", ""),
+    STATIC("content-language", ""),
+    STATIC("content-length", ""),
+    STATIC("content-location", ""),
+    STATIC("content-range", ""),
+    STATIC("content-type", ""),
+    STATIC("cookie", ""),
+    STATIC("date", ""),
+    STATIC("etag", ""),
+    STATIC("expect", ""),
+    STATIC("expires", ""),
+    STATIC("from", ""),
+    STATIC("host", ""),
+    STATIC("if-match", ""),
+    STATIC("if-modified-since", ""),
+    STATIC("if-none-match", ""),
+    STATIC("if-range", ""),
+    STATIC("if-unmodified-since", ""),
+    STATIC("last-modified", ""),
+    STATIC("link", ""),
+    STATIC("location", ""),
+    STATIC("max-forwards", ""),
+    STATIC("proxy-authenticate", ""),
+    STATIC("proxy-authorization", ""),
+    STATIC("range", ""),
+    STATIC("referer", ""),
+    STATIC("refresh", ""),
+    STATIC("retry-after", ""),
+    STATIC("server", ""),
+    STATIC("set-cookie", ""),
+    STATIC("strict-transport-security", ""),
+    STATIC("transfer-encoding", ""),
+    STATIC("user-agent", ""),
+    STATIC("vary", ""),
+    STATIC("via", ""),
+    STATIC("www-authenticate", ""),
+};
+
+// -----------------------------------------------------------------------------
+// Huffman code (RFC 7541 Appendix B)
+// -----------------------------------------------------------------------------
+// The code is canonical: codes of the same length are consecutive numbers,
+// and shorter codes come first. So a decoder only needs, per length, the
+// first code and how many there are - plus the symbols sorted by code.
+// Symbol 256 is EOS, which must never appear inside a string.
+
+static const uint32_t huffman_codes[257] = {
+    0x00001ff8, 0x007fffd8, 0x0fffffe2, 0x0fffffe3, 0x0fffffe4, 0x0fffffe5,
+    0x0fffffe6, 0x0fffffe7, 0x0fffffe8, 0x00ffffea, 0x3ffffffc, 0x0fffffe9,
+    0x0fffffea, 0x3ffffffd, 0x0fffffeb, 0x0fffffec, 0x0fffffed, 0x0fffffee,
+    0x0fffffef, 0x0ffffff0, 0x0ffffff1, 0x0ffffff2, 0x3ffffffe, 0x0ffffff3,
+    0x0ffffff4, 0x0ffffff5, 0x0ffffff6, 0x0ffffff7, 0x0ffffff8, 0x0ffffff9,
+    0x0ffffffa, 0x0ffffffb, 0x00000014, 0x000003f8, 0x000003f9, 0x00000ffa,
+    0x00001ff9, 0x00000015, 0x000000f8, 0x000007fa, 0x000003fa, 0x000003fb,
+    0x000000f9, 0x000007fb, 0x000000fa, 0x00000016, 0x00000017, 0x00000018,
+    0x00000000, 0x00000001, 0x00000002, 0x00000019, 0x0000001a, 0x0000001b,
+    0x0000001c, 0x0000001d, 0x0000001e, 0x0000001f, 0x0000005c, 0x000000fb,
+    0x00007ffc, 0x00000020, 0x00000ffb, 0x000003fc, 0x00001ffa, 0x00000021,
+    0x0000005d, 0x0000005e, 0x0000005f, 0x00000060, 0x00000061, 0x00000062,
+    0x00000063, 0x00000064, 0x00000065, 0x00000066, 0x00000067, 0x00000068,
+    0x00000069, 0x0000006a, 0x0000006b, 0x0000006c, 0x0000006d, 0x0000006e,
+    0x0000006f, 0x00000070, 0x00000071, 0x00000072, 0x000000fc, 0x00000073,
+    0x000000fd, 0x00001ffb, 0x0007fff0, 0x00001ffc, 0x00003ffc, 0x00000022,
+    0x00007ffd, 0x00000003, 0x00000023, 0x00000004, 0x00000024, 0x00000005,
+    0x00000025, 0x00000026, 0x00000027, 0x00000006, 0x00000074, 0x00000075,
+    0x00000028, 0x00000029, 0x0000002a, 0x00000007, 0x0000002b, 0x00000076,
+    0x0000002c, 0x00000008, 0x00000009, 0x0000002d, 0x00000077, 0x00000078,
+    0x00000079, 0x0000007a, 0x0000007b, 0x00007ffe, 0x000007fc, 0x00003ffd,
+    0x00001ffd, 0x0ffffffc, 0x000fffe6, 0x003fffd2, 0x000fffe7, 0x000fffe8,
+    0x003fffd3, 0x003fffd4, 0x003fffd5, 0x007fffd9, 0x003fffd6, 0x007fffda,
+    0x007fffdb, 0x007fffdc, 0x007fffdd, 0x007fffde, 0x00ffffeb, 0x007fffdf,
+    0x00ffffec, 0x00ffffed, 0x003fffd7, 0x007fffe0, 0x00ffffee, 0x007fffe1,
+    0x007fffe2, 0x007fffe3, 0x007fffe4, 0x001fffdc, 0x003fffd8, 0x007fffe5,
+    0x003fffd9, 0x007fffe6, 0x007fffe7, 0x00ffffef, 0x003fffda, 0x001fffdd,
+    0x000fffe9, 0x003fffdb, 0x003fffdc, 0x007fffe8, 0x007fffe9, 0x001fffde,
+    0x007fffea, 0x003fffdd, 0x003fffde, 0x00fffff0, 0x001fffdf, 0x003fffdf,
+    0x007fffeb, 0x007fffec, 0x001fffe0, 0x001fffe1, 0x003fffe0, 0x001fffe2,
+    0x007fffed, 0x003fffe1, 0x007fffee, 0x007fffef, 0x000fffea, 0x003fffe2,
+    0x003fffe3, 0x003fffe4, 0x007ffff0, 0x003fffe5, 0x003fffe6, 0x007ffff1,
+    0x03ffffe0, 0x03ffffe1, 0x000fffeb, 0x0007fff1, 0x003fffe7, 0x007ffff2,
+    0x003fffe8, 0x01ffffec, 0x03ffffe2, 0x03ffffe3, 0x03ffffe4, 0x07ffffde,
+    0x07ffffdf, 0x03ffffe5, 0x00fffff1, 0x01ffffed, 0x0007fff2, 0x001fffe3,
+    0x03ffffe6, 0x07ffffe0, 0x07ffffe1, 0x03ffffe7, 0x07ffffe2, 0x00fffff2,
+    0x001fffe4, 0x001fffe5, 0x03ffffe8, 0x03ffffe9, 0x0ffffffd, 0x07ffffe3,
+    0x07ffffe4, 0x07ffffe5, 0x000fffec, 0x00fffff3, 0x000fffed, 0x001fffe6,
+    0x003fffe9, 0x001fffe7, 0x001fffe8, 0x007ffff3, 0x003fffea, 0x003fffeb,
+    0x01ffffee, 0x01ffffef, 0x00fffff4, 0x00fffff5, 0x03ffffea, 0x007ffff4,
+    0x03ffffeb, 0x07ffffe6, 0x03ffffec, 0x03ffffed, 0x07ffffe7, 0x07ffffe8,
+    0x07ffffe9, 0x07ffffea, 0x07ffffeb, 0x0ffffffe, 0x07ffffec, 0x07ffffed,
+    0x07ffffee, 0x07ffffef, 0x07fffff0, 0x03ffffee, 0x3fffffff,
+};
+
+static const uint8_t huffman_lengths[257] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30,
+};
+
+static const uint16_t huffman_symbols[257] = {
+    48, 49, 50, 97, 99, 101, 105, 111, 115, 116, 32, 37,
+    45, 46, 47, 51, 52, 53, 54, 55, 56, 57, 61, 65,
+    95, 98, 100, 102, 103, 104, 108, 109, 110, 112, 114, 117,
+    58, 66, 67, 68, 69, 70, 71, 72, 73, 74, 75, 76,
+    77, 78, 79, 80, 81, 82, 83, 84, 85, 86, 87, 89,
+    106, 107, 113, 118, 119, 120, 121, 122, 38, 42, 44, 59,
+    88, 90, 33, 34, 40, 41, 63, 39, 43, 124, 35, 62,
+    0, 36, 64, 91, 93, 126, 94, 125, 60, 96, 123, 92,
+    195, 208, 128, 130, 131, 162, 184, 194, 224, 226, 153, 161,
+    167, 172, 176, 177, 179, 209, 216, 217, 227, 229, 230, 129,
+    132, 133, 134, 136, 146, 154, 156, 160, 163, 164, 169, 170,
+    173, 178, 181, 185, 186, 187, 189, 190, 196, 198, 228, 232,
+    233, 1, 135, 137, 138, 139, 140, 141, 143, 147, 149, 150,
+    151, 152, 155, 157, 158, 165, 166, 168, 174, 175, 180, 182,
+    183, 188, 191, 197, 231, 239, 9, 142, 144, 145, 148, 159,
+    171, 206, 215, 225, 236, 237, 199, 207, 234, 235, 192, 193,
+    200, 201, 202, 205, 210, 213, 218, 219, 238, 240, 242, 243,
+    255, 203, 204, 211, 212, 214, 221, 222, 223, 241, 244, 245,
+    246, 247, 248, 250, 251, 252, 253, 254, 2, 3, 4, 5,
+    6, 7, 8, 11, 12, 14, 15, 16, 17, 18, 19, 20,
+    21, 23, 24, 25, 26, 27, 28, 29, 30, 31, 127, 220,
+    249, 10, 13, 22, 256,
+};
+
+static const uint32_t huffman_first_code[31] = {
+    0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+    0x00000014, 0x0000005c, 0x000000f8, 0x00000000, 0x000003f8, 0x000007fa,
+    0x00000ffa, 0x00001ff8, 0x00003ffc, 0x00007ffc, 0x00000000, 0x00000000,
+    0x00000000, 0x0007fff0, 0x000fffe6, 0x001fffdc, 0x003fffd2, 0x007fffd8,
+    0x00ffffea, 0x01ffffec, 0x03ffffe0, 0x07ffffde, 0x0fffffe2, 0x00000000,
+    0x3ffffffc,
+};
+
+static const uint16_t huffman_count[31] = {
+    0, 0, 0, 0, 0, 10, 26, 32, 6, 0, 5, 3, 2, 6, 2, 3,
+    0, 0, 0, 3, 8, 13, 26, 29, 12, 4, 15, 19, 29, 0, 4,
+};
+
+static const uint16_t huffman_first_index[31] = {
+    0, 0, 0, 0, 0, 0, 10, 36, 68, 0, 74, 79, 82, 84, 90, 92,
+    0, 0, 0, 95, 98, 106, 119, 145, 174, 186, 190, 205, 224, 0, 253,
+};
+
+
+#define HUFFMAN_EOS 256
+#define HUFFMAN_MAX_BITS 30
+
+/*
+ * FUNCTION: huffman_decode
+ * PURPOSE: Decode Huffman-coded text into dest (at most `room` bytes)
+ * RETURNS: Decoded length - which may exceed room, then only a prefix was
+ *          written - or -1 if the code is invalid
+ * RULE: The last byte is padded with the high bits of EOS (all ones), and
+ *       padding longer than 7 bits is an error
+ */
+static long huffman_decode(const unsigned char *src, size_t length, char *dest, size_t room) {
+    uint32_t code = 0;
+    int bits = 0, bit;
+    size_t count = 0, i;
+
+    for (i = 0; i < length; i++) {
+        for (bit = 7; bit >= 0; bit--) {
+            code = (code << 1) | ((src[i] >> bit) & 1);
+            if (++bits > HUFFMAN_MAX_BITS) {
+                return -1;
+            }
+            if (code >= huffman_first_code[bits] &&
+                code - huffman_first_code[bits] < huffman_count[bits]) {
+                unsigned symbol = huffman_symbols[huffman_first_index[bits] + code - huffman_first_code[bits]];
+                if (symbol == HUFFMAN_EOS) {
+                    return -1;
+                }
+                if (count < room) {
+                    dest[count] = (char)symbol;
+                }
+                count++;
+                code = 0;
+                bits = 0;
+            }
+        }
+    }
+    if (bits > 7 || code != (1u << bits) - 1) {
+        return -1;
+    }
+    return (long)count;
+}
+
+static size_t huffman_length(const char *text, size_t length) {
+    size_t bits = 0, i;
+
+    for (i = 0; i < length; i++) {
+        bits += huffman_lengths[(unsigned char)text[i]];
+    }
+    return (bits + 7) / 8;
+}
+
+static void huffman_encode(unsigned char *out, const char *text, size_t length) {
+    uint64_t pending = 0;   // Bits not written yet, right-aligned
+    int bits = 0;
+    size_t i;
+
+    for (i = 0; i < length; i++) {
+        unsigned char c = (unsigned char)text[i];
+        pending = (pending << huffman_lengths[c]) | huffman_codes[c];
+        bits += huffman_lengths[c];
+        while (bits >= 8) {
+            bits -= 8;
+            *out++ = (unsigned char)(pending >> bits);
+        }
+    }
+    if (bits > 0) {
+        // Pad with ones - the start of EOS
+        *out = (unsigned char)((pending << (8 - bits)) | (0xffu >> bits));
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Dynamic table
+// -----------------------------------------------------------------------------
+
+void hpack_table_init(struct hpack_table *table) {
+    table->count = 0;
+    table->size = 0;
+    table->max_size = HPACK_TABLE_SIZE;
+    table->used = 0;
+    table->pending_size = 0;
+    table->pending_min = 0;
+    table->resize_pending = 0;
+}
+
+/*
+ * FUNCTION: evict_to
+ * PURPOSE: Drop the oldest entries until the table size is at most `limit`
+ */
+static void evict_to(struct hpack_table *table, size_t limit) {
+    size_t bytes = 0;
+    int evicted = 0, i;
+
+    while (table->size > limit) {
+        const struct hpack_entry *entry = &table->entries[evicted++];
+        size_t entry_bytes = (size_t)entry->name_length + entry->value_length;
+        bytes += entry_bytes;
+        table->size -= entry_bytes + HPACK_ENTRY_OVERHEAD;
+    }
+    if (evicted == 0) {
+        return;
+    }
+
+    table->count -= evicted;
+    table->used -= bytes;
+    memmove(table->entries, table->entries + evicted, (size_t)table->count * sizeof(table->entries[0]));
+    memmove(table->data, table->data + bytes, table->used);
+    for (i = 0; i < table->count; i++) {
+        table->entries[i].offset = (uint16_t)(table->entries[i].offset - bytes);
+    }
+}
+
+/*
+ * FUNCTION: table_insert
+ * PURPOSE: Add a field as the newest entry, evicting old ones to make room
+ * RULE: name/value must not point into the table itself (eviction moves it)
+ */
+static void table_insert(struct hpack_table *table, const char *name, size_t name_length,
+                         const char *value, size_t value_length) {
+    size_t entry_size = name_length + value_length + HPACK_ENTRY_OVERHEAD;
+    struct hpack_entry *entry;
+
+    if (entry_size > table->max_size) {
+        evict_to(table, 0);     // Bigger than the whole table: it just empties it
+        return;
+    }
+    evict_to(table, table->max_size - entry_size);
+
+    entry = &table->entries[table->count++];
+    entry->offset = (uint16_t)table->used;
+    entry->name_length = (uint16_t)name_length;
+    entry->value_length = (uint16_t)value_length;
+    memcpy(table->data + table->used, name, name_length);
+    memcpy(table->data + table->used + name_length, value, value_length);
+    table->used += name_length + value_length;
+    table->size += entry_size;
+}
+
+/*
+ * FUNCTION: lookup
+ * PURPOSE: Find the field behind an index: 1-61 static, 62+ dynamic (newest first)
+ * RETURNS: 0 on success, -1 for an index that doesn't exist
+ */
+static int lookup(const struct hpack_table *table, uint32_t index,
+                  const char **name, size_t *name_length,
+                  const char **value, size_t *value_length) {
+    const struct hpack_entry *entry;
+
+    if (index == 0) {
+        return -1;
+    }
+    if (index <= HPACK_STATIC_COUNT) {
+        const struct hpack_static *field = &static_table[index - 1];
+        *name = field->name;
+        *name_length = field->name_length;
+        *value = field->value;
+        *value_length = field->value_length;
+        return 0;
+    }
+    index -= HPACK_STATIC_COUNT + 1;
+    if (index >= (uint32_t)table->count) {
+        return -1;
+    }
+    entry = &table->entries[table->count - 1 - (int)index];
+    *name = table->data + entry->offset;
+    *name_length = entry->name_length;
+    *value = *name + entry->name_length;
+    *value_length = entry->value_length;
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+// Decoding
+// -----------------------------------------------------------------------------
+
+/*
+ * FUNCTION: decode_integer
+ * PURPOSE: Read an integer with an N-bit prefix (RFC 7541 section 5.1)
+ * RETURNS: 0 on success, -1 if truncated or unreasonably large
+ */
+static int decode_integer(const unsigned char **p, const unsigned char *end,
+                          int prefix_bits, uint32_t *value) {
+    uint32_t max_prefix = (1u << prefix_bits) - 1;
+    uint32_t result;
+    int shift = 0;
+
+    if (*p == end) {
+        return -1;
+    }
+    result = *(*p)++ & max_prefix;
+    if (result < max_prefix) {
+        *value = result;
+        return 0;
+    }
+    while (*p < end) {
+        unsigned char byte = *(*p)++;
+        if (shift > 21) {
+            return -1;      // Over 2^28 - no header field is that long
+        }
+        result += (uint32_t)(byte & 0x7f) << shift;
+        shift += 7;
+        if (!(byte & 0x80)) {
+            *value = result;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/*
+ * FUNCTION: decode_string
+ * PURPOSE: Read a string literal (plain or Huffman) into dest
+ * RETURNS: Its decoded length - only written if it fits `room` - or -1
+ */
+static long decode_string(const unsigned char **p, const unsigned char *end, char *dest, size_t room) {
+    const unsigned char *text;
+    uint32_t length;
+    int huffman;
+
+    if (*p == end) {
+        return -1;
+    }
+    huffman = **p & 0x80;
+    if (decode_integer(p, end, 7, &length) < 0 || length > (size_t)(end - *p)) {
+        return -1;
+    }
+    text = *p;
+    *p += length;
+
+    if (huffman) {
+        return huffman_decode(text, length, dest, room);
+    }
+    if (length <= room) {
+        memcpy(dest, text, length);
+    }
+    return (long)length;
+}
+
+/*
+ * FUNCTION: decode_literal
+ * PURPOSE: Read the name (by index or literal) and value of a literal field
+ *          into dest, name first and the value right after it
+ * RETURNS: 0 on success (the bytes are only there if the lengths fit room), -1 on error
+ */
+static int decode_literal(const struct hpack_table *table, const unsigned char **p,
+                          const unsigned char *end, uint32_t name_index,
+                          char *dest, size_t room, size_t *name_length, size_t *value_length) {
+    long length;
+
+    if (name_index > 0) {
+        const char *name, *value;
+        size_t ignored;
+        if (lookup(table, name_index, &name, name_length, &value, &ignored) < 0) {
+            return -1;
+        }
+        if (*name_length <= room) {
+            memcpy(dest, name, *name_length);
+        }
+    } else {
+        length = decode_string(p, end, dest, room);
+        if (length < 0) {
+            return -1;
+        }
+        *name_length = (size_t)length;
+    }
+
+    room = *name_length <= room ? room - *name_length : 0;
+    length = decode_string(p, end, dest + *name_length, room);
+    if (length < 0) {
+        return -1;
+    }
+    *value_length = (size_t)length;
+    return 0;
+}
+
+/*
+ * FUNCTION: add_field
+ * PURPOSE: Record a decoded field that sits at out->buffer + out->length
+ */
+static void add_field(struct hpack_fields *out, size_t name_length, size_t value_length) {
+    struct http_header *field;
+
+    if (out->count == out->max_fields) {
+        out->truncated = 1;
+        return;
+    }
+    field = &out->fields[out->count++];
+    field->name.offset = (uint32_t)out->length;
+    field->name.length = (uint32_t)name_length;
+    field->value.offset = (uint32_t)(out->length + name_length);
+    field->value.length = (uint32_t)value_length;
+    out->length += name_length + value_length;
+}
+
+int hpack_decode(struct hpack_table *table, const unsigned char *block, size_t length,
+                 struct hpack_fields *out) {
+    const unsigned char *p = block, *end = block + length;
+    char spill[2 * HPACK_TABLE_SIZE];   // Fields that don't fit the output, kept for the table
+    int fields_seen = 0;
+
+    out->length = 0;
+    out->count = 0;
+    out->truncated = 0;
+
+    while (p < end) {
+        unsigned char first = *p;
+        const unsigned char *start = p;
+        size_t room = out->size - out->length;
+        char *dest = out->buffer + out->length;
+        size_t name_length, value_length;
+        uint32_t index;
+
+        if (first & 0x80) {
+            // 1xxxxxxx: a field from one of the tables
+            const char *name, *value;
+            if (decode_integer(&p, end, 7, &index) < 0 ||
+                lookup(table, index, &name, &name_length, &value, &value_length) < 0) {
+                return -1;
+            }
+            if (name_length + value_length <= room) {
+                memcpy(dest, name, name_length);
+                memcpy(dest + name_length, value, value_length);
+                add_field(out, name_length, value_length);
+            } else {
+                out->truncated = 1;
+            }
+            fields_seen = 1;
+            continue;
+        }
+
+        if ((first & 0xe0) == 0x20) {
+            // 001xxxxx: dynamic table size update, only before the first field
+            if (fields_seen || decode_integer(&p, end, 5, &index) < 0 || index > HPACK_TABLE_SIZE) {
+                return -1;
+            }
+            table->max_size = index;
+            evict_to(table, index);
+            continue;
+        }
+
+        // 01xxxxxx: literal, add to the table
+        // 0000xxxx / 0001xxxx: literal, don't add / never add
+        if (decode_integer(&p, end, (first & 0x40) ? 6 : 4, &index) < 0 ||
+            decode_literal(table, &p, end, index, dest, room, &name_length, &value_length) < 0) {
+            return -1;
+        }
+        if (name_length + value_length <= room) {
+            add_field(out, name_length, value_length);
+        } else {
+            // No room in the output, but the table may still need the bytes
+            out->truncated = 1;
+            p = start;
+            decode_integer(&p, end, (first & 0x40) ? 6 : 4, &index);
+            decode_literal(table, &p, end, index, spill, sizeof(spill), &name_length, &value_length);
+            dest = spill;
+        }
+
+        if (first & 0x40) {
+            if (name_length + value_length <= sizeof(spill)) {
+                table_insert(table, dest, name_length, dest + name_length, value_length);
+            } else {
+                evict_to(table, 0);     // Larger than any table: it just empties it
+            }
+        }
+        fields_seen = 1;
+    }
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+// Encoding
+// -----------------------------------------------------------------------------
+
+/*
+ * FUNCTION: encode_integer
+ * PURPOSE: Write an integer with an N-bit prefix; `flags` fills the bits above it
+ * RETURNS: Bytes written, or -1 if `room` is too small
+ */
+static int encode_integer(unsigned char *out, size_t room, uint32_t value,
+                          int prefix_bits, unsigned char flags) {
+    uint32_t max_prefix = (1u << prefix_bits) - 1;
+    size_t count = 0;
+
+    if (room == 0) {
+        return -1;
+    }
+    if (value < max_prefix) {
+        out[0] = (unsigned char)(flags | value);
+        return 1;
+    }
+    out[count++] = (unsigned char)(flags | max_prefix);
+    value -= max_prefix;
+    while (1) {
+        if (count == room) {
+            return -1;
+        }
+        if (value < 0x80) {
+            out[count++] = (unsigned char)value;
+            return (int)count;
+        }
+        out[count++] = (unsigned char)(0x80 | (value & 0x7f));
+        value >>= 7;
+    }
+}
+
+/*
+ * FUNCTION: encode_string
+ * PURPOSE: Write a string literal, Huffman-coded whenever that is shorter
+ * RETURNS: Bytes written, or -1 if `room` is too small
+ */
+static int encode_string(unsigned char *out, size_t room, const char *text, size_t length) {
+    size_t coded = huffman_length(text, length);
+    int huffman = coded < length;
+    size_t data_length = huffman ? coded : length;
+    int prefix = encode_integer(out, room, (uint32_t)data_length, 7, huffman ? 0x80 : 0);
+
+    if (prefix < 0 || data_length > room - (size_t)prefix) {
+        return -1;
+    }
+    if (huffman) {
+        huffman_encode(out + prefix, text, length);
+    } else {
+        memcpy(out + prefix, text, length);
+    }
+    return prefix + (int)data_length;
+}
+
+void hpack_encoder_resize(struct hpack_table *table, size_t size) {
+    if (size > HPACK_TABLE_SIZE) {
+        size = HPACK_TABLE_SIZE;
+    }
+    if (!table->resize_pending || size < table->pending_min) {
+        table->pending_min = size;
+    }
+    table->pending_size = size;
+    table->resize_pending = 1;
+}
+
+int hpack_encode_start(struct hpack_table *table, unsigned char *out, size_t room) {
+    int written = 0, bytes;
+
+    if (!table->resize_pending) {
+        return 0;
+    }
+
+    // A smaller limit in between must be announced too: the decoder would
+    // have evicted entries for it
+    if (table->pending_min < table->pending_size) {
+        bytes = encode_integer(out, room, (uint32_t)table->pending_min, 5, 0x20);
+        if (bytes < 0) {
+            return -1;
+        }
+        written = bytes;
+    }
+    bytes = encode_integer(out + written, room - (size_t)written, (uint32_t)table->pending_size, 5, 0x20);
+    if (bytes < 0) {
+        return -1;
+    }
+
+    evict_to(table, table->pending_min);
+    table->max_size = table->pending_size;
+    evict_to(table, table->max_size);
+    table->resize_pending = 0;
+    return written + bytes;
+}
+
+int hpack_encode_field(struct hpack_table *table, unsigned char *out, size_t room,
+                       const char *name, size_t name_length,
+                       const char *value, size_t value_length, int index) {
+    uint32_t name_index = 0;
+    int written, bytes, i;
+
+    // A field either table already has costs a single index
+    for (i = 0; i < HPACK_STATIC_COUNT; i++) {
+        const struct hpack_static *field = &static_table[i];
+        if (field->name_length != name_length || memcmp(field->name, name, name_length) != 0) {
+            continue;
+        }
+        if (field->value_length == value_length && memcmp(field->value, value, value_length) == 0) {
+            return encode_integer(out, room, (uint32_t)i + 1, 7, 0x80);
+        }
+        if (name_index == 0) {
+            name_index = (uint32_t)i + 1;
+        }
+    }
+    for (i = 0; i < table->count; i++) {
+        const struct hpack_entry *entry = &table->entries[table->count - 1 - i];
+        const char *entry_name = table->data + entry->offset;
+        if (entry->name_length != name_length || memcmp(entry_name, name, name_length) != 0) {
+            continue;
+        }
+        if (entry->value_length == value_length &&
+            memcmp(entry_name + name_length, value, value_length) == 0) {
+            return encode_integer(out, room, (uint32_t)(HPACK_STATIC_COUNT + 1 + i), 7, 0x80);
+        }
+        if (name_index == 0) {
+            name_index = (uint32_t)(HPACK_STATIC_COUNT + 1 + i);
+        }
+    }
+
+    // Otherwise a literal value, with the name by index if we have one
+    written = encode_integer(out, room, name_index, index ? 6 : 4, index ? 0x40 : 0);
+    if (written < 0) {
+        return -1;
+    }
+    if (name_index == 0) {
+        bytes = encode_string(out + written, room - (size_t)written, name, name_length);
+        if (bytes < 0) {
+            return -1;
+        }
+        written += bytes;
+    }
+    bytes = encode_string(out + written, room - (size_t)written, value, value_length);
+    if (bytes < 0) {
+        return -1;
+    }
+    written += bytes;
+
+    if (index) {
+        table_insert(table, name, name_length, value, value_length);
+    }
+    return written;
+}
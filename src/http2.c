@@ -0,0 +1,1291 @@
+/*
+ * =============================================================================
+ * HTTP/2 IMPLEMENTATION - FRAMES, STREAMS, FLOW CONTROL AND TRANSLATION
+ * =============================================================================
+ */
+
+#include <stdio.h>          // perror
+#include <string.h>         // memcmp, memcpy, memmove, memchr
+#include <unistd.h>         // close
+
+#include "config.h"
+#include "http2.h"
+#include "response.h"
+#include "router.h"
+#include "worker.h"
+
+// Frame types
+#define FRAME_DATA 0x0
+#define FRAME_HEADERS 0x1
+#define FRAME_PRIORITY 0x2
+#define FRAME_RST_STREAM 0x3
+#define FRAME_SETTINGS 0x4
+#define FRAME_PUSH_PROMISE 0x5
+#define FRAME_PING 0x6
+#define FRAME_GOAWAY 0x7
+#define FRAME_WINDOW_UPDATE 0x8
+#define FRAME_CONTINUATION 0x9
+
+// Frame flags
+#define FLAG_END_STREAM 0x1         // DATA, HEADERS
+#define FLAG_ACK 0x1                // SETTINGS, PING
+#define FLAG_END_HEADERS 0x4        // HEADERS, CONTINUATION
+#define FLAG_PADDED 0x8             // DATA, HEADERS
+#define FLAG_PRIORITY 0x20          // HEADERS
+
+// Error codes for RST_STREAM and GOAWAY
+#define H2_NO_ERROR 0x0
+#define H2_PROTOCOL_ERROR 0x1
+#define H2_INTERNAL_ERROR 0x2
+#define H2_FLOW_CONTROL_ERROR 0x3
+#define H2_STREAM_CLOSED 0x5
+#define H2_FRAME_SIZE_ERROR 0x6
+#define H2_REFUSED_STREAM 0x7
+#define H2_COMPRESSION_ERROR 0x9
+#define H2_ENHANCE_YOUR_CALM 0xb
+
+// SETTINGS parameters
+#define SETTINGS_HEADER_TABLE_SIZE 0x1
+#define SETTINGS_ENABLE_PUSH 0x2
+#define SETTINGS_MAX_CONCURRENT_STREAMS 0x3
+#define SETTINGS_INITIAL_WINDOW_SIZE 0x4
+#define SETTINGS_MAX_FRAME_SIZE 0x5
+#define SETTINGS_MAX_HEADER_LIST_SIZE 0x6
+
+#define H2_MAX_WINDOW 0x7fffffff
+#define H2_LARGEST_FRAME 0xffffff
+
+// Output needed to handle any one frame: a frame of ours plus two small
+// control frames (window updates, resets)
+#define H2_FRAME_PARTS 4
+#define H2_FRAME_SCRATCH 64
+
+// What a complete header block is for
+enum header_kind {
+    HEADERS_REQUEST,        // Opens a new stream
+    HEADERS_TRAILERS,       // Ends a request body - decoded, not used
+    HEADERS_IGNORED         // Closed/refused stream - decoded only for HPACK
+};
+
+static const char client_preface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+#define CLIENT_PREFACE_LENGTH (sizeof(client_preface) - 1)
+
+// -----------------------------------------------------------------------------
+// Frame helpers
+// -----------------------------------------------------------------------------
+
+static uint32_t read_u32(const unsigned char *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static void write_u32(unsigned char *p, uint32_t value) {
+    p[0] = (unsigned char)(value >> 24);
+    p[1] = (unsigned char)(value >> 16);
+    p[2] = (unsigned char)(value >> 8);
+    p[3] = (unsigned char)value;
+}
+
+static void write_frame_header(unsigned char *out, size_t length, int type, int flags, uint32_t stream_id) {
+    out[0] = (unsigned char)(length >> 16);
+    out[1] = (unsigned char)(length >> 8);
+    out[2] = (unsigned char)length;
+    out[3] = (unsigned char)type;
+    out[4] = (unsigned char)flags;
+    write_u32(out + 5, stream_id);
+}
+
+/*
+ * FUNCTION: queue_frame
+ * PURPOSE: Queue a small frame of ours, copied into the output queue's arena
+ * RETURNS: Where its payload goes (to be filled in by the caller)
+ * RULE: The caller made sure the queue has room (H2_FRAME_PARTS/SCRATCH)
+ */
+static unsigned char *queue_frame(connection *conn, size_t length, int type, int flags, uint32_t stream_id) {
+    unsigned char *frame = arena_alloc(&conn->output.arena, H2_FRAME_HEADER + length, 1);
+
+    write_frame_header(frame, length, type, flags, stream_id);
+    output_push(&conn->output, frame, H2_FRAME_HEADER + length);
+    return frame + H2_FRAME_HEADER;
+}
+
+static void send_rst_stream(connection *conn, uint32_t stream_id, uint32_t code) {
+    write_u32(queue_frame(conn, 4, FRAME_RST_STREAM, 0, stream_id), code);
+}
+
+static void send_window_update(connection *conn, uint32_t stream_id, uint32_t increment) {
+    write_u32(queue_frame(conn, 4, FRAME_WINDOW_UPDATE, 0, stream_id), increment);
+}
+
+static void send_goaway(connection *conn, uint32_t code) {
+    struct h2_session *session = conn->h2;
+    unsigned char *payload = queue_frame(conn, 8, FRAME_GOAWAY, 0, 0);
+
+    // Streams above last_stream_id were never touched - the client may retry them
+    write_u32(payload, session->last_stream_id);
+    write_u32(payload + 4, code);
+    session->goaway_sent = 1;
+}
+
+/*
+ * FUNCTION: connection_error
+ * PURPOSE: Something is wrong with the connection as a whole: say why with
+ *          GOAWAY, stop processing and close once that is sent
+ */
+static void connection_error(connection *conn, uint32_t code) {
+    if (!conn->h2->failed) {
+        send_goaway(conn, code);
+        conn->h2->failed = 1;
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Streams
+// -----------------------------------------------------------------------------
+
+static struct h2_stream *find_stream(struct h2_session *session, uint32_t id) {
+    int i;
+
+    for (i = 0; i < H2_MAX_STREAMS; i++) {
+        if (session->streams[i].state != H2_STREAM_FREE && session->streams[i].id == id) {
+            return &session->streams[i];
+        }
+    }
+    return NULL;
+}
+
+static struct h2_stream *new_stream(struct h2_session *session, uint32_t id) {
+    int i;
+
+    for (i = 0; i < H2_MAX_STREAMS; i++) {
+        struct h2_stream *stream = &session->streams[i];
+        if (stream->state == H2_STREAM_FREE) {
+            stream->id = id;
+            stream->state = H2_STREAM_SENDING;
+            stream->remote_closed = 0;
+            stream->send_window = session->peer_initial_window;
+            stream->recv_window = H2_WINDOW;
+            stream->body_start = stream->body_end = 0;
+            stream->file.fd = -1;
+            stream->file.offset = 0;
+            stream->file.data = NULL;
+            stream->file.hold = NULL;
+            stream->file_remaining = 0;
+            stream->streamer.fill = NULL;
+            stream->stream_buffer = NULL;
+            stream->stream_start = stream->stream_end = 0;
+            stream->stream_queued = 0;
+            session->active_streams++;
+            return stream;
+        }
+    }
+    return NULL;
+}
+
+static void free_stream(connection *conn, struct h2_stream *stream) {
+    stream_abort(&stream->streamer);    // Reset before its answer was complete
+    pool_put(&conn->worker->record_pool, stream->stream_buffer);
+    stream->stream_buffer = NULL;
+    if (stream->file.fd >= 0) {
+        close(stream->file.fd);
+        stream->file.fd = -1;
+    }
+    if (stream->file.hold) {
+        stream->file.hold->release(stream->file.hold);
+        stream->file.hold = NULL;
+    }
+    stream->file.data = NULL;
+    stream->state = H2_STREAM_FREE;
+    conn->h2->active_streams--;
+}
+
+/*
+ * FUNCTION: reclaim_streams
+ * PURPOSE: Free the slots of finished streams, and let streamed answers
+ *          make their next piece
+ * RULE: Only when the output queue is empty - before that, queued frames may
+ *       still point into a stream's buffers or read from its file
+ */
+static void reclaim_streams(connection *conn) {
+    struct h2_session *session = conn->h2;
+    int i;
+
+    for (i = 0; i < H2_MAX_STREAMS; i++) {
+        if (session->streams[i].state == H2_STREAM_DONE) {
+            // Everything of it is sent now: that's its response time
+            metrics_observe(&conn->worker->metrics->response_time,
+                            metrics_now_us() - session->streams[i].start_us);
+            free_stream(conn, &session->streams[i]);
+        }
+        session->streams[i].stream_queued = 0;
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Requests: HTTP/2 fields in, HTTP/1.1 handlers, HTTP/2 frames out
+// -----------------------------------------------------------------------------
+
+static int field_is(const struct h2_session *session, const struct http_slice *slice, const char *text) {
+    size_t length = strlen(text);
+    return slice->length == length && memcmp(session->decoded + slice->offset, text, length) == 0;
+}
+
+/*
+ * FUNCTION: build_request
+ * PURPOSE: Fill session->request from the decoded fields, like the HTTP/1.1
+ *          parser would, so the handlers can't tell the difference
+ * RETURNS: 0 on success, 1 if over a limit (431), -1 if malformed (the
+ *          stream is reset with PROTOCOL_ERROR)
+ */
+static int build_request(struct h2_session *session, const struct hpack_fields *fields) {
+    struct http_request *request = &session->request;
+    const struct http_header *method = NULL, *path = NULL, *authority = NULL;
+    int regular = 0, has_host = 0, i;
+    size_t j;
+
+    http_parser_init(request);
+    if (fields->truncated) {
+        return 1;
+    }
+
+    for (i = 0; i < fields->count; i++) {
+        const struct http_header *field = &fields->fields[i];
+        const char *name = session->decoded + field->name.offset;
+
+        // No CR, LF, NUL or other control byte may get into the HTTP/1.1
+        // form of the request (RFC 9113 section 8.2.1)
+        if (field->name.length == 0 ||
+            !http_valid_field_value(session->decoded + field->value.offset, field->value.length)) {
+            return -1;
+        }
+        if (name[0] == ':') {
+            // Pseudo-headers come first, each at most once
+            const struct http_header **slot;
+            if (regular) {
+                return -1;
+            }
+            if (field_is(session, &field->name, ":method")) {
+                slot = &method;
+            } else if (field_is(session, &field->name, ":path")) {
+                slot = &path;
+            } else if (field_is(session, &field->name, ":authority")) {
+                slot = &authority;
+            } else if (field_is(session, &field->name, ":scheme")) {
+                continue;
+            } else {
+                return -1;
+            }
+            if (*slot) {
+                return -1;
+            }
+            *slot = field;
+            continue;
+        }
+
+        // Names are lower case tokens, and hop-by-hop headers don't exist
+        // in HTTP/2
+        regular = 1;
+        if (!http_valid_token(name, field->name.length)) {
+            return -1;
+        }
+        for (j = 0; j < field->name.length; j++) {
+            if (name[j] >= 'A' && name[j] <= 'Z') {
+                return -1;
+            }
+        }
+        if (field_is(session, &field->name, "connection") ||
+            field_is(session, &field->name, "keep-alive") ||
+            field_is(session, &field->name, "proxy-connection") ||
+            field_is(session, &field->name, "transfer-encoding") ||
+            field_is(session, &field->name, "upgrade") ||
+            (field_is(session, &field->name, "te") && !field_is(session, &field->value, "trailers"))) {
+            return -1;
+        }
+        if (field_is(session, &field->name, "host")) {
+            has_host = 1;
+        }
+        if (request->header_count == config.max_headers) {
+            return 1;
+        }
+        request->headers[request->header_count++] = *field;
+    }
+
+    if (!method || !path || path->value.length == 0 ||
+        !http_valid_token(session->decoded + method->value.offset, method->value.length) ||
+        !http_valid_target(session->decoded + path->value.offset, path->value.length)) {
+        return -1;
+    }
+    request->method = method->value;
+    request->path = path->value;
+    for (j = 0; j < path->value.length; j++) {
+        if (session->decoded[path->value.offset + j] == '?') {
+            // Same layout as HTTP/1.1: path, '?', query
+            request->path.length = (uint32_t)j;
+            request->query.offset = (uint32_t)(path->value.offset + j + 1);
+            request->query.length = (uint32_t)(path->value.length - j - 1);
+            break;
+        }
+    }
+    request->minor_version = 1;
+
+    // :authority stands in for Host - give it the name handlers look for
+    if (authority && !has_host && request->header_count < config.max_headers) {
+        struct http_header *host = &request->headers[request->header_count++];
+        memcpy(session->decoded + fields->length, "host", 4);
+        host->name.offset = (uint32_t)fields->length;
+        host->name.length = 4;
+        host->value = authority->value;
+    }
+    request->header_length = fields->length;
+    return 0;
+}
+
+/*
+ * FUNCTION: log_request
+ * PURPOSE: Hand a request's (still HTTP/1.1) answer to the access log
+ * RULE: Before translate_answer() - it takes the parts out of the queue
+ */
+static void log_request(connection *conn, const struct output_queue *answer, int parsed) {
+    const struct http_request *request = &conn->h2->request;
+    const char *decoded = conn->h2->decoded;
+    size_t url_length = request->path.length + (request->query.length ? request->query.length + 1 : 0);
+    worker *w = conn->worker;
+
+    if (access_log_request(w->log, event_loop_wall_time(w->loop), &conn->peer, ACCESS_HTTP_2,
+                           decoded + request->method.offset, parsed ? request->method.length : 0,
+                           decoded + request->path.offset, url_length, answer, 0, 0) < 0) {
+        metric_add(&w->metrics->log_dropped, 1);
+    }
+}
+
+/*
+ * FUNCTION: find_blank_line
+ * RETURNS: The "\r\n\r\n" that ends the HTTP/1.1 head, or NULL
+ */
+static const char *find_blank_line(const char *head, size_t length) {
+    size_t i;
+
+    for (i = 0; i + 4 <= length; i++) {
+        if (memcmp(head + i, "\r\n\r\n", 4) == 0) {
+            return head + i;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * FUNCTION: encode_head
+ * PURPOSE: Turn the HTTP/1.1 status line and headers into an HPACK block
+ * RETURNS: Block length, or -1 if it doesn't fit `room`
+ */
+static int encode_head(struct hpack_table *encoder, unsigned char *block, size_t room,
+                       const char *head, const char *blank_line) {
+    const char *line = (const char *)memchr(head, '\n', (size_t)(blank_line + 2 - head)) + 1;
+    int written, bytes;
+
+    written = hpack_encode_start(encoder, block, room);
+    if (written < 0) {
+        return -1;
+    }
+    // "HTTP/1.1 200 OK" -> :status 200
+    bytes = hpack_encode_field(encoder, block + written, room - (size_t)written,
+                               ":status", 7, head + 9, 3, 0);
+    if (bytes < 0) {
+        return -1;
+    }
+    written += bytes;
+
+    while (line < blank_line + 2) {
+        const char *end = line;
+        const char *colon, *value;
+        char name[64];
+        size_t name_length, i;
+        int index;
+
+        while (end[0] != '\r' || end[1] != '\n') {
+            end++;
+        }
+        colon = memchr(line, ':', (size_t)(end - line));
+        if (!colon || (size_t)(colon - line) >= sizeof(name)) {
+            return -1;
+        }
+        name_length = (size_t)(colon - line);
+        for (i = 0; i < name_length; i++) {
+            char c = line[i];
+            name[i] = (c >= 'A' && c <= 'Z') ? (char)(c + 'a' - 'A') : c;
+        }
+        value = colon + 1;
+        while (value < end && *value == ' ') {
+            value++;
+        }
+        line = end + 2;
+
+        // The connection itself is HTTP/2's business, not a header's
+        // (and so is framing a body: that's what DATA frames do)
+        if ((name_length == 10 && memcmp(name, "connection", 10) == 0) ||
+            (name_length == 10 && memcmp(name, "keep-alive", 10) == 0) ||
+            (name_length == 17 && memcmp(name, "transfer-encoding", 17) == 0)) {
+            continue;
+        }
+
+        // Values that change with every response would only churn the table
+        index = !(name_length == 14 && memcmp(name, "content-length", 14) == 0) &&
+                !(name_length == 13 && memcmp(name, "content-range", 13) == 0);
+
+        bytes = hpack_encode_field(encoder, block + written, room - (size_t)written,
+                                   name, name_length, value, (size_t)(end - value), index);
+        if (bytes < 0) {
+            return -1;
+        }
+        written += bytes;
+    }
+    return written;
+}
+
+/*
+ * FUNCTION: translate_answer
+ * PURPOSE: Turn a handler's HTTP/1.1 answer into the stream's HEADERS frame
+ *          (queued right away) and a body for later DATA frames
+ * RETURNS: 0 on success, -1 if it doesn't fit the stream (the caller resets it)
+ * RULE: Header blocks must reach the client in the order they were encoded,
+ *       so the HEADERS frame is queued immediately
+ */
+static int translate_answer(connection *conn, struct h2_stream *stream, struct output_queue *answer) {
+    struct h2_session *session = conn->h2;
+    char head[H2_STREAM_BUFFER];
+    unsigned char *block = (unsigned char *)stream->buffer + H2_FRAME_HEADER;
+    size_t length = output_gather(answer, head, sizeof(head), 0);
+    size_t file_length = 0, body_length;
+    const char *blank_line = find_blank_line(head, length);
+    int block_length, has_body;
+
+    if ((answer->length > 0 && !output_front_file(answer, &file_length)) ||
+        !blank_line || length < 12 || memcmp(head, "HTTP/1.", 7) != 0) {
+        return -1;
+    }
+    body_length = length - (size_t)(blank_line + 4 - head);
+    if (body_length > sizeof(stream->buffer) - H2_FRAME_HEADER) {
+        return -1;
+    }
+
+    // From here on the encoder table changes, so failing would leave the
+    // client's copy out of step - that is fatal for the whole connection
+    block_length = encode_head(&session->encoder, block,
+                               sizeof(stream->buffer) - H2_FRAME_HEADER - body_length, head, blank_line);
+    if (block_length < 0) {
+        connection_error(conn, H2_INTERNAL_ERROR);
+        return 0;
+    }
+
+    stream->body_start = H2_FRAME_HEADER + (size_t)block_length;
+    stream->body_end = stream->body_start + body_length;
+    memcpy(stream->buffer + stream->body_start, blank_line + 4, body_length);
+    stream->file_remaining = output_take_file(answer, &stream->file, &file_length) ? file_length : 0;
+
+    // END_STREAM comes with the last DATA frame - or on HEADERS when there
+    // is no body and the request has ended already
+    has_body = body_length > 0 || stream->file_remaining > 0 || stream->streamer.fill;
+    write_frame_header((unsigned char *)stream->buffer, (size_t)block_length, FRAME_HEADERS,
+                       FLAG_END_HEADERS | (has_body || !stream->remote_closed ? 0 : FLAG_END_STREAM),
+                       stream->id);
+    output_push(&conn->output, stream->buffer, H2_FRAME_HEADER + (size_t)block_length);
+    if (!has_body && stream->remote_closed) {
+        stream->state = H2_STREAM_DONE;
+    }
+    return 0;
+}
+
+/*
+ * FUNCTION: serve_request
+ * PURPOSE: Answer a complete request with the same handlers as HTTP/1.1
+ */
+static void serve_request(connection *conn, struct h2_stream *stream, const struct hpack_fields *fields) {
+    struct h2_session *session = conn->h2;
+    const struct http_request *request = &session->request;
+    struct http_date *date = &conn->worker->date;
+    struct output_queue answer;     // The HTTP/1.1 answer, translated below
+    struct http_context context;
+    void *state = NULL;
+    int status = build_request(session, fields);
+
+    if (status < 0) {
+        send_rst_stream(conn, stream->id, H2_PROTOCOL_ERROR);
+        free_stream(conn, stream);      // Nothing queued refers to it
+        return;
+    }
+
+    http_date_update(date, event_loop_wall_time(conn->worker->loop));
+    output_init(&answer);
+
+    if (status > 0) {
+        output_push(&answer, response_431.data, response_431.length);
+    } else {
+        context.output = &answer;       // Empty, so there's room for any answer
+        context.date = date;
+        context.data = session->decoded;
+        context.request = request;
+        context.keep_alive = 1;         // Connection-level: HTTP/2 streams don't close it
+        context.tls = 1;
+        context.body_length = 0;        // DATA frames of a request aren't passed on
+        context.state = &state;
+        context.streamer = &stream->streamer;
+        context.body_ignored = !stream->remote_closed;
+        context.worker = conn->worker;
+        context.peer = &conn->peer;
+        stream->streamer.owner = conn;
+        router_dispatch(&context);
+    }
+    log_request(conn, &answer, status == 0);
+
+    if (stream->streamer.fill && stream->streamer.head) {
+        // Deferred: the HEADERS frame follows once fill has made the head
+    } else if (translate_answer(conn, stream, &answer) < 0) {
+        output_discard(&answer);
+        send_rst_stream(conn, stream->id, H2_INTERNAL_ERROR);
+        free_stream(conn, stream);
+        return;
+    }
+
+    metric_add(&conn->worker->metrics->requests_http2, 1);
+
+    // Same limit as keep-alive: after that many requests, ask the client to
+    // move to a new connection (it finishes the ones in flight here)
+    if ((++conn->requests_served >= config.keepalive_requests || conn->worker->draining) &&
+        !session->goaway_sent) {
+        send_goaway(conn, H2_NO_ERROR);
+    }
+}
+
+/*
+ * FUNCTION: header_block_done
+ * PURPOSE: A complete header block arrived - decode it and act on it
+ * RULE: Decode EVERY block, even for streams we ignore, or HPACK breaks
+ */
+static void header_block_done(connection *conn, const unsigned char *block, size_t length) {
+    struct h2_session *session = conn->h2;
+    struct hpack_fields fields;
+    struct h2_stream *stream;
+
+    fields.buffer = session->decoded;
+    fields.size = (size_t)config.max_header_size;   // Leaves room to add "host"
+    fields.fields = session->fields;
+    fields.max_fields = config.max_headers + H2_PSEUDO_HEADERS;
+
+    if (hpack_decode(&session->decoder, block, length, &fields) < 0) {
+        connection_error(conn, H2_COMPRESSION_ERROR);
+        return;
+    }
+
+    if (session->header_kind == HEADERS_TRAILERS) {
+        stream = find_stream(session, session->header_stream);
+        if (stream) {
+            stream->remote_closed = 1;
+        }
+        return;
+    }
+    if (session->header_kind == HEADERS_IGNORED) {
+        return;
+    }
+
+    stream = new_stream(session, session->header_stream);
+    if (!stream) {
+        send_rst_stream(conn, session->header_stream, H2_REFUSED_STREAM);
+        return;
+    }
+    stream->remote_closed = (session->header_flags & FLAG_END_STREAM) != 0;
+    stream->start_us = metrics_now_us();
+    serve_request(conn, stream, &fields);
+}
+
+// -----------------------------------------------------------------------------
+// Frame handlers
+// -----------------------------------------------------------------------------
+
+/*
+ * FUNCTION: strip_padding
+ * PURPOSE: Remove the optional pad length byte and padding of DATA/HEADERS
+ * RETURNS: 0 on success, -1 if the padding is longer than the frame
+ */
+static int strip_padding(int flags, const unsigned char **payload, size_t *length) {
+    size_t padding;
+
+    if (!(flags & FLAG_PADDED)) {
+        return 0;
+    }
+    if (*length < 1) {
+        return -1;
+    }
+    padding = (*payload)[0];
+    (*payload)++;
+    (*length)--;
+    if (padding > *length) {
+        return -1;
+    }
+    *length -= padding;
+    return 0;
+}
+
+static void on_data(connection *conn, int flags, uint32_t stream_id,
+                    const unsigned char *payload, size_t length) {
+    struct h2_session *session = conn->h2;
+    size_t frame_length = length;   // Padding counts against the windows too
+    struct h2_stream *stream;
+
+    if (stream_id == 0 || stream_id > session->last_stream_id ||
+        strip_padding(flags, &payload, &length) < 0) {
+        connection_error(conn, H2_PROTOCOL_ERROR);
+        return;
+    }
+    if ((int64_t)frame_length > session->recv_window) {
+        connection_error(conn, H2_FLOW_CONTROL_ERROR);
+        return;
+    }
+
+    // The body is dropped, so its room can be given back right away - in
+    // batches, not one WINDOW_UPDATE per frame
+    session->recv_window -= (int64_t)frame_length;
+    if (session->recv_window <= H2_WINDOW / 2) {
+        send_window_update(conn, 0, (uint32_t)(H2_WINDOW - session->recv_window));
+        session->recv_window = H2_WINDOW;
+    }
+
+    stream = find_stream(session, stream_id);
+    if (!stream || stream->remote_closed) {
+        return;     // Already answered and reset - late frames are ignored
+    }
+    if ((int64_t)frame_length > stream->recv_window) {
+        send_rst_stream(conn, stream_id, H2_FLOW_CONTROL_ERROR);
+        stream->remote_closed = 1;
+        if (stream->state == H2_STREAM_SENDING) {
+            stream->state = H2_STREAM_DONE;
+        }
+        return;
+    }
+    stream->recv_window -= (int64_t)frame_length;
+
+    if (flags & FLAG_END_STREAM) {
+        stream->remote_closed = 1;
+    } else if (stream->recv_window <= H2_WINDOW / 2) {
+        send_window_update(conn, stream_id, (uint32_t)(H2_WINDOW - stream->recv_window));
+        stream->recv_window = H2_WINDOW;
+    }
+}
+
+static void on_headers(connection *conn, int flags, uint32_t stream_id,
+                       const unsigned char *payload, size_t length) {
+    struct h2_session *session = conn->h2;
+
+    if (stream_id == 0 || !(stream_id & 1) || strip_padding(flags, &payload, &length) < 0) {
+        connection_error(conn, H2_PROTOCOL_ERROR);
+        return;
+    }
+    if (flags & FLAG_PRIORITY) {
+        // Stream dependency and weight - prioritization is advisory, we don't use it
+        if (length < 5) {
+            connection_error(conn, H2_PROTOCOL_ERROR);
+            return;
+        }
+        payload += 5;
+        length -= 5;
+    }
+
+    if (stream_id > session->last_stream_id) {
+        if (session->goaway_sent) {
+            session->header_kind = HEADERS_IGNORED;     // Past our GOAWAY
+        } else {
+            session->header_kind = HEADERS_REQUEST;
+            session->last_stream_id = stream_id;
+        }
+    } else {
+        const struct h2_stream *stream = find_stream(session, stream_id);
+        if (stream && !stream->remote_closed) {
+            // Trailers after a request body: they must end the stream
+            if (!(flags & FLAG_END_STREAM)) {
+                connection_error(conn, H2_PROTOCOL_ERROR);
+                return;
+            }
+            session->header_kind = HEADERS_TRAILERS;
+        } else {
+            session->header_kind = HEADERS_IGNORED;
+        }
+    }
+    session->header_stream = stream_id;
+    session->header_flags = flags;
+
+    if (flags & FLAG_END_HEADERS) {
+        header_block_done(conn, payload, length);    // The usual case: no copy
+        return;
+    }
+    if (length > sizeof(session->header_block)) {
+        connection_error(conn, H2_ENHANCE_YOUR_CALM);
+        return;
+    }
+    memcpy(session->header_block, payload, length);
+    session->header_block_length = length;
+    session->continuation = 1;
+}
+
+static void on_continuation(connection *conn, int flags, const unsigned char *payload, size_t length) {
+    struct h2_session *session = conn->h2;
+
+    if (length > sizeof(session->header_block) - session->header_block_length) {
+        connection_error(conn, H2_ENHANCE_YOUR_CALM);
+        return;
+    }
+    memcpy(session->header_block + session->header_block_length, payload, length);
+    session->header_block_length += length;
+
+    if (flags & FLAG_END_HEADERS) {
+        session->continuation = 0;
+        header_block_done(conn, session->header_block, session->header_block_length);
+    }
+}
+
+static void on_rst_stream(connection *conn, uint32_t stream_id, size_t length) {
+    struct h2_session *session = conn->h2;
+    struct h2_stream *stream;
+
+    if (length != 4) {
+        connection_error(conn, H2_FRAME_SIZE_ERROR);
+        return;
+    }
+    if (stream_id == 0 || stream_id > session->last_stream_id) {
+        connection_error(conn, H2_PROTOCOL_ERROR);
+        return;
+    }
+    // The client gave up on it (e.g. navigated away): stop sending its body
+    stream = find_stream(session, stream_id);
+    if (stream) {
+        stream->remote_closed = 1;
+        stream->state = H2_STREAM_DONE;
+    }
+}
+
+static void on_settings(connection *conn, int flags, uint32_t stream_id,
+                        const unsigned char *payload, size_t length) {
+    struct h2_session *session = conn->h2;
+    size_t i;
+
+    if (stream_id != 0) {
+        connection_error(conn, H2_PROTOCOL_ERROR);
+        return;
+    }
+    if (flags & FLAG_ACK) {
+        if (length != 0) {
+            connection_error(conn, H2_FRAME_SIZE_ERROR);
+        }
+        return;     // The client applied ours - nothing depends on knowing that
+    }
+    if (length % 6 != 0) {
+        connection_error(conn, H2_FRAME_SIZE_ERROR);
+        return;
+    }
+
+    for (i = 0; i < length; i += 6) {
+        unsigned id = (unsigned)payload[i] << 8 | payload[i + 1];
+        uint32_t value = read_u32(payload + i + 2);
+        int j;
+
+        switch (id) {
+        case SETTINGS_HEADER_TABLE_SIZE:
+            hpack_encoder_resize(&session->encoder, value);
+            break;
+        case SETTINGS_ENABLE_PUSH:
+            if (value > 1) {
+                connection_error(conn, H2_PROTOCOL_ERROR);
+                return;
+            }
+            break;      // We never push
+        case SETTINGS_INITIAL_WINDOW_SIZE:
+            if (value > H2_MAX_WINDOW) {
+                connection_error(conn, H2_FLOW_CONTROL_ERROR);
+                return;
+            }
+            // Applies to open streams too, by the difference
+            for (j = 0; j < H2_MAX_STREAMS; j++) {
+                struct h2_stream *stream = &session->streams[j];
+                if (stream->state == H2_STREAM_FREE) {
+                    continue;
+                }
+                stream->send_window += (int64_t)value - session->peer_initial_window;
+                if (stream->send_window > H2_MAX_WINDOW) {
+                    connection_error(conn, H2_FLOW_CONTROL_ERROR);
+                    return;
+                }
+            }
+            session->peer_initial_window = value;
+            break;
+        case SETTINGS_MAX_FRAME_SIZE:
+            if (value < H2_MAX_FRAME || value > H2_LARGEST_FRAME) {
+                connection_error(conn, H2_PROTOCOL_ERROR);
+                return;
+            }
+            session->peer_max_frame = value;
+            break;
+        default:
+            break;      // MAX_CONCURRENT_STREAMS, MAX_HEADER_LIST_SIZE, unknown: unused
+        }
+    }
+
+    session->settings_received = 1;
+    queue_frame(conn, 0, FRAME_SETTINGS, FLAG_ACK, 0);
+}
+
+static void on_ping(connection *conn, int flags, uint32_t stream_id,
+                    const unsigned char *payload, size_t length) {
+    if (length != 8) {
+        connection_error(conn, H2_FRAME_SIZE_ERROR);
+        return;
+    }
+    if (stream_id != 0) {
+        connection_error(conn, H2_PROTOCOL_ERROR);
+        return;
+    }
+    if (!(flags & FLAG_ACK)) {
+        memcpy(queue_frame(conn, 8, FRAME_PING, FLAG_ACK, 0), payload, 8);
+    }
+}
+
+static void on_window_update(connection *conn, uint32_t stream_id,
+                             const unsigned char *payload, size_t length) {
+    struct h2_session *session = conn->h2;
+    uint32_t increment;
+    struct h2_stream *stream;
+
+    if (length != 4) {
+        connection_error(conn, H2_FRAME_SIZE_ERROR);
+        return;
+    }
+    increment = read_u32(payload) & 0x7fffffff;
+
+    if (stream_id == 0) {
+        session->send_window += increment;
+        if (increment == 0 || session->send_window > H2_MAX_WINDOW) {
+            connection_error(conn, increment == 0 ? H2_PROTOCOL_ERROR : H2_FLOW_CONTROL_ERROR);
+        }
+        return;
+    }
+
+    stream = find_stream(session, stream_id);
+    if (!stream || stream->state != H2_STREAM_SENDING) {
+        return;     // Nothing left to send on it
+    }
+    stream->send_window += increment;
+    if (increment == 0 || stream->send_window > H2_MAX_WINDOW) {
+        send_rst_stream(conn, stream_id, increment == 0 ? H2_PROTOCOL_ERROR : H2_FLOW_CONTROL_ERROR);
+        stream->remote_closed = 1;
+        stream->state = H2_STREAM_DONE;
+    }
+}
+
+static void handle_frame(connection *conn, int type, int flags, uint32_t stream_id,
+                         const unsigned char *payload, size_t length) {
+    struct h2_session *session = conn->h2;
+
+    // A header block must arrive in one piece - nothing else in between
+    if (session->continuation != (type == FRAME_CONTINUATION) ||
+        (session->continuation && stream_id != session->header_stream)) {
+        connection_error(conn, H2_PROTOCOL_ERROR);
+        return;
+    }
+    // The client's preface ends with its SETTINGS frame
+    if (!session->settings_received && (type != FRAME_SETTINGS || (flags & FLAG_ACK))) {
+        connection_error(conn, H2_PROTOCOL_ERROR);
+        return;
+    }
+
+    switch (type) {
+    case FRAME_DATA:
+        on_data(conn, flags, stream_id, payload, length);
+        break;
+    case FRAME_HEADERS:
+        on_headers(conn, flags, stream_id, payload, length);
+        break;
+    case FRAME_PRIORITY:
+        if (stream_id == 0) {
+            connection_error(conn, H2_PROTOCOL_ERROR);
+        } else if (length != 5) {
+            send_rst_stream(conn, stream_id, H2_FRAME_SIZE_ERROR);
+        }
+        break;      // Advisory - ignored
+    case FRAME_RST_STREAM:
+        on_rst_stream(conn, stream_id, length);
+        break;
+    case FRAME_SETTINGS:
+        on_settings(conn, flags, stream_id, payload, length);
+        break;
+    case FRAME_PUSH_PROMISE:
+        connection_error(conn, H2_PROTOCOL_ERROR);  // Only servers push
+        break;
+    case FRAME_PING:
+        on_ping(conn, flags, stream_id, payload, length);
+        break;
+    case FRAME_GOAWAY:
+        if (stream_id != 0 || length < 8) {
+            connection_error(conn, H2_PROTOCOL_ERROR);
+        } else {
+            session->goaway_received = 1;   // Finish what we have, then close
+        }
+        break;
+    case FRAME_WINDOW_UPDATE:
+        on_window_update(conn, stream_id, payload, length);
+        break;
+    case FRAME_CONTINUATION:
+        on_continuation(conn, flags, payload, length);
+        break;
+    default:
+        break;      // Unknown frame types must be ignored
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Sending DATA
+// -----------------------------------------------------------------------------
+
+/*
+ * FUNCTION: refill_stream
+ * PURPOSE: The last piece of a streamed body is sent: make the next one
+ * RETURNS: 1 if there is one (or the body is complete), -1 if it failed,
+ *          STREAM_WAIT if fill has nothing yet
+ */
+static int refill_stream(connection *conn, struct h2_stream *stream) {
+    int bytes;
+
+    if (!stream->stream_buffer) {
+        stream->stream_buffer = pool_get(&conn->worker->record_pool);
+        if (!stream->stream_buffer) {
+            perror("Unable to allocate stream buffer");
+            stream_abort(&stream->streamer);
+            return -1;
+        }
+    }
+    bytes = stream->streamer.fill(stream->streamer.state, stream->stream_buffer, TLS_RECORD_SIZE);
+    if (bytes == STREAM_WAIT) {
+        return STREAM_WAIT;
+    }
+    if (bytes <= 0) {
+        stream->streamer.fill = NULL;   // Over - it has freed its state
+        return bytes < 0 ? -1 : 1;
+    }
+    stream->stream_start = 0;
+    stream->stream_end = (size_t)bytes;
+    return 1;
+}
+
+/*
+ * FUNCTION: reset_streamed
+ * PURPOSE: A streamed answer failed: stop it and reset its stream
+ * RETURNS: 1 (a frame was queued)
+ */
+static int reset_streamed(connection *conn, struct h2_stream *stream) {
+    stream_abort(&stream->streamer);
+    send_rst_stream(conn, stream->id, H2_INTERNAL_ERROR);
+    stream->state = H2_STREAM_DONE;
+    return 1;
+}
+
+/*
+ * FUNCTION: queue_head
+ * PURPOSE: Translate the head of a deferred answer once fill has made it
+ * RETURNS: 1 if a frame was queued, 0 if fill has nothing yet
+ */
+static int queue_head(connection *conn, struct h2_stream *stream) {
+    struct output_queue answer;
+    char *end;
+    int bytes;
+
+    if (!stream->stream_buffer) {
+        stream->stream_buffer = pool_get(&conn->worker->record_pool);
+        if (!stream->stream_buffer) {
+            perror("Unable to allocate stream buffer");
+            return reset_streamed(conn, stream);
+        }
+    }
+    bytes = stream->streamer.fill(stream->streamer.state, stream->stream_buffer,
+                                  TLS_RECORD_SIZE - STREAM_HEAD_END);
+    if (bytes == STREAM_WAIT) {
+        return 0;
+    }
+    stream->streamer.head = 0;
+    if (bytes <= 0) {
+        stream->streamer.fill = NULL;   // It has freed its state
+        return reset_streamed(conn, stream);
+    }
+
+    // Back into HTTP/1.1 form - the length is worth passing on, the rest of
+    // the framing is for DATA frames to say
+    end = stream->stream_buffer + bytes;
+    if (!stream->streamer.bodyless && stream->streamer.length != STREAM_LENGTH_UNKNOWN) {
+        end += snprintf(end, STREAM_HEAD_END, "Content-Length: %llu\r\n",
+                        (unsigned long long)stream->streamer.length);
+    }
+    memcpy(end, "\r\n", 2);
+    end += 2;
+    output_init(&answer);
+    output_push(&answer, stream->stream_buffer, (size_t)(end - stream->stream_buffer));
+    if (translate_answer(conn, stream, &answer) < 0) {
+        return reset_streamed(conn, stream);
+    }
+    return 1;
+}
+
+/*
+ * FUNCTION: queue_data
+ * PURPOSE: Queue one DATA frame of a stream's body, as far as the windows allow
+ * RETURNS: 1 if a frame was queued, 0 if the stream has to wait (for a
+ *          window, or for the end of the request)
+ * WHY: Our END_STREAM waits until the client has ended its request. The
+ *      body is dropped, but answering "early" would make some clients (curl)
+ *      stop uploading and abandon the response - so the answer goes out right
+ *      away and only the final empty DATA frame waits for the upload.
+ *      A streamed body is made on demand: only when the windows are open,
+ *      and the previous piece is out of the output queue.
+ */
+static int queue_data(connection *conn, struct h2_stream *stream) {
+    struct h2_session *session = conn->h2;
+    size_t memory = stream->body_end - stream->body_start;
+    size_t piece = stream->stream_end - stream->stream_start;
+    uint64_t remaining = memory + stream->file_remaining + piece;
+    int64_t allowed = session->send_window < stream->send_window ? session->send_window : stream->send_window;
+    size_t chunk = 0;
+    unsigned char *header;
+    int flags, result;
+
+    if (stream->streamer.head) {
+        return queue_head(conn, stream);    // HEADERS aren't flow-controlled
+    }
+    if (allowed > (int64_t)session->peer_max_frame) {
+        allowed = session->peer_max_frame;
+    }
+    if (remaining == 0 && stream->streamer.fill) {
+        if (stream->stream_queued || allowed <= 0) {
+            return 0;
+        }
+        result = refill_stream(conn, stream);
+        if (result == STREAM_WAIT) {
+            return 0;
+        }
+        if (result < 0) {
+            return reset_streamed(conn, stream);
+        }
+        piece = remaining = stream->stream_end - stream->stream_start;
+    }
+    if (remaining == 0 ? !stream->remote_closed || stream->streamer.fill : allowed <= 0) {
+        return 0;
+    }
+    if (remaining > 0) {
+        chunk = remaining < (uint64_t)allowed ? (size_t)remaining : (size_t)allowed;
+        if (memory > 0 && chunk > memory) {
+            chunk = memory;     // One frame doesn't mix memory and file bytes
+        }
+    }
+    flags = chunk == remaining && stream->remote_closed && !stream->streamer.fill ? FLAG_END_STREAM : 0;
+
+    header = arena_alloc(&conn->output.arena, H2_FRAME_HEADER, 1);
+    write_frame_header(header, chunk, FRAME_DATA, flags, stream->id);
+    output_push(&conn->output, header, H2_FRAME_HEADER);
+
+    if (memory > 0) {
+        output_push(&conn->output, stream->buffer + stream->body_start, chunk);
+        stream->body_start += chunk;
+    } else if (piece > 0) {
+        output_push(&conn->output, stream->stream_buffer + stream->stream_start, chunk);
+        stream->stream_start += chunk;
+        stream->stream_queued = 1;
+    } else if (chunk > 0) {
+        // The stream keeps the file open (or cached) until the queue has sent this
+        if (stream->file.data) {
+            output_push_cached(&conn->output, stream->file.data, stream->file.offset, chunk, NULL);
+        } else {
+            output_push_file_ref(&conn->output, stream->file.fd, stream->file.offset, chunk);
+        }
+        stream->file.offset += (off_t)chunk;
+        stream->file_remaining -= chunk;
+    }
+
+    session->send_window -= (int64_t)chunk;
+    stream->send_window -= (int64_t)chunk;
+    if (flags & FLAG_END_STREAM) {
+        stream->state = H2_STREAM_DONE;
+    }
+    return 1;
+}
+
+/*
+ * FUNCTION: pump_data
+ * PURPOSE: Queue DATA frames for all sending streams, one frame per stream
+ *          in turn, so one big download doesn't hold up the small ones
+ */
+static void pump_data(connection *conn) {
+    struct h2_session *session = conn->h2;
+    int progress = 1;
+
+    while (progress) {
+        int i;
+
+        progress = 0;
+        for (i = 0; i < H2_MAX_STREAMS; i++) {
+            int slot = (session->next_stream + i) % H2_MAX_STREAMS;
+            struct h2_stream *stream = &session->streams[slot];
+
+            if (stream->state != H2_STREAM_SENDING) {
+                continue;
+            }
+            // DATA header + body part + a reset, and not too much at once
+            if (conn->output.length >= H2_SEND_BATCH ||
+                !output_has_room(&conn->output, 3, H2_FRAME_HEADER * 2 + 4)) {
+                session->next_stream = slot;    // It goes first next time
+                return;
+            }
+            progress |= queue_data(conn, stream);
+        }
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Session API
+// -----------------------------------------------------------------------------
+
+int h2_session_start(connection *conn) {
+    struct h2_session *session = pool_get(&conn->worker->h2_pool);
+    unsigned char *settings;
+    int i;
+
+    if (!session) {
+        perror("Unable to allocate HTTP/2 session");
+        return -1;
+    }
+
+    // From the pool and NOT zeroed - set every field that is read before written
+    hpack_table_init(&session->decoder);
+    hpack_table_init(&session->encoder);
+    session->preface_received = 0;
+    session->settings_received = 0;
+    session->peer_max_frame = H2_MAX_FRAME;
+    session->peer_initial_window = H2_WINDOW;
+    session->send_window = H2_WINDOW;
+    session->recv_window = H2_WINDOW;
+    session->last_stream_id = 0;
+    session->goaway_sent = 0;
+    session->goaway_received = 0;
+    session->failed = 0;
+    session->active_streams = 0;
+    session->next_stream = 0;
+    session->continuation = 0;
+    session->header_block_length = 0;
+    session->input_start = 0;
+    session->input_length = 0;
+    for (i = 0; i < H2_MAX_STREAMS; i++) {
+        session->streams[i].state = H2_STREAM_FREE;
+        session->streams[i].file.fd = -1;
+        session->streams[i].file.hold = NULL;
+    }
+    conn->h2 = session;
+
+    // Our connection preface: the SETTINGS that differ from the defaults
+    settings = queue_frame(conn, 12, FRAME_SETTINGS, 0, 0);
+    settings[0] = 0;
+    settings[1] = SETTINGS_MAX_CONCURRENT_STREAMS;
+    write_u32(settings + 2, H2_MAX_STREAMS);
+    settings[6] = 0;
+    settings[7] = SETTINGS_MAX_HEADER_LIST_SIZE;
+    write_u32(settings + 8, (uint32_t)config.max_header_size);
+    return 0;
+}
+
+size_t h2_input_space(struct h2_session *session, char **dest) {
+    // Move the unfinished frame to the front - a whole frame always fits
+    if (session->input_start > 0) {
+        session->input_length -= session->input_start;
+        memmove(session->input, session->input + session->input_start, session->input_length);
+        session->input_start = 0;
+    }
+    *dest = (char *)session->input + session->input_length;
+    return sizeof(session->input) - session->input_length;
+}
+
+void h2_input_received(struct h2_session *session, size_t bytes) {
+    session->input_length += bytes;
+}
+
+int h2_process(connection *conn) {
+    struct h2_session *session = conn->h2;
+
+    if (conn->output.length == 0) {
+        reclaim_streams(conn);   // Nothing queued refers to finished streams now
+    }
+
+    while (!session->failed) {
+        const unsigned char *frame = session->input + session->input_start;
+        size_t available = session->input_length - session->input_start;
+        size_t length;
+
+        if (!session->preface_received) {
+            if (available < CLIENT_PREFACE_LENGTH) {
+                break;
+            }
+            if (memcmp(frame, client_preface, CLIENT_PREFACE_LENGTH) != 0) {
+                return -1;  // Not HTTP/2 at all
+            }
+            session->preface_received = 1;
+            session->input_start += CLIENT_PREFACE_LENGTH;
+            continue;
+        }
+
+        // Whatever the frame, its answer must fit - else send first, come back
+        if (available < H2_FRAME_HEADER ||
+            !output_has_room(&conn->output, H2_FRAME_PARTS, H2_FRAME_SCRATCH)) {
+            break;
+        }
+        length = (size_t)frame[0] << 16 | (size_t)frame[1] << 8 | frame[2];
+        if (length > H2_MAX_FRAME) {
+            connection_error(conn, H2_FRAME_SIZE_ERROR);
+            break;
+        }
+        if (available < H2_FRAME_HEADER + length) {
+            break;
+        }
+        session->input_start += H2_FRAME_HEADER + length;
+        handle_frame(conn, frame[3], frame[4], read_u32(frame + 5) & 0x7fffffff,
+                     frame + H2_FRAME_HEADER, length);
+    }
+
+    if (!session->failed) {
+        pump_data(conn);
+    }
+    return 0;
+}
+
+void h2_drain(connection *conn) {
+    if (!conn->h2->goaway_sent && !conn->h2->failed) {
+        send_goaway(conn, H2_NO_ERROR);
+    }
+}
+
+int h2_finished(const struct h2_session *session) {
+    return session->failed ||
+           ((session->goaway_sent || session->goaway_received) && session->active_streams == 0);
+}
+
+int h2_waiting(const struct h2_session *session) {
+    int i;
+
+    for (i = 0; i < H2_MAX_STREAMS; i++) {
+        if (session->streams[i].state == H2_STREAM_SENDING && session->streams[i].streamer.fill) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void h2_session_end(connection *conn) {
+    struct h2_session *session = conn->h2;
+    int i;
+
+    for (i = 0; i < H2_MAX_STREAMS; i++) {
+        if (session->streams[i].state != H2_STREAM_FREE) {
+            free_stream(conn, &session->streams[i]);
+        }
+    }
+    pool_put(&conn->worker->h2_pool, session);
+    conn->h2 = NULL;
+}
@@ -0,0 +1,598 @@
+/*
+ * =============================================================================
+ * HTTP PARSER IMPLEMENTATION
+ * =============================================================================
+ * Each state looks for the delimiter that ends its token (space, '?', ':' or
+ * end of line) with scan3(), which checks 16-32 bytes per step (see scan.h).
+ * When the delimiter hasn't arrived yet we remember the state and return
+ * INCOMPLETE; the next call continues from exactly that byte.
+ * =============================================================================
+ */
+
+#include <string.h>     // strlen, memchr, memmove
+#include <strings.h>    // strncasecmp
+
+#include "http_parser.h"
+#include "scan.h"       // scan3: SIMD search for the next delimiter
+
+enum parser_state {
+    S_START,            // Skipping stray blank lines before the request
+    S_METHOD,           // In "GET"
+    S_TARGET,           // In "/search"
+    S_QUERY,            // In "q=tiny" (after '?')
+    S_VERSION,          // In "HTTP/1.1"
+    S_HEADER_START,     // At the beginning of a header line (or blank line)
+    S_HEADER_NAME,      // In "Host"
+    S_HEADER_VALUE,     // In "example.com"
+    S_HEADERS_END,      // Saw '\r' of the final blank line, need '\n'
+    S_DONE
+};
+
+/*
+ * FUNCTION: is_token_char
+ * PURPOSE: Characters allowed in methods and header names (RFC 7230 "tchar")
+ */
+static int is_token_char(unsigned char ch) {
+    if (ch >= 'a' && ch <= 'z') return 1;
+    if (ch >= 'A' && ch <= 'Z') return 1;
+    if (ch >= '0' && ch <= '9') return 1;
+    return ch != '\0' && strchr("!#$%&'*+-.^_`|~", ch) != NULL;
+}
+
+static int is_token(const char *data, size_t start, size_t end) {
+    if (start == end) {
+        return 0;
+    }
+    for (; start < end; start++) {
+        if (!is_token_char((unsigned char)data[start])) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * FUNCTION: has_control_chars
+ * PURPOSE: Reject raw control bytes in the request target
+ */
+static int has_control_chars(const char *data, size_t start, size_t end) {
+    for (; start < end; start++) {
+        unsigned char ch = (unsigned char)data[start];
+        if (ch < 0x21 || ch == 0x7f) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * FUNCTION: is_field_value
+ * PURPOSE: Header values may hold visible characters, blanks and obs-text,
+ *          but no control bytes except HTAB (RFC 9110 field-vchar)
+ * WHY: A bare CR or NUL passed on unchanged - to a backend by the proxy,
+ *      into the access log - can end a header line where we didn't
+ */
+static int is_field_value(const char *data, size_t start, size_t end) {
+    for (; start < end; start++) {
+        unsigned char ch = (unsigned char)data[start];
+        if ((ch < 0x20 && ch != '\t') || ch == 0x7f) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static struct http_slice make_slice(size_t start, size_t end) {
+    struct http_slice slice;
+    slice.offset = (uint32_t)start;
+    slice.length = (uint32_t)(end - start);
+    return slice;
+}
+
+void http_parser_init(struct http_request *request) {
+    // Only the bookkeeping needs resetting - results are written before use
+    request->state = S_START;
+    request->position = 0;
+    request->mark = 0;
+    request->header_count = 0;
+    request->query.offset = 0;
+    request->query.length = 0;
+    request->error = HTTP_ERROR_NONE;
+}
+
+static enum http_parse_result fail(struct http_request *request, enum http_parse_error error) {
+    request->error = error;
+    return HTTP_PARSE_ERROR;
+}
+
+static int name_is(const char *data, const struct http_header *header, const char *name, size_t length) {
+    return header->name.length == length && strncasecmp(data + header->name.offset, name, length) == 0;
+}
+
+/*
+ * FUNCTION: find_framing
+ * PURPOSE: Work out how the body after the headers is delimited
+ * RETURNS: HTTP_ERROR_NONE, or why the request can't be taken
+ * WHY: An ambiguous length is how request smuggling works - a proxy in
+ *      front of us and we would disagree where the request ends and the
+ *      next one begins. So Content-Length together with Transfer-Encoding,
+ *      or two different lengths, are refused instead of guessed.
+ */
+static enum http_parse_error find_framing(struct http_request *request, const char *data) {
+    const struct http_header *encoding = NULL;
+    int i, lengths = 0, encodings = 0;
+
+    request->body = HTTP_BODY_NONE;
+    request->content_length = 0;
+
+    for (i = 0; i < request->header_count; i++) {
+        const struct http_header *header = &request->headers[i];
+
+        if (name_is(data, header, "Content-Length", 14)) {
+            const char *digit = data + header->value.offset;
+            uint64_t value = 0;
+            uint32_t n;
+
+            if (header->value.length == 0 || header->value.length > 19) {
+                return HTTP_ERROR_BAD_REQUEST;      // 19 digits can't overflow
+            }
+            for (n = 0; n < header->value.length; n++) {
+                if (digit[n] < '0' || digit[n] > '9') {
+                    return HTTP_ERROR_BAD_REQUEST;
+                }
+                value = value * 10 + (uint64_t)(digit[n] - '0');
+            }
+            if (lengths++ > 0 && value != request->content_length) {
+                return HTTP_ERROR_BAD_REQUEST;
+            }
+            request->content_length = value;
+        } else if (name_is(data, header, "Transfer-Encoding", 17)) {
+            encoding = header;
+            encodings++;
+        }
+    }
+
+    if (encodings > 0) {
+        if (lengths > 0) {
+            return HTTP_ERROR_BAD_REQUEST;
+        }
+        // Only plain "chunked" - a compressed upload (gzip, chunked) isn't for us to undo
+        if (encodings > 1 || encoding->value.length != 7 ||
+            strncasecmp(data + encoding->value.offset, "chunked", 7) != 0) {
+            return HTTP_ERROR_NOT_IMPLEMENTED;
+        }
+        request->content_length = 0;
+        request->body = HTTP_BODY_CHUNKED;
+    } else if (request->content_length > 0) {
+        request->body = HTTP_BODY_LENGTH;
+    }
+    return HTTP_ERROR_NONE;
+}
+
+enum http_parse_result http_parse(struct http_request *request, const char *data,
+                                  size_t length, const struct http_limits *limits) {
+    size_t end = length;
+    size_t pos = request->position;
+    size_t found;
+
+    if (request->state == S_DONE) {
+        return HTTP_PARSE_DONE;
+    }
+    if (request->error != HTTP_ERROR_NONE) {
+        return HTTP_PARSE_ERROR;
+    }
+
+    // Never look past the header size limit
+    if (end > limits->max_header_size) {
+        end = limits->max_header_size;
+    }
+
+    while (pos < end) {
+        switch (request->state) {
+        case S_START:
+            // Clients may send an extra CRLF after a request body - skip it
+            if (data[pos] == '\r' || data[pos] == '\n') {
+                pos++;
+                break;
+            }
+            request->mark = pos;
+            request->state = S_METHOD;
+            break;
+
+        case S_METHOD:
+            found = scan3(data, pos, end, ' ', '\n', '\n');
+            if (found == end) {
+                pos = end;
+                break;
+            }
+            if (data[found] != ' ' || !is_token(data, request->mark, found)) {
+                return fail(request, HTTP_ERROR_BAD_REQUEST);
+            }
+            request->method = make_slice(request->mark, found);
+            pos = found + 1;
+            request->mark = pos;
+            request->state = S_TARGET;
+            break;
+
+        case S_TARGET:
+            found = scan3(data, pos, end, ' ', '?', '\n');
+            if (found == end) {
+                pos = end;
+                break;
+            }
+            if (data[found] == '\n' || found == request->mark ||
+                has_control_chars(data, request->mark, found)) {
+                return fail(request, HTTP_ERROR_BAD_REQUEST);
+            }
+            request->path = make_slice(request->mark, found);
+            pos = found + 1;
+            request->mark = pos;
+            request->state = data[found] == '?' ? S_QUERY : S_VERSION;
+            break;
+
+        case S_QUERY:
+            found = scan3(data, pos, end, ' ', '\n', '\n');
+            if (found == end) {
+                pos = end;
+                break;
+            }
+            if (data[found] != ' ' || has_control_chars(data, request->mark, found)) {
+                return fail(request, HTTP_ERROR_BAD_REQUEST);
+            }
+            request->query = make_slice(request->mark, found);
+            pos = found + 1;
+            request->mark = pos;
+            request->state = S_VERSION;
+            break;
+
+        case S_VERSION: {
+            size_t version_end;
+
+            found = scan3(data, pos, end, '\n', '\n', '\n');
+            if (found == end) {
+                pos = end;
+                break;
+            }
+            version_end = found;
+            if (version_end > request->mark && data[version_end - 1] == '\r') {
+                version_end--;
+            }
+            // Only "HTTP/1.0" and "HTTP/1.1" are understood
+            if (version_end - request->mark != 8 ||
+                strncmp(data + request->mark, "HTTP/1.", 7) != 0 ||
+                (data[request->mark + 7] != '0' && data[request->mark + 7] != '1')) {
+                return fail(request, HTTP_ERROR_BAD_REQUEST);
+            }
+            request->version = make_slice(request->mark, version_end);
+            request->minor_version = data[request->mark + 7] - '0';
+            pos = found + 1;
+            request->state = S_HEADER_START;
+            break;
+        }
+
+        case S_HEADER_START:
+            if (data[pos] == '\r') {
+                pos++;
+                request->state = S_HEADERS_END;
+                break;
+            }
+            if (data[pos] == '\n') {
+                pos++;
+                request->state = S_DONE;
+                break;
+            }
+            if (data[pos] == ' ' || data[pos] == '\t') {
+                // Obsolete line folding - RFC 7230 lets servers reject it
+                return fail(request, HTTP_ERROR_BAD_REQUEST);
+            }
+            if (request->header_count >= limits->max_headers) {
+                return fail(request, HTTP_ERROR_TOO_LARGE);
+            }
+            request->mark = pos;
+            request->state = S_HEADER_NAME;
+            break;
+
+        case S_HEADER_NAME:
+            found = scan3(data, pos, end, ':', '\n', '\n');
+            if (found == end) {
+                pos = end;
+                break;
+            }
+            // No whitespace allowed between the name and the colon
+            if (data[found] != ':' || !is_token(data, request->mark, found)) {
+                return fail(request, HTTP_ERROR_BAD_REQUEST);
+            }
+            request->headers[request->header_count].name = make_slice(request->mark, found);
+            pos = found + 1;
+            request->mark = pos;
+            request->state = S_HEADER_VALUE;
+            break;
+
+        case S_HEADER_VALUE: {
+            size_t value_start = request->mark;
+            size_t value_end;
+
+            found = scan3(data, pos, end, '\n', '\n', '\n');
+            if (found == end) {
+                pos = end;
+                break;
+            }
+            // Drop the line's '\r', then optional whitespace around the value
+            value_end = found;
+            if (value_end > value_start && data[value_end - 1] == '\r') {
+                value_end--;
+            }
+            while (value_start < value_end && (data[value_start] == ' ' || data[value_start] == '\t')) {
+                value_start++;
+            }
+            while (value_end > value_start && (data[value_end - 1] == ' ' || data[value_end - 1] == '\t')) {
+                value_end--;
+            }
+            if (!is_field_value(data, value_start, value_end)) {
+                return fail(request, HTTP_ERROR_BAD_REQUEST);
+            }
+            request->headers[request->header_count].value = make_slice(value_start, value_end);
+            request->header_count++;
+            pos = found + 1;
+            request->state = S_HEADER_START;
+            break;
+        }
+
+        case S_HEADERS_END:
+            if (data[pos] != '\n') {
+                return fail(request, HTTP_ERROR_BAD_REQUEST);
+            }
+            pos++;
+            request->state = S_DONE;
+            break;
+        }
+
+        if (request->state == S_DONE) {
+            enum http_parse_error error = find_framing(request, data);
+
+            if (error != HTTP_ERROR_NONE) {
+                return fail(request, error);
+            }
+            request->position = pos;
+            request->header_length = pos;
+            return HTTP_PARSE_DONE;
+        }
+    }
+
+    request->position = pos;
+
+    // Limit reached and still no blank line - the headers are too big
+    if (end < length || end == limits->max_header_size) {
+        return fail(request, HTTP_ERROR_TOO_LARGE);
+    }
+    return HTTP_PARSE_INCOMPLETE;
+}
+
+const struct http_header *http_find_header(const struct http_request *request,
+                                           const char *data, const char *name) {
+    size_t name_length = strlen(name);
+    int i;
+
+    for (i = 0; i < request->header_count; i++) {
+        const struct http_header *header = &request->headers[i];
+        if (header->name.length == name_length &&
+            strncasecmp(data + header->name.offset, name, name_length) == 0) {
+            return header;
+        }
+    }
+    return NULL;
+}
+
+int http_header_has_token(const struct http_request *request, const char *data,
+                          const char *name, const char *token) {
+    size_t token_length = strlen(token);
+    int i;
+
+    // A header may appear several times - check every occurrence
+    for (i = 0; i < request->header_count; i++) {
+        const struct http_header *header = &request->headers[i];
+        const char *value = data + header->value.offset;
+        size_t remaining = header->value.length;
+
+        if (strlen(name) != header->name.length ||
+            strncasecmp(data + header->name.offset, name, header->name.length) != 0) {
+            continue;
+        }
+
+        // Walk the comma-separated list: "keep-alive, Upgrade"
+        while (remaining > 0) {
+            size_t item = 0;
+
+            while (remaining > 0 && (*value == ' ' || *value == '\t' || *value == ',')) {
+                value++;
+                remaining--;
+            }
+            while (item < remaining && value[item] != ',') {
+                item++;
+            }
+            while (item > 0 && (value[item - 1] == ' ' || value[item - 1] == '\t')) {
+                item--;
+            }
+            if (item == token_length && strncasecmp(value, token, token_length) == 0) {
+                return 1;
+            }
+            while (remaining > 0 && *value != ',') {
+                value++;
+                remaining--;
+            }
+        }
+    }
+    return 0;
+}
+
+int http_valid_token(const char *data, size_t length) {
+    return is_token(data, 0, length);
+}
+
+int http_valid_target(const char *data, size_t length) {
+    return !has_control_chars(data, 0, length);
+}
+
+int http_valid_field_value(const char *data, size_t length) {
+    return is_field_value(data, 0, length);
+}
+
+// -----------------------------------------------------------------------------
+// Chunked bodies
+// -----------------------------------------------------------------------------
+
+enum chunked_state {
+    C_SIZE,             // In the hex chunk size
+    C_EXTENSION,        // After "size;" - skipped up to the end of the line
+    C_SIZE_LF,          // Saw '\r' after the size, need '\n'
+    C_DATA,             // In the chunk's bytes
+    C_DATA_CR,          // Need the CRLF that ends the chunk
+    C_DATA_LF,
+    C_TRAILER_START,    // At the beginning of a trailer line (or the blank line)
+    C_TRAILER,          // In a trailer line - skipped
+    C_END_LF,           // Saw '\r' of the final blank line, need '\n'
+    C_DONE
+};
+
+static int hex_value(char ch) {
+    if (ch >= '0' && ch <= '9') return ch - '0';
+    if (ch >= 'a' && ch <= 'f') return ch - 'a' + 10;
+    if (ch >= 'A' && ch <= 'F') return ch - 'A' + 10;
+    return -1;
+}
+
+void http_chunked_init(struct http_chunked *chunked) {
+    chunked->state = C_SIZE;
+    chunked->remaining = 0;
+    chunked->digits = 0;
+}
+
+/*
+ * FUNCTION: size_line_done
+ * PURPOSE: The chunk size line is over - data follows, or the end of the body
+ */
+static void size_line_done(struct http_chunked *chunked) {
+    chunked->state = chunked->remaining > 0 ? C_DATA : C_TRAILER_START;
+}
+
+enum http_parse_result http_chunked_decode(struct http_chunked *chunked, char *data, size_t length,
+                                           size_t *used, size_t *decoded) {
+    size_t pos = 0, out = 0;
+
+    while (pos < length && chunked->state != C_DONE) {
+        char ch = data[pos];
+
+        switch (chunked->state) {
+        case C_SIZE: {
+            int digit = hex_value(ch);
+
+            if (digit >= 0) {
+                // 16 hex digits fill a uint64_t
+                if (chunked->digits++ == 16) {
+                    return HTTP_PARSE_ERROR;
+                }
+                chunked->remaining = chunked->remaining * 16 + (uint64_t)digit;
+                pos++;
+                break;
+            }
+            if (chunked->digits == 0) {
+                return HTTP_PARSE_ERROR;
+            }
+            pos++;
+            if (ch == ';' || ch == ' ' || ch == '\t') {
+                chunked->state = C_EXTENSION;
+            } else if (ch == '\r') {
+                chunked->state = C_SIZE_LF;
+            } else if (ch == '\n') {
+                size_line_done(chunked);
+            } else {
+                return HTTP_PARSE_ERROR;
+            }
+            break;
+        }
+
+        case C_EXTENSION: {
+            const char *end = memchr(data + pos, '\n', length - pos);
+
+            if (!end) {
+                pos = length;
+                break;
+            }
+            pos = (size_t)(end - data) + 1;
+            size_line_done(chunked);
+            break;
+        }
+
+        case C_SIZE_LF:
+            if (ch != '\n') {
+                return HTTP_PARSE_ERROR;
+            }
+            pos++;
+            size_line_done(chunked);
+            break;
+
+        case C_DATA: {
+            size_t take = length - pos;
+
+            if (take > chunked->remaining) {
+                take = (size_t)chunked->remaining;
+            }
+            // Decoded bytes never get ahead of the input, so this is safe in place
+            memmove(data + out, data + pos, take);
+            out += take;
+            pos += take;
+            chunked->remaining -= take;
+            if (chunked->remaining == 0) {
+                chunked->state = C_DATA_CR;
+            }
+            break;
+        }
+
+        case C_DATA_CR:
+            if (ch != '\r' && ch != '\n') {
+                return HTTP_PARSE_ERROR;
+            }
+            pos++;
+            chunked->state = ch == '\r' ? C_DATA_LF : C_SIZE;
+            chunked->digits = 0;
+            break;
+
+        case C_DATA_LF:
+            if (ch != '\n') {
+                return HTTP_PARSE_ERROR;
+            }
+            pos++;
+            chunked->state = C_SIZE;
+            break;
+
+        case C_TRAILER_START:
+            pos++;
+            chunked->state = ch == '\r' ? C_END_LF : ch == '\n' ? C_DONE : C_TRAILER;
+            break;
+
+        case C_TRAILER: {
+            const char *end = memchr(data + pos, '\n', length - pos);
+
+            if (!end) {
+                pos = length;
+                break;
+            }
+            pos = (size_t)(end - data) + 1;
+            chunked->state = C_TRAILER_START;
+            break;
+        }
+
+        case C_END_LF:
+            if (ch != '\n') {
+                return HTTP_PARSE_ERROR;
+            }
+            pos++;
+            chunked->state = C_DONE;
+            break;
+        }
+    }
+
+    *used = pos;
+    *decoded = out;
+    return chunked->state == C_DONE ? HTTP_PARSE_DONE : HTTP_PARSE_INCOMPLETE;
+}
@@ -0,0 +1,394 @@
+/*
+ * =============================================================================
+ * METRICS IMPLEMENTATION - REGISTRY, HISTOGRAMS, PROMETHEUS ADMIN ENDPOINT
+ * =============================================================================
+ */
+
+#include <errno.h>          // errno
+#include <stdio.h>          // snprintf, vsnprintf, perror
+#include <stdarg.h>         // va_list
+#include <stddef.h>         // offsetof
+#include <stdlib.h>         // malloc, realloc, posix_memalign, free
+#include <string.h>         // memset, strncmp, strerror
+#include <unistd.h>         // read, write, close
+#include <fcntl.h>          // fcntl, FD_CLOEXEC
+#include <time.h>           // clock_gettime, nanosleep
+#include <pthread.h>        // pthread_create, pthread_detach
+#include <sys/socket.h>     // socket, bind, listen, accept
+#include <sys/time.h>       // struct timeval
+#include <netinet/in.h>     // sockaddr_in
+#include <arpa/inet.h>      // inet_pton
+
+#include "config.h"
+#include "metrics.h"
+
+// Upper bounds of the latency buckets, in microseconds (100 us .. 5 s)
+static const uint64_t bucket_bounds[METRICS_BUCKETS] = {
+    100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000,
+    100000, 250000, 500000, 1000000, 2500000, 5000000
+};
+
+static const char *const failure_names[HANDSHAKE_FAILURE_REASONS] = {
+    "certificate", "protocol", "closed", "timeout", "other"
+};
+
+static const char *const rejection_names[REJECTION_REASONS] = {
+    "limit", "handshakes", "descriptors"
+};
+
+// One block per worker, filled in before any thread reads it
+static struct metrics *registered[MAX_WORKERS];
+static int registered_count;
+
+#define ADMIN_RETRY_MS 100          // Pause after accept() fails for want of descriptors or memory
+
+static int listen_fd = -1;
+
+struct metrics *metrics_create(void) {
+    struct metrics *metrics;
+
+    if (registered_count == MAX_WORKERS) {
+        return NULL;
+    }
+    // sizeof() is already a multiple of the cache line (aligned attribute),
+    // so the block's end doesn't share a line with whatever comes next
+    if (posix_memalign((void **)&metrics, METRICS_CACHE_LINE, sizeof(*metrics)) != 0) {
+        return NULL;
+    }
+    memset(metrics, 0, sizeof(*metrics));
+    registered[registered_count++] = metrics;
+    return metrics;
+}
+
+void metrics_observe(struct metrics_histogram *histogram, uint64_t microseconds) {
+    int i = 0;
+
+    // 15 compares at most, usually a handful - cheaper than anything clever
+    while (i < METRICS_BUCKETS && microseconds > bucket_bounds[i]) {
+        i++;
+    }
+    metric_add(&histogram->buckets[i], 1);
+    metric_add(&histogram->sum_us, microseconds);
+    metric_add(&histogram->count, 1);
+}
+
+const char *metrics_failure_name(enum handshake_failure reason) {
+    return failure_names[reason];
+}
+
+uint64_t metrics_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+// -----------------------------------------------------------------------------
+// Scraping
+// -----------------------------------------------------------------------------
+
+/*
+ * STRUCT: text
+ * PURPOSE: Growing buffer for the exposition text
+ */
+struct text {
+    char *data;
+    size_t length;
+    size_t size;
+    int failed;
+};
+
+static void append(struct text *text, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+static void append(struct text *text, const char *format, ...) {
+    va_list args;
+    int written;
+
+    if (text->failed) {
+        return;
+    }
+    va_start(args, format);
+    written = vsnprintf(text->data + text->length, text->size - text->length, format, args);
+    va_end(args);
+
+    if (written >= 0 && (size_t)written >= text->size - text->length) {
+        // Didn't fit: grow and format again
+        size_t size = (text->length + (size_t)written + 1) * 2;
+        char *data = realloc(text->data, size);
+        if (!data) {
+            text->failed = 1;
+            return;
+        }
+        text->data = data;
+        text->size = size;
+        va_start(args, format);
+        written = vsnprintf(text->data + text->length, text->size - text->length, format, args);
+        va_end(args);
+    }
+    if (written < 0) {
+        text->failed = 1;
+        return;
+    }
+    text->length += (size_t)written;
+}
+
+static uint64_t read_counter(const uint64_t *counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+/*
+ * FUNCTION: sum_counter
+ * PURPOSE: Add one counter up over every worker
+ * PARAMETER: offset - offsetof(struct metrics, ...) of the counter
+ */
+static uint64_t sum_counter(size_t offset) {
+    uint64_t total = 0;
+    int i;
+
+    for (i = 0; i < registered_count; i++) {
+        total += read_counter((const uint64_t *)((const char *)registered[i] + offset));
+    }
+    return total;
+}
+
+#define SUM(field) sum_counter(offsetof(struct metrics, field))
+
+static void append_counter(struct text *text, const char *name, const char *help, uint64_t value) {
+    append(text, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n",
+           name, help, name, name, (unsigned long long)value);
+}
+
+static void append_histogram(struct text *text, const char *name, const char *help, size_t offset) {
+    uint64_t buckets[METRICS_BUCKETS + 1] = { 0 };
+    uint64_t sum_us = 0, count = 0, cumulative = 0;
+    int i, j;
+
+    for (i = 0; i < registered_count; i++) {
+        const struct metrics_histogram *histogram =
+            (const struct metrics_histogram *)((const char *)registered[i] + offset);
+        for (j = 0; j <= METRICS_BUCKETS; j++) {
+            buckets[j] += read_counter(&histogram->buckets[j]);
+        }
+        sum_us += read_counter(&histogram->sum_us);
+        count += read_counter(&histogram->count);
+    }
+
+    append(text, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+    for (j = 0; j < METRICS_BUCKETS; j++) {
+        cumulative += buckets[j];
+        append(text, "%s_bucket{le=\"%g\"} %llu\n", name, (double)bucket_bounds[j] / 1e6,
+               (unsigned long long)cumulative);
+    }
+    // Counters are read one by one while workers keep counting, so +Inf
+    // takes the largest of the totals seen to stay monotonic
+    cumulative += buckets[METRICS_BUCKETS];
+    append(text, "%s_bucket{le=\"+Inf\"} %llu\n", name,
+           (unsigned long long)(cumulative > count ? cumulative : count));
+    append(text, "%s_sum %.6f\n%s_count %llu\n", name, (double)sum_us / 1e6,
+           name, (unsigned long long)(cumulative > count ? cumulative : count));
+}
+
+/*
+ * FUNCTION: render
+ * PURPOSE: Every metric in the Prometheus text exposition format
+ */
+static void render(struct text *text) {
+    uint64_t accepts = SUM(accepts), closes = SUM(closes);
+    int i;
+
+    append_counter(text, "tinyserver_connections_accepted_total", "Connections accepted.", accepts);
+    append_counter(text, "tinyserver_connections_closed_total", "Connections closed.", closes);
+    append(text, "# HELP tinyserver_connections_open Connections currently open.\n"
+                 "# TYPE tinyserver_connections_open gauge\n"
+                 "tinyserver_connections_open %llu\n",
+           (unsigned long long)(accepts > closes ? accepts - closes : 0));
+    append(text, "# HELP tinyserver_connections_rejected_total Clients turned away at accept, by reason.\n"
+                 "# TYPE tinyserver_connections_rejected_total counter\n");
+    for (i = 0; i < REJECTION_REASONS; i++) {
+        append(text, "tinyserver_connections_rejected_total{reason=\"%s\"} %llu\n", rejection_names[i],
+               (unsigned long long)sum_counter(offsetof(struct metrics, rejected) +
+                                               (size_t)i * sizeof(uint64_t)));
+    }
+    append_counter(text, "tinyserver_request_header_timeouts_total",
+                   "Connections closed for sending request headers too slowly.", SUM(header_timeouts));
+
+    append_counter(text, "tinyserver_tls_handshakes_total", "TLS handshakes completed.", SUM(handshakes));
+    append_counter(text, "tinyserver_tls_resumed_handshakes_total",
+                   "TLS handshakes that resumed a session.", SUM(handshakes_resumed));
+    append(text, "# HELP tinyserver_tls_handshake_failures_total TLS handshakes that failed, by reason.\n"
+                 "# TYPE tinyserver_tls_handshake_failures_total counter\n");
+    for (i = 0; i < HANDSHAKE_FAILURE_REASONS; i++) {
+        append(text, "tinyserver_tls_handshake_failures_total{reason=\"%s\"} %llu\n", failure_names[i],
+               (unsigned long long)sum_counter(offsetof(struct metrics, handshake_failures) +
+                                               (size_t)i * sizeof(uint64_t)));
+    }
+    append_histogram(text, "tinyserver_tls_handshake_seconds",
+                     "Time from accept to completed TLS handshake.",
+                     offsetof(struct metrics, handshake_time));
+    append_counter(text, "tinyserver_http2_connections_total",
+                   "Connections that negotiated HTTP/2.", SUM(http2_connections));
+
+    append_counter(text, "tinyserver_received_bytes_total", "Application bytes received.", SUM(bytes_in));
+    append_counter(text, "tinyserver_sent_bytes_total", "Application bytes sent.", SUM(bytes_out));
+
+    append(text, "# HELP tinyserver_requests_total Requests answered, by protocol.\n"
+                 "# TYPE tinyserver_requests_total counter\n"
+                 "tinyserver_requests_total{protocol=\"http/1.1\"} %llu\n"
+                 "tinyserver_requests_total{protocol=\"h2\"} %llu\n",
+           (unsigned long long)SUM(requests_http1), (unsigned long long)SUM(requests_http2));
+    append_histogram(text, "tinyserver_response_seconds",
+                     "Time from a complete request to its response being sent.",
+                     offsetof(struct metrics, response_time));
+
+    append_counter(text, "tinyserver_log_records_dropped_total",
+                   "Access/error log records dropped because the log thread fell behind.",
+                   SUM(log_dropped));
+}
+
+// -----------------------------------------------------------------------------
+// Admin endpoint
+// -----------------------------------------------------------------------------
+
+static void write_all(int fd, const char *data, size_t length) {
+    while (length > 0) {
+        ssize_t bytes = write(fd, data, length);
+        if (bytes <= 0) {
+            return;     // Scraper went away - nothing to clean up
+        }
+        data += bytes;
+        length -= (size_t)bytes;
+    }
+}
+
+/*
+ * FUNCTION: answer
+ * PURPOSE: Serve one admin connection: GET /metrics or 404
+ * WHY: Blocking I/O with a timeout is fine here - this thread serves
+ *      nothing else, and a scraper connects every few seconds at most
+ */
+static void answer(int client) {
+    static const char not_found[] =
+        "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+    struct timeval timeout = { 2, 0 };
+    struct text text = { NULL, 0, 0, 0 };
+    char request[1024], head[160];
+    ssize_t bytes;
+    int head_length;
+
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    // The request line arrives in the first packet in practice
+    bytes = read(client, request, sizeof(request) - 1);
+    if (bytes <= 0) {
+        return;
+    }
+    request[bytes] = '\0';
+    if (strncmp(request, "GET /metrics ", 13) != 0 && strncmp(request, "GET /metrics?", 13) != 0) {
+        write_all(client, not_found, sizeof(not_found) - 1);
+        return;
+    }
+
+    text.size = 16384;
+    text.data = malloc(text.size);
+    text.failed = text.data == NULL;
+    render(&text);
+    if (text.failed) {
+        free(text.data);
+        return;
+    }
+
+    head_length = snprintf(head, sizeof(head),
+                           "HTTP/1.1 200 OK\r\n"
+                           "Content-Type: text/plain; version=0.0.4\r\n"
+                           "Content-Length: %zu\r\n"
+                           "Connection: close\r\n\r\n", text.length);
+    write_all(client, head, (size_t)head_length);
+    write_all(client, text.data, text.length);
+    free(text.data);
+}
+
+/*
+ * FUNCTION: admin_thread_main
+ * PURPOSE: Answer scrapes one after the other, until accept() can't go on
+ * WHY: Out of descriptors or memory is when the metrics matter most, so
+ *      that only pauses the thread (ADMIN_RETRY_MS) - retrying at once
+ *      would spin a core on the very same error
+ */
+static void *admin_thread_main(void *arg) {
+    const struct timespec pause = { 0, ADMIN_RETRY_MS * 1000000L };
+
+    (void)arg;
+
+    while (1) {
+        int client = accept(listen_fd, NULL, NULL);
+        if (client < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;   // The scraper gave up while queued
+            }
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+                nanosleep(&pause, NULL);
+                continue;
+            }
+            perror("Unable to accept on the metrics socket");
+            break;
+        }
+        answer(client);
+        close(client);
+    }
+    return NULL;
+}
+
+int metrics_socket(void) {
+    return listen_fd;
+}
+
+/*
+ * FUNCTION: open_admin_socket
+ * RETURNS: A socket listening on address:port, or -1 on failure
+ */
+static int open_admin_socket(const char *address, int port) {
+    struct sockaddr_in addr;
+    int fd, on = 1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t)port);
+    if (inet_pton(AF_INET, address, &addr.sin_addr) != 1) {
+        fprintf(stderr, "Invalid --metrics-address: %s\n", address);
+        return -1;
+    }
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("Unable to create metrics socket");
+        return -1;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);     // Handed over explicitly, never inherited
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 16) < 0) {
+        perror("Unable to listen on the metrics port");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int metrics_serve(const char *address, int port, int inherited) {
+    pthread_t thread;
+    int error;
+
+    listen_fd = inherited >= 0 ? inherited : open_admin_socket(address, port);
+    if (listen_fd < 0) {
+        return -1;
+    }
+
+    error = pthread_create(&thread, NULL, admin_thread_main, NULL);
+    if (error != 0) {
+        fprintf(stderr, "Unable to start metrics thread: %s\n", strerror(error));
+        close(listen_fd);
+        listen_fd = -1;
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
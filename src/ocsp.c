@@ -0,0 +1,657 @@
+/*
+ * =============================================================================
+ * OCSP STAPLING IMPLEMENTATION - CACHED ANSWERS AND THE REFRESH THREAD
+ * =============================================================================
+ * One "staple" per certificate: who to ask and how to name the certificate
+ * in the request (fixed), and the latest good answer (replaced by the
+ * refresh thread, copied by handshakes - under the staple's own lock, held
+ * only for a memcpy). Every SSL_CTX serving the certificate holds a
+ * reference, dropped by OpenSSL when the context is freed; so does the
+ * refresh thread while it fetches, so a reload can't pull a staple away
+ * from under it.
+ * =============================================================================
+ */
+
+#include <stdio.h>          // snprintf, fprintf, fopen
+#include <stdlib.h>         // calloc, malloc, free
+#include <string.h>         // memcmp, memcpy, memchr, strchr, strdup, strerror
+#include <time.h>           // time
+#include <fcntl.h>          // fcntl, FD_CLOEXEC
+#include <unistd.h>         // read, write, close
+#include <pthread.h>        // pthread_create, pthread_detach, pthread_once
+#include <netdb.h>          // getaddrinfo
+#include <sys/socket.h>     // socket, connect, setsockopt
+#include <sys/time.h>       // struct timeval
+#include <openssl/err.h>    // ERR_clear_error
+#include <openssl/ocsp.h>   // OCSP_REQUEST, OCSP_RESPONSE, OCSP_basic_verify
+#include <openssl/pem.h>    // PEM_read_X509
+#include <openssl/x509v3.h> // X509_get1_ocsp, X509_check_issued
+
+#include "config.h"
+#include "ocsp.h"
+
+// How long an answer without nextUpdate ("always fresher ones available")
+// is used - it's fetched again after half of it, like any other
+#define OCSP_DEFAULT_VALIDITY 3600
+
+// Clock skew we accept between the responder and us (seconds)
+#define OCSP_CLOCK_SKEW 300
+
+/*
+ * STRUCT: staple
+ * PURPOSE: One certificate's responder and cached answer
+ */
+struct staple {
+    int references;                 // Contexts + refresh thread (under list_lock)
+    time_t refresh_at;              // Next fetch (under list_lock)
+    int failing;                    // Last fetch failed (refresh thread only)
+    unsigned char fingerprint[32];  // SHA-256 of the certificate
+    const char *name;               // Certificate file, for messages (config)
+    OCSP_CERTID *id;                // The certificate as the responder knows it
+    X509 *issuer;                   // Signed it - and the answers about it
+    char *url;
+    const char *path;               // Points into url
+    char authority[262];            // "host[:port]" for the Host header
+    char host[256];
+    char port[8];
+    pthread_mutex_t lock;           // Guards the answer
+    unsigned char *response;        // DER, NULL = nothing to staple yet
+    int response_length;
+    time_t expires;                 // The answer's nextUpdate
+    struct staple *next;
+};
+
+static pthread_mutex_t list_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t list_changed = PTHREAD_COND_INITIALIZER;
+static struct staple *staples;
+
+static pthread_once_t index_once = PTHREAD_ONCE_INIT;
+static int staple_index = -1;
+
+/*
+ * FUNCTION: free_staple / release
+ * PURPOSE: Drop a reference to a staple; the last one frees it
+ * RULE: release() with list_lock held
+ */
+static void free_staple(struct staple *staple) {
+    OCSP_CERTID_free(staple->id);
+    X509_free(staple->issuer);
+    free(staple->url);
+    pthread_mutex_destroy(&staple->lock);
+    OPENSSL_free(staple->response);
+    free(staple);
+}
+
+static void release(struct staple *staple) {
+    struct staple **link;
+
+    if (--staple->references > 0) {
+        return;
+    }
+    for (link = &staples; *link && *link != staple; link = &(*link)->next) {
+    }
+    if (*link) {
+        *link = staple->next;
+    }
+    free_staple(staple);
+}
+
+/*
+ * FUNCTION: release_from_context
+ * PURPOSE: ex_data destructor - OpenSSL calls it when a context is freed
+ */
+static void release_from_context(void *parent, void *ptr, CRYPTO_EX_DATA *ad,
+                                 int idx, long argl, void *argp) {
+    (void)parent; (void)ad; (void)idx; (void)argl; (void)argp;
+
+    if (ptr) {      // Called for every SSL_CTX, including unstapled ones
+        pthread_mutex_lock(&list_lock);
+        release(ptr);
+        pthread_mutex_unlock(&list_lock);
+    }
+}
+
+static void create_index(void) {
+    staple_index = SSL_CTX_get_ex_new_index(0, NULL, NULL, NULL, release_from_context);
+}
+
+/*
+ * FUNCTION: on_status_request
+ * PURPOSE: OpenSSL's status callback - hand a client that asked for the
+ *          certificate status a copy of the cached answer
+ * RETURNS: SSL_TLSEXT_ERR_OK with an answer, SSL_TLSEXT_ERR_NOACK without
+ * WHY a copy: OpenSSL frees the answer with the connection, and the refresh
+ *     thread may replace the cached one at any moment
+ */
+static int on_status_request(SSL *ssl, void *arg) {
+    struct staple *staple = arg;
+    unsigned char *copy = NULL;
+    int length = 0;
+
+    pthread_mutex_lock(&staple->lock);
+    if (staple->response && time(NULL) < staple->expires) {
+        copy = OPENSSL_malloc((size_t)staple->response_length);
+        if (copy) {
+            memcpy(copy, staple->response, (size_t)staple->response_length);
+            length = staple->response_length;
+        }
+    }
+    pthread_mutex_unlock(&staple->lock);
+
+    if (!copy) {
+        return SSL_TLSEXT_ERR_NOACK;
+    }
+    if (!SSL_set_tlsext_status_ocsp_resp(ssl, copy, length)) {
+        OPENSSL_free(copy);
+        return SSL_TLSEXT_ERR_NOACK;
+    }
+    return SSL_TLSEXT_ERR_OK;
+}
+
+// -----------------------------------------------------------------------------
+// Asking the responder
+// -----------------------------------------------------------------------------
+
+/*
+ * FUNCTION: parse_url
+ * PURPOSE: Split "http://host[:port][/path]" (host may be "[IPv6]") up into
+ *          staple->host / port / authority / path
+ * RETURNS: 0 on success, -1 if it isn't such a URL
+ * WHY only http: the answers are signed - responders serve plain HTTP
+ */
+static int parse_url(struct staple *staple) {
+    const char *authority = staple->url + 7;
+    const char *end, *host, *host_end, *port;
+    size_t length;
+
+    if (strncmp(staple->url, "http://", 7) != 0) {
+        return -1;
+    }
+    end = strchr(authority, '/');
+    staple->path = end ? end : "/";
+    if (!end) {
+        end = authority + strlen(authority);
+    }
+    length = (size_t)(end - authority);
+    if (length == 0 || length >= sizeof(staple->authority)) {
+        return -1;
+    }
+    memcpy(staple->authority, authority, length);
+    staple->authority[length] = '\0';
+
+    // port: right after the host - ":NNN" or the end
+    host = authority;
+    if (*host == '[') {
+        host_end = memchr(host, ']', length);
+        if (!host_end) {
+            return -1;
+        }
+        port = host_end + 1;
+        host++;
+    } else {
+        host_end = memchr(host, ':', length);
+        if (!host_end) {
+            host_end = end;
+        }
+        port = host_end;
+    }
+    length = (size_t)(host_end - host);
+    if (length == 0 || length >= sizeof(staple->host)) {
+        return -1;
+    }
+    memcpy(staple->host, host, length);
+    staple->host[length] = '\0';
+
+    if (port == end) {
+        strcpy(staple->port, "80");
+        return 0;
+    }
+    if (*port != ':') {
+        return -1;
+    }
+    port++;
+    length = (size_t)(end - port);
+    if (length == 0 || length >= sizeof(staple->port)) {
+        return -1;
+    }
+    memcpy(staple->port, port, length);
+    staple->port[length] = '\0';
+    return 0;
+}
+
+/*
+ * FUNCTION: write_all
+ * RETURNS: 0 when everything went out, -1 on error or timeout
+ */
+static int write_all(int fd, const void *data, size_t length) {
+    const char *next = data;
+
+    while (length > 0) {
+        ssize_t written = write(fd, next, length);
+        if (written <= 0) {
+            return -1;
+        }
+        next += written;
+        length -= (size_t)written;
+    }
+    return 0;
+}
+
+/*
+ * FUNCTION: ask_responder
+ * PURPOSE: POST an OCSP request to the staple's responder and read the answer
+ * RETURNS: The decoded answer, or NULL with *error set
+ * RULE: Blocks (up to OCSP_FETCH_TIMEOUT per step) - refresh thread only
+ */
+static OCSP_RESPONSE *ask_responder(const struct staple *staple, const unsigned char *request,
+                                    int request_length, const char **error) {
+    struct timeval timeout = { OCSP_FETCH_TIMEOUT, 0 };
+    struct addrinfo hints, *result, *address;
+    char head[1024];
+    char *answer;
+    const unsigned char *body = NULL;
+    size_t got = 0, space = OCSP_RESPONSE_MAX + sizeof(head), i;
+    int fd = -1, head_length, sent;
+    OCSP_RESPONSE *response = NULL;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(staple->host, staple->port, &hints, &result) != 0) {
+        *error = "unable to resolve the responder";
+        return NULL;
+    }
+    for (address = result; address && fd < 0; address = address->ai_next) {
+        fd = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+        if (fd < 0) {
+            continue;
+        }
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        // connect() gives up after SO_SNDTIMEO as well
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        if (connect(fd, address->ai_addr, address->ai_addrlen) < 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(result);
+    if (fd < 0) {
+        *error = "unable to connect to the responder";
+        return NULL;
+    }
+
+    // HTTP/1.0: the answer ends where the connection does - no chunks
+    head_length = snprintf(head, sizeof(head),
+                           "POST %s HTTP/1.0\r\nHost: %s\r\nContent-Type: application/ocsp-request\r\n"
+                           "Content-Length: %d\r\n\r\n", staple->path, staple->authority, request_length);
+    answer = malloc(space);
+    sent = answer && head_length < (int)sizeof(head) && write_all(fd, head, (size_t)head_length) == 0 &&
+           write_all(fd, request, (size_t)request_length) == 0;
+    while (sent && got < space) {
+        ssize_t bytes = read(fd, answer + got, space - got);
+        if (bytes <= 0) {
+            break;
+        }
+        got += (size_t)bytes;
+    }
+    close(fd);
+
+    // "HTTP/1.1 200 OK\r\n" ... "\r\n\r\n" DER
+    for (i = 0; sent && i + 4 <= got && !body; i++) {
+        if (memcmp(answer + i, "\r\n\r\n", 4) == 0) {
+            body = (const unsigned char *)answer + i + 4;
+        }
+    }
+    if (!sent) {
+        *error = answer ? "unable to send the request" : "out of memory";
+    } else if (got == space) {
+        *error = "the answer is too big";
+    } else if (got < 12 || memcmp(answer, "HTTP/1.", 7) != 0 || memcmp(answer + 8, " 200", 4) != 0) {
+        *error = "the responder didn't answer 200";
+    } else if (!body) {
+        *error = "incomplete answer";
+    } else {
+        response = d2i_OCSP_RESPONSE(NULL, &body, (long)((const unsigned char *)answer + got - body));
+        if (!response) {
+            *error = "the answer isn't an OCSP response";
+        }
+    }
+    free(answer);
+    return response;
+}
+
+/*
+ * FUNCTION: check_answer
+ * PURPOSE: Make sure an answer is signed by our issuer (or a responder it
+ *          certified), is about our certificate and is current
+ * RETURNS: NULL if it is - with *status, *issued and *expires set - or why not
+ */
+static const char *check_answer(const struct staple *staple, OCSP_BASICRESP *basic, int *status,
+                                time_t *issued, time_t *expires) {
+    STACK_OF(X509) *issuers = sk_X509_new_null();
+    X509_STORE *store = X509_STORE_new();
+    ASN1_GENERALIZEDTIME *this_update = NULL, *next_update = NULL;
+    const char *error = NULL;
+    int reason, days, seconds;
+    time_t now = time(NULL);
+
+    // The issuer is the only one trusted here, root or not (partial chain)
+    if (!issuers || !store || !sk_X509_push(issuers, staple->issuer) ||
+        !X509_STORE_add_cert(store, staple->issuer)) {
+        error = "out of memory";
+    } else {
+        X509_STORE_set_flags(store, X509_V_FLAG_PARTIAL_CHAIN);
+        if (OCSP_basic_verify(basic, issuers, store, 0) <= 0) {
+            error = "the answer isn't signed by the certificate's issuer";
+        } else if (!OCSP_resp_find_status(basic, staple->id, status, &reason, NULL,
+                                          &this_update, &next_update)) {
+            error = "the answer is about another certificate";
+        } else if (!OCSP_check_validity(this_update, next_update, OCSP_CLOCK_SKEW, -1)) {
+            error = "the answer is out of date";
+        } else if (*status == V_OCSP_CERTSTATUS_UNKNOWN) {
+            error = "the responder doesn't know the certificate";
+        } else {
+            *issued = now;
+            if (ASN1_TIME_diff(&days, &seconds, NULL, this_update)) {
+                *issued = now + (time_t)days * 86400 + seconds;
+            }
+            *expires = now + OCSP_DEFAULT_VALIDITY;
+            if (next_update && ASN1_TIME_diff(&days, &seconds, NULL, next_update)) {
+                *expires = now + (time_t)days * 86400 + seconds;
+            }
+        }
+    }
+    sk_X509_free(issuers);          // Not the issuer itself - that is the staple's
+    X509_STORE_free(store);
+    ERR_clear_error();
+    return error;
+}
+
+/*
+ * FUNCTION: refresh
+ * PURPOSE: Fetch, check and cache a new answer for one staple
+ * RETURNS: When to fetch again
+ * RULE: Refresh thread only, without list_lock (it may take seconds)
+ */
+static time_t refresh(struct staple *staple) {
+    OCSP_REQUEST *request = OCSP_REQUEST_new();
+    OCSP_CERTID *id = OCSP_CERTID_dup(staple->id);
+    OCSP_RESPONSE *response = NULL;
+    OCSP_BASICRESP *basic = NULL;
+    unsigned char *request_der = NULL, *der = NULL;
+    int request_length = -1, length = -1, status = V_OCSP_CERTSTATUS_UNKNOWN;
+    const char *error = NULL;
+    time_t now = time(NULL), issued = now, expires = now, retry = now + OCSP_RETRY_DELAY, next;
+
+    if (request && id && OCSP_request_add0_id(request, id)) {
+        id = NULL;                  // The request's now
+        request_length = i2d_OCSP_REQUEST(request, &request_der);
+    }
+    OCSP_CERTID_free(id);
+    OCSP_REQUEST_free(request);
+
+    if (request_length <= 0) {
+        error = "out of memory";
+    } else {
+        response = ask_responder(staple, request_der, request_length, &error);
+    }
+    OPENSSL_free(request_der);
+
+    if (response) {
+        if (OCSP_response_status(response) != OCSP_RESPONSE_STATUS_SUCCESSFUL) {
+            error = OCSP_response_status_str(OCSP_response_status(response));
+        } else if (!(basic = OCSP_response_get1_basic(response))) {
+            error = "the answer has no status in it";
+        } else {
+            error = check_answer(staple, basic, &status, &issued, &expires);
+        }
+        if (!error) {
+            length = i2d_OCSP_RESPONSE(response, &der);
+            if (length <= 0) {
+                error = "out of memory";
+            }
+        }
+        OCSP_BASICRESP_free(basic);
+        OCSP_RESPONSE_free(response);
+    }
+
+    if (error) {
+        // Once, not every minute - the old answer is stapled until it expires
+        if (!staple->failing) {
+            fprintf(stderr, "OCSP: unable to refresh the status of %s from %s: %s\n",
+                    staple->name, staple->url, error);
+        }
+        staple->failing = 1;
+        ERR_clear_error();
+        return retry;
+    }
+
+    pthread_mutex_lock(&staple->lock);
+    OPENSSL_free(staple->response);
+    staple->response = der;
+    staple->response_length = length;
+    staple->expires = expires;
+    pthread_mutex_unlock(&staple->lock);
+
+    if (status == V_OCSP_CERTSTATUS_REVOKED) {
+        fprintf(stderr, "OCSP: %s has been REVOKED - clients will refuse it\n", staple->name);
+    } else if (staple->failing) {
+        fprintf(stderr, "OCSP: the status of %s is fresh again\n", staple->name);
+    }
+    staple->failing = 0;
+
+    // Halfway through its validity - a new answer is in place long before
+    // this one expires, even if the responder is down for a while
+    next = issued + (expires - issued) / 2;
+    return next > retry ? next : retry;
+}
+
+/*
+ * FUNCTION: refresh_thread_main
+ * PURPOSE: Refresh every staple when it is due, sleep until the next one is
+ *          (or a new certificate shows up)
+ */
+static void *refresh_thread_main(void *arg) {
+    (void)arg;
+
+    pthread_mutex_lock(&list_lock);
+    while (1) {
+        struct staple *staple, *due = NULL;
+        time_t now = time(NULL), wake = now + OCSP_DEFAULT_VALIDITY;
+
+        for (staple = staples; staple && !due; staple = staple->next) {
+            if (staple->refresh_at <= now) {
+                due = staple;
+            } else if (staple->refresh_at < wake) {
+                wake = staple->refresh_at;
+            }
+        }
+        if (due) {
+            time_t next;
+
+            due->references++;      // Keeps it while we fetch without the lock
+            pthread_mutex_unlock(&list_lock);
+            next = refresh(due);
+            pthread_mutex_lock(&list_lock);
+            due->refresh_at = next;
+            release(due);
+        } else {
+            struct timespec until;
+
+            until.tv_sec = wake;
+            until.tv_nsec = 0;
+            pthread_cond_timedwait(&list_changed, &list_lock, &until);
+        }
+    }
+    return NULL;
+}
+
+// -----------------------------------------------------------------------------
+// Setting up
+// -----------------------------------------------------------------------------
+
+/*
+ * FUNCTION: find_issuer
+ * PURPOSE: Find the certificate that issued ours: further down the
+ *          certificate file (an intermediate), or among the --ca certificates
+ * RETURNS: The issuer with a reference for the caller, or NULL
+ */
+static X509 *find_issuer(SSL_CTX *ctx, const char *cert_file, X509 *certificate) {
+    FILE *file = fopen(cert_file, "r");
+    X509_STORE_CTX *store_ctx;
+    X509 *candidate, *issuer = NULL;
+
+    while (file && !issuer && (candidate = PEM_read_X509(file, NULL, NULL, NULL)) != NULL) {
+        if (X509_cmp(candidate, certificate) != 0 && X509_check_issued(candidate, certificate) == X509_V_OK) {
+            issuer = candidate;
+        } else {
+            X509_free(candidate);
+        }
+    }
+    if (file) {
+        fclose(file);
+    }
+
+    store_ctx = issuer ? NULL : X509_STORE_CTX_new();
+    if (store_ctx && X509_STORE_CTX_init(store_ctx, SSL_CTX_get_cert_store(ctx), certificate, NULL) &&
+        X509_STORE_CTX_get1_issuer(&issuer, store_ctx, certificate) <= 0) {
+        issuer = NULL;
+    }
+    X509_STORE_CTX_free(store_ctx);
+    ERR_clear_error();              // The end of the file counts as an error
+    return issuer;
+}
+
+/*
+ * FUNCTION: create_staple
+ * PURPOSE: Set up the staple for a certificate seen for the first time
+ * RETURNS: 0 with *created set - or left NULL if the certificate can't be
+ *          stapled (reported, except when it names no responder) - or -1
+ *          when out of memory
+ */
+static int create_staple(SSL_CTX *ctx, const char *cert_file, X509 *certificate,
+                         const unsigned char *fingerprint, struct staple **created) {
+    STACK_OF(OPENSSL_STRING) *urls = NULL;
+    const char *url = config.ocsp_url;
+    struct staple *staple;
+
+    *created = NULL;
+    if (!url) {
+        urls = X509_get1_ocsp(certificate);
+        url = sk_OPENSSL_STRING_num(urls) > 0 ? sk_OPENSSL_STRING_value(urls, 0) : NULL;
+    }
+    if (!url) {
+        return 0;                   // Self-signed and test certificates name none
+    }
+
+    staple = calloc(1, sizeof(*staple));
+    if (staple) {
+        pthread_mutex_init(&staple->lock, NULL);
+        staple->url = strdup(url);
+    }
+    X509_email_free(urls);
+    if (!staple || !staple->url) {
+        if (staple) {
+            free_staple(staple);
+        }
+        return -1;
+    }
+
+    if (parse_url(staple) < 0) {
+        fprintf(stderr, "OCSP: can't staple %s - unsupported responder URL %s\n", cert_file, staple->url);
+        free_staple(staple);
+        return 0;
+    }
+    staple->issuer = find_issuer(ctx, cert_file, certificate);
+    if (!staple->issuer) {
+        fprintf(stderr, "OCSP: can't staple %s - its issuer is neither in that file nor in --ca\n", cert_file);
+        free_staple(staple);
+        return 0;
+    }
+    staple->id = OCSP_cert_to_id(NULL, certificate, staple->issuer);
+    if (!staple->id) {
+        free_staple(staple);
+        return -1;
+    }
+    memcpy(staple->fingerprint, fingerprint, sizeof(staple->fingerprint));
+    staple->name = cert_file;
+    staple->references = 1;         // The context's
+    staple->refresh_at = 0;         // Right away
+
+    pthread_mutex_lock(&list_lock);
+    staple->next = staples;
+    staples = staple;
+    pthread_cond_signal(&list_changed);
+    pthread_mutex_unlock(&list_lock);
+
+    *created = staple;
+    return 0;
+}
+
+int ocsp_configure(SSL_CTX *ctx, const char *cert_file) {
+    X509 *certificate = SSL_CTX_get0_certificate(ctx);
+    unsigned char fingerprint[32];
+    unsigned int fingerprint_length = 0;
+    struct staple *staple;
+
+    if (!config.ocsp_stapling || !certificate) {
+        return 0;
+    }
+    pthread_once(&index_once, create_index);
+    if (staple_index < 0 || !X509_digest(certificate, EVP_sha256(), fingerprint, &fingerprint_length) ||
+        fingerprint_length != sizeof(fingerprint)) {
+        return -1;
+    }
+
+    // The same certificate as before (a reload, or one used twice): share
+    // its staple and with it the answer already fetched
+    pthread_mutex_lock(&list_lock);
+    for (staple = staples; staple; staple = staple->next) {
+        if (memcmp(staple->fingerprint, fingerprint, sizeof(fingerprint)) == 0) {
+            staple->references++;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&list_lock);
+
+    if (!staple && create_staple(ctx, cert_file, certificate, fingerprint, &staple) < 0) {
+        return -1;
+    }
+    if (!staple) {
+        return 0;
+    }
+    if (!SSL_CTX_set_ex_data(ctx, staple_index, staple)) {
+        pthread_mutex_lock(&list_lock);
+        release(staple);
+        pthread_mutex_unlock(&list_lock);
+        return -1;
+    }
+    SSL_CTX_set_tlsext_status_cb(ctx, on_status_request);
+    SSL_CTX_set_tlsext_status_arg(ctx, staple);
+    return 0;
+}
+
+int ocsp_start(void) {
+    struct staple *staple;
+    pthread_t thread;
+    int error, count = 0;
+
+    if (!config.ocsp_stapling) {
+        return 0;
+    }
+    // Also without a stapled certificate yet - a reload may bring one
+    error = pthread_create(&thread, NULL, refresh_thread_main, NULL);
+    if (error != 0) {
+        fprintf(stderr, "Unable to start the OCSP refresh thread: %s\n", strerror(error));
+        return -1;
+    }
+    pthread_detach(thread);         // Refreshes until the process exits
+
+    pthread_mutex_lock(&list_lock);
+    for (staple = staples; staple; staple = staple->next) {
+        count++;
+    }
+    pthread_mutex_unlock(&list_lock);
+    return count;
+}
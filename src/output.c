@@ -0,0 +1,324 @@
+/*
+ * =============================================================================
+ * OUTPUT QUEUE IMPLEMENTATION
+ * =============================================================================
+ */
+
+#include <string.h>         // memcpy
+#include <errno.h>          // errno, EIO
+#include <unistd.h>         // close, pread, write
+#include <sys/socket.h>     // setsockopt
+#include <netinet/in.h>     // IPPROTO_TCP
+#include <netinet/tcp.h>    // TCP_CORK / TCP_NOPUSH
+
+#ifdef __linux__
+#include <sys/sendfile.h>   // Linux sendfile
+#endif
+
+#include "output.h"
+
+void output_init(struct output_queue *queue) {
+    queue->first = 0;
+    queue->count = 0;
+    queue->file_count = 0;
+    queue->length = 0;
+    arena_init(&queue->arena, queue->scratch, sizeof(queue->scratch));
+}
+
+int output_push(struct output_queue *queue, const void *data, size_t length) {
+    if (length == 0) {
+        return 0;
+    }
+    if (queue->count == OUTPUT_MAX_PARTS) {
+        return -1;
+    }
+    queue->parts[queue->count].iov_base = (void *)data;
+    queue->parts[queue->count].iov_len = length;
+    queue->count++;
+    queue->length += length;
+    return 0;
+}
+
+int output_push_copy(struct output_queue *queue, const void *data, size_t length) {
+    char *copy;
+
+    if (length == 0) {
+        return 0;
+    }
+    if (!output_has_room(queue, 1, length)) {
+        return -1;
+    }
+    copy = arena_alloc(&queue->arena, length, 1);
+    memcpy(copy, data, length);
+    return output_push(queue, copy, length);
+}
+
+static void push_file(struct output_queue *queue, int fd, off_t offset, size_t length, int owned) {
+    queue->files[queue->count].fd = fd;
+    queue->files[queue->count].offset = offset;
+    queue->files[queue->count].owned = owned;
+    queue->files[queue->count].data = NULL;
+    queue->files[queue->count].hold = NULL;
+    queue->parts[queue->count].iov_base = NULL;     // Marks a file part
+    queue->parts[queue->count].iov_len = length;
+    queue->count++;
+    queue->file_count++;
+    queue->length += length;
+}
+
+int output_push_file(struct output_queue *queue, int fd, off_t offset, size_t length) {
+    if (length == 0 || queue->count == OUTPUT_MAX_PARTS) {
+        close(fd);
+        return length == 0 ? 0 : -1;
+    }
+    push_file(queue, fd, offset, length, 1);
+    return 0;
+}
+
+int output_push_file_ref(struct output_queue *queue, int fd, off_t offset, size_t length) {
+    if (length == 0) {
+        return 0;
+    }
+    if (queue->count == OUTPUT_MAX_PARTS) {
+        return -1;
+    }
+    push_file(queue, fd, offset, length, 0);
+    return 0;
+}
+
+int output_push_cached(struct output_queue *queue, const char *data, off_t offset, size_t length,
+                       struct output_hold *hold) {
+    if (length == 0 || queue->count == OUTPUT_MAX_PARTS) {
+        if (hold) {
+            hold->release(hold);
+        }
+        return length == 0 ? 0 : -1;
+    }
+    push_file(queue, -1, offset, length, 0);
+    queue->files[queue->count - 1].data = data;
+    queue->files[queue->count - 1].hold = hold;
+    return 0;
+}
+
+int output_take_file(struct output_queue *queue, struct output_file *file, size_t *length) {
+    const struct output_file *front = output_front_file(queue, length);
+
+    if (!front) {
+        return 0;
+    }
+    *file = *front;
+    queue->length -= *length;
+    queue->file_count--;
+    queue->first++;
+    if (queue->first == queue->count) {
+        output_init(queue);
+    }
+    return 1;
+}
+
+/*
+ * FUNCTION: drop_file
+ * PURPOSE: A file part is done with - close its fd or release what it holds
+ */
+static void drop_file(struct output_file *file) {
+    if (file->owned) {
+        close(file->fd);
+    }
+    if (file->hold) {
+        file->hold->release(file->hold);
+    }
+}
+
+int output_has_room(const struct output_queue *queue, int parts, size_t scratch) {
+    return queue->count + parts <= OUTPUT_MAX_PARTS && arena_room(&queue->arena, scratch);
+}
+
+/*
+ * FUNCTION: owns
+ * PURPOSE: Check whether a part points into the response's own scratch area
+ */
+static int owns(const struct response *response, const struct iovec *part) {
+    const char *base = part->iov_base;
+    return base >= response->arena.base && base < response->arena.base + response->arena.size;
+}
+
+int output_push_response(struct output_queue *queue, const struct response *response) {
+    size_t copy_bytes = 0;
+    int i;
+
+    // Check everything fits first, so a response is never half-queued
+    for (i = 0; i < response->count; i++) {
+        if (owns(response, &response->parts[i])) {
+            copy_bytes += response->parts[i].iov_len;
+        }
+    }
+    if (!output_has_room(queue, response->count, copy_bytes)) {
+        return -1;
+    }
+
+    for (i = 0; i < response->count; i++) {
+        const struct iovec *part = &response->parts[i];
+        const void *data = part->iov_base;
+
+        // The response is a temporary - anything it owns must be copied
+        if (owns(response, part)) {
+            char *copy = arena_alloc(&queue->arena, part->iov_len, 1);
+            memcpy(copy, part->iov_base, part->iov_len);
+            data = copy;
+        }
+        output_push(queue, data, part->iov_len);
+    }
+    return 0;
+}
+
+void output_consume(struct output_queue *queue, size_t bytes) {
+    queue->length -= bytes;
+
+    while (bytes > 0) {
+        struct iovec *part = &queue->parts[queue->first];
+
+        if (bytes < part->iov_len) {
+            // Partially sent - the rest of this part goes out next time
+            if (part->iov_base) {
+                part->iov_base = (char *)part->iov_base + bytes;
+            } else {
+                queue->files[queue->first].offset += (off_t)bytes;
+            }
+            part->iov_len -= bytes;
+            return;
+        }
+        bytes -= part->iov_len;
+        if (!part->iov_base) {
+            drop_file(&queue->files[queue->first]);
+            queue->file_count--;
+        }
+        queue->first++;
+    }
+
+    if (queue->first == queue->count) {
+        output_init(queue);     // Everything sent - start over at the front
+    }
+}
+
+/*
+ * FUNCTION: send_file
+ * PURPOSE: Send (part of) the file part at the front of the queue
+ * RETURNS: Bytes sent, or -1 with errno set
+ */
+static ssize_t send_file(struct output_queue *queue, int fd) {
+    struct output_file *file = &queue->files[queue->first];
+    size_t length = queue->parts[queue->first].iov_len;
+
+    if (file->data) {
+        return write(fd, file->data + file->offset, length);
+    }
+#ifdef __linux__
+    // Linux advances a copy of the offset; output_consume() tracks the real one
+    off_t offset = file->offset;
+    return sendfile(fd, file->fd, &offset, length);
+#else
+    // BSD/macOS: `sent` reports progress even when the call fails with EAGAIN
+    off_t sent = (off_t)length;
+    if (sendfile(file->fd, fd, file->offset, &sent, NULL, 0) < 0 &&
+        !(errno == EAGAIN && sent > 0)) {
+        return -1;
+    }
+    return (ssize_t)sent;
+#endif
+}
+
+ssize_t output_send(struct output_queue *queue, int fd) {
+    int parts = 0;
+    ssize_t sent;
+
+    if (queue->parts[queue->first].iov_base == NULL) {
+        sent = send_file(queue, fd);
+        if (sent == 0) {
+            errno = EIO;    // File shrank under us - the response can't be finished
+            return -1;
+        }
+    } else {
+        // All memory parts up to the next file part (or the writev limit)
+        while (queue->first + parts < queue->count && parts < OUTPUT_WRITEV_MAX &&
+               queue->parts[queue->first + parts].iov_base != NULL) {
+            parts++;
+        }
+        sent = writev(fd, &queue->parts[queue->first], parts);
+    }
+
+    if (sent > 0) {
+        output_consume(queue, (size_t)sent);
+    }
+    return sent;
+}
+
+const struct output_file *output_front_file(const struct output_queue *queue, size_t *length) {
+    if (queue->first == queue->count || queue->parts[queue->first].iov_base) {
+        return NULL;
+    }
+    *length = queue->parts[queue->first].iov_len;
+    return &queue->files[queue->first];
+}
+
+size_t output_gather(struct output_queue *queue, char *buffer, size_t size, int read_files) {
+    size_t copied = 0;
+    int i;
+
+    for (i = queue->first; i < queue->count && copied < size; i++) {
+        size_t chunk = queue->parts[i].iov_len;
+        if (chunk > size - copied) {
+            chunk = size - copied;
+        }
+
+        if (!queue->parts[i].iov_base) {
+            ssize_t bytes;
+
+            if (!read_files) {
+                break;
+            }
+            if (queue->files[i].data) {
+                memcpy(buffer + copied, queue->files[i].data + queue->files[i].offset, chunk);
+                copied += chunk;
+                continue;
+            }
+            bytes = pread(queue->files[i].fd, buffer + copied, chunk, queue->files[i].offset);
+            if (bytes <= 0) {
+                if (bytes == 0) {
+                    errno = EIO;    // File shrank under us
+                }
+                return 0;
+            }
+            copied += (size_t)bytes;
+            if ((size_t)bytes < chunk) {
+                break;  // A short read is fine - send what we have so far
+            }
+            continue;
+        }
+        memcpy(buffer + copied, queue->parts[i].iov_base, chunk);
+        copied += chunk;
+    }
+    output_consume(queue, copied);
+    return copied;
+}
+
+void output_discard(struct output_queue *queue) {
+    int i;
+
+    for (i = queue->first; i < queue->count; i++) {
+        if (!queue->parts[i].iov_base) {
+            drop_file(&queue->files[i]);
+        }
+    }
+    output_init(queue);
+}
+
+void socket_cork(int fd, int on) {
+#if defined(TCP_CORK)
+    setsockopt(fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+#elif defined(TCP_NOPUSH)
+    setsockopt(fd, IPPROTO_TCP, TCP_NOPUSH, &on, sizeof(on));
+#else
+    (void)fd;
+    (void)on;
+#endif
+}
@@ -0,0 +1,94 @@
+/*
+ * =============================================================================
+ * POOL IMPLEMENTATION
+ * =============================================================================
+ */
+
+#include <stdlib.h>     // malloc, free
+
+#include "pool.h"
+
+// Slabs are never returned to malloc() before pool_destroy(): a server that
+// once had N connections is likely to see N again.
+struct pool_slab {
+    struct pool_slab *next;
+    // Objects follow, aligned like the union below
+};
+
+// Strictest alignment any object may need
+union pool_align {
+    void *pointer;
+    long long integer;
+    long double floating;
+};
+
+#define POOL_ALIGN sizeof(union pool_align)
+#define SLAB_HEADER ((sizeof(struct pool_slab) + POOL_ALIGN - 1) / POOL_ALIGN * POOL_ALIGN)
+
+void pool_init(struct pool *pool, size_t object_size, size_t objects_per_slab) {
+    if (object_size < sizeof(void *)) {
+        object_size = sizeof(void *);   // Free objects hold the list link
+    }
+    pool->object_size = (object_size + POOL_ALIGN - 1) / POOL_ALIGN * POOL_ALIGN;
+    pool->objects_per_slab = objects_per_slab > 0 ? objects_per_slab : 1;
+    pool->free_list = NULL;
+    pool->slabs = NULL;
+    pool->in_use = 0;
+}
+
+/*
+ * FUNCTION: pool_grow
+ * PURPOSE: Allocate one more slab and put all of its objects on the free list
+ * RETURNS: 0 on success, -1 if out of memory
+ */
+static int pool_grow(struct pool *pool) {
+    struct pool_slab *slab = malloc(SLAB_HEADER + pool->object_size * pool->objects_per_slab);
+    char *object;
+    size_t i;
+
+    if (!slab) {
+        return -1;
+    }
+    slab->next = pool->slabs;
+    pool->slabs = slab;
+
+    // Link back to front so objects are handed out in address order
+    object = (char *)slab + SLAB_HEADER + pool->object_size * pool->objects_per_slab;
+    for (i = 0; i < pool->objects_per_slab; i++) {
+        object -= pool->object_size;
+        *(void **)object = pool->free_list;
+        pool->free_list = object;
+    }
+    return 0;
+}
+
+void *pool_get(struct pool *pool) {
+    void *object;
+
+    if (!pool->free_list && pool_grow(pool) < 0) {
+        return NULL;
+    }
+    object = pool->free_list;
+    pool->free_list = *(void **)object;
+    pool->in_use++;
+    return object;
+}
+
+void pool_put(struct pool *pool, void *object) {
+    if (!object) {
+        return;
+    }
+    *(void **)object = pool->free_list;
+    pool->free_list = object;
+    pool->in_use--;
+}
+
+void pool_destroy(struct pool *pool) {
+    while (pool->slabs) {
+        struct pool_slab *slab = pool->slabs;
+        pool->slabs = slab->next;
+        free(slab);
+    }
+    pool->free_list = NULL;
+    pool->in_use = 0;
+}
@@ -0,0 +1,1449 @@
+/*
+ * =============================================================================
+ * PROXY IMPLEMENTATION - BACKENDS, POOLED CONNECTIONS, EXCHANGES
+ * =============================================================================
+ * An "exchange" is one request on its way through: the request as it goes
+ * to the backend (out), the answer as it comes back (in), and where both
+ * stand. An "upstream" is one connection to a backend; it belongs to an
+ * exchange while one uses it, and sits on its backend's idle list in the
+ * worker otherwise.
+ *
+ *     proxy_body()    --> out --> backend          (the body, piece by piece)
+ *     proxy_handler() --> stream_defer(proxy_fill)
+ *     backend --> in  --> proxy_fill() --> client  (head, then body)
+ *
+ * Only what arrives together with the head goes through "in" - the rest of
+ * the answer is read from the backend straight into the buffer it is sent
+ * to the client from. Chunks are decoded in place and framed again on the
+ * way out (or become DATA frames): the client's framing is the server's
+ * business, not the backend's.
+ *
+ * On the client side each of the two waits the same way: return 0 (body
+ * handler) or STREAM_WAIT (fill) with client_waiting set, and whichever
+ * backend event makes progress possible calls stream_wake() - always as
+ * the last thing it does, since the client may finish and free the
+ * exchange right there.
+ * =============================================================================
+ */
+
+#include <stdio.h>          // snprintf, fprintf, perror
+#include <stdlib.h>         // calloc, qsort
+#include <string.h>         // memcpy, memmove, memset, strchr, strrchr
+#include <strings.h>        // strncasecmp
+#include <errno.h>          // errno, EAGAIN, EINPROGRESS
+#include <fcntl.h>          // fcntl, FD_CLOEXEC
+#include <unistd.h>         // read, write, close, sleep
+#include <pthread.h>        // pthread_create, pthread_detach
+#include <netdb.h>          // getaddrinfo
+#include <netinet/in.h>     // IPPROTO_TCP
+#include <netinet/tcp.h>    // TCP_NODELAY
+#include <arpa/inet.h>      // inet_ntop
+#include <sys/socket.h>     // socket, connect, getsockopt
+#include <sys/time.h>       // struct timeval
+
+#include "config.h"
+#include "proxy.h"
+#include "stream.h"
+#include "worker.h"
+
+#define PROXY_BUFFER TLS_RECORD_SIZE    // out and in are record_pool buffers
+#define RING_POINTS 160                 // Points per backend on the hash ring
+#define HEALTH_TIMEOUT 2                // Seconds a health check may take
+#define HASH_SEED 2166136261u           // FNV-1a offset basis
+#define CHUNK_FRAMING 20                // Size line and CRLF around a chunk of the body
+
+static const struct segment status_501 = SEGMENT("HTTP/1.1 501 Not Implemented\r\n");
+static const struct segment status_400 = SEGMENT("HTTP/1.1 400 Bad Request\r\n");
+static const struct segment status_502 = SEGMENT("HTTP/1.1 502 Bad Gateway\r\n");
+static const struct segment status_503 = SEGMENT("HTTP/1.1 503 Service Unavailable\r\n");
+static const struct segment last_chunk = SEGMENT("0\r\n\r\n");
+
+struct backend {
+    const char *name;               // As given to --upstream ("HOST:PORT")
+    struct sockaddr_storage address;
+    socklen_t address_length;
+    int healthy;                    // 1 = takes requests (atomic)
+    int active;                     // Requests on it right now, all workers (atomic)
+};
+
+struct ring_point {
+    uint32_t hash;
+    int backend;
+};
+
+static struct backend backends[MAX_UPSTREAMS];
+static int backend_count;
+static struct ring_point ring[MAX_UPSTREAMS * RING_POINTS];    // Sorted by hash
+static int ring_size;
+
+struct exchange;
+
+/*
+ * STRUCT: upstream
+ * PURPOSE: One connection to a backend, busy or idle
+ */
+struct upstream {
+    event_handler handler;          // MUST be first (fd = -1 once closed)
+    struct proxy_pool *pool;
+    int backend;
+    int connected;                  // 0 = connect() still in progress
+    int events;                     // What the event loop watches (0 = not in it)
+    int served;                     // Answers it brought back so far
+    struct exchange *exchange;      // Who uses it, NULL = idle
+    struct upstream *next;          // Idle list or closed list
+};
+
+enum framing {
+    FRAMING_LENGTH,                 // Content-Length
+    FRAMING_CHUNKED,                // Transfer-Encoding: chunked
+    FRAMING_CLOSE                   // Until the backend closes the connection
+};
+
+/*
+ * STRUCT: exchange
+ * PURPOSE: One request passed on, and its answer coming back
+ */
+struct exchange {
+    struct proxy_pool *pool;
+    struct upstream *upstream;      // NULL = done with the backend (or none yet)
+    struct http_streamer *streamer; // The client's, for stream_wake()
+    int backend;                    // Where it goes, -1 = nowhere to go
+    uint32_t key;                   // --balance hash: the URL's hash
+    char *out;                      // Request bytes for the backend
+    size_t out_length;
+    size_t out_sent;
+    char *in;                       // Answer bytes from it, not passed on yet
+    size_t in_start;
+    size_t in_length;
+    size_t scanned;                 // Bytes of in searched for the end of the head
+    int has_body;                   // 1 = the request has a body
+    int chunked_body;               //   and it goes on in chunks
+    int request_done;               // 1 = all of the request is in out
+    int head_request;
+    int retried;
+    int client_waiting;             // 1 = the client sleeps until stream_wake()
+    int error;                      // Status to answer with instead (502, 503)
+    int status;                     // The backend's, 0 = no head yet
+    size_t head_length;             // Of the head at in[0]
+    size_t connection_offset;       // Its Connection header value (0 = none)
+    size_t connection_length;
+    int head_sent;
+    int bodyless;                   // HEAD, 204 and 304 answers have no body
+    enum framing framing;
+    uint64_t remaining;             // FRAMING_LENGTH: body bytes still to come
+    struct http_chunked chunked;    // FRAMING_CHUNKED
+    int reusable;                   // The backend keeps the connection open
+    int body_done;                  // All of the answer is passed on
+};
+
+/*
+ * STRUCT: proxy_pool
+ * PURPOSE: One worker's exchanges and backend connections
+ */
+struct proxy_pool {
+    worker *worker;
+    struct pool exchanges;
+    struct pool upstreams;
+    struct upstream *idle[MAX_UPSTREAMS];   // Per backend, last used first
+    int idle_count[MAX_UPSTREAMS];
+    struct upstream *closed;                // Freed by proxy_collect()
+    unsigned turn;                          // Where least-connections starts looking
+};
+
+// What the body handler leaves behind when it couldn't start an exchange
+static char out_of_memory;
+
+// -----------------------------------------------------------------------------
+// Backends: which one, and is it up
+// -----------------------------------------------------------------------------
+
+static uint32_t hash_bytes(uint32_t hash, const char *data, size_t length) {
+    size_t i;
+    for (i = 0; i < length; i++) {
+        hash = (hash ^ (unsigned char)data[i]) * 16777619u;
+    }
+    return hash;
+}
+
+/*
+ * FUNCTION: mix
+ * PURPOSE: Spread a hash over all 32 bits
+ * WHY: FNV-1a of "backend#1", "backend#2"... differs mostly in the low
+ *      bits - the ring points would bunch up without this
+ */
+static uint32_t mix(uint32_t hash) {
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bu;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35u;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+static int is_healthy(int backend) {
+    return __atomic_load_n(&backends[backend].healthy, __ATOMIC_RELAXED);
+}
+
+/*
+ * FUNCTION: pick_by_hash
+ * PURPOSE: The first healthy backend at or after key on the ring
+ */
+static int pick_by_hash(uint32_t key) {
+    int low = 0, high = ring_size, i;
+
+    while (low < high) {
+        int middle = (low + high) / 2;
+        if (ring[middle].hash < key) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    for (i = 0; i < ring_size; i++) {
+        const struct ring_point *point = &ring[(low + i) % ring_size];
+        if (is_healthy(point->backend)) {
+            return point->backend;
+        }
+    }
+    return -1;
+}
+
+/*
+ * FUNCTION: pick_least
+ * PURPOSE: The healthy backend with the fewest requests in progress
+ * WHY: Ties go round: each pick starts looking one backend further on
+ */
+static int pick_least(struct proxy_pool *pool) {
+    int best = -1, best_active = 0, i;
+
+    for (i = 0; i < backend_count; i++) {
+        int backend = (int)((pool->turn + (unsigned)i) % (unsigned)backend_count);
+        int active;
+
+        if (!is_healthy(backend)) {
+            continue;
+        }
+        active = __atomic_load_n(&backends[backend].active, __ATOMIC_RELAXED);
+        if (best < 0 || active < best_active) {
+            best = backend;
+            best_active = active;
+        }
+    }
+    pool->turn++;
+    return best;
+}
+
+static int pick_backend(struct exchange *ex) {
+    return config.balance_hash ? pick_by_hash(ex->key) : pick_least(ex->pool);
+}
+
+/*
+ * FUNCTION: mark_down
+ * PURPOSE: A backend refused a connection - send nothing more its way
+ * RULE: Only with health checks: they are what brings it back
+ */
+static void mark_down(int backend) {
+    if (config.health_interval > 0 && __atomic_exchange_n(&backends[backend].healthy, 0, __ATOMIC_RELAXED)) {
+        fprintf(stderr, "Backend %s refused a connection - taken out until it passes a health check\n",
+                backends[backend].name);
+    }
+}
+
+/*
+ * FUNCTION: check_backend
+ * PURPOSE: Ask a backend for --health-path (blocking, health thread only)
+ * RETURNS: 1 if it answered with a status below 500, 0 otherwise
+ */
+static int check_backend(const struct backend *backend) {
+    struct timeval timeout = { HEALTH_TIMEOUT, 0 };
+    char request[1024], answer[12];
+    int fd, length, healthy = 0;
+    size_t got = 0;
+
+    length = snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\nHost: %s\r\nConnection: close\r\n\r\n",
+                      config.health_path, backend->name);
+    fd = socket(backend->address.ss_family, SOCK_STREAM, 0);
+    if (fd < 0 || length >= (int)sizeof(request)) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return 0;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    // connect() gives up after SO_SNDTIMEO as well
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    if (connect(fd, (const struct sockaddr *)&backend->address, backend->address_length) == 0 &&
+        write(fd, request, (size_t)length) == length) {
+        while (got < sizeof(answer)) {
+            ssize_t bytes = read(fd, answer + got, sizeof(answer) - got);
+            if (bytes <= 0) {
+                break;
+            }
+            got += (size_t)bytes;
+        }
+        // "HTTP/1.1 200"
+        if (got == sizeof(answer) && memcmp(answer, "HTTP/1.", 7) == 0 && answer[8] == ' ' &&
+            answer[9] >= '1' && answer[9] <= '4') {
+            healthy = 1;
+        }
+    }
+    close(fd);
+    return healthy;
+}
+
+static void *health_thread_main(void *arg) {
+    (void)arg;
+
+    while (1) {
+        int i;
+        for (i = 0; i < backend_count; i++) {
+            int healthy = check_backend(&backends[i]);
+            if (__atomic_exchange_n(&backends[i].healthy, healthy, __ATOMIC_RELAXED) != healthy) {
+                fprintf(stderr, healthy ? "Backend %s is up again\n" : "Backend %s failed its health check\n",
+                        backends[i].name);
+            }
+        }
+        sleep((unsigned)config.health_interval);
+    }
+    return NULL;
+}
+
+/*
+ * FUNCTION: resolve
+ * PURPOSE: Turn "HOST:PORT" or "[IPv6]:PORT" into the backend's address
+ * RETURNS: 0 on success, -1 on failure (reported)
+ */
+static int resolve(struct backend *backend, const char *name) {
+    char host[256];
+    const char *port, *end;
+    struct addrinfo hints, *result;
+    int error;
+
+    if (name[0] == '[') {
+        end = strchr(name, ']');
+        port = end && end[1] == ':' ? end + 2 : NULL;
+        name++;
+    } else {
+        end = strrchr(name, ':');
+        port = end ? end + 1 : NULL;
+    }
+    if (!port || *port == '\0' || end == name || (size_t)(end - name) >= sizeof(host)) {
+        fprintf(stderr, "Invalid --upstream value (expected HOST:PORT): %s\n", backend->name);
+        return -1;
+    }
+    memcpy(host, name, (size_t)(end - name));
+    host[end - name] = '\0';
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    error = getaddrinfo(host, port, &hints, &result);
+    if (error != 0) {
+        fprintf(stderr, "Unable to resolve backend %s: %s\n", backend->name, gai_strerror(error));
+        return -1;
+    }
+    memcpy(&backend->address, result->ai_addr, result->ai_addrlen);
+    backend->address_length = result->ai_addrlen;
+    freeaddrinfo(result);
+    return 0;
+}
+
+static int compare_points(const void *a, const void *b) {
+    uint32_t x = ((const struct ring_point *)a)->hash, y = ((const struct ring_point *)b)->hash;
+    return x < y ? -1 : x > y;
+}
+
+int proxy_start(void) {
+    int i, point;
+
+    for (i = 0; i < config.upstream_count; i++) {
+        backends[i].name = config.upstreams[i];
+        backends[i].healthy = 1;
+        backends[i].active = 0;
+        if (resolve(&backends[i], config.upstreams[i]) < 0) {
+            return -1;
+        }
+        for (point = 0; point < RING_POINTS; point++) {
+            char label[300];
+            int length = snprintf(label, sizeof(label), "%s#%d", backends[i].name, point);
+            ring[ring_size].hash = mix(hash_bytes(HASH_SEED, label, (size_t)length));
+            ring[ring_size++].backend = i;
+        }
+    }
+    backend_count = config.upstream_count;
+    qsort(ring, (size_t)ring_size, sizeof(ring[0]), compare_points);
+
+    if (backend_count > 0 && config.health_interval > 0) {
+        pthread_t thread;
+        int error = pthread_create(&thread, NULL, health_thread_main, NULL);
+        if (error != 0) {
+            fprintf(stderr, "Unable to start the health check thread: %s\n", strerror(error));
+            return -1;
+        }
+        pthread_detach(thread);     // Checks until the process exits
+    }
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+// Upstreams: connections to the backends, kept for the next request
+// -----------------------------------------------------------------------------
+
+static void on_upstream_event(event_handler *handler, int events);
+
+/*
+ * FUNCTION: get_pool
+ * PURPOSE: The worker's proxy state, made the first time it is needed
+ */
+static struct proxy_pool *get_pool(worker *w) {
+    if (!w->proxy) {
+        w->proxy = calloc(1, sizeof(*w->proxy));
+        if (!w->proxy) {
+            perror("Unable to allocate proxy state");
+            return NULL;
+        }
+        w->proxy->worker = w;
+        pool_init(&w->proxy->exchanges, sizeof(struct exchange), 16);
+        pool_init(&w->proxy->upstreams, sizeof(struct upstream), 16);
+    }
+    return w->proxy;
+}
+
+/*
+ * FUNCTION: upstream_watch
+ * PURPOSE: Tell the event loop which readiness the upstream waits for
+ * WHY: Watching nothing takes it out of the loop altogether - epoll
+ *      reports a hangup even then, again and again until somebody reads
+ */
+static void upstream_watch(struct upstream *up, int events) {
+    event_loop *loop = up->pool->worker->loop;
+
+    if (events == up->events) {
+        return;
+    }
+    if (events == 0) {
+        event_loop_remove(loop, &up->handler);
+    } else if (up->events == 0) {
+        event_loop_add(loop, &up->handler, events);
+    } else {
+        event_loop_modify(loop, &up->handler, events);
+    }
+    up->events = events;
+}
+
+/*
+ * FUNCTION: upstream_close
+ * PURPOSE: Close the connection; the object itself waits for proxy_collect()
+ */
+static void upstream_close(struct upstream *up) {
+    upstream_watch(up, 0);
+    close(up->handler.fd);
+    up->handler.fd = -1;
+    up->next = up->pool->closed;
+    up->pool->closed = up;
+}
+
+/*
+ * FUNCTION: upstream_connect
+ * PURPOSE: Start a new connection to a backend
+ * RETURNS: The upstream (maybe still connecting), or NULL on failure
+ */
+static struct upstream *upstream_connect(struct proxy_pool *pool, int backend) {
+    const struct backend *target = &backends[backend];
+    struct upstream *up;
+    int fd = socket(target->address.ss_family, SOCK_STREAM, 0), one = 1;
+
+    if (fd < 0) {
+        perror("Unable to create backend socket");
+        return NULL;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);     // Not for the binary taking over on SIGUSR2
+    // A request goes out in one piece - don't hold its last segment back
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (set_nonblocking(fd) < 0 ||
+        (connect(fd, (const struct sockaddr *)&target->address, target->address_length) < 0 &&
+         errno != EINPROGRESS)) {
+        close(fd);
+        mark_down(backend);
+        return NULL;
+    }
+    up = pool_get(&pool->upstreams);
+    if (!up) {
+        close(fd);
+        return NULL;
+    }
+    up->handler.fd = fd;
+    up->handler.on_event = on_upstream_event;
+    up->pool = pool;
+    up->backend = backend;
+    up->connected = 0;
+    up->events = 0;
+    up->served = 0;
+    up->exchange = NULL;
+    up->next = NULL;
+    return up;
+}
+
+/*
+ * FUNCTION: upstream_take
+ * PURPOSE: An idle connection to the backend, or else a new one
+ * PARAMETER: fresh - 1 = always a new one
+ */
+static struct upstream *upstream_take(struct proxy_pool *pool, int backend, int fresh) {
+    struct upstream *up = pool->idle[backend];
+
+    if (fresh || !up) {
+        return upstream_connect(pool, backend);
+    }
+    pool->idle[backend] = up->next;
+    pool->idle_count[backend]--;
+    return up;
+}
+
+/*
+ * FUNCTION: upstream_release
+ * PURPOSE: Its answer is complete - keep the connection for the next request
+ */
+static void upstream_release(struct upstream *up) {
+    struct proxy_pool *pool = up->pool;
+
+    up->served++;
+    if (pool->idle_count[up->backend] >= config.upstream_keepalive || pool->worker->draining) {
+        upstream_close(up);
+        return;
+    }
+    up->next = pool->idle[up->backend];
+    pool->idle[up->backend] = up;
+    pool->idle_count[up->backend]++;
+    upstream_watch(up, EVENT_READ);     // Readable while idle = the backend closed it
+}
+
+/*
+ * FUNCTION: forget_idle
+ * PURPOSE: Take an idle upstream off its backend's list
+ */
+static void forget_idle(struct upstream *up) {
+    struct proxy_pool *pool = up->pool;
+    struct upstream **link = &pool->idle[up->backend];
+
+    while (*link && *link != up) {
+        link = &(*link)->next;
+    }
+    if (*link) {
+        *link = up->next;
+        pool->idle_count[up->backend]--;
+    }
+}
+
+void proxy_collect(worker *w) {
+    struct proxy_pool *pool = w->proxy;
+
+    while (pool && pool->closed) {
+        struct upstream *up = pool->closed;
+        pool->closed = up->next;
+        pool_put(&pool->upstreams, up);
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Exchanges: the request on its way out
+// -----------------------------------------------------------------------------
+
+/*
+ * FUNCTION: wake
+ * PURPOSE: Let the client carry on if it is waiting for us
+ * RULE: Last thing the caller does - the exchange may be gone afterwards
+ */
+static void wake(struct exchange *ex) {
+    if (ex->client_waiting) {
+        ex->client_waiting = 0;
+        stream_wake(ex->streamer);
+    }
+}
+
+/*
+ * FUNCTION: attach
+ * PURPOSE: Give the exchange a connection to its backend
+ * RETURNS: 0 on success, -1 if none could be had
+ */
+static int attach(struct exchange *ex, int fresh) {
+    struct upstream *up = upstream_take(ex->pool, ex->backend, fresh);
+
+    if (!up) {
+        return -1;
+    }
+    up->exchange = ex;
+    ex->upstream = up;
+    __atomic_add_fetch(&backends[ex->backend].active, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/*
+ * FUNCTION: detach
+ * PURPOSE: The exchange is done with its backend connection
+ * PARAMETER: reuse - 1 = the answer is complete and the connection clean
+ */
+static void detach(struct exchange *ex, int reuse) {
+    struct upstream *up = ex->upstream;
+
+    if (!up) {
+        return;
+    }
+    ex->upstream = NULL;
+    up->exchange = NULL;
+    __atomic_sub_fetch(&backends[up->backend].active, 1, __ATOMIC_RELAXED);
+    if (reuse) {
+        upstream_release(up);
+    } else {
+        upstream_close(up);
+    }
+}
+
+static void exchange_free(struct exchange *ex) {
+    struct pool *records = &ex->pool->worker->record_pool;
+
+    detach(ex, 0);
+    pool_put(records, ex->out);
+    pool_put(records, ex->in);
+    pool_put(&ex->pool->exchanges, ex);
+}
+
+static void send_request(struct exchange *ex);
+
+/*
+ * FUNCTION: fail
+ * PURPOSE: The connection broke before the answer was complete
+ * PARAMETER: refused - 1 = it never got connected
+ * WHY: An idle connection the backend was closing just as we took it
+ *      fails without an answer; the request is sent again on a new one -
+ *      unless it had a body, which may be half-consumed by now
+ */
+static void fail(struct exchange *ex, int refused) {
+    struct upstream *up = ex->upstream;
+    int reused = up && up->served > 0;
+    int retry = !ex->retried && ex->status == 0 && ex->in_length == 0 && (refused || (reused && !ex->has_body));
+
+    detach(ex, 0);
+    if (refused) {
+        mark_down(ex->backend);
+    }
+    if (retry) {
+        ex->retried = 1;
+        if (refused) {
+            ex->backend = pick_backend(ex);     // The next one, if checks took it out
+        }
+        if (ex->backend >= 0 && attach(ex, 1) == 0) {
+            ex->out_sent = 0;
+            send_request(ex);
+            return;
+        }
+    }
+    ex->error = ex->backend < 0 ? 503 : 502;
+    wake(ex);
+}
+
+/*
+ * FUNCTION: send_request
+ * PURPOSE: Write out whatever of the request the backend hasn't got yet
+ */
+static void send_request(struct exchange *ex) {
+    struct upstream *up = ex->upstream;
+
+    if (!up) {
+        return;
+    }
+    if (!up->connected) {
+        upstream_watch(up, EVENT_WRITE);    // Writable = connected (or refused)
+        return;
+    }
+    while (ex->out_sent < ex->out_length) {
+        ssize_t sent = write(up->handler.fd, ex->out + ex->out_sent, ex->out_length - ex->out_sent);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                upstream_watch(up, EVENT_WRITE);
+                return;
+            }
+            fail(ex, 0);
+            return;
+        }
+        ex->out_sent += (size_t)sent;
+    }
+
+    if (ex->request_done) {
+        upstream_watch(up, EVENT_READ);     // The answer is next
+        return;
+    }
+    // All of the body so far is out: room for the next piece
+    ex->out_sent = ex->out_length = 0;
+    upstream_watch(up, 0);
+    wake(ex);
+}
+
+static int put(struct exchange *ex, const void *data, size_t length) {
+    if (length > PROXY_BUFFER - ex->out_length) {
+        return -1;
+    }
+    memcpy(ex->out + ex->out_length, data, length);
+    ex->out_length += length;
+    return 0;
+}
+
+static int put_slice(struct exchange *ex, const char *data, struct http_slice slice) {
+    return put(ex, data + slice.offset, slice.length);
+}
+
+static int name_is(const char *data, struct http_slice name, const char *expected) {
+    return name.length == strlen(expected) && strncasecmp(data + name.offset, expected, name.length) == 0;
+}
+
+/*
+ * FUNCTION: hop_by_hop
+ * PURPOSE: Whether a header only concerns one connection, not the message
+ */
+static int hop_by_hop(const char *name, size_t length) {
+    static const char *const names[] = {
+        "Connection", "Keep-Alive", "Proxy-Connection", "TE", "Trailer", "Upgrade", "Transfer-Encoding", NULL
+    };
+    int i;
+
+    for (i = 0; names[i]; i++) {
+        if (length == strlen(names[i]) && strncasecmp(name, names[i], length) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * FUNCTION: named_in_connection
+ * PURPOSE: Whether the client's Connection header lists this header, which
+ *          makes it hop-by-hop too ("Connection: close, X-Trace")
+ */
+static int named_in_connection(const struct http_context *context, struct http_slice name) {
+    char token[64];
+
+    if (name.length >= sizeof(token)) {
+        return 0;
+    }
+    memcpy(token, context->data + name.offset, name.length);
+    token[name.length] = '\0';
+    return http_header_has_token(context->request, context->data, "Connection", token);
+}
+
+/*
+ * FUNCTION: build_request
+ * PURPOSE: Write the request head as the backend gets it into out
+ * RETURNS: 0 on success, -1 if it doesn't fit
+ * WHY: Always HTTP/1.1 on a connection we keep, whatever the client spoke.
+ *      Hop-by-hop headers stay behind, the body gets our own framing, and
+ *      X-Forwarded-For/-Proto say who really asked, and how
+ */
+static int build_request(struct exchange *ex, const struct http_context *context) {
+    const struct http_request *request = context->request;
+    const char *data = context->data;
+    const struct log_peer *peer = context->peer;
+    const struct http_header *forwarded = NULL;
+    char address[INET6_ADDRSTRLEN], line[64];
+    int has_host = 0, length, i;
+
+    if (put_slice(ex, data, request->method) < 0 || put(ex, " ", 1) < 0 ||
+        put_slice(ex, data, request->path) < 0 ||
+        (request->query.length > 0 && (put(ex, "?", 1) < 0 || put_slice(ex, data, request->query) < 0)) ||
+        put(ex, " HTTP/1.1\r\n", 11) < 0) {
+        return -1;
+    }
+
+    for (i = 0; i < request->header_count; i++) {
+        const struct http_header *header = &request->headers[i];
+
+        if (hop_by_hop(data + header->name.offset, header->name.length) ||
+            name_is(data, header->name, "Content-Length") || name_is(data, header->name, "Expect") ||
+            name_is(data, header->name, "X-Forwarded-Proto") || named_in_connection(context, header->name)) {
+            continue;
+        }
+        if (name_is(data, header->name, "X-Forwarded-For")) {
+            forwarded = header;     // Goes out below, with the client added
+            continue;
+        }
+        if (name_is(data, header->name, "Host")) {
+            has_host = 1;
+        }
+        if (put_slice(ex, data, header->name) < 0 || put(ex, ": ", 2) < 0 ||
+            put_slice(ex, data, header->value) < 0 || put(ex, "\r\n", 2) < 0) {
+            return -1;
+        }
+    }
+
+    // HTTP/1.0 clients may not say which site they want
+    if (!has_host && (put(ex, "Host: ", 6) < 0 || put(ex, backends[ex->backend].name,
+                                                        strlen(backends[ex->backend].name)) < 0 ||
+                      put(ex, "\r\n", 2) < 0)) {
+        return -1;
+    }
+    if (peer && peer->family && inet_ntop(peer->family, peer->address, address, sizeof(address))) {
+        if (put(ex, "X-Forwarded-For: ", 17) < 0 ||
+            (forwarded && (put_slice(ex, data, forwarded->value) < 0 || put(ex, ", ", 2) < 0)) ||
+            put(ex, address, strlen(address)) < 0 || put(ex, "\r\n", 2) < 0) {
+            return -1;
+        }
+    } else if (forwarded && (put(ex, "X-Forwarded-For: ", 17) < 0 || put_slice(ex, data, forwarded->value) < 0 ||
+                             put(ex, "\r\n", 2) < 0)) {
+        return -1;
+    }
+
+    length = snprintf(line, sizeof(line), "X-Forwarded-Proto: %s\r\n", context->tls ? "https" : "http");
+    if (put(ex, line, (size_t)length) < 0) {
+        return -1;
+    }
+    if (request->body == HTTP_BODY_LENGTH) {
+        length = snprintf(line, sizeof(line), "Content-Length: %llu\r\n",
+                          (unsigned long long)request->content_length);
+        if (put(ex, line, (size_t)length) < 0) {
+            return -1;
+        }
+    } else if (request->body == HTTP_BODY_CHUNKED && put(ex, "Transfer-Encoding: chunked\r\n", 28) < 0) {
+        return -1;
+    }
+    return put(ex, "\r\n", 2);
+}
+
+/*
+ * FUNCTION: request_is_clean
+ * PURPOSE: Whether every part build_request() copies is safe to copy
+ * WHY: The parts go out verbatim, so a CR, LF or NUL in one of them could
+ *      end a line - or the whole request - where we didn't, and whatever
+ *      follows reaches the backend as a request of its own (smuggling).
+ *      Both parsers refuse those bytes already; this doesn't trust them to
+ */
+static int request_is_clean(const struct http_context *context) {
+    const struct http_request *request = context->request;
+    const char *data = context->data;
+    int i;
+
+    if (!http_valid_token(data + request->method.offset, request->method.length) ||
+        request->path.length == 0 || !http_valid_target(data + request->path.offset, request->path.length) ||
+        !http_valid_target(data + request->query.offset, request->query.length)) {
+        return 0;
+    }
+    for (i = 0; i < request->header_count; i++) {
+        const struct http_header *header = &request->headers[i];
+        if (!http_valid_token(data + header->name.offset, header->name.length) ||
+            !http_valid_field_value(data + header->value.offset, header->value.length)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * FUNCTION: exchange_start
+ * PURPOSE: Pick a backend and get the request ready for it
+ * RETURNS: The exchange (with error set if it can't go anywhere), or NULL
+ *          if out of memory
+ */
+static struct exchange *exchange_start(const struct http_context *context) {
+    const struct http_request *request = context->request;
+    struct proxy_pool *pool = get_pool(context->worker);
+    struct exchange *ex = pool ? pool_get(&pool->exchanges) : NULL;
+
+    if (!ex) {
+        return NULL;
+    }
+    memset(ex, 0, sizeof(*ex));
+    ex->pool = pool;
+    ex->streamer = context->streamer;
+    ex->out = pool_get(&pool->worker->record_pool);
+    ex->in = pool_get(&pool->worker->record_pool);
+    if (!ex->out || !ex->in) {
+        perror("Unable to allocate proxy buffers");
+        exchange_free(ex);
+        return NULL;
+    }
+    ex->has_body = request->body != HTTP_BODY_NONE;
+    ex->chunked_body = request->body == HTTP_BODY_CHUNKED;
+    ex->head_request = request->method.length == 4 && memcmp(context->data + request->method.offset, "HEAD", 4) == 0;
+
+    if (config.balance_hash) {
+        uint32_t hash = hash_bytes(HASH_SEED, context->data + request->path.offset, request->path.length);
+        if (request->query.length > 0) {
+            hash = hash_bytes(hash_bytes(hash, "?", 1), context->data + request->query.offset, request->query.length);
+        }
+        ex->key = mix(hash);
+    }
+    if (!request_is_clean(context)) {
+        ex->backend = -1;
+        ex->error = 400;    // Goes nowhere
+        return ex;
+    }
+    ex->backend = pick_backend(ex);
+    if (ex->backend < 0) {
+        ex->error = 503;    // Every backend is down
+    } else if (build_request(ex, context) < 0) {
+        ex->error = 502;
+    } else if (attach(ex, 0) < 0) {
+        fail(ex, 1);        // Tries another backend (nobody sleeps yet, so no wakeup)
+    }
+    return ex;
+}
+
+int proxy_body(const struct http_context *context, void *arg, const char *chunk, size_t length) {
+    struct exchange *ex = *context->state;
+    char line[CHUNK_FRAMING];
+    int size;
+
+    (void)arg;
+    if (!chunk) {
+        if (ex && *context->state != &out_of_memory) {
+            exchange_free(ex);
+        }
+        *context->state = NULL;
+        return 1;
+    }
+    if (*context->state == &out_of_memory) {
+        return 1;
+    }
+    if (!ex) {
+        ex = exchange_start(context);
+        if (!ex) {
+            *context->state = &out_of_memory;   // proxy_handler answers 503
+            return 1;
+        }
+        *context->state = ex;
+    }
+    ex->client_waiting = 0;
+    if (ex->error) {
+        return 1;   // It gets the error instead: the body goes nowhere
+    }
+    // Always leave room for the last chunk (see proxy_handler)
+    if (ex->out_length + length + CHUNK_FRAMING + last_chunk.length > PROXY_BUFFER) {
+        ex->client_waiting = 1;     // send_request() wakes us once it's out
+        return 0;
+    }
+    if (ex->chunked_body) {
+        size = snprintf(line, sizeof(line), "%zx\r\n", length);
+        put(ex, line, (size_t)size);
+        put(ex, chunk, length);
+        put(ex, "\r\n", 2);
+    } else {
+        put(ex, chunk, length);
+    }
+    send_request(ex);
+    return 1;
+}
+
+// -----------------------------------------------------------------------------
+// The answer on its way back
+// -----------------------------------------------------------------------------
+
+/*
+ * STRUCT: head_field
+ * PURPOSE: One header line of the backend's answer
+ */
+struct head_field {
+    const char *line;               // The whole line, CRLF included
+    size_t line_length;
+    const char *name;
+    size_t name_length;
+    const char *value;              // Without surrounding whitespace
+    size_t value_length;
+};
+
+/*
+ * FUNCTION: next_field
+ * PURPOSE: Read the header line at *cursor and move past it
+ * RETURNS: 1 if there was one, 0 at end
+ */
+static int next_field(const char **cursor, const char *end, struct head_field *field) {
+    const char *line = *cursor, *stop, *colon;
+
+    while (line < end) {
+        stop = memchr(line, '\n', (size_t)(end - line));
+        stop = stop ? stop + 1 : end;
+        colon = memchr(line, ':', (size_t)(stop - line));
+        *cursor = stop;
+        if (!colon) {
+            line = stop;    // Not a header - skip it
+            continue;
+        }
+        field->line = line;
+        field->line_length = (size_t)(stop - line);
+        field->name = line;
+        field->name_length = (size_t)(colon - line);
+        field->value = colon + 1;
+        while (field->value < stop && (*field->value == ' ' || *field->value == '\t')) {
+            field->value++;
+        }
+        while (stop > field->value && (stop[-1] == '\r' || stop[-1] == '\n' || stop[-1] == ' ' || stop[-1] == '\t')) {
+            stop--;
+        }
+        field->value_length = (size_t)(stop - field->value);
+        return 1;
+    }
+    return 0;
+}
+
+static int field_is(const struct head_field *field, const char *name) {
+    return field->name_length == strlen(name) && strncasecmp(field->name, name, field->name_length) == 0;
+}
+
+/*
+ * FUNCTION: has_token
+ * PURPOSE: Whether a comma-separated value lists a token (case-insensitive)
+ */
+static int has_token(const char *value, size_t length, const char *token, size_t token_length) {
+    while (length > 0) {
+        size_t item = 0;
+
+        while (length > 0 && (*value == ' ' || *value == '\t' || *value == ',')) {
+            value++;
+            length--;
+        }
+        while (item < length && value[item] != ',') {
+            item++;
+        }
+        while (item > 0 && (value[item - 1] == ' ' || value[item - 1] == '\t')) {
+            item--;
+        }
+        if (item == token_length && item > 0 && strncasecmp(value, token, token_length) == 0) {
+            return 1;
+        }
+        while (length > 0 && *value != ',') {
+            value++;
+            length--;
+        }
+    }
+    return 0;
+}
+
+/*
+ * FUNCTION: parse_head
+ * PURPOSE: Look for the complete head of the answer in in, and read how
+ *          its body is framed. Interim (1xx) heads are dropped
+ * RETURNS: 1 once it's in, 0 if more is needed, -1 if it's not HTTP
+ */
+static int parse_head(struct exchange *ex) {
+    while (1) {
+        struct head_field field;
+        const char *cursor, *end;
+        size_t i = ex->scanned > 3 ? ex->scanned - 3 : 0;
+        int minor;
+
+        for (; i + 4 <= ex->in_length; i++) {
+            if (memcmp(ex->in + i, "\r\n\r\n", 4) == 0) {
+                break;
+            }
+        }
+        if (i + 4 > ex->in_length) {
+            ex->scanned = ex->in_length;
+            return 0;
+        }
+        ex->head_length = i + 4;
+        ex->scanned = 0;
+
+        // "HTTP/1.1 200 OK"
+        if (ex->head_length < 16 || memcmp(ex->in, "HTTP/1.", 7) != 0 || ex->in[8] != ' ' ||
+            ex->in[9] < '1' || ex->in[9] > '5' || ex->in[10] < '0' || ex->in[10] > '9' ||
+            ex->in[11] < '0' || ex->in[11] > '9') {
+            return -1;
+        }
+        ex->status = (ex->in[9] - '0') * 100 + (ex->in[10] - '0') * 10 + (ex->in[11] - '0');
+        if (ex->status < 200) {
+            if (ex->status == 101) {
+                return -1;      // We never offered an upgrade
+            }
+            // "100 Continue" and the like: the client already had ours
+            ex->in_length -= ex->head_length;
+            memmove(ex->in, ex->in + ex->head_length, ex->in_length);
+            ex->status = 0;
+            continue;
+        }
+
+        minor = ex->in[7] - '0';
+        ex->reusable = minor >= 1;
+        ex->framing = FRAMING_CLOSE;
+        ex->connection_offset = ex->connection_length = 0;
+        cursor = memchr(ex->in, '\n', ex->head_length) + 1;
+        end = ex->in + ex->head_length - 2;
+        while (next_field(&cursor, end, &field)) {
+            if (field_is(&field, "Content-Length") && ex->framing != FRAMING_CHUNKED) {
+                uint64_t length = 0;
+                size_t j;
+                // An empty or second, different length is no framing at all -
+                // on a reused connection guessing would serve the rest of this
+                // answer to the next client
+                if (field.value_length == 0) {
+                    return -1;
+                }
+                for (j = 0; j < field.value_length; j++) {
+                    if (field.value[j] < '0' || field.value[j] > '9' || length > UINT64_MAX / 10 - 1) {
+                        return -1;
+                    }
+                    length = length * 10 + (uint64_t)(field.value[j] - '0');
+                }
+                if (ex->framing == FRAMING_LENGTH && ex->remaining != length) {
+                    return -1;
+                }
+                ex->framing = FRAMING_LENGTH;
+                ex->remaining = length;
+            } else if (field_is(&field, "Transfer-Encoding")) {
+                // Only chunked tells where the body ends, and it comes last
+                if (field.value_length >= 7 &&
+                    strncasecmp(field.value + field.value_length - 7, "chunked", 7) == 0) {
+                    ex->framing = FRAMING_CHUNKED;
+                    http_chunked_init(&ex->chunked);
+                } else {
+                    ex->framing = FRAMING_CLOSE;
+                }
+            } else if (field_is(&field, "Connection")) {
+                ex->connection_offset = (size_t)(field.value - ex->in);
+                ex->connection_length = field.value_length;
+                if (has_token(field.value, field.value_length, "close", 5)) {
+                    ex->reusable = 0;
+                } else if (has_token(field.value, field.value_length, "keep-alive", 10)) {
+                    ex->reusable = 1;
+                }
+            }
+        }
+
+        ex->bodyless = ex->head_request || ex->status == 204 || ex->status == 304;
+        if (!ex->bodyless && ex->framing == FRAMING_CLOSE) {
+            ex->reusable = 0;
+        }
+        ex->in_start = ex->head_length;     // The body (some of it) may be here already
+        return 1;
+    }
+}
+
+/*
+ * FUNCTION: read_head
+ * PURPOSE: Read from the backend until the head of its answer is in
+ */
+static void read_head(struct exchange *ex) {
+    struct upstream *up = ex->upstream;
+
+    while (1) {
+        int parsed = parse_head(ex);
+        ssize_t bytes;
+
+        if (parsed > 0) {
+            upstream_watch(up, 0);      // The client reads the body itself
+            wake(ex);
+            return;
+        }
+        if (parsed < 0 || ex->in_length == PROXY_BUFFER) {
+            fprintf(stderr, "Backend %s sent a malformed or oversized answer head\n",
+                    backends[ex->backend].name);
+            detach(ex, 0);
+            ex->error = 502;
+            wake(ex);
+            return;
+        }
+        bytes = read(up->handler.fd, ex->in + ex->in_length, PROXY_BUFFER - ex->in_length);
+        if (bytes > 0) {
+            ex->in_length += (size_t)bytes;
+            continue;
+        }
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            upstream_watch(up, EVENT_READ);
+            return;
+        }
+        fail(ex, 0);    // Closed (or reset) without an answer
+        return;
+    }
+}
+
+/*
+ * FUNCTION: on_upstream_event
+ * PURPOSE: A backend connection is ready: carry on with its exchange
+ */
+static void on_upstream_event(event_handler *handler, int events) {
+    struct upstream *up = (struct upstream *)handler;
+    struct exchange *ex = up->exchange;
+
+    (void)events;
+    if (handler->fd < 0) {
+        return;     // Closed earlier in this batch of events
+    }
+    if (!ex) {
+        // Idle, and the backend closed it (or says something unasked)
+        forget_idle(up);
+        upstream_close(up);
+        return;
+    }
+    if (!up->connected) {
+        int error = 0;
+        socklen_t length = sizeof(error);
+
+        if (getsockopt(handler->fd, SOL_SOCKET, SO_ERROR, &error, &length) < 0 || error != 0) {
+            fail(ex, 1);
+            return;
+        }
+        up->connected = 1;
+    }
+    if (ex->out_sent < ex->out_length) {
+        send_request(ex);
+    } else if (ex->status == 0) {
+        if (ex->request_done) {
+            read_head(ex);
+        } else {
+            upstream_watch(up, 0);      // Waiting for more of the body
+        }
+    } else {
+        upstream_watch(up, 0);          // More of the body: the client reads it
+        wake(ex);
+    }
+}
+
+/*
+ * FUNCTION: finish_body
+ * PURPOSE: All of the answer is in - the connection can take the next request
+ * WHY: Unless the backend said more than it was asked, or the request
+ *      isn't even complete (it answered early)
+ */
+static void finish_body(struct exchange *ex) {
+    ex->body_done = 1;
+    detach(ex, ex->reusable && ex->request_done && ex->out_sent == ex->out_length && ex->in_start == ex->in_length);
+}
+
+/*
+ * FUNCTION: copy_head
+ * PURPOSE: The backend's head as the client gets it (see stream_defer)
+ * RETURNS: Bytes written, or -1 if it doesn't fit
+ */
+static int copy_head(struct exchange *ex, char *buffer, size_t room) {
+    const char *status_end = memchr(ex->in, '\n', ex->head_length) + 1;
+    const char *cursor = status_end, *end = ex->in + ex->head_length - 2;
+    const char *connection = ex->in + ex->connection_offset;
+    const struct http_date *date = &ex->pool->worker->date;
+    struct head_field field;
+    size_t length = 9 + (size_t)(status_end - ex->in - 9);
+    int has_date = 0;
+
+    if (length > room) {
+        return -1;
+    }
+    memcpy(buffer, "HTTP/1.1 ", 9);     // Whatever the backend speaks
+    memcpy(buffer + 9, ex->in + 9, length - 9);
+
+    while (next_field(&cursor, end, &field)) {
+        if (hop_by_hop(field.name, field.name_length) ||
+            (ex->connection_offset && has_token(connection, ex->connection_length, field.name, field.name_length))) {
+            continue;
+        }
+        // The server frames the body - except that HEAD and 304 answers
+        // have none to frame and tell the length of the one they stand for
+        if (field_is(&field, "Content-Length") && (!ex->bodyless || ex->status == 204)) {
+            continue;
+        }
+        if (field_is(&field, "Date")) {
+            has_date = 1;
+        }
+        if (field.line_length > room - length) {
+            return -1;
+        }
+        memcpy(buffer + length, field.line, field.line_length);
+        length += field.line_length;
+    }
+    if (!has_date) {
+        if (date->length > room - length) {
+            return -1;
+        }
+        memcpy(buffer + length, date->header, date->length);
+        length += date->length;
+    }
+    return (int)length;
+}
+
+/*
+ * FUNCTION: error_head
+ * PURPOSE: Answer for the backend that couldn't (502 or 503), or for a
+ *          request we won't pass on (400) - no body
+ */
+static int error_head(struct exchange *ex, char *buffer, size_t room) {
+    const struct segment *status = ex->error == 400 ? &status_400 : ex->error == 503 ? &status_503 : &status_502;
+    const struct http_date *date = &ex->pool->worker->date;
+
+    detach(ex, 0);
+    if (status->length + date->length > room) {
+        exchange_free(ex);
+        return -1;
+    }
+    memcpy(buffer, status->data, status->length);
+    memcpy(buffer + status->length, date->header, date->length);
+    ex->streamer->length = 0;
+    ex->body_done = 1;
+    return (int)(status->length + date->length);
+}
+
+/*
+ * FUNCTION: pull
+ * PURPOSE: The next bytes of the answer's body: first what came with the
+ *          head, then straight from the backend
+ * RETURNS: Bytes, 0 at end of stream, -1 on failure or STREAM_WAIT
+ */
+static int pull(struct exchange *ex, char *buffer, size_t room) {
+    struct upstream *up = ex->upstream;
+    ssize_t bytes;
+
+    if (ex->in_start < ex->in_length) {
+        size_t length = ex->in_length - ex->in_start < room ? ex->in_length - ex->in_start : room;
+        memcpy(buffer, ex->in + ex->in_start, length);
+        ex->in_start += length;
+        return (int)length;
+    }
+    if (!up) {
+        return -1;
+    }
+    do {
+        bytes = read(up->handler.fd, buffer, room);
+    } while (bytes < 0 && errno == EINTR);
+    if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        upstream_watch(up, EVENT_READ);
+        ex->client_waiting = 1;
+        return STREAM_WAIT;
+    }
+    return bytes < 0 ? -1 : (int)bytes;
+}
+
+/*
+ * FUNCTION: read_body
+ * PURPOSE: proxy_fill() once the head is out: the next piece of the body
+ */
+static int read_body(struct exchange *ex, char *buffer, size_t room) {
+    while (1) {
+        enum http_parse_result result;
+        size_t used, decoded;
+        int bytes;
+
+        if (ex->framing == FRAMING_LENGTH && ex->remaining < room) {
+            room = (size_t)ex->remaining;
+        }
+        bytes = pull(ex, buffer, room);
+        if (bytes == STREAM_WAIT) {
+            return STREAM_WAIT;
+        }
+        if (bytes == 0 && ex->framing == FRAMING_CLOSE) {
+            exchange_free(ex);      // That's how this one ends
+            return 0;
+        }
+        if (bytes <= 0) {
+            exchange_free(ex);      // Broken off: the client must see that
+            return -1;
+        }
+
+        if (ex->framing == FRAMING_LENGTH) {
+            ex->remaining -= (uint64_t)bytes;
+            if (ex->remaining == 0) {
+                finish_body(ex);
+            }
+            return bytes;
+        }
+        if (ex->framing == FRAMING_CLOSE) {
+            return bytes;
+        }
+
+        result = http_chunked_decode(&ex->chunked, buffer, (size_t)bytes, &used, &decoded);
+        if (result == HTTP_PARSE_ERROR) {
+            exchange_free(ex);
+            return -1;
+        }
+        if (result == HTTP_PARSE_DONE) {
+            ex->reusable = ex->reusable && used == (size_t)bytes;
+            finish_body(ex);
+        }
+        if (decoded > 0) {
+            return (int)decoded;
+        }
+        if (ex->body_done) {
+            exchange_free(ex);
+            return 0;
+        }
+    }
+}
+
+/*
+ * FUNCTION: proxy_fill
+ * PURPOSE: The client's side of the exchange (a stream_fill): the head
+ *          once the backend sent it, then the body as it arrives
+ */
+static int proxy_fill(void *state, char *buffer, size_t room) {
+    struct exchange *ex = state;
+    int bytes;
+
+    if (!buffer) {
+        exchange_free(ex);      // The client went away
+        return 0;
+    }
+    ex->client_waiting = 0;
+
+    if (!ex->head_sent) {
+        if (!ex->error && ex->status == 0) {
+            ex->client_waiting = 1;
+            return STREAM_WAIT;
+        }
+        ex->head_sent = 1;
+        bytes = ex->error ? -1 : copy_head(ex, buffer, room);
+        if (bytes < 0) {
+            ex->error = ex->error ? ex->error : 502;
+            return error_head(ex, buffer, room);
+        }
+        ex->streamer->bodyless = ex->bodyless;
+        if (ex->framing == FRAMING_LENGTH) {
+            ex->streamer->length = ex->remaining;
+        }
+        if (ex->bodyless || (ex->framing == FRAMING_LENGTH && ex->remaining == 0)) {
+            finish_body(ex);
+        }
+        return bytes;
+    }
+
+    if (ex->body_done) {
+        exchange_free(ex);
+        return 0;
+    }
+    if (ex->error) {
+        exchange_free(ex);      // The backend broke off halfway
+        return -1;
+    }
+    return read_body(ex, buffer, room);
+}
+
+int proxy_handler(const struct http_context *context, void *arg) {
+    struct exchange *ex = *context->state;
+    struct response response;
+
+    (void)arg;
+    if (!ex && !context->body_ignored) {
+        ex = exchange_start(context);   // No body came, so no exchange yet
+    }
+    if (!ex || ex == (struct exchange *)&out_of_memory) {
+        // HTTP/2 request bodies don't reach handlers, so there is nothing
+        // to pass on - better no answer than a wrong one
+        if (!output_has_room(context->output, RESPONSE_MAX_PARTS, RESPONSE_SCRATCH)) {
+            return 0;   // Asked again later - nothing was started
+        }
+        response_empty(&response, context->date, context->body_ignored ? &status_501 : &status_503,
+                       context->keep_alive);
+        output_push_response(context->output, &response);
+        *context->state = NULL;
+        return 1;
+    }
+    *context->state = NULL;     // proxy_fill() frees it from now on
+
+    if (!ex->error) {
+        if (ex->chunked_body) {
+            put(ex, last_chunk.data, last_chunk.length);    // proxy_body() kept room
+        }
+        ex->request_done = 1;
+        send_request(ex);
+    }
+    return stream_defer(context, proxy_fill, ex);
+}
@@ -0,0 +1,172 @@
+/*
+ * =============================================================================
+ * RESPONSE IMPLEMENTATION - SEGMENTS, DATE CACHE AND THE ECHO PAGE
+ * =============================================================================
+ */
+
+#include <string.h>     // memcpy
+
+#include "response.h"
+
+// -----------------------------------------------------------------------------
+// Fixed pieces of the echo page
+// -----------------------------------------------------------------------------
+
+#define ECHO_HEAD_TLS \
+    "<!DOCTYPE html><html><head><title>Tiny SSL Server</title></head>" \
+    "<body><h1>Secure HTTPS Server!</h1><p>Method: "
+#define ECHO_HEAD_PLAIN \
+    "<!DOCTYPE html><html><head><title>Tiny HTTP Server</title></head>" \
+    "<body><h1>Plain HTTP Server!</h1><p>Method: "
+#define ECHO_MIDDLE "</p><p>URL: "
+#define ECHO_TAIL "</p></body></html>"
+
+static const struct segment content_length = SEGMENT("Content-Length: ");
+static const struct segment keep_alive_end = SEGMENT("\r\nConnection: keep-alive\r\n\r\n");
+static const struct segment close_end = SEGMENT("\r\nConnection: close\r\n\r\n");
+static const struct segment echo_head_tls = SEGMENT(ECHO_HEAD_TLS);
+static const struct segment echo_head_plain = SEGMENT(ECHO_HEAD_PLAIN);
+static const struct segment echo_middle = SEGMENT(ECHO_MIDDLE);
+static const struct segment echo_tail = SEGMENT(ECHO_TAIL);
+
+const struct segment content_type_html = SEGMENT("Content-Type: text/html\r\n");
+
+const struct segment status_200 = SEGMENT("HTTP/1.1 200 OK\r\n");
+const struct segment status_206 = SEGMENT("HTTP/1.1 206 Partial Content\r\n");
+const struct segment status_304 = SEGMENT("HTTP/1.1 304 Not Modified\r\n");
+const struct segment status_403 = SEGMENT("HTTP/1.1 403 Forbidden\r\n");
+const struct segment status_404 = SEGMENT("HTTP/1.1 404 Not Found\r\n");
+const struct segment status_405 = SEGMENT("HTTP/1.1 405 Method Not Allowed\r\nAllow: GET, HEAD\r\n");
+const struct segment status_416 = SEGMENT("HTTP/1.1 416 Range Not Satisfiable\r\n");
+
+const struct segment response_100 = SEGMENT("HTTP/1.1 100 Continue\r\n\r\n");
+const struct segment response_400 = SEGMENT(
+    "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+const struct segment response_413 = SEGMENT(
+    "HTTP/1.1 413 Content Too Large\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+const struct segment response_431 = SEGMENT(
+    "HTTP/1.1 431 Request Header Fields Too Large\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+const struct segment response_501 = SEGMENT(
+    "HTTP/1.1 501 Not Implemented\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+const struct segment response_503 = SEGMENT(
+    "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\nConnection: close\r\nRetry-After: 1\r\n\r\n");
+
+// Longest URL echoed back - keeps the page (and our buffers) bounded
+#define ECHO_MAX_URL 255
+
+void http_date_update(struct http_date *date, time_t now) {
+    struct tm utc;
+
+    if (date->length > 0 && date->second == now) {
+        return;     // Still the same second - nothing to do
+    }
+    gmtime_r(&now, &utc);
+    date->length = strftime(date->header, sizeof(date->header),
+                            "Date: %a, %d %b %Y %H:%M:%S GMT\r\n", &utc);
+    date->second = now;
+}
+
+/*
+ * FUNCTION: format_number
+ * PURPOSE: Write a number as decimal digits (the only "formatting" we do)
+ * RETURNS: Number of digits written
+ */
+static size_t format_number(char *out, uint64_t value) {
+    char reversed[24];
+    size_t count = 0, i;
+
+    do {
+        reversed[count++] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value > 0);
+
+    for (i = 0; i < count; i++) {
+        out[i] = reversed[count - 1 - i];
+    }
+    return count;
+}
+
+void response_add(struct response *response, const void *data, size_t length) {
+    response->parts[response->count].iov_base = (void *)data;
+    response->parts[response->count].iov_len = length;
+    response->count++;
+    response->length += length;
+}
+
+void response_add_segment(struct response *response, const struct segment *segment) {
+    response_add(response, segment->data, segment->length);
+}
+
+void response_copy(struct response *response, const void *data, size_t length) {
+    char *end = arena_alloc(&response->arena, length, 1);
+    struct iovec *last = response->count > 0 ? &response->parts[response->count - 1] : NULL;
+
+    memcpy(end, data, length);
+
+    // Adjacent copies merge into a single part
+    if (last != NULL && (char *)last->iov_base + last->iov_len == end) {
+        last->iov_len += length;
+        response->length += length;
+    } else {
+        response_add(response, end, length);
+    }
+}
+
+void response_copy_number(struct response *response, uint64_t value) {
+    char digits[24];
+    response_copy(response, digits, format_number(digits, value));
+}
+
+void response_start(struct response *response, const struct segment *status) {
+    response->count = 0;
+    response->length = 0;
+    arena_init(&response->arena, response->scratch, sizeof(response->scratch));
+    response_add_segment(response, status);
+}
+
+void response_end_headers(struct response *response, const struct http_date *date,
+                          int keep_alive, uint64_t body_length) {
+    const struct segment *end = keep_alive ? &keep_alive_end : &close_end;
+
+    // The Date changes every second, so these are copied
+    response_copy(response, date->header, date->length);
+    response_copy(response, content_length.data, content_length.length);
+    response_copy_number(response, body_length);
+    response_copy(response, end->data, end->length);
+}
+
+void response_end_stream_headers(struct response *response, const struct http_date *date, int keep_alive) {
+    const struct segment *end = keep_alive ? &keep_alive_end : &close_end;
+
+    // The end segments start by closing the Content-Length line - skip that
+    response_copy(response, date->header, date->length);
+    response_copy(response, end->data + 2, end->length - 2);
+}
+
+void response_empty(struct response *response, const struct http_date *date,
+                    const struct segment *status, int keep_alive) {
+    response_start(response, status);
+    response_end_headers(response, date, keep_alive, 0);
+}
+
+int response_echo_body(struct iovec *body, int tls,
+                       const char *method, size_t method_length,
+                       const char *url, size_t url_length) {
+    const struct segment *head = tls ? &echo_head_tls : &echo_head_plain;
+
+    if (url_length > ECHO_MAX_URL) {
+        url_length = ECHO_MAX_URL;
+    }
+
+    body[0].iov_base = (void *)head->data;
+    body[0].iov_len = head->length;
+    body[1].iov_base = (void *)method;
+    body[1].iov_len = method_length;
+    body[2].iov_base = (void *)echo_middle.data;
+    body[2].iov_len = echo_middle.length;
+    body[3].iov_base = (void *)url;
+    body[3].iov_len = url_length;
+    body[4].iov_base = (void *)echo_tail.data;
+    body[4].iov_len = echo_tail.length;
+    return RESPONSE_ECHO_PARTS;
+}
@@ -0,0 +1,391 @@
+/*
+ * =============================================================================
+ * ROUTER IMPLEMENTATION - RADIX TRIE, FLAT LAYOUT, LONGEST PREFIX MATCH
+ * =============================================================================
+ * Registration builds an ordinary pointer trie (it happens once, at
+ * startup). router_finish() then copies it breadth-first into one array:
+ * breadth-first order puts the children of every node next to each other,
+ * so a node only needs the index of its first child and a count.
+ *
+ *     "/", "/api/", "/assets/"      nodes[0]  ""       children 1..1
+ *                                   nodes[1]  "/"      children 2..2
+ *                                   nodes[2]  "a"      children 3..4
+ *                                   nodes[3]  "pi/"
+ *                                   nodes[4]  "ssets/"
+ * =============================================================================
+ */
+
+#include <stdio.h>          // fprintf
+#include <stdlib.h>         // malloc, calloc, realloc, free
+#include <string.h>         // memcpy, memcmp, strlen
+
+#include "compress.h"
+#include "router.h"
+
+struct route {
+    char method[ROUTER_METHOD_MAX + 1];
+    size_t method_length;           // 0 = any method
+    http_handler handler;
+    http_body_handler body;         // NULL = bodies are thrown away
+    void *arg;
+    int next;                       // Next route for the same prefix, -1 = none
+};
+
+/*
+ * STRUCT: radix_node
+ * PURPOSE: One node of the finished trie - four of them share a cache line
+ */
+struct radix_node {
+    uint32_t label;                 // Offset of the edge label in labels[]
+    uint32_t first_child;           // Children: nodes[first_child ... + child_count - 1]
+    int32_t route;                  // First route for exactly this prefix, -1 if none
+    uint16_t label_length;
+    uint16_t child_count;           // Their labels all start with different bytes
+};
+
+// Registration only
+struct build_node {
+    char *label;
+    size_t length;
+    struct build_node **children;
+    int child_count;
+    int route;
+};
+
+static struct route *routes;
+static int route_count;
+static struct build_node build_root = { NULL, 0, NULL, 0, -1 };
+
+// After router_finish() - read-only, shared by all workers
+static struct radix_node *nodes;
+static char *labels;
+
+static const struct segment status_405_bare = SEGMENT("HTTP/1.1 405 Method Not Allowed\r\n");
+
+#define ALLOW_MAX_METHODS 8         // Listed in a 405 (keeps it within RESPONSE_SCRATCH)
+
+// -----------------------------------------------------------------------------
+// Registration
+// -----------------------------------------------------------------------------
+
+static struct build_node *new_node(const char *label, size_t length) {
+    struct build_node *node = calloc(1, sizeof(*node));
+
+    if (!node || !(node->label = malloc(length))) {
+        free(node);
+        return NULL;
+    }
+    memcpy(node->label, label, length);
+    node->length = length;
+    node->route = -1;
+    return node;
+}
+
+static int add_child(struct build_node *parent, struct build_node *child) {
+    struct build_node **children = realloc(parent->children,
+                                           (size_t)(parent->child_count + 1) * sizeof(*children));
+    if (!children) {
+        return -1;
+    }
+    children[parent->child_count++] = child;
+    parent->children = children;
+    return 0;
+}
+
+/*
+ * FUNCTION: insert
+ * PURPOSE: Find (or make) the node for exactly this prefix
+ * RETURNS: The node, or NULL if out of memory
+ */
+static struct build_node *insert(struct build_node *node, const char *key, size_t length) {
+    while (length > 0) {
+        struct build_node *child = NULL;
+        size_t common = 0;
+        int i;
+
+        for (i = 0; i < node->child_count; i++) {
+            if (node->children[i]->label[0] == key[0]) {
+                child = node->children[i];
+                break;
+            }
+        }
+        if (!child) {
+            child = new_node(key, length);
+            if (!child || add_child(node, child) < 0) {
+                return NULL;
+            }
+            return child;
+        }
+
+        while (common < child->length && common < length && child->label[common] == key[common]) {
+            common++;
+        }
+        if (common < child->length) {
+            // The key ends or turns off inside this edge: split it in two
+            struct build_node *rest = new_node(child->label + common, child->length - common);
+            if (!rest) {
+                return NULL;
+            }
+            rest->children = child->children;
+            rest->child_count = child->child_count;
+            rest->route = child->route;
+            child->children = NULL;
+            child->child_count = 0;
+            child->route = -1;
+            child->length = common;
+            if (add_child(child, rest) < 0) {
+                return NULL;
+            }
+        }
+        node = child;
+        key += common;
+        length -= common;
+    }
+    return node;
+}
+
+int router_add(const char *method, const char *prefix, http_handler handler, void *arg) {
+    return router_add_body(method, prefix, handler, NULL, arg);
+}
+
+int router_add_body(const char *method, const char *prefix, http_handler handler,
+                    http_body_handler body, void *arg) {
+    size_t method_length = method ? strlen(method) : 0;
+    size_t length = strlen(prefix);
+    struct build_node *node;
+    struct route *grown;
+    int r;
+
+    if (nodes || prefix[0] != '/' || length > UINT16_MAX || method_length > ROUTER_METHOD_MAX) {
+        fprintf(stderr, "Invalid route %s %s\n", method ? method : "*", prefix);
+        return -1;
+    }
+
+    node = insert(&build_root, prefix, length);
+    if (!node) {
+        perror("Unable to add route");
+        return -1;
+    }
+    for (r = node->route; r >= 0; r = routes[r].next) {
+        if (routes[r].method_length == method_length &&
+            memcmp(routes[r].method, method ? method : "", method_length) == 0) {
+            fprintf(stderr, "Route %s %s registered twice\n", method ? method : "*", prefix);
+            return -1;
+        }
+    }
+
+    grown = realloc(routes, (size_t)(route_count + 1) * sizeof(*routes));
+    if (!grown) {
+        perror("Unable to add route");
+        return -1;
+    }
+    routes = grown;
+    memset(&routes[route_count], 0, sizeof(routes[route_count]));
+    memcpy(routes[route_count].method, method ? method : "", method_length);
+    routes[route_count].method_length = method_length;
+    routes[route_count].handler = handler;
+    routes[route_count].body = body;
+    routes[route_count].arg = arg;
+    routes[route_count].next = node->route;
+    node->route = route_count++;
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+// Flattening
+// -----------------------------------------------------------------------------
+
+static void count_nodes(const struct build_node *node, size_t *count, size_t *label_bytes) {
+    int i;
+
+    (*count)++;
+    *label_bytes += node->length;
+    for (i = 0; i < node->child_count; i++) {
+        count_nodes(node->children[i], count, label_bytes);
+    }
+}
+
+static void free_build_node(struct build_node *node) {
+    int i;
+
+    for (i = 0; i < node->child_count; i++) {
+        free_build_node(node->children[i]);
+        free(node->children[i]);
+    }
+    free(node->children);
+    free(node->label);
+}
+
+int router_finish(void) {
+    size_t count = 0, label_bytes = 0, head, tail = 1, used = 0;
+    const struct build_node **order;
+    int i;
+
+    count_nodes(&build_root, &count, &label_bytes);
+    order = malloc(count * sizeof(*order));
+    nodes = calloc(count, sizeof(*nodes));
+    labels = malloc(label_bytes + 1);
+    if (!order || !nodes || !labels) {
+        perror("Unable to build routing table");
+        free(order);
+        return -1;
+    }
+
+    // Breadth first: a node's children are queued - and numbered - together
+    order[0] = &build_root;
+    for (head = 0; head < count; head++) {
+        const struct build_node *from = order[head];
+        struct radix_node *to = &nodes[head];
+
+        memcpy(labels + used, from->label, from->length);
+        to->label = (uint32_t)used;
+        to->label_length = (uint16_t)from->length;
+        to->route = from->route;
+        to->first_child = (uint32_t)tail;
+        to->child_count = (uint16_t)from->child_count;
+        used += from->length;
+        for (i = 0; i < from->child_count; i++) {
+            order[tail++] = from->children[i];
+        }
+    }
+
+    free(order);
+    free_build_node(&build_root);
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+// Lookup
+// -----------------------------------------------------------------------------
+
+/*
+ * FUNCTION: match
+ * PURPOSE: Longest prefix of path with a route for this method
+ * PARAMETER: refused - set to the deepest node whose routes all wanted
+ *            another method (for the 405's Allow header), else left alone
+ * RETURNS: The route, or NULL if there is none
+ */
+static const struct route *match(const char *method, size_t method_length,
+                                 const char *path, size_t length, const struct radix_node **refused) {
+    const struct radix_node *node = &nodes[0];
+    const struct route *best = NULL;
+    size_t position = 0;
+
+    while (1) {
+        const struct route *any = NULL, *exact = NULL;
+        const struct radix_node *next = NULL;
+        int r, i;
+
+        // A route for this very method beats one for any method
+        for (r = node->route; r >= 0 && !exact; r = routes[r].next) {
+            if (routes[r].method_length == 0) {
+                any = &routes[r];
+            } else if (routes[r].method_length == method_length &&
+                       memcmp(routes[r].method, method, method_length) == 0) {
+                exact = &routes[r];
+            }
+        }
+        if (exact || any) {
+            best = exact ? exact : any;
+        } else if (node->route >= 0) {
+            *refused = node;
+        }
+
+        if (position == length) {
+            break;
+        }
+        for (i = 0; i < node->child_count; i++) {
+            const struct radix_node *child = &nodes[node->first_child + (uint32_t)i];
+            if (labels[child->label] == path[position]) {
+                next = child;
+                break;
+            }
+        }
+        if (!next || next->label_length > length - position ||
+            memcmp(labels + next->label, path + position, next->label_length) != 0) {
+            break;
+        }
+        position += next->label_length;
+        node = next;
+    }
+    return best;
+}
+
+/*
+ * FUNCTION: queue_refusal
+ * PURPOSE: 404 when no prefix matched, 405 listing the methods that would work
+ */
+static int queue_refusal(const struct http_context *context, const struct radix_node *refused) {
+    struct response response;
+    int r, listed = 0;
+
+    if (!output_has_room(context->output, RESPONSE_MAX_PARTS, RESPONSE_SCRATCH)) {
+        return 0;
+    }
+    if (!refused) {
+        response_empty(&response, context->date, &status_404, context->keep_alive);
+    } else {
+        response_start(&response, &status_405_bare);
+        response_copy(&response, "Allow: ", 7);
+        for (r = refused->route; r >= 0 && listed < ALLOW_MAX_METHODS; r = routes[r].next, listed++) {
+            if (listed > 0) {
+                response_copy(&response, ", ", 2);
+            }
+            response_copy(&response, routes[r].method, routes[r].method_length);
+        }
+        response_copy(&response, "\r\n", 2);
+        response_end_headers(&response, context->date, context->keep_alive, 0);
+    }
+    output_push_response(context->output, &response);
+    return 1;
+}
+
+int router_dispatch(const struct http_context *context) {
+    const struct http_request *request = context->request;
+    const struct radix_node *refused = NULL;
+    const struct route *route = NULL;
+
+    if (nodes) {
+        route = match(context->data + request->method.offset, request->method.length,
+                      context->data + request->path.offset, request->path.length, &refused);
+    }
+    if (!route) {
+        return queue_refusal(context, refused);
+    }
+    return route->handler(context, route->arg);
+}
+
+int router_dispatch_body(const struct http_context *context, const char *chunk, size_t length) {
+    const struct http_request *request = context->request;
+    const struct radix_node *refused = NULL;
+    const struct route *route = NULL;
+
+    // Looked up again for every piece - a few trie nodes, cheaper than
+    // making every connection remember its route
+    if (nodes) {
+        route = match(context->data + request->method.offset, request->method.length,
+                      context->data + request->path.offset, request->path.length, &refused);
+    }
+    if (!route || !route->body) {
+        return 1;
+    }
+    return route->body(context, route->arg, chunk, length);
+}
+
+// -----------------------------------------------------------------------------
+// Built-in handlers
+// -----------------------------------------------------------------------------
+
+int echo_handler(const struct http_context *context, void *arg) {
+    const struct http_request *request = context->request;
+    // The URL is the path plus "?query" - they sit next to each other in data
+    size_t url_length = request->path.length + (request->query.length ? request->query.length + 1 : 0);
+    struct iovec body[RESPONSE_ECHO_PARTS];
+    int count;
+
+    (void)arg;
+    count = response_echo_body(body, context->tls,
+                               context->data + request->method.offset, request->method.length,
+                               context->data + request->path.offset, url_length);
+    return compress_queue_body(context, &status_200, &content_type_html, body, count);
+}
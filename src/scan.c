@@ -0,0 +1,187 @@
+/*
+ * =============================================================================
+ * SCAN IMPLEMENTATION - SCALAR, SSE4.2, AVX2 AND NEON KERNELS
+ * =============================================================================
+ * Every SIMD kernel has the same shape:
+ *   1. Load a block of bytes into a vector register
+ *   2. Compare all of them against a, b and c at once
+ *   3. If any matched, the position of the first match is the answer
+ *   4. The last partial block is finished with the scalar loop, so we never
+ *      read past the end of the caller's data
+ *
+ * The x86 kernels are compiled with __attribute__((target(...))) so the rest
+ * of the program doesn't need -mavx2 and still runs on older CPUs.
+ * =============================================================================
+ */
+
+#include <string.h>     // strcmp
+
+#include "scan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>  // SSE4.2 and AVX2 intrinsics
+#endif
+#if defined(__aarch64__) || defined(__ARM_NEON)
+#include <arm_neon.h>   // NEON intrinsics
+#endif
+
+size_t scan3_scalar(const char *data, size_t position, size_t end, char a, char b, char c) {
+    while (position < end) {
+        char ch = data[position];
+        if (ch == a || ch == b || ch == c) {
+            return position;
+        }
+        position++;
+    }
+    return end;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+/*
+ * FUNCTION: scan3_sse42
+ * PURPOSE: 16 bytes per step with PCMPESTRI ("find any of these characters")
+ */
+__attribute__((target("sse4.2")))
+size_t scan3_sse42(const char *data, size_t position, size_t end, char a, char b, char c) {
+    const __m128i needles = _mm_setr_epi8(a, b, c, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+
+    while (position + 16 <= end) {
+        __m128i block = _mm_loadu_si128((const __m128i *)(data + position));
+        int index = _mm_cmpestri(needles, 3, block, 16,
+                                 _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY | _SIDD_LEAST_SIGNIFICANT);
+        if (index < 16) {
+            return position + (size_t)index;
+        }
+        position += 16;
+    }
+    return scan3_scalar(data, position, end, a, b, c);
+}
+
+/*
+ * FUNCTION: scan3_avx2
+ * PURPOSE: 32 bytes per step: three compares, OR them, take the first set bit
+ */
+__attribute__((target("avx2")))
+size_t scan3_avx2(const char *data, size_t position, size_t end, char a, char b, char c) {
+    const __m256i va = _mm256_set1_epi8(a);
+    const __m256i vb = _mm256_set1_epi8(b);
+    const __m256i vc = _mm256_set1_epi8(c);
+
+    while (position + 32 <= end) {
+        __m256i block = _mm256_loadu_si256((const __m256i *)(data + position));
+        __m256i hits = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(block, va),
+                                                       _mm256_cmpeq_epi8(block, vb)),
+                                       _mm256_cmpeq_epi8(block, vc));
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(hits);
+        if (mask) {
+            return position + (size_t)__builtin_ctz(mask);
+        }
+        position += 32;
+    }
+    // Finish with one 16-byte step before falling back to bytes
+    if (position + 16 <= end) {
+        __m128i block = _mm_loadu_si128((const __m128i *)(data + position));
+        __m128i hits = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(block, _mm_set1_epi8(a)),
+                                                 _mm_cmpeq_epi8(block, _mm_set1_epi8(b))),
+                                    _mm_cmpeq_epi8(block, _mm_set1_epi8(c)));
+        unsigned int mask = (unsigned int)_mm_movemask_epi8(hits);
+        if (mask) {
+            return position + (size_t)__builtin_ctz(mask);
+        }
+        position += 16;
+    }
+    return scan3_scalar(data, position, end, a, b, c);
+}
+
+#endif // x86
+
+#if defined(__aarch64__) || defined(__ARM_NEON)
+
+/*
+ * FUNCTION: scan3_neon
+ * PURPOSE: 16 bytes per step on ARM
+ * WHY: NEON has no "movemask", so the 16 compare results (0x00 or 0xFF) are
+ *      narrowed to 4 bits each - giving a 64-bit mask where the first match
+ *      is at (trailing zero bits / 4)
+ */
+size_t scan3_neon(const char *data, size_t position, size_t end, char a, char b, char c) {
+    const uint8x16_t va = vdupq_n_u8((uint8_t)a);
+    const uint8x16_t vb = vdupq_n_u8((uint8_t)b);
+    const uint8x16_t vc = vdupq_n_u8((uint8_t)c);
+
+    while (position + 16 <= end) {
+        uint8x16_t block = vld1q_u8((const uint8_t *)(data + position));
+        uint8x16_t hits = vorrq_u8(vorrq_u8(vceqq_u8(block, va), vceqq_u8(block, vb)),
+                                   vceqq_u8(block, vc));
+        uint8x8_t narrowed = vshrn_n_u16(vreinterpretq_u16_u8(hits), 4);
+        uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(narrowed), 0);
+        if (mask) {
+            return position + (size_t)(__builtin_ctzll(mask) >> 2);
+        }
+        position += 16;
+    }
+    return scan3_scalar(data, position, end, a, b, c);
+}
+
+#endif // ARM
+
+int scan_available(const char *name) {
+    if (strcmp(name, "scalar") == 0) {
+        return 1;
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (strcmp(name, "sse4.2") == 0) {
+        return __builtin_cpu_supports("sse4.2");
+    }
+    if (strcmp(name, "avx2") == 0) {
+        return __builtin_cpu_supports("avx2");
+    }
+#endif
+#if defined(__aarch64__) || defined(__ARM_NEON)
+    if (strcmp(name, "neon") == 0) {
+        return 1;
+    }
+#endif
+    return 0;
+}
+
+static const char *implementation_name = "scalar";
+
+/*
+ * FUNCTION: scan3_resolve
+ * PURPOSE: First call of scan3(): pick the best kernel, remember it, use it
+ * WHY: After this, scan3 points straight at the kernel - no checks per call.
+ *      Two threads racing here both store the same value, which is harmless.
+ */
+static size_t scan3_resolve(const char *data, size_t position, size_t end, char a, char b, char c) {
+    scan3_fn best = scan3_scalar;
+    const char *name = "scalar";
+
+#if defined(__x86_64__) || defined(__i386__)
+    if (scan_available("avx2")) {
+        best = scan3_avx2;
+        name = "avx2";
+    } else if (scan_available("sse4.2")) {
+        best = scan3_sse42;
+        name = "sse4.2";
+    }
+#elif defined(__aarch64__) || defined(__ARM_NEON)
+    best = scan3_neon;
+    name = "neon";
+#endif
+
+    implementation_name = name;
+    scan3 = best;
+    return best(data, position, end, a, b, c);
+}
+
+scan3_fn scan3 = scan3_resolve;
+
+const char *scan_implementation_name(void) {
+    if (scan3 == scan3_resolve) {
+        scan3_resolve("", 0, 0, 0, 0, 0);   // Force the choice
+    }
+    return implementation_name;
+}
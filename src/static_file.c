@@ -0,0 +1,516 @@
+/*
+ * =============================================================================
+ * STATIC FILE IMPLEMENTATION - PATH MAPPING, RANGE REQUESTS, FILE PARTS
+ * =============================================================================
+ */
+
+#include <string.h>         // memcpy, memcmp, strlen
+#include <strings.h>        // strncasecmp
+#include <errno.h>          // errno, EACCES
+#include <fcntl.h>          // open
+#include <limits.h>         // PATH_MAX
+#include <unistd.h>         // close
+#include <sys/stat.h>       // fstat
+
+#include "compress.h"
+#include "config.h"
+#include "file_cache.h"
+#include "static_file.h"
+
+static const struct segment accept_ranges = SEGMENT("Accept-Ranges: bytes\r\n");
+static const struct segment index_file = SEGMENT("index.html");
+
+// -----------------------------------------------------------------------------
+// Content types by file extension
+// -----------------------------------------------------------------------------
+
+struct content_type {
+    const char *extension;
+    struct segment header;
+};
+
+#define CONTENT_TYPE(ext, type) { ext, SEGMENT("Content-Type: " type "\r\n") }
+
+static const struct content_type content_types[] = {
+    CONTENT_TYPE("html", "text/html"),
+    CONTENT_TYPE("htm", "text/html"),
+    CONTENT_TYPE("css", "text/css"),
+    CONTENT_TYPE("js", "text/javascript"),
+    CONTENT_TYPE("json", "application/json"),
+    CONTENT_TYPE("txt", "text/plain"),
+    CONTENT_TYPE("xml", "application/xml"),
+    CONTENT_TYPE("svg", "image/svg+xml"),
+    CONTENT_TYPE("png", "image/png"),
+    CONTENT_TYPE("jpg", "image/jpeg"),
+    CONTENT_TYPE("jpeg", "image/jpeg"),
+    CONTENT_TYPE("gif", "image/gif"),
+    CONTENT_TYPE("webp", "image/webp"),
+    CONTENT_TYPE("ico", "image/x-icon"),
+    CONTENT_TYPE("woff2", "font/woff2"),
+    CONTENT_TYPE("wasm", "application/wasm"),
+    CONTENT_TYPE("pdf", "application/pdf"),
+    CONTENT_TYPE("mp4", "video/mp4"),
+};
+
+static const struct segment default_content_type = SEGMENT("Content-Type: application/octet-stream\r\n");
+
+static const struct segment *content_type_for(const char *path, size_t length) {
+    size_t dot = length, i;
+
+    while (dot > 0 && path[dot - 1] != '.' && path[dot - 1] != '/') {
+        dot--;
+    }
+    if (dot == 0 || path[dot - 1] != '.') {
+        return &default_content_type;
+    }
+    for (i = 0; i < sizeof(content_types) / sizeof(content_types[0]); i++) {
+        const char *extension = content_types[i].extension;
+        if (strlen(extension) == length - dot &&
+            strncasecmp(path + dot, extension, length - dot) == 0) {
+            return &content_types[i].header;
+        }
+    }
+    return &default_content_type;
+}
+
+// -----------------------------------------------------------------------------
+// URL to file path
+// -----------------------------------------------------------------------------
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+/*
+ * FUNCTION: map_path
+ * PURPOSE: Turn the URL path into "<root><decoded path>[index.html]"
+ * RETURNS: Length of the path written to out, or 0 if the URL is refused
+ * RULE: Decoding happens BEFORE the ".." check - otherwise "/%2e%2e/" would
+ *       slip through
+ */
+static size_t map_path(char *out, size_t size, const char *url, size_t url_length) {
+    size_t root_length = strlen(config.document_root);
+    size_t length = root_length, segment_start, i;
+
+    if (url_length == 0 || url[0] != '/' || root_length + url_length + index_file.length >= size) {
+        return 0;
+    }
+    memcpy(out, config.document_root, root_length);
+
+    segment_start = length;
+    for (i = 0; i < url_length; i++) {
+        char c = url[i];
+
+        if (c == '%') {
+            int high = i + 2 < url_length ? hex_value(url[i + 1]) : -1;
+            int low = i + 2 < url_length ? hex_value(url[i + 2]) : -1;
+            if (high < 0 || low < 0) {
+                return 0;
+            }
+            c = (char)(high * 16 + low);
+            i += 2;
+            if (c == '\0' || c == '\\') {
+                return 0;
+            }
+        }
+
+        if (c == '/') {
+            // A segment just ended - refuse "..", the only way out of the root
+            if (length - segment_start == 2 && memcmp(out + segment_start, "..", 2) == 0) {
+                return 0;
+            }
+            segment_start = length + 1;
+        }
+        out[length++] = c;
+    }
+    if (length - segment_start == 2 && memcmp(out + segment_start, "..", 2) == 0) {
+        return 0;
+    }
+
+    // A directory URL means its index page
+    if (out[length - 1] == '/') {
+        memcpy(out + length, index_file.data, index_file.length);
+        length += index_file.length;
+    }
+    out[length] = '\0';
+    return length;
+}
+
+// -----------------------------------------------------------------------------
+// Range requests
+// -----------------------------------------------------------------------------
+
+enum range_result {
+    RANGE_NONE,             // No usable Range header - send the whole file
+    RANGE_OK,               // Send bytes first..last
+    RANGE_UNSATISFIABLE     // The range lies outside the file (416)
+};
+
+/*
+ * FUNCTION: parse_number
+ * RETURNS: Index after the digits, or `start` if there are none (or overflow)
+ */
+static size_t parse_number(const char *text, size_t start, size_t end, uint64_t *value) {
+    size_t i = start;
+
+    *value = 0;
+    while (i < end && text[i] >= '0' && text[i] <= '9') {
+        if (*value > (UINT64_MAX - 9) / 10) {
+            return start;
+        }
+        *value = *value * 10 + (uint64_t)(text[i] - '0');
+        i++;
+    }
+    return i;
+}
+
+/*
+ * FUNCTION: parse_range
+ * PURPOSE: Understand "bytes=first-last", "bytes=first-" and "bytes=-suffix"
+ * WHY: Anything else (several ranges, other units, junk) may legally be
+ *      ignored by answering with the whole file, so that is what we do
+ */
+static enum range_result parse_range(const char *value, size_t length, uint64_t size,
+                                     uint64_t *first, uint64_t *last) {
+    size_t position = 6, next;
+
+    if (length < 7 || strncasecmp(value, "bytes=", 6) != 0 || memchr(value, ',', length)) {
+        return RANGE_NONE;
+    }
+
+    if (value[position] == '-') {
+        // Suffix range: the last N bytes
+        uint64_t suffix;
+        next = parse_number(value, position + 1, length, &suffix);
+        if (next == position + 1 || next != length) {
+            return RANGE_NONE;
+        }
+        if (suffix == 0 || size == 0) {
+            return RANGE_UNSATISFIABLE;
+        }
+        *first = suffix < size ? size - suffix : 0;
+        *last = size - 1;
+        return RANGE_OK;
+    }
+
+    next = parse_number(value, position, length, first);
+    if (next == position || next == length || value[next] != '-') {
+        return RANGE_NONE;
+    }
+    position = next + 1;
+    if (position == length) {
+        *last = UINT64_MAX;     // "first-" means up to the end
+    } else {
+        next = parse_number(value, position, length, last);
+        if (next == position || next != length || *last < *first) {
+            return RANGE_NONE;
+        }
+    }
+
+    if (*first >= size) {
+        return RANGE_UNSATISFIABLE;
+    }
+    if (*last >= size) {
+        *last = size - 1;
+    }
+    return RANGE_OK;
+}
+
+// -----------------------------------------------------------------------------
+// The handler
+// -----------------------------------------------------------------------------
+
+static int is_method(const char *data, const struct http_request *request, const char *name) {
+    size_t length = strlen(name);
+    return request->method.length == length && memcmp(data + request->method.offset, name, length) == 0;
+}
+
+/*
+ * FUNCTION: queue_status
+ * PURPOSE: Queue a body-less error answer (the room was checked by the caller)
+ */
+static int queue_status(struct output_queue *output, const struct http_date *date,
+                        const struct segment *status, int keep_alive) {
+    struct response response;
+    response_empty(&response, date, status, keep_alive);
+    output_push_response(output, &response);
+    return 1;
+}
+
+// -----------------------------------------------------------------------------
+// Conditional requests
+// -----------------------------------------------------------------------------
+
+static int header_equals(const struct http_header *header, const char *data, const char *value, size_t length) {
+    return header->value.length == length && memcmp(data + header->value.offset, value, length) == 0;
+}
+
+/*
+ * FUNCTION: etag_listed
+ * PURPOSE: Whether an If-None-Match list names this ETag, or is "*"
+ * WHY: If-None-Match compares weakly - W/"x" matches "x"
+ */
+static int etag_listed(const char *list, size_t length, const struct file_tags *tags) {
+    size_t i = 0;
+
+    while (i < length) {
+        size_t start, end;
+
+        while (i < length && (list[i] == ' ' || list[i] == '\t' || list[i] == ',')) {
+            i++;
+        }
+        start = i;
+        while (i < length && list[i] != ',') {
+            i++;
+        }
+        end = i;
+        while (end > start && (list[end - 1] == ' ' || list[end - 1] == '\t')) {
+            end--;
+        }
+        if (end - start >= 2 && list[start] == 'W' && list[start + 1] == '/') {
+            start += 2;
+        }
+        if ((end - start == 1 && list[start] == '*') ||
+            (end - start == tags->etag_length && memcmp(list + start, tags->etag, tags->etag_length) == 0)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * FUNCTION: not_modified
+ * PURPOSE: Whether the client's copy is still current (answer 304)
+ * RULE: If-None-Match wins - If-Modified-Since only counts without it
+ */
+static int not_modified(const struct http_request *request, const char *data, const struct file_tags *tags) {
+    const struct http_header *header = http_find_header(request, data, "If-None-Match");
+
+    if (header) {
+        return etag_listed(data + header->value.offset, header->value.length, tags);
+    }
+    // Clients send back exactly the Last-Modified they got - no date parsing
+    header = http_find_header(request, data, "If-Modified-Since");
+    return header && header_equals(header, data, tags->last_modified, tags->last_modified_length);
+}
+
+/*
+ * FUNCTION: range_allowed
+ * PURPOSE: "If-Range: <validator>" asks for the range only if the file is
+ *          still the version the client has - otherwise for all of it
+ */
+static int range_allowed(const struct http_request *request, const char *data, const struct file_tags *tags) {
+    const struct http_header *header = http_find_header(request, data, "If-Range");
+
+    return !header || header_equals(header, data, tags->etag, tags->etag_length) ||
+           header_equals(header, data, tags->last_modified, tags->last_modified_length);
+}
+
+// -----------------------------------------------------------------------------
+// The handler
+// -----------------------------------------------------------------------------
+
+/*
+ * STRUCT: file_source
+ * PURPOSE: What an answer is sent from: a cache entry or an open file, and
+ *          which version of it (as it is, or a compressed variant)
+ */
+struct file_source {
+    struct file_entry *entry;       // Cached - we hold one reference
+    int fd;                         // Not cached - -1 when entry is set
+    struct stat info;               //   its fstat()
+    struct file_tags own_tags;      //   and validators
+    const struct file_tags *tags;   // Of the chosen version
+    const char *cached;             // Its bytes, if cached
+    uint64_t size;
+    enum content_encoding encoding;
+};
+
+static void source_done(struct file_source *source) {
+    if (source->entry) {
+        file_cache_release(source->entry);
+    } else {
+        close(source->fd);
+    }
+}
+
+/*
+ * FUNCTION: choose_variant
+ * PURPOSE: Switch the source to the best compressed version the client takes
+ */
+static void choose_variant(struct file_source *source, const char *path, size_t path_length, int accepted) {
+    enum content_encoding encoding;
+    size_t size;
+    int fd;
+
+    if (source->entry) {
+        encoding = accepted & ACCEPT_BROTLI && source->entry->versions[ENCODING_BROTLI].data ? ENCODING_BROTLI :
+                   accepted & ACCEPT_GZIP && source->entry->versions[ENCODING_GZIP].data ? ENCODING_GZIP :
+                   ENCODING_IDENTITY;
+        if (encoding != ENCODING_IDENTITY) {
+            const struct file_version *version = &source->entry->versions[encoding];
+            source->cached = version->data;
+            source->size = version->size;
+            source->tags = &version->tags;
+            source->encoding = encoding;
+        }
+        return;
+    }
+
+    fd = compress_open_variant(path, path_length, &source->info, accepted, &encoding, &size);
+    if (fd >= 0) {
+        close(source->fd);
+        source->fd = fd;
+        source->size = size;
+        file_tags_build(&source->own_tags, &source->info, encoding);
+        source->encoding = encoding;
+    }
+}
+
+int static_file_handler(const struct http_context *context, void *arg) {
+    struct output_queue *output = context->output;
+    const struct http_date *date = context->date;
+    const struct http_request *request = context->request;
+    const char *data = context->data;
+    int keep_alive = context->keep_alive;
+    const struct http_header *range;
+    const struct segment *content_type;
+    struct file_source source;
+    struct response response;
+    char path[PATH_MAX];
+    size_t path_length;
+    uint64_t first = 0, last = 0, size, ticket;
+    enum range_result ranged = RANGE_NONE;
+    int head, vary;
+
+    (void)arg;
+
+    // Every answer below is one response plus at most one file part
+    if (!output_has_room(output, RESPONSE_MAX_PARTS + 1, RESPONSE_SCRATCH)) {
+        return 0;
+    }
+
+    head = is_method(data, request, "HEAD");
+    if (!head && !is_method(data, request, "GET")) {
+        return queue_status(output, date, &status_405, keep_alive);
+    }
+
+    path_length = map_path(path, sizeof(path), data + request->path.offset, request->path.length);
+    if (path_length == 0) {
+        return queue_status(output, date, &status_403, keep_alive);
+    }
+    content_type = content_type_for(path, path_length);
+
+    // A hot file is answered from memory, without a single system call
+    source.fd = -1;
+    source.entry = file_cache_get(path, path_length, &ticket);
+    if (!source.entry) {
+        source.fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (source.fd < 0) {
+            return queue_status(output, date, errno == EACCES ? &status_403 : &status_404, keep_alive);
+        }
+        if (fstat(source.fd, &source.info) < 0 || !S_ISREG(source.info.st_mode)) {
+            close(source.fd);
+            return queue_status(output, date, &status_404, keep_alive);
+        }
+        source.entry = file_cache_add(path, path_length, ticket, source.fd, &source.info, content_type);
+        if (source.entry) {
+            close(source.fd);
+            source.fd = -1;
+        }
+    }
+    source.encoding = ENCODING_IDENTITY;
+    source.cached = NULL;
+    if (source.entry) {
+        source.cached = source.entry->versions[ENCODING_IDENTITY].data;
+        source.size = source.entry->versions[ENCODING_IDENTITY].size;
+        source.tags = &source.entry->versions[ENCODING_IDENTITY].tags;
+    } else {
+        source.size = (uint64_t)source.info.st_size;
+        file_tags_build(&source.own_tags, &source.info, ENCODING_IDENTITY);
+        source.tags = &source.own_tags;
+    }
+    size = source.size;
+
+    range = http_find_header(request, data, "Range");
+    if (range && range_allowed(request, data, source.tags)) {
+        ranged = parse_range(data + range->value.offset, range->value.length, size, &first, &last);
+    }
+
+    // A whole text file goes out as its precompressed variant if there is
+    // one - a range always means bytes of the file as it is on disk
+    vary = compress_worthwhile(content_type) && size >= (uint64_t)config.compress_min_size;
+    if (vary && ranged == RANGE_NONE) {
+        int accepted = compress_accepted(request, data);
+        if (accepted) {
+            choose_variant(&source, path, path_length, accepted);
+            size = source.size;
+        }
+    }
+
+    if (not_modified(request, data, source.tags)) {
+        source_done(&source);
+        response_start(&response, &status_304);
+        response_copy(&response, source.tags->header, source.tags->header_length);
+        if (vary) {
+            response_add_segment(&response, &compress_vary);
+        }
+        response_end_headers(&response, date, keep_alive, size);    // What a 200 would say
+        output_push_response(output, &response);
+        return 1;
+    }
+
+    if (ranged == RANGE_UNSATISFIABLE) {
+        source_done(&source);
+        response_start(&response, &status_416);
+        response_copy(&response, "Content-Range: bytes */", 23);
+        response_copy_number(&response, size);
+        response_copy(&response, "\r\n", 2);
+        response_end_headers(&response, date, keep_alive, 0);
+        output_push_response(output, &response);
+        return 1;
+    }
+
+    if (ranged == RANGE_OK) {
+        response_start(&response, &status_206);
+        response_add_segment(&response, content_type);
+        response_add_segment(&response, &accept_ranges);
+        response_copy(&response, "Content-Range: bytes ", 21);
+        response_copy_number(&response, first);
+        response_copy(&response, "-", 1);
+        response_copy_number(&response, last);
+        response_copy(&response, "/", 1);
+        response_copy_number(&response, size);
+        response_copy(&response, "\r\n", 2);
+        size = last - first + 1;
+    } else {
+        response_start(&response, &status_200);
+        response_add_segment(&response, content_type);
+        if (source.encoding != ENCODING_IDENTITY) {
+            response_add_segment(&response, compress_header(source.encoding));
+        } else {
+            response_add_segment(&response, &accept_ranges);
+        }
+    }
+    response_copy(&response, source.tags->header, source.tags->header_length);
+    if (vary) {
+        response_add_segment(&response, &compress_vary);
+    }
+    response_end_headers(&response, date, keep_alive, size);
+    output_push_response(output, &response);
+
+    if (head) {
+        source_done(&source);
+        return 1;
+    }
+    if (source.entry) {
+        // Our reference travels with the part and is dropped once it is sent
+        output_push_cached(output, source.cached, (off_t)first, (size_t)size, &source.entry->hold);
+    } else {
+        output_push_file(output, source.fd, (off_t)first, (size_t)size);
+    }
+    return 1;
+}
@@ -0,0 +1,310 @@
+/*
+ * =============================================================================
+ * STREAM IMPLEMENTATION - HEADS WITHOUT A LENGTH, BODIES IN CHUNKS
+ * =============================================================================
+ * A piece is made STREAM_CHUNK_HEAD bytes into its buffer, so the chunk
+ * size line can be written right in front of it and the CRLF behind it:
+ * every chunk goes out as one part of the output queue, not three.
+ *
+ *     buffer:  [  "3ff6\r\n" | fill() wrote these bytes | "\r\n" ]
+ *                 ^ queued from here
+ *
+ * A deferred head is finished the same way: fill writes its lines at the
+ * start of the buffer, and the framing and Connection header go right
+ * behind them - STREAM_HEAD_END bytes are kept free for that.
+ *
+ * A compressed answer puts a fill of its own in front of the handler's:
+ * the handler's pieces go into a buffer of the wrapper's, and what comes
+ * out of the encoder is the piece the connection sees - so chunks, DATA
+ * frames and backpressure work exactly as without.
+ * =============================================================================
+ */
+
+#include <stdio.h>          // snprintf
+#include <stdlib.h>         // malloc, free
+#include <string.h>         // memcpy, memcmp
+
+#include "compress.h"
+#include "connection.h"     // connection_resume
+#include "stream.h"
+
+static const struct segment transfer_chunked = SEGMENT("Transfer-Encoding: chunked\r\n");
+static const struct segment last_chunk = SEGMENT("0\r\n\r\n");
+static const struct segment keep_alive_end = SEGMENT("Connection: keep-alive\r\n\r\n");
+static const struct segment close_end = SEGMENT("Connection: close\r\n\r\n");
+
+/*
+ * FUNCTION: is_head
+ * PURPOSE: Whether the request only wants the head of the answer
+ */
+static int is_head(const struct http_context *context) {
+    const struct http_request *request = context->request;
+    return request->method.length == 4 && memcmp(context->data + request->method.offset, "HEAD", 4) == 0;
+}
+
+// -----------------------------------------------------------------------------
+// Compressed answers
+// -----------------------------------------------------------------------------
+
+/*
+ * STRUCT: packed_stream
+ * PURPOSE: The state of a compressing fill: the handler's fill and state,
+ *          its encoder, and the piece it is compressing
+ */
+struct packed_stream {
+    stream_fill fill;           // The handler's - NULL once it is done
+    void *state;
+    struct compressor compressor;
+    const unsigned char *input; // What of the piece isn't compressed yet
+    size_t input_length;
+    int pending;                // 1 = flushed output that didn't fit yet
+    int finishing;              // 1 = the handler is done: end the stream
+    int done;                   // 1 = all of it is out: answer 0 next
+    unsigned char piece[STREAM_PIECE];
+};
+
+static void packed_end(struct packed_stream *packed) {
+    if (packed->fill) {
+        packed->fill(packed->state, NULL, 0);
+    }
+    compressor_end(&packed->compressor);
+    free(packed);
+}
+
+/*
+ * FUNCTION: packed_fill
+ * PURPOSE: The stream_fill of a compressed answer
+ * WHY: Every piece is flushed - a client watching a live answer (a log
+ *      tail) gets each piece as it is made, not when the encoder feels
+ *      like it, for a few bytes per piece
+ */
+static int packed_fill(void *state, char *buffer, size_t room) {
+    struct packed_stream *packed = state;
+    int bytes;
+
+    if (!buffer || packed->done) {
+        packed_end(packed);
+        return 0;
+    }
+    while (1) {
+        if (packed->input_length > 0 || packed->pending || packed->finishing) {
+            unsigned char *out = (unsigned char *)buffer;
+            size_t left = room;
+            int result = compressor_run(&packed->compressor, &packed->input, &packed->input_length,
+                                        &out, &left, packed->finishing ? 1 : COMPRESS_FLUSH);
+
+            if (result < 0 || (left == room && result == 0)) {
+                packed_end(packed);
+                return -1;
+            }
+            packed->pending = result == 0;
+            packed->done = packed->finishing && result == 1;
+            if (left < room) {
+                return (int)(room - left);
+            }
+            if (packed->done) {
+                packed_end(packed);
+                return 0;
+            }
+        }
+
+        bytes = packed->fill(packed->state, (char *)packed->piece, sizeof(packed->piece));
+        if (bytes == STREAM_WAIT) {
+            return STREAM_WAIT;
+        }
+        if (bytes <= 0) {
+            packed->fill = NULL;        // It has freed its state
+            if (bytes < 0) {
+                packed_end(packed);
+                return -1;
+            }
+            packed->finishing = 1;
+        } else {
+            packed->input = packed->piece;
+            packed->input_length = (size_t)bytes;
+        }
+    }
+}
+
+/*
+ * FUNCTION: negotiate
+ * PURPOSE: The encoding a streamed answer of this type goes out in
+ */
+static enum content_encoding negotiate(const struct http_context *context, const struct segment *content_type) {
+    int accepted;
+
+    if (!content_type || !compress_worthwhile(content_type)) {
+        return ENCODING_IDENTITY;
+    }
+    accepted = compress_accepted(context->request, context->data);
+    return accepted & ACCEPT_BROTLI ? ENCODING_BROTLI :
+           accepted & ACCEPT_GZIP ? ENCODING_GZIP : ENCODING_IDENTITY;
+}
+
+/*
+ * FUNCTION: begin
+ * PURPOSE: Leave fill(state) behind as the request's answer
+ */
+static void begin(const struct http_context *context, stream_fill fill, void *state, int head) {
+    struct http_streamer *streamer = context->streamer;
+
+    streamer->fill = fill;
+    streamer->state = state;
+    streamer->chunked = context->request->minor_version >= 1;
+    // Without chunks only closing the connection can say where the body ends
+    streamer->keep_alive = context->keep_alive && streamer->chunked;
+    streamer->head = head;
+    streamer->length = STREAM_LENGTH_UNKNOWN;
+    streamer->bodyless = 0;
+}
+
+int stream_start(const struct http_context *context, const struct segment *status,
+                 const struct segment *content_type, stream_fill fill, void *state) {
+    struct response response;
+    struct packed_stream *packed = NULL;
+    enum content_encoding encoding = negotiate(context, content_type);
+    int chunked = context->request->minor_version >= 1;
+
+    if (!output_has_room(context->output, RESPONSE_MAX_PARTS, RESPONSE_SCRATCH)) {
+        return 0;
+    }
+    if (encoding != ENCODING_IDENTITY && !is_head(context)) {
+        // No memory for an encoder: the answer goes out as it is
+        packed = malloc(sizeof(*packed));
+        if (packed && compressor_start(&packed->compressor, encoding, 0) < 0) {
+            free(packed);
+            packed = NULL;
+        }
+        if (!packed) {
+            encoding = ENCODING_IDENTITY;
+        }
+    }
+
+    response_start(&response, status);
+    if (content_type) {
+        response_add_segment(&response, content_type);
+    }
+    if (content_type && compress_worthwhile(content_type)) {
+        response_add_segment(&response, &compress_vary);
+    }
+    if (encoding != ENCODING_IDENTITY) {
+        response_add_segment(&response, compress_header(encoding));
+    }
+    if (chunked) {
+        response_add_segment(&response, &transfer_chunked);
+    }
+    // Without chunks only closing the connection can say where the body ends
+    response_end_stream_headers(&response, context->date, context->keep_alive && chunked);
+    output_push_response(context->output, &response);
+
+    if (is_head(context)) {
+        fill(state, NULL, 0);   // Nothing to make
+        return 1;
+    }
+    if (packed) {
+        packed->fill = fill;
+        packed->state = state;
+        packed->input_length = 0;
+        packed->pending = packed->finishing = packed->done = 0;
+        fill = packed_fill;
+        state = packed;
+    }
+    begin(context, fill, state, 0);
+    return 1;
+}
+
+int stream_defer(const struct http_context *context, stream_fill fill, void *state) {
+    begin(context, fill, state, 1);
+    return 1;
+}
+
+void stream_wake(struct http_streamer *streamer) {
+    connection_resume(streamer->owner);
+}
+
+/*
+ * FUNCTION: next_head
+ * PURPOSE: stream_next() for a deferred head: fill's lines, then ours
+ */
+static int next_head(struct http_streamer *streamer, char *buffer, size_t size, struct output_queue *output) {
+    char *end;
+    int bytes = streamer->fill(streamer->state, buffer, size - STREAM_HEAD_END);
+
+    if (bytes == STREAM_WAIT) {
+        return STREAM_WAIT;
+    }
+    if (bytes <= 0) {
+        streamer->fill = NULL;
+        return -1;      // An answer without a head can't be put right any more
+    }
+    streamer->head = 0;
+
+    end = buffer + bytes;
+    if (streamer->bodyless || streamer->length != STREAM_LENGTH_UNKNOWN) {
+        if (!streamer->bodyless) {
+            end += snprintf(end, STREAM_HEAD_END, "Content-Length: %llu\r\n",
+                            (unsigned long long)streamer->length);
+        }
+        streamer->chunked = 0;  // Delimited after all - fill will stop in time
+    } else if (streamer->chunked) {
+        memcpy(end, transfer_chunked.data, transfer_chunked.length);
+        end += transfer_chunked.length;
+    }
+    if (streamer->keep_alive) {
+        memcpy(end, keep_alive_end.data, keep_alive_end.length);
+        end += keep_alive_end.length;
+    } else {
+        memcpy(end, close_end.data, close_end.length);
+        end += close_end.length;
+    }
+    output_push(output, buffer, (size_t)(end - buffer));
+    return 1;
+}
+
+int stream_next(struct http_streamer *streamer, char *buffer, size_t size, struct output_queue *output) {
+    char line[STREAM_CHUNK_HEAD + 1];
+    int bytes, length;
+
+    if (!streamer->fill) {
+        return 0;
+    }
+    if (streamer->head) {
+        return next_head(streamer, buffer, size, output);
+    }
+    if (!streamer->chunked) {
+        bytes = streamer->fill(streamer->state, buffer, size);
+        if (bytes > 0) {
+            output_push(output, buffer, (size_t)bytes);
+            return 1;
+        }
+        if (bytes != STREAM_WAIT) {
+            streamer->fill = NULL;
+        }
+        return bytes;
+    }
+
+    bytes = streamer->fill(streamer->state, buffer + STREAM_CHUNK_HEAD, size - STREAM_CHUNK_HEAD - 2);
+    if (bytes == STREAM_WAIT) {
+        return STREAM_WAIT;
+    }
+    if (bytes > 0) {
+        length = snprintf(line, sizeof(line), "%x\r\n", (unsigned)bytes);
+        memcpy(buffer + STREAM_CHUNK_HEAD - length, line, (size_t)length);
+        memcpy(buffer + STREAM_CHUNK_HEAD + bytes, "\r\n", 2);
+        output_push(output, buffer + STREAM_CHUNK_HEAD - length, (size_t)(length + bytes + 2));
+        return 1;
+    }
+    streamer->fill = NULL;
+    if (bytes < 0) {
+        return -1;      // No last chunk: the client can tell the answer broke off
+    }
+    output_push(output, last_chunk.data, last_chunk.length);
+    return 1;
+}
+
+void stream_abort(struct http_streamer *streamer) {
+    if (streamer->fill) {
+        streamer->fill(streamer->state, NULL, 0);
+        streamer->fill = NULL;
+    }
+}
@@ -0,0 +1,182 @@
+/*
+ * =============================================================================
+ * TIMER WHEEL IMPLEMENTATION - SLOTS, CASCADING, SKIPPING EMPTY TICKS
+ * =============================================================================
+ * Each slot is a list linked through the timers themselves. prev_next
+ * points at whatever points at a timer (the slot head or the previous
+ * timer's next), so unlinking needs neither the list nor a search.
+ * =============================================================================
+ */
+
+#include <limits.h>         // INT_MAX
+#include <string.h>         // memset
+
+#include "timer_wheel.h"
+
+#define DUE_SLOT (TIMER_LEVELS * TIMER_SLOTS)
+#define SLOT_MASK (TIMER_SLOTS - 1)
+
+static void link_timer(struct timer_wheel *wheel, struct timer *timer, unsigned slot) {
+    timer->next = wheel->slots[slot];
+    if (timer->next) {
+        timer->next->prev_next = &timer->next;
+    }
+    wheel->slots[slot] = timer;
+    timer->prev_next = &wheel->slots[slot];
+    timer->slot = slot;
+    if (slot < DUE_SLOT) {
+        wheel->occupied[slot / TIMER_SLOTS] |= (uint64_t)1 << (slot % TIMER_SLOTS);
+    }
+}
+
+static void unlink_timer(struct timer_wheel *wheel, struct timer *timer) {
+    *timer->prev_next = timer->next;
+    if (timer->next) {
+        timer->next->prev_next = timer->prev_next;
+    }
+    if (timer->slot < DUE_SLOT && !wheel->slots[timer->slot]) {
+        wheel->occupied[timer->slot / TIMER_SLOTS] &= ~((uint64_t)1 << (timer->slot % TIMER_SLOTS));
+    }
+    timer->prev_next = NULL;
+}
+
+/*
+ * FUNCTION: place
+ * PURPOSE: Put a timer on the finest level that reaches its expiry tick
+ */
+static void place(struct timer_wheel *wheel, struct timer *timer) {
+    uint64_t delta;
+    int level;
+
+    if (timer->expires < wheel->tick) {
+        timer->expires = wheel->tick;   // Late already: fires on the next tick processed
+    }
+    delta = timer->expires - wheel->tick;
+    for (level = 0; level < TIMER_LEVELS - 1; level++) {
+        if (delta < (uint64_t)1 << (TIMER_SLOT_BITS * (level + 1))) {
+            break;
+        }
+    }
+    if (delta >= (uint64_t)1 << (TIMER_SLOT_BITS * TIMER_LEVELS)) {
+        timer->expires = wheel->tick + ((uint64_t)1 << (TIMER_SLOT_BITS * TIMER_LEVELS)) - 1;
+    }
+    link_timer(wheel, timer, (unsigned)(level * TIMER_SLOTS) +
+               (unsigned)((timer->expires >> (TIMER_SLOT_BITS * level)) & SLOT_MASK));
+}
+
+/*
+ * FUNCTION: cascade
+ * PURPOSE: Redistribute one slot of a coarser level (its time has come)
+ * RETURNS: The slot index, 0 meaning the next level up is due as well
+ */
+static unsigned cascade(struct timer_wheel *wheel, int level) {
+    unsigned index = (unsigned)(wheel->tick >> (TIMER_SLOT_BITS * level)) & SLOT_MASK;
+    unsigned slot = (unsigned)(level * TIMER_SLOTS) + index;
+
+    while (wheel->slots[slot]) {
+        struct timer *timer = wheel->slots[slot];
+        unlink_timer(wheel, timer);
+        place(wheel, timer);
+    }
+    return index;
+}
+
+/*
+ * FUNCTION: advance
+ * PURPOSE: Process every tick up to now: cascade, and move level 0 slots
+ *          that came due onto the due list
+ */
+static void advance(struct timer_wheel *wheel, uint64_t now_ms) {
+    uint64_t target = now_ms / TIMER_TICK_MS;
+
+    while (wheel->tick <= target) {
+        unsigned index = (unsigned)wheel->tick & SLOT_MASK;
+        uint64_t ahead = wheel->occupied[0] >> index;
+        int level;
+
+        if (wheel->pending == 0) {
+            wheel->tick = target + 1;
+            return;
+        }
+        if (index == 0) {
+            for (level = 1; level < TIMER_LEVELS && cascade(wheel, level) == 0; level++) {
+            }
+            ahead = wheel->occupied[0];
+        }
+        if (!ahead) {
+            // Nothing more on level 0 before the next cascade: jump there -
+            // but not past now, or a timer started later would fire late
+            uint64_t boundary = (wheel->tick | SLOT_MASK) + 1;
+            wheel->tick = boundary < target + 1 ? boundary : target + 1;
+            continue;
+        }
+        while (wheel->slots[index]) {
+            struct timer *timer = wheel->slots[index];
+            unlink_timer(wheel, timer);
+            link_timer(wheel, timer, DUE_SLOT);
+        }
+        wheel->tick++;
+    }
+}
+
+void timer_wheel_init(struct timer_wheel *wheel, uint64_t now_ms) {
+    memset(wheel, 0, sizeof(*wheel));
+    wheel->tick = now_ms / TIMER_TICK_MS;
+}
+
+void timer_start(struct timer_wheel *wheel, struct timer *timer, uint64_t expires_ms) {
+    if (timer_pending(timer)) {
+        unlink_timer(wheel, timer);
+    } else {
+        wheel->pending++;
+    }
+    // Rounded up: a timer may fire up to a tick late, never early
+    timer->expires = (expires_ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    place(wheel, timer);
+}
+
+void timer_stop(struct timer_wheel *wheel, struct timer *timer) {
+    if (timer_pending(timer)) {
+        unlink_timer(wheel, timer);
+        wheel->pending--;
+    }
+}
+
+struct timer *timer_wheel_expire(struct timer_wheel *wheel, uint64_t now_ms) {
+    struct timer *timer;
+
+    if (!wheel->slots[DUE_SLOT]) {
+        advance(wheel, now_ms);
+    }
+    timer = wheel->slots[DUE_SLOT];
+    if (timer) {
+        unlink_timer(wheel, timer);
+        wheel->pending--;
+    }
+    return timer;
+}
+
+int timer_wheel_timeout(const struct timer_wheel *wheel, uint64_t now_ms) {
+    unsigned index = (unsigned)wheel->tick & SLOT_MASK;
+    uint64_t ahead = wheel->occupied[0] >> index;
+    uint64_t next, at_ms;
+
+    if (wheel->pending == 0) {
+        return -1;
+    }
+    if (wheel->slots[DUE_SLOT]) {
+        return 0;
+    }
+    if (index == 0) {
+        next = wheel->tick;     // A cascade is due first - it may bring timers down
+    } else if (ahead) {
+        next = wheel->tick + (uint64_t)__builtin_ctzll(ahead);
+    } else {
+        next = (wheel->tick | SLOT_MASK) + 1;
+    }
+    at_ms = next * TIMER_TICK_MS;
+    if (at_ms <= now_ms) {
+        return 0;
+    }
+    return at_ms - now_ms > INT_MAX ? INT_MAX : (int)(at_ms - now_ms);
+}
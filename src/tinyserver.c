@@ -23,23 +23,36 @@
 #include <unistd.h>     // Unix standard: close, etc.
 #include <sys/socket.h> // Socket functions: socket, bind, listen, accept
 #include <arpa/inet.h>  // Internet operations: htons, INADDR_ANY
+#include <netinet/in.h> // IPPROTO_TCP
+#include <netinet/tcp.h> // TCP_DEFER_ACCEPT, TCP_FASTOPEN, TCP_NODELAY
+#include <signal.h>     // signal, SIGPIPE, sigwait, SIGTERM, SIGUSR2
+#include <fcntl.h>      // fcntl, FD_CLOEXEC
+#include <pthread.h>    // pthread_sigmask
 #include <openssl/ssl.h> // OpenSSL SSL functions
 #include <openssl/err.h> // OpenSSL error handling
 
+#include "access_log.h" // Request log written by a thread of its own
+#include "compress.h"   // gzip/brotli answers and precompressed files
+#include "config.h"     // Command line settings
+#include "crypto_pool.h" // Threads that do the TLS handshake crypto
+#include "file_cache.h" // Small static files kept in memory
+#include "handoff.h"    // Passing the listening sockets to a new binary
+#include "metrics.h"    // Prometheus counters on an admin port
+#include "ocsp.h"       // Certificate status stapled to the handshake
+#include "proxy.h"      // Requests passed on to --upstream backends
+#include "router.h"     // Which handler answers which request
+#include "static_file.h" // Files from --root
+#include "tls_context.h" // Certificate reload and SNI hosts
+#include "tls_session.h" // TLS session resumption
+#include "tls_verify.h" // Client certificate cache and CRLs
+#include "scan.h"       // SIMD delimiter search used by the HTTP parser
+#include "worker.h"     // Event loop that serves all clients
+
 // =============================================================================
-// CONSTANTS (DEFINES)
+// SETTINGS
 // =============================================================================
-// #define creates constants that never change during program execution
-// Using constants makes code easier to read and maintain
-
-#define PORT 8080           // Port number server listens on (like a door number)
-#define CERT_FILE "server.crt"  // Server's public certificate file
-#define KEY_FILE "server.key"   // Server's private key file  
-#define CA_FILE "ca.crt"        // Certificate Authority file (trusted root)
-#define BUFFER_SIZE 4096        // Size of buffer for HTTP requests/responses
-
-// Global flag to enable/disable TLS (can be set via command line)
-int use_tls = 1;  // 1 = use TLS/SSL, 0 = plain HTTP
+// Runtime settings (port, listen backlog, TLS on/off, certificate files,
+// workers, ...) live in config.h and come from the command line
 
 // =============================================================================
 // FUNCTION DECLARATIONS AND EXPLANATIONS
@@ -74,7 +87,7 @@ void cleanup_openssl() {
 /*
  * FUNCTION: create_context
  * PURPOSE: Create SSL context (like a "settings container" for SSL)
- * RETURNS: SSL_CTX pointer (context object)
+ * RETURNS: SSL_CTX pointer (context object), or NULL on failure
  * RULE: Always check if functions return NULL (failure)
  * WHY: SSL context holds all the configuration for SSL connections
  */
@@ -97,49 +110,265 @@ SSL_CTX *create_context() {
         // Print OpenSSL-specific error messages
         ERR_print_errors_fp(stderr);
         
-        // Exit program with failure code
-        exit(EXIT_FAILURE);
+        // Let the caller decide: exit at startup, keep the old one on reload
+        return NULL;
     }
 
     // Return the successfully created context
     return ctx;
 }
 
+/*
+ * FUNCTION: select_protocol
+ * PURPOSE: ALPN callback - pick the application protocol from the client's list
+ * WHY: "h2" only if the client offers it (and --no-http2 isn't set); anything
+ *      else speaks HTTP/1.1, which is also what clients without ALPN expect
+ */
+static int select_protocol(SSL *ssl, const unsigned char **out, unsigned char *out_length,
+                           const unsigned char *in, unsigned int in_length, void *arg) {
+    static const unsigned char both[] = "\x02h2\x08http/1.1";
+    static const unsigned char http1[] = "\x08http/1.1";
+    const unsigned char *ours = config.http2 ? both : http1;
+    unsigned int ours_length = config.http2 ? sizeof(both) - 1 : sizeof(http1) - 1;
+
+    (void)ssl; (void)arg;
+
+    // Our order wins: h2 first. OpenSSL's API wants non-const out here.
+    if (SSL_select_next_proto((unsigned char **)out, out_length, ours, ours_length,
+                              in, in_length) != OPENSSL_NPN_NEGOTIATED) {
+        return SSL_TLSEXT_ERR_NOACK;    // No overlap - go on without ALPN
+    }
+    return SSL_TLSEXT_ERR_OK;
+}
+
 /*
  * FUNCTION: configure_context
  * PURPOSE: Load certificates and configure SSL settings
- * PARAMETER: ctx - SSL context to configure
+ * PARAMETERS: ctx - SSL context to configure
+ *             cert_file, key_file - certificate and private key to serve
+ * RETURNS: 0 on success, -1 on failure (errors printed)
  * RULE: Always validate certificates and keys match
  * WHY: SSL needs certificates to prove server identity and encrypt data
  */
-void configure_context(SSL_CTX *ctx) {
+int configure_context(SSL_CTX *ctx, const char *cert_file, const char *key_file) {
     
     // Load server certificate file (public key that clients can verify)
     // SSL_FILETYPE_PEM means certificate is in PEM format (text-based)
-    if (SSL_CTX_use_certificate_file(ctx, CERT_FILE, SSL_FILETYPE_PEM) <= 0) {
-        // If loading fails, print error and exit
+    if (SSL_CTX_use_certificate_file(ctx, cert_file, SSL_FILETYPE_PEM) <= 0) {
+        // If loading fails, print error and give up on this context
         ERR_print_errors_fp(stderr);
-        exit(EXIT_FAILURE);
+        return -1;
     }
 
     // Load server private key file (secret key for decryption)
     // This MUST match the certificate loaded above
-    if (SSL_CTX_use_PrivateKey_file(ctx, KEY_FILE, SSL_FILETYPE_PEM) <= 0 ) {
+    if (SSL_CTX_use_PrivateKey_file(ctx, key_file, SSL_FILETYPE_PEM) <= 0 ) {
         ERR_print_errors_fp(stderr);
-        exit(EXIT_FAILURE);
+        return -1;
     }
 
     // Load Certificate Authority file (trusted root certificate)
     // This is used to verify client certificates
-    if (SSL_CTX_load_verify_locations(ctx, CA_FILE, NULL) <= 0) {
+    if (SSL_CTX_load_verify_locations(ctx, config.ca_file, NULL) <= 0) {
         ERR_print_errors_fp(stderr);
-        exit(EXIT_FAILURE);
+        return -1;
     }
 
     // Set verification mode - require client to present valid certificate
     // SSL_VERIFY_PEER: verify the client certificate
     // SSL_VERIFY_FAIL_IF_NO_PEER_CERT: fail if client has no certificate
     SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER | SSL_VERIFY_FAIL_IF_NO_PEER_CERT, NULL);
+
+    // Remember the client certificates that passed, so a returning client
+    // skips the chain work, and refuse the ones revoked by --crl
+    if (tls_verify_configure(ctx) < 0) {
+        ERR_print_errors_fp(stderr);
+        return -1;
+    }
+
+    // Let OpenSSL free its own per-connection read/write buffers (~34 KB)
+    // while a connection is idle, like we do with ours (see pool.h)
+    SSL_CTX_set_mode(ctx, SSL_MODE_RELEASE_BUFFERS);
+
+    // ALPN: agree on HTTP/2 or HTTP/1.1 during the handshake (see http2.h)
+    SSL_CTX_set_alpn_select_cb(ctx, select_protocol, NULL);
+
+    // Kernel TLS: after the handshake OpenSSL hands the session keys to the
+    // kernel, which then encrypts the records - so files can go out with
+    // SSL_sendfile() without a copy. If the kernel (Linux "tls" module) or
+    // the negotiated cipher can't do it, OpenSSL stays in user space.
+    if (config.ktls) {
+#ifdef SSL_OP_ENABLE_KTLS
+        SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#else
+        fprintf(stderr, "This OpenSSL has no kTLS support - ignoring --ktls\n");
+#endif
+    }
+
+    // Let returning clients resume their session instead of repeating the
+    // whole handshake (session cache + rotating session tickets)
+    if (tls_session_configure(ctx) < 0) {
+        ERR_print_errors_fp(stderr);
+        return -1;
+    }
+
+    // OCSP stapling: hand clients the CA's word that the certificate isn't
+    // revoked, so they don't have to go and ask (needs --ca loaded above)
+    if (ocsp_configure(ctx, cert_file) < 0) {
+        ERR_print_errors_fp(stderr);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * FUNCTION: build_context
+ * PURPOSE: create_context() + configure_context() for one certificate
+ * RETURNS: Ready-to-use context, or NULL on failure
+ * WHY: tls_context.c calls this at startup, for every --sni host and again
+ *      on every SIGHUP reload
+ */
+SSL_CTX *build_context(const char *cert_file, const char *key_file) {
+    SSL_CTX *ctx = create_context();
+
+    if (ctx && configure_context(ctx, cert_file, key_file) < 0) {
+        SSL_CTX_free(ctx);
+        ctx = NULL;
+    }
+    return ctx;
+}
+
+/*
+ * FUNCTION: tune_listen_socket
+ * PURPOSE: Apply the TCP tuning options from config to a listening socket
+ * RULE: Call before listen() - buffer sizes decide the TCP window scale,
+ *       which is announced in the SYN-ACK, and accepted sockets inherit them
+ * WHY: These are optimizations, not correctness: a kernel that refuses one
+ *      gets a warning, and the server runs without it
+ */
+static void tune_listen_socket(int sock) {
+    static int warned;      // One warning is enough, not one per worker
+
+    // SO_RCVBUF / SO_SNDBUF: fixed socket buffer sizes. Setting them turns
+    // off the kernel's own autotuning, so only do it when asked to.
+    if (config.rcvbuf > 0 &&
+        setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &config.rcvbuf, sizeof(config.rcvbuf)) < 0 &&
+        !warned) {
+        perror("Unable to set SO_RCVBUF");
+    }
+    if (config.sndbuf > 0 &&
+        setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &config.sndbuf, sizeof(config.sndbuf)) < 0 &&
+        !warned) {
+        perror("Unable to set SO_SNDBUF");
+    }
+
+    // TCP_DEFER_ACCEPT: don't report a client until its first bytes arrived.
+    // Our clients always speak first (ClientHello or request line), so
+    // clients that only connect never wake a worker at all.
+    if (config.defer_accept > 0) {
+#ifdef TCP_DEFER_ACCEPT
+        if (setsockopt(sock, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+                       &config.defer_accept, sizeof(config.defer_accept)) < 0 && !warned) {
+            perror("Unable to set TCP_DEFER_ACCEPT");
+        }
+#else
+        if (!warned) {
+            fprintf(stderr, "TCP_DEFER_ACCEPT is Linux only - ignoring --defer-accept\n");
+        }
+#endif
+    }
+
+    // TCP_FASTOPEN: returning clients may send data inside their SYN,
+    // saving one round trip. The value is the queue of such pending clients.
+    if (config.fastopen > 0) {
+#ifdef TCP_FASTOPEN
+        if (setsockopt(sock, IPPROTO_TCP, TCP_FASTOPEN,
+                       &config.fastopen, sizeof(config.fastopen)) < 0 && !warned) {
+            perror("Unable to set TCP_FASTOPEN");
+        }
+#else
+        if (!warned) {
+            fprintf(stderr, "This system has no TCP_FASTOPEN - ignoring --fastopen\n");
+        }
+#endif
+    }
+
+    // TCP_NODELAY for --io-uring: its sockets live in the ring's descriptor
+    // table, where setsockopt() can't reach them - but on Linux accepted
+    // sockets inherit the option from the listening one
+    if (config.io_uring && config.tcp_nodelay) {
+        int on = 1;
+
+        if (setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) < 0 && !warned) {
+            perror("Unable to set TCP_NODELAY");
+        }
+    }
+
+    warned = 1;
+}
+
+/*
+ * FUNCTION: create_listen_socket
+ * PURPOSE: Create a TCP socket listening on config.port
+ * PARAMETER: reuse_port - also set SO_REUSEPORT so several sockets can share the port
+ * RETURNS: Listening socket file descriptor (exits on failure)
+ * WHY: Each worker needs its own listening socket for the kernel to balance
+ */
+int create_listen_socket(int reuse_port) {
+    int sock;                    // Socket file descriptor (like a handle)
+    struct sockaddr_in addr;     // Address structure (IP + port info)
+    int opt = 1;
+
+    // Create socket: AF_INET = IPv4, SOCK_STREAM = TCP, 0 = default protocol
+    // Returns file descriptor (integer handle) for the socket
+    sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) {
+        perror("Unable to create socket");
+        exit(EXIT_FAILURE);
+    }
+
+    // A new binary gets it explicitly (see handoff.h), never by accident
+    fcntl(sock, F_SETFD, FD_CLOEXEC);
+
+    // Set SO_REUSEADDR to allow reusing the address immediately
+    // This prevents "Address already in use" error when restarting server
+    if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
+        perror("Unable to set socket options");
+        exit(EXIT_FAILURE);
+    }
+
+    // Set SO_REUSEPORT so every worker can bind its own socket to the same port
+    // The kernel then load-balances incoming connections between them
+    if (reuse_port &&
+        setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+        perror("Unable to set SO_REUSEPORT");
+        exit(EXIT_FAILURE);
+    }
+
+    // Configure address structure (where server will listen)
+    addr.sin_family = AF_INET;        // IPv4 address family
+    addr.sin_port = htons((unsigned short)config.port); // Network byte order
+    addr.sin_addr.s_addr = INADDR_ANY; // Listen on all available interfaces
+
+    // Bind socket to address (claim the port)
+    // This is like putting your name on a mailbox
+    if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        perror("Unable to bind");
+        exit(EXIT_FAILURE);
+    }
+
+    tune_listen_socket(sock);
+
+    // Start listening for connections
+    // The backlog is how many finished handshakes may wait to be accepted.
+    // Once it is full the kernel drops new SYNs, and those clients retry after
+    // a second or more - so it must absorb a whole burst, not one client.
+    if (listen(sock, config.listen_backlog) < 0) {
+        perror("Unable to listen");
+        exit(EXIT_FAILURE);
+    }
+
+    return sock;
 }
 
 /*
@@ -155,209 +384,248 @@ int main(int argc, char **argv) {
     // COMMAND LINE ARGUMENT PARSING
     // =============================================================================
     
-    // Check for --no-tls flag to disable SSL/TLS
-    int i;
-    for (i = 1; i < argc; i++) {
-        if (strcmp(argv[i], "--no-tls") == 0) {
-            use_tls = 0;
-            printf("TLS disabled - running as plain HTTP server\n");
-            break;
-        }
-    }
+    // --no-tls, --workers N, keep-alive limits... (see src/config.c)
+    config_parse_args(argc, argv);
     
     // =============================================================================
     // VARIABLE DECLARATIONS
     // =============================================================================
     // In C, declare all variables at the beginning of a block (C89/C90 rule)
     
-    int sock;                    // Socket file descriptor (like a handle)
-    struct sockaddr_in addr;     // Address structure (IP + port info)
-    unsigned int len = sizeof(addr); // Size of address structure
-    SSL_CTX *ctx = NULL;        // SSL context (our SSL settings) - NULL if no TLS
-    SSL *ssl = NULL;            // SSL connection object - NULL if no TLS
+    int i;
+    worker *workers;            // One event loop per worker thread
+    int taking_over;            // 1 = an old process handed us its sockets
+    sigset_t lifecycle;         // SIGTERM = drain and exit, SIGUSR2 = upgrade
+    int signal_number;
+    int stapled = 0;            // Certificates with an OCSP answer to staple
+
+    // Blocked before any thread exists, so every thread inherits the mask
+    // and only main()'s sigwait() below ever sees them
+    sigemptyset(&lifecycle);
+    sigaddset(&lifecycle, SIGTERM);
+    sigaddset(&lifecycle, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &lifecycle, NULL);
+
+    // Started by an old process on SIGUSR2? Then take over its sockets
+    taking_over = handoff_receive();
+    if (taking_over < 0) {
+        exit(EXIT_FAILURE);
+    }
 
     // =============================================================================
     // INITIALIZATION PHASE
     // =============================================================================
     
     // Only initialize SSL if TLS is enabled
-    if (use_tls) {
+    if (config.use_tls) {
         // Step 1: Initialize OpenSSL library
         init_openssl();
         
-        // Step 2: Create SSL context (settings container)
-        ctx = create_context();
-        
-        // Step 3: Configure SSL context (load certificates)
-        configure_context(ctx);
+        // Steps 2 + 3: Create and configure the SSL contexts (settings
+        // containers with our certificates) - one default plus one per --sni host
+        if (tls_context_load(build_context) < 0) {
+            exit(EXIT_FAILURE);
+        }
+
+        // Taking over: keep the old process's ticket keys, so its clients
+        // still resume their sessions with us
+        if (taking_over) {
+            handoff_restore_keys();
+        }
+
+        // kill -HUP reloads the certificates without a restart. This must
+        // happen before any other thread exists (see tls_context.h)
+        if (tls_context_watch_sighup() < 0) {
+            exit(EXIT_FAILURE);
+        }
         
+        // Step 4: Handshake crypto runs on its own threads, so a burst of
+        // new clients doesn't stall the ones already being served
+        if (crypto_pool_start(config.handshake_threads) < 0) {
+            exit(EXIT_FAILURE);
+        }
+
+        // Step 5: Fetch the OCSP answers we staple (and keep them fresh)
+        // off the handshake path
+        stapled = ocsp_start();
+        if (stapled < 0) {
+            exit(EXIT_FAILURE);
+        }
+
         printf("TLS enabled - running as HTTPS server\n");
+        if (config.handshake_threads > 0) {
+            printf("TLS handshakes on %d crypto thread%s\n", config.handshake_threads,
+                   config.handshake_threads == 1 ? "" : "s");
+        }
+        if (stapled > 0) {
+            printf("Stapling OCSP answers for %d certificate%s\n", stapled, stapled == 1 ? "" : "s");
+        }
     } else {
         printf("TLS disabled - running as HTTP server\n");
     }
 
     // =============================================================================
-    // SOCKET CREATION AND SETUP
+    // ROUTES
     // =============================================================================
-    
-    // Create socket: AF_INET = IPv4, SOCK_STREAM = TCP, 0 = default protocol
-    // Returns file descriptor (integer handle) for the socket
-    sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock < 0) {
-        perror("Unable to create socket");
+    // Register your own handlers here - a longer prefix wins, so a route
+    // like router_add("GET", "/status", status_handler, NULL) is taken
+    // before the catch-all "/" below. Routes that take uploads register a
+    // body handler too, with router_add_body() (see router.h), and answers
+    // made while they are sent use stream_start() (see stream.h).
+    // With --upstream, everything under --proxy goes to the backends.
+    if (config.upstream_count > 0 &&
+        router_add_body(NULL, config.proxy_prefix, proxy_handler, proxy_body, NULL) < 0) {
         exit(EXIT_FAILURE);
     }
-
-    // Set SO_REUSEADDR to allow reusing the address immediately
-    // This prevents "Address already in use" error when restarting server
-    int opt = 1;
-    if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
-        perror("Unable to set socket options");
+    if ((config.upstream_count == 0 || strcmp(config.proxy_prefix, "/") != 0) &&
+        router_add(NULL, "/", config.document_root ? static_file_handler : echo_handler, NULL) < 0) {
+        exit(EXIT_FAILURE);
+    }
+    if (router_finish() < 0) {
         exit(EXIT_FAILURE);
     }
 
-    // Configure address structure (where server will listen)
-    addr.sin_family = AF_INET;        // IPv4 address family
-    addr.sin_port = htons(PORT);      // Convert port to network byte order
-    addr.sin_addr.s_addr = INADDR_ANY; // Listen on all available interfaces
+    // =============================================================================
+    // SOCKET CREATION AND SETUP
+    // =============================================================================
+    // Every worker gets its OWN listening socket on the same port. With
+    // SO_REUSEPORT the kernel spreads new connections across them, so workers
+    // never compete for one shared accept queue.
 
-    // Bind socket to address (claim the port)
-    // This is like putting your name on a mailbox
-    if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
-        perror("Unable to bind");
+    workers = calloc((size_t)config.worker_count, sizeof(*workers));
+    if (!workers) {
+        perror("Unable to allocate workers");
         exit(EXIT_FAILURE);
     }
 
-    // Start listening for connections (queue size = 1)
-    // This makes the socket ready to accept incoming connections
-    if (listen(sock, 1) < 0) {
-        perror("Unable to listen");
-        exit(EXIT_FAILURE);
+    for (i = 0; i < config.worker_count; i++) {
+        int sock = handoff_listener(i);     // The old process's, if it had one
+        if (sock < 0) {
+            sock = create_listen_socket(config.worker_count > 1);
+        }
+        if (worker_init(&workers[i], i, sock) < 0) {
+            exit(EXIT_FAILURE);
+        }
     }
 
+    // Writing to a client that already hung up raises SIGPIPE, which would
+    // kill the whole server - ignore it and handle the EPIPE error instead
+    signal(SIGPIPE, SIG_IGN);
+
+    if (workers[0].uring) {
+        printf("Connections served with io_uring\n");
+    }
+
+    // Pick the fastest delimiter search for this CPU before threads start
+    printf("Request parser using %s scanning\n", scan_implementation_name());
+
     // Print status message to let user know server is ready
-    printf("Server listening on port %d\n", PORT);
+    printf("Server listening on port %d with %d worker%s\n",
+           config.port, config.worker_count, config.worker_count == 1 ? "" : "s");
+
+    // Every worker has registered its log ring and counters by now (worker_init)
+    if (access_log_start() < 0) {
+        exit(EXIT_FAILURE);
+    }
+    if (compress_cache_start() < 0) {
+        exit(EXIT_FAILURE);
+    }
+    if (config.compress_cache) {
+        printf("Compressed file variants built in %s\n", config.compress_cache);
+    }
+    if (file_cache_start() < 0) {
+        exit(EXIT_FAILURE);
+    }
+    if (config.file_cache_size && config.document_root) {
+        printf("Static files cached in memory (%d MB)\n", config.file_cache_size);
+    }
+    if (proxy_start() < 0) {
+        exit(EXIT_FAILURE);
+    }
+    if (config.upstream_count > 0) {
+        printf("Passing %s on to %d backend%s (%s)\n", config.proxy_prefix, config.upstream_count,
+               config.upstream_count == 1 ? "" : "s", config.balance_hash ? "consistent hash" : "least connections");
+    }
+    if (config.access_log) {
+        printf("Access log: %s\n", strcmp(config.access_log, "-") == 0 ? "stdout" : config.access_log);
+    }
+    if (config.metrics_port) {
+        if (metrics_serve(config.metrics_address, config.metrics_port, handoff_metrics_socket()) < 0) {
+            exit(EXIT_FAILURE);
+        }
+        printf("Metrics at http://%s:%d/metrics\n", config.metrics_address, config.metrics_port);
+    }
 
     // =============================================================================
     // MAIN SERVER LOOP
     // =============================================================================
-    // while(1) creates infinite loop - server runs until manually stopped
-    
-    while(1) {
-        
-        // Accept incoming connection from client
-        // This blocks (waits) until a client connects
-        // Returns new socket for this specific client
-        int client = accept(sock, (struct sockaddr*)&addr, &len);
-        if (client < 0) {
-            perror("Unable to accept");
+    // Each worker thread switches its sockets to non-blocking mode and waits on
+    // all of them at once with epoll (Linux) or kqueue (macOS). A slow client
+    // only delays itself - everybody else keeps being served.
+
+    for (i = 0; i < config.worker_count; i++) {
+        if (worker_start(&workers[i]) < 0) {
             exit(EXIT_FAILURE);
         }
+    }
+
+    // Now that we accept, the process we replace (if any) can start draining
+    handoff_ready();
 
-        if (use_tls) {
-            // =============================================================================
-            // TLS/SSL MODE - Encrypted communication
-            // =============================================================================
-            
-            // Create new SSL object for this client connection
-            ssl = SSL_new(ctx);
-            
-            // Associate SSL object with client socket
-            SSL_set_fd(ssl, client);
-
-            // Perform SSL handshake with client
-            if (SSL_accept(ssl) <= 0) {
-                ERR_print_errors_fp(stderr);
-            } else {
-                // SSL handshake successful - communicate securely
-                char request_buffer[BUFFER_SIZE] = {0};
-                int bytes = SSL_read(ssl, request_buffer, sizeof(request_buffer) - 1);
-                
-                if (bytes > 0) {
-                    request_buffer[bytes] = '\0';
-                    printf("Received HTTPS request:\n%s\n", request_buffer);
-                    
-                    // Parse and respond with HTTP
-                    char method[16] = {0}, url[256] = {0};
-                    sscanf(request_buffer, "%s %s", method, url);
-                    
-                    char html_content[1024];
-                    sprintf(html_content,
-                        "<!DOCTYPE html><html><head><title>Tiny SSL Server</title></head>"
-                        "<body><h1>Secure HTTPS Server!</h1><p>Method: %s</p><p>URL: %s</p></body></html>",
-                        method, url);
-                    
-                    char http_response[BUFFER_SIZE];
-                    sprintf(http_response,
-                        "HTTP/1.1 200 OK\r\nContent-Type: text/html\r\nContent-Length: %zu\r\n\r\n%s",
-                        strlen(html_content), html_content);
-                    
-                    SSL_write(ssl, http_response, strlen(http_response));
-                }
+    // =============================================================================
+    // SHUTDOWN AND UPGRADE
+    // =============================================================================
+    // The workers do all the serving; this thread only waits for a signal.
+    //   kill -TERM: stop accepting, let the connections finish, exit
+    //   kill -USR2: start the binary again, hand it the listening sockets
+    //               (see handoff.h), then drain and exit like SIGTERM -
+    //               if the new one fails to start, carry on as before
+
+    while (sigwait(&lifecycle, &signal_number) == 0) {
+        if (signal_number == SIGTERM) {
+            printf("SIGTERM: draining connections (at most %d s)\n", config.drain_timeout);
+            break;
+        }
+        if (signal_number == SIGUSR2) {
+            int listeners[MAX_WORKERS];
+            pid_t successor;
+
+            for (i = 0; i < config.worker_count; i++) {
+                listeners[i] = workers[i].listener.fd;
             }
-        } else {
-            // =============================================================================
-            // PLAIN HTTP MODE - No encryption
-            // =============================================================================
-            
-            // Read plain HTTP request directly from socket
-            char request_buffer[BUFFER_SIZE] = {0};
-            int bytes = read(client, request_buffer, sizeof(request_buffer) - 1);
-            
-            if (bytes > 0) {
-                request_buffer[bytes] = '\0';
-                printf("Received HTTP request:\n%s\n", request_buffer);
-                
-                // Parse and respond with HTTP
-                char method[16] = {0}, url[256] = {0};
-                sscanf(request_buffer, "%s %s", method, url);
-                
-                char html_content[1024];
-                sprintf(html_content,
-                    "<!DOCTYPE html><html><head><title>Tiny HTTP Server</title></head>"
-                    "<body><h1>Plain HTTP Server!</h1><p>Method: %s</p><p>URL: %s</p></body></html>",
-                    method, url);
-                
-                char http_response[BUFFER_SIZE];
-                sprintf(http_response,
-                    "HTTP/1.1 200 OK\r\nContent-Type: text/html\r\nContent-Length: %zu\r\n\r\n%s",
-                    strlen(html_content), html_content);
-                
-                // Send plain HTTP response directly to socket
-                write(client, http_response, strlen(http_response));
+            successor = handoff_upgrade(argv, listeners, config.worker_count, metrics_socket());
+            if (successor > 0) {
+                printf("SIGUSR2: process %d took over - draining connections\n", (int)successor);
+                break;
             }
         }
+    }
+    fflush(stdout);
 
-        // =============================================================================
-        // CONNECTION CLEANUP
-        // =============================================================================
-        
-        // Clean up SSL resources only if TLS is enabled
-        if (use_tls && ssl) {
-            SSL_shutdown(ssl);
-            SSL_free(ssl);
-        }
-        
-        // Close client socket (always needed)
-        close(client);
-        
-        // Loop continues to accept next client...
+    for (i = 0; i < config.worker_count; i++) {
+        worker_drain(&workers[i]);
+    }
+    for (i = 0; i < config.worker_count; i++) {
+        worker_join(&workers[i]);
     }
 
     // =============================================================================
-    // PROGRAM CLEANUP (This code never runs due to infinite loop above)
+    // PROGRAM CLEANUP
     // =============================================================================
-    // In a real server, you'd have signal handlers to break the loop gracefully
-    
-    close(sock);           // Close server socket
-    
+    // No worker is left, so nothing uses the contexts or the log rings any more
+
+    free(workers);
+    access_log_stop();          // Writes out what the workers logged last
+    compress_cache_stop();
+
     // Clean up SSL resources only if TLS was enabled
-    if (use_tls && ctx) {
-        SSL_CTX_free(ctx);     // Free SSL context
+    if (config.use_tls) {
+        tls_context_free();
         cleanup_openssl();     // Cleanup OpenSSL library
     }
 
-    return 0;  // Return success (though this line never executes)
+    printf("Shut down cleanly\n");
+    return 0;
 }
 
 /*
@@ -404,14 +672,12 @@ int main(int argc, char **argv) {
  * 2. Create and configure SSL context with certificates
  * 3. Create network socket
  * 4. Bind socket to port and start listening
- * 5. Enter infinite loop:
- *    a. Accept client connection
- *    b. Create SSL object for client
- *    c. Perform SSL handshake
- *    d. Read encrypted message from client
- *    e. Send encrypted response to client
- *    f. Clean up client connection
- *    g. Repeat for next client
+ * 5. Enter the event loop (src/worker.c, src/connection.c):
+ *    a. Wait until any socket is ready (epoll / kqueue)
+ *    b. Listening socket ready: accept client, create SSL object for it
+ *    c. Client socket ready: advance its state machine one step
+ *       HANDSHAKE -> READING -> WRITING -> CLOSING
+ *    d. Never block - a client that isn't ready just waits for its next event
  * 
  * KEY C PROGRAMMING RULES DEMONSTRATED:
  * - Declare variables at beginning of blocks
@@ -0,0 +1,216 @@
+/*
+ * =============================================================================
+ * TLS CONTEXT IMPLEMENTATION - GENERATIONS, SNI CALLBACK, SIGHUP WATCHER
+ * =============================================================================
+ */
+
+#include <stdio.h>          // printf, fprintf
+#include <stdlib.h>         // calloc, free
+#include <string.h>         // strchr, strerror
+#include <strings.h>        // strcasecmp
+#include <signal.h>         // sigset_t, sigwait
+#include <pthread.h>        // pthread_rwlock_t, pthread_sigmask
+
+#include "config.h"
+#include "tls_context.h"
+
+/*
+ * STRUCT: tls_generation
+ * PURPOSE: The SNI host contexts loaded together with one default context
+ * RULE: Attached to the default SSL_CTX as ex_data and freed with it - so
+ *       it lives exactly as long as any connection that may look into it
+ */
+struct tls_generation {
+    int count;
+    const char *names[MAX_SNI_HOSTS];   // Point into config (never freed)
+    SSL_CTX *contexts[MAX_SNI_HOSTS];
+};
+
+static tls_context_builder builder;
+static int generation_index = -1;
+
+// The context new clients get. Readers (every accept) far outnumber the
+// writer (a reload), hence a read-write lock.
+static pthread_rwlock_t current_lock = PTHREAD_RWLOCK_INITIALIZER;
+static SSL_CTX *current;
+
+/*
+ * FUNCTION: free_generation
+ * PURPOSE: ex_data destructor - OpenSSL calls it when the default context is
+ *          finally freed (no connection uses it any more)
+ */
+static void free_generation(void *parent, void *ptr, CRYPTO_EX_DATA *ad,
+                            int idx, long argl, void *argp) {
+    struct tls_generation *generation = ptr;
+    int i;
+
+    (void)parent; (void)ad; (void)idx; (void)argl; (void)argp;
+
+    if (!generation) {
+        return;     // Called for every SSL_CTX, including SNI host contexts
+    }
+    for (i = 0; i < generation->count; i++) {
+        SSL_CTX_free(generation->contexts[i]);
+    }
+    free(generation);
+}
+
+/*
+ * FUNCTION: host_matches
+ * PURPOSE: Compare a requested name with a configured one ("*.example.com"
+ *          matches exactly one extra label: "www.example.com")
+ */
+static int host_matches(const char *pattern, const char *name) {
+    if (pattern[0] == '*' && pattern[1] == '.') {
+        const char *dot = strchr(name, '.');
+        return dot != NULL && dot != name && strcasecmp(dot, pattern + 1) == 0;
+    }
+    return strcasecmp(pattern, name) == 0;
+}
+
+/*
+ * FUNCTION: on_servername
+ * PURPOSE: SNI callback - switch the handshake to the requested host's context
+ * WHY: It runs before the server picks its certificate, so the client sees
+ *      the certificate for the name it asked for
+ */
+static int on_servername(SSL *ssl, int *alert, void *arg) {
+    const struct tls_generation *generation = arg;
+    const char *name = SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name);
+    int i;
+
+    (void)alert;
+
+    if (!name) {
+        return SSL_TLSEXT_ERR_OK;   // No SNI - use the default certificate
+    }
+    for (i = 0; i < generation->count; i++) {
+        if (host_matches(generation->names[i], name)) {
+            SSL_set_SSL_CTX(ssl, generation->contexts[i]);
+            break;
+        }
+    }
+    return SSL_TLSEXT_ERR_OK;
+}
+
+/*
+ * FUNCTION: build_generation
+ * PURPOSE: Load the default certificate and every SNI host certificate
+ * RETURNS: New default context (owning its generation), or NULL on failure
+ */
+static SSL_CTX *build_generation(void) {
+    struct tls_generation *generation;
+    SSL_CTX *ctx = builder(config.cert_file, config.key_file);
+    int i;
+
+    if (!ctx) {
+        return NULL;
+    }
+
+    generation = calloc(1, sizeof(*generation));
+    if (!generation || !SSL_CTX_set_ex_data(ctx, generation_index, generation)) {
+        free(generation);
+        SSL_CTX_free(ctx);
+        return NULL;
+    }
+    // From here on, freeing ctx also frees the generation and its contexts
+
+    for (i = 0; i < config.sni_count; i++) {
+        SSL_CTX *host = builder(config.sni_hosts[i].cert_file, config.sni_hosts[i].key_file);
+        if (!host) {
+            SSL_CTX_free(ctx);
+            return NULL;
+        }
+        generation->names[i] = config.sni_hosts[i].name;
+        generation->contexts[i] = host;
+        generation->count++;
+    }
+
+    if (generation->count > 0) {
+        SSL_CTX_set_tlsext_servername_callback(ctx, on_servername);
+        SSL_CTX_set_tlsext_servername_arg(ctx, generation);
+    }
+    return ctx;
+}
+
+int tls_context_load(tls_context_builder build) {
+    builder = build;
+    generation_index = SSL_CTX_get_ex_new_index(0, NULL, NULL, NULL, free_generation);
+    if (generation_index < 0) {
+        return -1;
+    }
+
+    current = build_generation();
+    return current ? 0 : -1;
+}
+
+int tls_context_reload(void) {
+    SSL_CTX *fresh = build_generation();
+    SSL_CTX *old;
+
+    if (!fresh) {
+        return -1;
+    }
+
+    pthread_rwlock_wrlock(&current_lock);
+    old = current;
+    current = fresh;
+    pthread_rwlock_unlock(&current_lock);
+
+    // Drop only OUR reference - connections that use it keep theirs
+    SSL_CTX_free(old);
+    return 0;
+}
+
+void tls_context_free(void) {
+    pthread_rwlock_wrlock(&current_lock);
+    SSL_CTX_free(current);      // Also frees its generation (SNI contexts)
+    current = NULL;
+    pthread_rwlock_unlock(&current_lock);
+}
+
+SSL *tls_context_new_ssl(void) {
+    SSL *ssl;
+
+    // SSL_new() takes its own reference to the context under the lock
+    pthread_rwlock_rdlock(&current_lock);
+    ssl = SSL_new(current);
+    pthread_rwlock_unlock(&current_lock);
+    return ssl;
+}
+
+static void *sighup_thread_main(void *arg) {
+    sigset_t *signals = arg;
+    int signal_number;
+
+    while (sigwait(signals, &signal_number) == 0) {
+        if (tls_context_reload() == 0) {
+            printf("SIGHUP: certificates reloaded for new connections\n");
+        } else {
+            fprintf(stderr, "SIGHUP: reload failed - still using the previous certificates\n");
+        }
+        fflush(stdout);
+    }
+    return NULL;
+}
+
+int tls_context_watch_sighup(void) {
+    static sigset_t signals;
+    pthread_t thread;
+    int error;
+
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGHUP);
+
+    // Blocked here and inherited by every later thread: only sigwait() sees it
+    error = pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    if (error == 0) {
+        error = pthread_create(&thread, NULL, sighup_thread_main, &signals);
+    }
+    if (error != 0) {
+        fprintf(stderr, "Unable to watch for SIGHUP: %s\n", strerror(error));
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
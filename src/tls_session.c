@@ -0,0 +1,447 @@
+/*
+ * =============================================================================
+ * TLS SESSION RESUMPTION IMPLEMENTATION
+ * =============================================================================
+ * Ticket keys and the session cache both live here, once per process, and
+ * not in an SSL_CTX: a SIGHUP reload builds new contexts (one per --sni
+ * host, too), and a client must be able to resume with any of them.
+ * =============================================================================
+ */
+
+#include <stdint.h>             // uint64_t
+#include <stdlib.h>             // calloc, free
+#include <string.h>             // memcpy, memcmp, memset
+#include <time.h>               // time
+#include <pthread.h>            // pthread_rwlock_t
+#include <openssl/evp.h>        // EVP_CIPHER_CTX, EVP_MAC_CTX
+#include <openssl/rand.h>       // RAND_bytes
+#include <openssl/crypto.h>     // OPENSSL_cleanse
+#include <openssl/core_names.h> // OSSL_MAC_PARAM_KEY, OSSL_MAC_PARAM_DIGEST
+
+#include "config.h"
+#include "tls_session.h"
+
+// Identifies our sessions - a session is only resumed with the same context
+#define SESSION_ID_CONTEXT "tinyserver"
+
+// Current key + previous keys still accepted for decryption
+#define TICKET_KEY_COUNT 3
+
+struct ticket_key {
+    unsigned char name[16];         // Sent in the clear so we can find the key
+    unsigned char aes_key[32];      // AES-256-CBC encryption key
+    unsigned char hmac_key[32];     // HMAC-SHA256 integrity key
+    time_t created;                 // 0 = slot unused
+};
+
+// ticket_keys[0] is the key new tickets are encrypted with
+static struct ticket_key ticket_keys[TICKET_KEY_COUNT];
+static pthread_rwlock_t ticket_keys_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/*
+ * STRUCT: cached_session
+ * PURPOSE: One session in the server-side cache, serialized (DER) - so it is
+ *          independent of the SSL_CTX it was made with
+ */
+struct cached_session {
+    unsigned char id[SSL_MAX_SSL_SESSION_ID_LENGTH];
+    unsigned int id_length;
+    time_t expires;
+    unsigned char *der;
+    int der_length;
+    struct cached_session *bucket_next;
+    struct cached_session *lru_prev;    // Towards the most recently used
+    struct cached_session *lru_next;
+};
+
+// The cache: a chained hash table over the sessions plus an LRU list, for
+// at most --session-cache of them
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+static struct cached_session **cache_buckets;
+static uint64_t cache_mask;
+static int cache_count;
+static struct cached_session *cache_head;  // Most recently used
+static struct cached_session *cache_tail;  // Next to go
+
+/*
+ * FUNCTION: rotate_ticket_keys
+ * PURPOSE: Generate a fresh current key and age the others by one slot
+ * RULE: Caller must hold the write lock
+ */
+static int rotate_ticket_keys(time_t now) {
+    struct ticket_key fresh;
+
+    if (RAND_bytes(fresh.name, sizeof(fresh.name)) != 1 ||
+        RAND_bytes(fresh.aes_key, sizeof(fresh.aes_key)) != 1 ||
+        RAND_bytes(fresh.hmac_key, sizeof(fresh.hmac_key)) != 1) {
+        return -1;
+    }
+    fresh.created = now;
+
+    memmove(&ticket_keys[1], &ticket_keys[0], sizeof(ticket_keys[0]) * (TICKET_KEY_COUNT - 1));
+    ticket_keys[0] = fresh;
+    return 0;
+}
+
+/*
+ * FUNCTION: current_key_expired
+ * RULE: Caller must hold the read or write lock
+ */
+static int current_key_expired(time_t now) {
+    return now - ticket_keys[0].created >= config.ticket_key_lifetime;
+}
+
+/*
+ * FUNCTION: set_ticket_hmac
+ * PURPOSE: Point the ticket HMAC at SHA-256 with the given key
+ */
+static int set_ticket_hmac(EVP_MAC_CTX *hctx, unsigned char *hmac_key) {
+    OSSL_PARAM params[3];
+
+    params[0] = OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, hmac_key, 32);
+    params[1] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, "SHA256", 0);
+    params[2] = OSSL_PARAM_construct_end();
+    return EVP_MAC_CTX_set_params(hctx, params);
+}
+
+/*
+ * FUNCTION: ticket_key_callback
+ * PURPOSE: Called by OpenSSL (on any worker thread) to encrypt a new ticket
+ *          (enc = 1) or to decrypt a ticket a client sent back (enc = 0)
+ * RETURNS: 1 = ok, 2 = ok but please issue a fresh ticket (old key),
+ *          0 = unknown key (fall back to a full handshake), -1 = error
+ */
+static int ticket_key_callback(SSL *ssl, unsigned char key_name[16],
+                               unsigned char iv[EVP_MAX_IV_LENGTH],
+                               EVP_CIPHER_CTX *cipher_ctx, EVP_MAC_CTX *hmac_ctx,
+                               int enc) {
+    time_t now = time(NULL);
+    int result = -1;
+    int i;
+
+    (void)ssl;
+
+    if (enc) {
+        // Rotate lazily: the first ticket issued after expiry makes a new key
+        pthread_rwlock_rdlock(&ticket_keys_lock);
+        if (current_key_expired(now)) {
+            pthread_rwlock_unlock(&ticket_keys_lock);
+            pthread_rwlock_wrlock(&ticket_keys_lock);
+            if (current_key_expired(now) && rotate_ticket_keys(now) < 0) {
+                pthread_rwlock_unlock(&ticket_keys_lock);
+                return -1;
+            }
+        }
+
+        if (RAND_bytes(iv, 16) == 1 &&
+            EVP_EncryptInit_ex(cipher_ctx, EVP_aes_256_cbc(), NULL, ticket_keys[0].aes_key, iv) &&
+            set_ticket_hmac(hmac_ctx, ticket_keys[0].hmac_key)) {
+            memcpy(key_name, ticket_keys[0].name, 16);
+            result = 1;
+        }
+        pthread_rwlock_unlock(&ticket_keys_lock);
+        return result;
+    }
+
+    pthread_rwlock_rdlock(&ticket_keys_lock);
+    result = 0;
+    for (i = 0; i < TICKET_KEY_COUNT; i++) {
+        if (ticket_keys[i].created == 0 || memcmp(key_name, ticket_keys[i].name, 16) != 0) {
+            continue;
+        }
+        if (EVP_DecryptInit_ex(cipher_ctx, EVP_aes_256_cbc(), NULL, ticket_keys[i].aes_key, iv) &&
+            set_ticket_hmac(hmac_ctx, ticket_keys[i].hmac_key)) {
+            // An older key still works, but ask OpenSSL to renew the ticket
+            result = (i == 0 && !current_key_expired(now)) ? 1 : 2;
+        } else {
+            result = -1;
+        }
+        break;
+    }
+    pthread_rwlock_unlock(&ticket_keys_lock);
+    return result;
+}
+
+// -----------------------------------------------------------------------------
+// The session cache
+// -----------------------------------------------------------------------------
+// OpenSSL's own cache belongs to the SSL_CTX a connection started with, so
+// every reload would start over with an empty one. Ours is handed to every
+// context through the "external cache" callbacks and outlives them all.
+
+static void create_cache(void) {
+    uint64_t buckets = 16;
+
+    while (buckets < (uint64_t)config.session_cache_size) {
+        buckets *= 2;
+    }
+    cache_buckets = calloc((size_t)buckets, sizeof(*cache_buckets));
+    cache_mask = buckets - 1;
+}
+
+/*
+ * FUNCTION: find_session / push_session / pull_session / unlink_session
+ * RULE: With cache_lock held
+ */
+static struct cached_session **find_session(const unsigned char *id, unsigned int length) {
+    struct cached_session **link;
+    uint64_t hash = 14695981039346656037ULL;    // FNV-1a
+    unsigned int i;
+
+    for (i = 0; i < length; i++) {
+        hash ^= id[i];
+        hash *= 1099511628211ULL;
+    }
+    for (link = &cache_buckets[hash & cache_mask]; *link; link = &(*link)->bucket_next) {
+        if ((*link)->id_length == length && memcmp((*link)->id, id, length) == 0) {
+            break;
+        }
+    }
+    return link;    // Where it is, or where it would go
+}
+
+// Put entry at the front of the LRU list
+static void push_session(struct cached_session *entry) {
+    entry->lru_prev = NULL;
+    entry->lru_next = cache_head;
+    if (cache_head) {
+        cache_head->lru_prev = entry;
+    } else {
+        cache_tail = entry;
+    }
+    cache_head = entry;
+}
+
+// Take entry off the LRU list (not out of its bucket)
+static void pull_session(struct cached_session *entry) {
+    if (entry->lru_prev) {
+        entry->lru_prev->lru_next = entry->lru_next;
+    } else {
+        cache_head = entry->lru_next;
+    }
+    if (entry->lru_next) {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    } else {
+        cache_tail = entry->lru_prev;
+    }
+}
+
+static void unlink_session(struct cached_session **link) {
+    struct cached_session *entry = *link;
+
+    *link = entry->bucket_next;
+    pull_session(entry);
+    cache_count--;
+    OPENSSL_free(entry->der);
+    free(entry);
+}
+
+/*
+ * FUNCTION: on_new_session
+ * PURPOSE: OpenSSL's "a session was made" callback - remember it
+ * RETURNS: 0 - we keep a copy, not OpenSSL's object
+ */
+static int on_new_session(SSL *ssl, SSL_SESSION *session) {
+    struct cached_session *entry, **link;
+    const unsigned char *id;
+    unsigned int id_length;
+
+    (void)ssl;
+
+    id = SSL_SESSION_get_id(session, &id_length);
+    entry = calloc(1, sizeof(*entry));
+    if (!entry || id_length == 0 || id_length > sizeof(entry->id)) {
+        free(entry);
+        return 0;
+    }
+    memcpy(entry->id, id, id_length);
+    entry->id_length = id_length;
+    entry->expires = (time_t)SSL_SESSION_get_time(session) + (time_t)SSL_SESSION_get_timeout(session);
+    entry->der_length = i2d_SSL_SESSION(session, &entry->der);
+    if (entry->der_length <= 0) {
+        free(entry);
+        return 0;
+    }
+
+    pthread_mutex_lock(&cache_lock);
+    link = find_session(id, id_length);
+    if (*link) {
+        unlink_session(link);
+        link = find_session(id, id_length);
+    }
+    if (cache_count >= config.session_cache_size) {
+        unlink_session(find_session(cache_tail->id, cache_tail->id_length));
+        link = find_session(id, id_length);     // The eviction may have moved it
+    }
+    entry->bucket_next = NULL;
+    *link = entry;
+    push_session(entry);
+    cache_count++;
+    pthread_mutex_unlock(&cache_lock);
+    return 0;
+}
+
+/*
+ * FUNCTION: on_get_session
+ * PURPOSE: OpenSSL's lookup callback - a client wants to resume by ID
+ * RETURNS: A session of its own for OpenSSL (*copy = 0), or NULL
+ */
+static SSL_SESSION *on_get_session(SSL *ssl, const unsigned char *id, int length, int *copy) {
+    struct cached_session **link;
+    SSL_SESSION *session = NULL;
+
+    (void)ssl;
+    *copy = 0;
+
+    if (length <= 0 || length > SSL_MAX_SSL_SESSION_ID_LENGTH) {
+        return NULL;
+    }
+    pthread_mutex_lock(&cache_lock);
+    link = find_session(id, (unsigned int)length);
+    if (*link && (*link)->expires <= time(NULL)) {
+        unlink_session(link);
+    } else if (*link) {
+        const unsigned char *der = (*link)->der;
+        session = d2i_SSL_SESSION(NULL, &der, (*link)->der_length);
+        pull_session(*link);        // Used again: last to go now
+        push_session(*link);
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return session;
+}
+
+/*
+ * FUNCTION: on_remove_session
+ * PURPOSE: OpenSSL's callback for a session that must not be resumed again
+ */
+static void on_remove_session(SSL_CTX *ctx, SSL_SESSION *session) {
+    struct cached_session **link;
+    const unsigned char *id;
+    unsigned int id_length;
+
+    (void)ctx;
+
+    id = SSL_SESSION_get_id(session, &id_length);
+    pthread_mutex_lock(&cache_lock);
+    link = find_session(id, id_length);
+    if (*link) {
+        unlink_session(link);
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+// -----------------------------------------------------------------------------
+// Handing the keys over
+// -----------------------------------------------------------------------------
+// Fixed layout, so a newer binary with a different struct can still read
+// it: a count byte, then per key name, AES key, HMAC key and the creation
+// time as 8 big-endian bytes.
+
+#define EXPORTED_KEY_SIZE (16 + 32 + 32 + 8)
+
+size_t tls_session_export_keys(unsigned char *data, size_t space) {
+    size_t used = 1;
+    int i, b;
+
+    if (!config.session_tickets || space < 1 + TICKET_KEY_COUNT * EXPORTED_KEY_SIZE) {
+        return 0;
+    }
+    pthread_rwlock_rdlock(&ticket_keys_lock);
+    data[0] = 0;
+    for (i = 0; i < TICKET_KEY_COUNT && ticket_keys[i].created != 0; i++) {
+        const struct ticket_key *key = &ticket_keys[i];
+        uint64_t created = (uint64_t)key->created;
+
+        memcpy(data + used, key->name, 16);
+        memcpy(data + used + 16, key->aes_key, 32);
+        memcpy(data + used + 48, key->hmac_key, 32);
+        for (b = 0; b < 8; b++) {
+            data[used + 80 + (size_t)b] = (unsigned char)(created >> (56 - 8 * b));
+        }
+        used += EXPORTED_KEY_SIZE;
+        data[0]++;
+    }
+    pthread_rwlock_unlock(&ticket_keys_lock);
+    return used;
+}
+
+int tls_session_import_keys(const unsigned char *data, size_t length) {
+    struct ticket_key keys[TICKET_KEY_COUNT];
+    int count, i, b;
+
+    if (length < 1 || data[0] == 0 || data[0] > TICKET_KEY_COUNT ||
+        length != 1 + (size_t)data[0] * EXPORTED_KEY_SIZE) {
+        return -1;
+    }
+    count = data[0];
+    memset(keys, 0, sizeof(keys));
+    for (i = 0; i < count; i++) {
+        const unsigned char *from = data + 1 + (size_t)i * EXPORTED_KEY_SIZE;
+        uint64_t created = 0;
+
+        memcpy(keys[i].name, from, 16);
+        memcpy(keys[i].aes_key, from + 16, 32);
+        memcpy(keys[i].hmac_key, from + 48, 32);
+        for (b = 0; b < 8; b++) {
+            created = created << 8 | from[80 + b];
+        }
+        keys[i].created = (time_t)created;
+    }
+
+    // Wholesale: the old process's current key stays current, and rotation
+    // carries on from when it was made
+    pthread_rwlock_wrlock(&ticket_keys_lock);
+    memcpy(ticket_keys, keys, sizeof(ticket_keys));
+    pthread_rwlock_unlock(&ticket_keys_lock);
+    OPENSSL_cleanse(keys, sizeof(keys));
+    return 0;
+}
+
+int tls_session_configure(SSL_CTX *ctx) {
+    // Required for resumption when client certificates are verified:
+    // OpenSSL refuses to resume a verified session without a context ID
+    if (SSL_CTX_set_session_id_context(ctx, (const unsigned char *)SESSION_ID_CONTEXT,
+                                       sizeof(SESSION_ID_CONTEXT) - 1) != 1) {
+        return -1;
+    }
+
+    // How long a session may be resumed - applies to both cache and tickets
+    SSL_CTX_set_timeout(ctx, config.session_timeout);
+
+    if (config.session_cache_size > 0) {
+        // Server-side cache shared by all workers and every context, old
+        // and new - none of OpenSSL's own per-context one
+        pthread_once(&cache_once, create_cache);
+        if (!cache_buckets) {
+            return -1;
+        }
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER | SSL_SESS_CACHE_NO_INTERNAL);
+        SSL_CTX_sess_set_new_cb(ctx, on_new_session);
+        SSL_CTX_sess_set_get_cb(ctx, on_get_session);
+        SSL_CTX_sess_set_remove_cb(ctx, on_remove_session);
+    } else {
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+    }
+
+    if (!config.session_tickets) {
+        // In TLS 1.3 this makes OpenSSL hand out cache-backed (stateful) tickets
+        SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+        return 0;
+    }
+
+    // The first key is made once, with the first context - the others (SNI
+    // hosts, reloads) share it, so building one never retires a key a
+    // client still holds
+    pthread_rwlock_wrlock(&ticket_keys_lock);
+    if (ticket_keys[0].created == 0 && rotate_ticket_keys(time(NULL)) < 0) {
+        pthread_rwlock_unlock(&ticket_keys_lock);
+        return -1;
+    }
+    pthread_rwlock_unlock(&ticket_keys_lock);
+
+    if (SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, ticket_key_callback) != 1) {
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,460 @@
+/*
+ * =============================================================================
+ * TLS VERIFY IMPLEMENTATION - VERIFIED CERTIFICATE CACHE, REVOKED SERIAL SET
+ * =============================================================================
+ * The cache is a fixed array of entries, a chained hash table over them
+ * and an LRU list, all under one lock held for a lookup - a few hundred
+ * nanoseconds next to the milliseconds of a handshake, so handshakes on
+ * different threads hardly ever wait for each other.
+ *
+ * The revoked set is an open-addressing table pointing into the CRLs
+ * themselves, which are kept for exactly that. It is built once and only
+ * read afterwards, so it needs no lock.
+ * =============================================================================
+ */
+
+#include <stdio.h>          // fprintf, fopen
+#include <stdint.h>         // uint64_t
+#include <stdlib.h>         // calloc, free
+#include <string.h>         // memcmp, memcpy, strerror
+#include <errno.h>          // errno
+#include <time.h>           // time
+#include <pthread.h>        // pthread_mutex_t, pthread_once
+#include <openssl/err.h>    // ERR_peek_last_error, ERR_clear_error
+#include <openssl/pem.h>    // PEM_read_X509_CRL
+#include <openssl/x509.h>   // X509_verify_cert, X509_CRL
+
+#include "config.h"
+#include "tls_verify.h"
+
+#define FINGERPRINT_SIZE 32         // SHA-256
+
+/*
+ * STRUCT: verified
+ * PURPOSE: A client certificate that passed, and until when that holds
+ */
+struct verified {
+    unsigned char fingerprint[FINGERPRINT_SIZE];
+    time_t expires;                 // First notAfter in its chain
+    struct verified *bucket_next;
+    struct verified *lru_prev;      // Towards the most recently used
+    struct verified *lru_next;
+};
+
+/*
+ * STRUCT: revoked
+ * PURPOSE: One slot of the revoked set (serial NULL = empty)
+ */
+struct revoked {
+    uint64_t hash;
+    const X509_NAME *issuer;        // Both point into the CRL
+    const ASN1_INTEGER *serial;
+};
+
+/*
+ * STRUCT: client_verify
+ * PURPOSE: Everything one SSL_CTX checks client certificates with
+ */
+struct client_verify {
+    pthread_mutex_t lock;           // Guards the cache (not the set)
+    struct verified *entries;       // --verify-cache of them
+    int size;
+    int used;
+    struct verified **buckets;
+    uint64_t bucket_mask;
+    struct verified *lru_head;      // Most recently used
+    struct verified *lru_tail;      // Next to go
+    STACK_OF(X509_CRL) *crls;       // NULL without --crl
+    struct revoked *revoked;
+    uint64_t revoked_mask;
+};
+
+static pthread_once_t index_once = PTHREAD_ONCE_INIT;
+static int verify_index = -1;
+
+// -----------------------------------------------------------------------------
+// The revoked set
+// -----------------------------------------------------------------------------
+
+/*
+ * FUNCTION: hash_serial
+ * PURPOSE: FNV-1a of the serial's bytes, started from the issuer's name hash
+ */
+static uint64_t hash_serial(const X509_NAME *issuer, const ASN1_INTEGER *serial) {
+    const unsigned char *bytes = ASN1_STRING_get0_data(serial);
+    int length = ASN1_STRING_length(serial), i;
+    uint64_t hash = 14695981039346656037ULL ^ X509_NAME_hash((X509_NAME *)issuer);
+
+    for (i = 0; i < length; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/*
+ * FUNCTION: is_revoked
+ * PURPOSE: Look a certificate up in the revoked set
+ */
+static int is_revoked(const struct client_verify *verify, X509 *certificate) {
+    const X509_NAME *issuer = X509_get_issuer_name(certificate);
+    const ASN1_INTEGER *serial = X509_get0_serialNumber(certificate);
+    uint64_t hash = hash_serial(issuer, serial), slot;
+
+    for (slot = hash & verify->revoked_mask; verify->revoked[slot].serial; slot = (slot + 1) & verify->revoked_mask) {
+        const struct revoked *entry = &verify->revoked[slot];
+        if (entry->hash == hash && ASN1_INTEGER_cmp(entry->serial, serial) == 0 &&
+            X509_NAME_cmp(entry->issuer, issuer) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * FUNCTION: chain_revoked
+ * PURPOSE: Check every certificate of a verified chain against the set
+ * RETURNS: Depth of the first revoked one, or -1 if none is
+ */
+static int chain_revoked(const struct client_verify *verify, X509_STORE_CTX *store_ctx) {
+    STACK_OF(X509) *chain = X509_STORE_CTX_get0_chain(store_ctx);
+    int depth;
+
+    for (depth = 0; verify->revoked && depth < sk_X509_num(chain); depth++) {
+        if (is_revoked(verify, sk_X509_value(chain, depth))) {
+            return depth;
+        }
+    }
+    return -1;
+}
+
+/*
+ * FUNCTION: signed_by_ca
+ * PURPOSE: Check that a CRL is signed by one of the --ca certificates
+ * WHY: Otherwise anyone who can write the file could revoke - or, with an
+ *      empty list, seem to un-revoke - any client
+ */
+static int signed_by_ca(SSL_CTX *ctx, X509_CRL *crl) {
+    STACK_OF(X509_OBJECT) *objects = X509_STORE_get0_objects(SSL_CTX_get_cert_store(ctx));
+    int i;
+
+    for (i = 0; i < sk_X509_OBJECT_num(objects); i++) {
+        X509 *ca = X509_OBJECT_get0_X509(sk_X509_OBJECT_value(objects, i));
+        if (ca && X509_NAME_cmp(X509_get_subject_name(ca), X509_CRL_get_issuer(crl)) == 0 &&
+            X509_CRL_verify(crl, X509_get0_pubkey(ca)) == 1) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * FUNCTION: load_crls
+ * PURPOSE: Read --crl and build the revoked set from it
+ * RETURNS: 0 on success, -1 on failure (reported)
+ */
+static int load_crls(struct client_verify *verify, SSL_CTX *ctx) {
+    FILE *file = fopen(config.crl_file, "r");
+    X509_CRL *crl;
+    int i, j, count = 0, failed = 0;
+    uint64_t capacity = 16;
+
+    if (!file) {
+        fprintf(stderr, "%s: %s\n", config.crl_file, strerror(errno));
+        return -1;
+    }
+    verify->crls = sk_X509_CRL_new_null();
+    while (verify->crls && !failed && (crl = PEM_read_X509_CRL(file, NULL, NULL, NULL)) != NULL) {
+        char issuer[256];
+
+        X509_NAME_oneline(X509_CRL_get_issuer(crl), issuer, sizeof(issuer));
+        if (!signed_by_ca(ctx, crl)) {
+            fprintf(stderr, "%s: the CRL of %s isn't signed by a --ca certificate\n", config.crl_file, issuer);
+            failed = 1;
+        } else if (!sk_X509_CRL_push(verify->crls, crl)) {
+            failed = 1;
+        }
+        if (failed) {
+            X509_CRL_free(crl);
+            break;
+        }
+        // Still better than none: it lists every revocation up to then
+        if (X509_CRL_get0_nextUpdate(crl) && X509_cmp_time(X509_CRL_get0_nextUpdate(crl), NULL) < 0) {
+            fprintf(stderr, "%s: the CRL of %s is out of date - get a new one\n", config.crl_file, issuer);
+        }
+        count += sk_X509_REVOKED_num(X509_CRL_get_REVOKED(crl));
+    }
+    fclose(file);
+
+    // Reading past the last CRL ends with "no start line" - anything else
+    // is a broken file
+    if (!failed && (!verify->crls || sk_X509_CRL_num(verify->crls) == 0 ||
+                    ERR_GET_REASON(ERR_peek_last_error()) != PEM_R_NO_START_LINE)) {
+        fprintf(stderr, "%s: not a PEM file of CRLs\n", config.crl_file);
+        failed = 1;
+    }
+    if (failed) {
+        return -1;
+    }
+    ERR_clear_error();
+
+    // At most half full, so a lookup ends after a slot or two
+    while (capacity < (uint64_t)count * 2) {
+        capacity *= 2;
+    }
+    verify->revoked = calloc((size_t)capacity, sizeof(*verify->revoked));
+    if (!verify->revoked) {
+        return -1;
+    }
+    verify->revoked_mask = capacity - 1;
+
+    for (i = 0; i < sk_X509_CRL_num(verify->crls); i++) {
+        X509_CRL *list = sk_X509_CRL_value(verify->crls, i);
+        STACK_OF(X509_REVOKED) *entries = X509_CRL_get_REVOKED(list);
+
+        for (j = 0; j < sk_X509_REVOKED_num(entries); j++) {
+            const ASN1_INTEGER *serial = X509_REVOKED_get0_serialNumber(sk_X509_REVOKED_value(entries, j));
+            uint64_t hash = hash_serial(X509_CRL_get_issuer(list), serial), slot = hash & verify->revoked_mask;
+
+            while (verify->revoked[slot].serial) {
+                slot = (slot + 1) & verify->revoked_mask;
+            }
+            verify->revoked[slot].hash = hash;
+            verify->revoked[slot].issuer = X509_CRL_get_issuer(list);
+            verify->revoked[slot].serial = serial;
+        }
+    }
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+// The cache
+// -----------------------------------------------------------------------------
+
+static struct verified **bucket_of(struct client_verify *verify, const unsigned char *fingerprint) {
+    uint64_t hash;
+
+    memcpy(&hash, fingerprint, sizeof(hash));       // SHA-256 bytes are hash enough
+    return &verify->buckets[hash & verify->bucket_mask];
+}
+
+static void lru_unlink(struct client_verify *verify, struct verified *entry) {
+    if (entry->lru_prev) {
+        entry->lru_prev->lru_next = entry->lru_next;
+    } else {
+        verify->lru_head = entry->lru_next;
+    }
+    if (entry->lru_next) {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    } else {
+        verify->lru_tail = entry->lru_prev;
+    }
+}
+
+static void lru_push_front(struct client_verify *verify, struct verified *entry) {
+    entry->lru_prev = NULL;
+    entry->lru_next = verify->lru_head;
+    if (verify->lru_head) {
+        verify->lru_head->lru_prev = entry;
+    } else {
+        verify->lru_tail = entry;
+    }
+    verify->lru_head = entry;
+}
+
+/*
+ * FUNCTION: find
+ * RULE: With the lock held
+ */
+static struct verified *find(struct client_verify *verify, const unsigned char *fingerprint) {
+    struct verified *entry;
+
+    for (entry = *bucket_of(verify, fingerprint); entry; entry = entry->bucket_next) {
+        if (memcmp(entry->fingerprint, fingerprint, FINGERPRINT_SIZE) == 0) {
+            break;
+        }
+    }
+    return entry;
+}
+
+/*
+ * FUNCTION: cache_hit
+ * RETURNS: 1 if the certificate passed before and still holds
+ */
+static int cache_hit(struct client_verify *verify, const unsigned char *fingerprint, time_t now) {
+    struct verified *entry;
+    int hit = 0;
+
+    pthread_mutex_lock(&verify->lock);
+    entry = find(verify, fingerprint);
+    if (entry && now < entry->expires) {
+        lru_unlink(verify, entry);
+        lru_push_front(verify, entry);
+        hit = 1;
+    }
+    pthread_mutex_unlock(&verify->lock);
+    return hit;
+}
+
+/*
+ * FUNCTION: cache_add
+ * PURPOSE: Remember a certificate that passed, evicting the least recently
+ *          used one if there's no room
+ */
+static void cache_add(struct client_verify *verify, const unsigned char *fingerprint, time_t expires) {
+    struct verified *entry, **link;
+
+    pthread_mutex_lock(&verify->lock);
+    entry = find(verify, fingerprint);
+    if (!entry) {
+        if (verify->used < verify->size) {
+            entry = &verify->entries[verify->used++];
+        } else {
+            entry = verify->lru_tail;
+            for (link = bucket_of(verify, entry->fingerprint); *link != entry; link = &(*link)->bucket_next) {
+            }
+            *link = entry->bucket_next;
+            lru_unlink(verify, entry);
+        }
+        memcpy(entry->fingerprint, fingerprint, FINGERPRINT_SIZE);
+        link = bucket_of(verify, fingerprint);
+        entry->bucket_next = *link;
+        *link = entry;
+    } else {
+        lru_unlink(verify, entry);  // Was there, but expired (a renewed CA?)
+    }
+    entry->expires = expires;
+    lru_push_front(verify, entry);
+    pthread_mutex_unlock(&verify->lock);
+}
+
+/*
+ * FUNCTION: chain_expires
+ * PURPOSE: When the first certificate of a verified chain runs out
+ */
+static time_t chain_expires(X509_STORE_CTX *store_ctx, time_t now) {
+    STACK_OF(X509) *chain = X509_STORE_CTX_get0_chain(store_ctx);
+    time_t expires = 0;
+    int i, days, seconds;
+
+    for (i = 0; i < sk_X509_num(chain); i++) {
+        if (ASN1_TIME_diff(&days, &seconds, NULL, X509_get0_notAfter(sk_X509_value(chain, i)))) {
+            time_t until = now + (time_t)days * 86400 + seconds;
+            if (expires == 0 || until < expires) {
+                expires = until;
+            }
+        }
+    }
+    return expires;                 // 0 (never cached) if none could be read
+}
+
+// -----------------------------------------------------------------------------
+// OpenSSL hooks
+// -----------------------------------------------------------------------------
+
+/*
+ * FUNCTION: verify_client
+ * PURPOSE: OpenSSL's certificate verification callback - replaces the
+ *          X509_verify_cert() it would otherwise call for every handshake
+ * RETURNS: 1 if the client certificate is accepted, 0 if not (with the
+ *          reason in store_ctx, as SSL_get_verify_result() reports it)
+ * RULE: Runs on whichever thread does the handshake (see crypto_pool.h)
+ */
+static int verify_client(X509_STORE_CTX *store_ctx, void *arg) {
+    struct client_verify *verify = arg;
+    X509 *certificate = X509_STORE_CTX_get0_cert(store_ctx);
+    unsigned char fingerprint[FINGERPRINT_SIZE];
+    unsigned int length = 0;
+    time_t now = time(NULL);
+    int cacheable, depth;
+
+    cacheable = verify->size > 0 && certificate &&
+                X509_digest(certificate, EVP_sha256(), fingerprint, &length) && length == FINGERPRINT_SIZE;
+    if (cacheable && cache_hit(verify, fingerprint, now)) {
+        X509_STORE_CTX_set_error(store_ctx, X509_V_OK);
+        return 1;
+    }
+
+    if (X509_verify_cert(store_ctx) <= 0) {
+        return 0;
+    }
+    depth = chain_revoked(verify, store_ctx);
+    if (depth >= 0) {
+        X509_STORE_CTX_set_error_depth(store_ctx, depth);
+        X509_STORE_CTX_set_current_cert(store_ctx, sk_X509_value(X509_STORE_CTX_get0_chain(store_ctx), depth));
+        X509_STORE_CTX_set_error(store_ctx, X509_V_ERR_CERT_REVOKED);
+        return 0;
+    }
+    if (cacheable) {
+        time_t expires = chain_expires(store_ctx, now);
+        if (expires > now) {
+            cache_add(verify, fingerprint, expires);
+        }
+    }
+    return 1;
+}
+
+/*
+ * FUNCTION: free_verify
+ * PURPOSE: ex_data destructor - OpenSSL calls it when a context is freed
+ */
+static void free_verify(void *parent, void *ptr, CRYPTO_EX_DATA *ad,
+                        int idx, long argl, void *argp) {
+    struct client_verify *verify = ptr;
+
+    (void)parent; (void)ad; (void)idx; (void)argl; (void)argp;
+
+    if (!verify) {
+        return;     // Called for every SSL_CTX
+    }
+    pthread_mutex_destroy(&verify->lock);
+    free(verify->entries);
+    free(verify->buckets);
+    free(verify->revoked);
+    sk_X509_CRL_pop_free(verify->crls, X509_CRL_free);
+    free(verify);
+}
+
+static void create_index(void) {
+    verify_index = SSL_CTX_get_ex_new_index(0, NULL, NULL, NULL, free_verify);
+}
+
+int tls_verify_configure(SSL_CTX *ctx) {
+    struct client_verify *verify;
+    uint64_t buckets = 16;
+
+    if (config.verify_cache_size == 0 && !config.crl_file) {
+        return 0;                   // Plain X509_verify_cert(), as OpenSSL does it
+    }
+    pthread_once(&index_once, create_index);
+    if (verify_index < 0) {
+        return -1;
+    }
+
+    verify = calloc(1, sizeof(*verify));
+    if (!verify) {
+        return -1;
+    }
+    pthread_mutex_init(&verify->lock, NULL);
+    verify->size = config.verify_cache_size;
+    while (buckets < (uint64_t)verify->size) {
+        buckets *= 2;
+    }
+    verify->bucket_mask = buckets - 1;
+    if (verify->size > 0) {
+        verify->entries = calloc((size_t)verify->size, sizeof(*verify->entries));
+        verify->buckets = calloc((size_t)buckets, sizeof(*verify->buckets));
+    }
+
+    // Attached first, so every way out below frees it with the context
+    if (!SSL_CTX_set_ex_data(ctx, verify_index, verify)) {
+        free_verify(NULL, verify, NULL, 0, 0, NULL);
+        return -1;
+    }
+    if ((verify->size > 0 && (!verify->entries || !verify->buckets)) ||
+        (config.crl_file && load_crls(verify, ctx) < 0)) {
+        return -1;
+    }
+    SSL_CTX_set_cert_verify_callback(ctx, verify_client, verify);
+    return 0;
+}
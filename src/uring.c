@@ -0,0 +1,502 @@
+/*
+ * =============================================================================
+ * URING IMPLEMENTATION - RING SETUP, SUBMISSION, COMPLETION, BUFFER RING
+ * =============================================================================
+ * The rings are plain memory shared with the kernel. Each side owns one
+ * index of each ring and only reads the other's:
+ *
+ *   submission queue: we advance tail, the kernel advances head
+ *   completion queue: the kernel advances tail, we advance head
+ *
+ * Indexes only ever grow; "index & mask" is the slot. Acquire loads and
+ * release stores order the entries against the indexes that publish them.
+ * =============================================================================
+ */
+
+#include "uring.h"
+
+#if defined(__linux__)
+
+#include <stdlib.h>         // calloc, free, posix_memalign
+#include <string.h>         // memset
+#include <errno.h>          // errno, EINTR, ETIME
+#include <poll.h>           // POLLIN
+#include <unistd.h>         // syscall, close, sysconf
+#include <time.h>           // struct timespec
+#include <sys/mman.h>       // mmap, munmap
+#include <sys/resource.h>   // getrlimit, RLIMIT_NOFILE
+#include <sys/socket.h>     // struct msghdr, MSG_WAITALL, SHUT_WR
+#include <sys/syscall.h>    // __NR_io_uring_*
+#include <linux/io_uring.h> // The kernel ABI
+
+#define DATA_SEND_FLAGS (MSG_WAITALL | MSG_NOSIGNAL)
+
+struct uring {
+    int fd;
+    int disabled;                   // 1 = created stopped, uring_enable() starts it
+
+    // Submission queue
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sq_queued;             // Our tail: entries filled in so far
+    unsigned sq_submitted;          // Entries handed to the kernel so far
+    struct io_uring_sqe *sqes;
+
+    // Completion queue
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+
+    // Provided buffers
+    struct io_uring_buf_ring *buffers;
+    unsigned buffer_mask;
+    unsigned short buffer_tail;
+    size_t buffer_size;
+    char *buffer_memory;
+
+    void *sq_ring;                  // The mappings, for uring_create() failing midway
+    size_t sq_ring_size;
+    size_t sqes_size;
+};
+
+// glibc has no wrappers for these - the raw system calls are the API
+static int uring_setup(unsigned entries, struct io_uring_params *params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int fd, unsigned submit, unsigned wait, unsigned flags, void *arg, size_t size) {
+    return (int)syscall(__NR_io_uring_enter, fd, submit, wait, flags, arg, size);
+}
+
+static int uring_register(int fd, unsigned opcode, const void *arg, unsigned count) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, count);
+}
+
+/*
+ * FUNCTION: supports_ops
+ * RETURNS: 1 if the kernel knows every operation we submit, 0 otherwise
+ */
+static int supports_ops(int fd) {
+    static const int needed[] = {
+        IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND, IORING_OP_SENDMSG,
+        IORING_OP_SHUTDOWN, IORING_OP_CLOSE, IORING_OP_ASYNC_CANCEL, IORING_OP_POLL_ADD
+    };
+    size_t size = sizeof(struct io_uring_probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, size);
+    size_t i;
+    int ok = 0;
+
+    if (!probe) {
+        return 0;
+    }
+    if (uring_register(fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) == 0) {
+        ok = 1;
+        for (i = 0; i < sizeof(needed) / sizeof(needed[0]); i++) {
+            if (needed[i] > probe->last_op || !(probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED)) {
+                ok = 0;
+            }
+        }
+    }
+    free(probe);
+    return ok;
+}
+
+/*
+ * FUNCTION: map_rings
+ * PURPOSE: Map the queues the kernel just created into our address space
+ * RETURNS: 0 on success, -1 on failure
+ */
+static int map_rings(struct uring *ring, const struct io_uring_params *params) {
+    char *sq, *cq;
+    unsigned *array, i;
+
+    // One mapping holds both rings (IORING_FEAT_SINGLE_MMAP, checked by caller)
+    ring->sq_ring_size = params->sq_off.array + params->sq_entries * sizeof(unsigned);
+    if (params->cq_off.cqes + params->cq_entries * sizeof(struct io_uring_cqe) > ring->sq_ring_size) {
+        ring->sq_ring_size = params->cq_off.cqes + params->cq_entries * sizeof(struct io_uring_cqe);
+    }
+    sq = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+              ring->fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED) {
+        return -1;
+    }
+    ring->sq_ring = sq;
+
+    ring->sqes_size = params->sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        return -1;
+    }
+
+    ring->sq_head = (unsigned *)(sq + params->sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params->sq_off.tail);
+    ring->sq_mask = *(unsigned *)(sq + params->sq_off.ring_mask);
+    ring->sq_entries = params->sq_entries;
+
+    // The indirection array: slot i always holds entry i, so the tail alone
+    // says which entries are new
+    array = (unsigned *)(sq + params->sq_off.array);
+    for (i = 0; i < params->sq_entries; i++) {
+        array[i] = i;
+    }
+
+    cq = sq;
+    ring->cq_head = (unsigned *)(cq + params->cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params->cq_off.tail);
+    ring->cq_mask = *(unsigned *)(cq + params->cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params->cq_off.cqes);
+    return 0;
+}
+
+/*
+ * FUNCTION: setup_buffers
+ * PURPOSE: Register the provided buffer ring (group 0) and fill it
+ * RETURNS: 0 on success, -1 on failure (kernel before 5.19)
+ */
+static int setup_buffers(struct uring *ring, size_t buffer_size) {
+    long page = sysconf(_SC_PAGESIZE);
+    struct io_uring_buf_reg reg;
+    unsigned i;
+
+    // The ring itself must be page aligned
+    if (posix_memalign((void **)&ring->buffers, (size_t)page, URING_BUFFERS * sizeof(struct io_uring_buf)) != 0) {
+        ring->buffers = NULL;
+        return -1;
+    }
+    memset(ring->buffers, 0, URING_BUFFERS * sizeof(struct io_uring_buf));
+    ring->buffer_memory = malloc(URING_BUFFERS * buffer_size);
+    if (!ring->buffer_memory) {
+        return -1;
+    }
+    ring->buffer_size = buffer_size;
+    ring->buffer_mask = URING_BUFFERS - 1;
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)ring->buffers;
+    reg.ring_entries = URING_BUFFERS;
+    reg.bgid = 0;
+    if (uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        return -1;
+    }
+    for (i = 0; i < URING_BUFFERS; i++) {
+        uring_buffer_recycle(ring, (int)i);
+    }
+    return 0;
+}
+
+static void destroy(struct uring *ring) {
+    if (ring->sqes) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->sq_ring) {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+    if (ring->fd >= 0) {
+        close(ring->fd);
+    }
+    free(ring->buffers);
+    free(ring->buffer_memory);
+    free(ring);
+}
+
+struct uring *uring_create(size_t buffer_size) {
+    struct io_uring_rsrc_register files;
+    struct io_uring_params params;
+    struct rlimit limit;
+    struct uring *ring = calloc(1, sizeof(*ring));
+
+    if (!ring) {
+        return NULL;
+    }
+
+    // Single issuer + deferred task work: completions are only processed
+    // when we ask for them, on our thread - no interrupting the worker
+    // mid-request. Created disabled so it can be bound to the worker thread.
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_R_DISABLED |
+                   IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    params.cq_entries = URING_ENTRIES * 2;
+    ring->fd = uring_setup(URING_ENTRIES, &params);
+    if (ring->fd < 0 && errno == EINVAL) {
+        // Kernels before 6.1 don't know the last two - a plain ring still works
+        memset(&params, 0, sizeof(params));
+        params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL;
+        params.cq_entries = URING_ENTRIES * 2;
+        ring->fd = uring_setup(URING_ENTRIES, &params);
+    }
+    if (ring->fd < 0) {
+        free(ring);
+        return NULL;
+    }
+    ring->disabled = (params.flags & IORING_SETUP_R_DISABLED) != 0;
+
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_EXT_ARG) ||
+        !(params.features & IORING_FEAT_NODROP) || !supports_ops(ring->fd) ||
+        map_rings(ring, &params) < 0) {
+        destroy(ring);
+        return NULL;
+    }
+
+    // An empty table for the accepted sockets; accept fills free slots
+    // The kernel caps the table at the open files limit, though its slots
+    // aren't process descriptors
+    memset(&files, 0, sizeof(files));
+    files.nr = URING_FILES;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < URING_FILES) {
+        files.nr = (unsigned)limit.rlim_cur;
+    }
+    files.flags = IORING_RSRC_REGISTER_SPARSE;
+    if (uring_register(ring->fd, IORING_REGISTER_FILES2, &files, sizeof(files)) < 0 ||
+        setup_buffers(ring, buffer_size) < 0) {
+        destroy(ring);
+        return NULL;
+    }
+    return ring;
+}
+
+int uring_enable(struct uring *ring) {
+    if (ring->disabled && uring_register(ring->fd, IORING_REGISTER_ENABLE_RINGS, NULL, 0) < 0) {
+        return -1;
+    }
+    ring->disabled = 0;
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+// Submission
+// -----------------------------------------------------------------------------
+
+/*
+ * FUNCTION: submit
+ * PURPOSE: Hand the entries filled in so far to the kernel
+ * RETURNS: 0 on success, -1 on failure
+ */
+static int submit(struct uring *ring, unsigned wait, unsigned flags, void *arg, size_t size) {
+    unsigned count = ring->sq_queued - ring->sq_submitted;
+    int result;
+
+    __atomic_store_n(ring->sq_tail, ring->sq_queued, __ATOMIC_RELEASE);
+    result = uring_enter(ring->fd, count, wait, flags, arg, size);
+    if (result < 0) {
+        return -1;
+    }
+    ring->sq_submitted += (unsigned)result;     // SUBMIT_ALL: that is all of them
+    return 0;
+}
+
+/*
+ * FUNCTION: make_room
+ * PURPOSE: Make sure `count` entries are free, submitting early if needed
+ * WHY: A linked chain must reach the kernel in one submission, so it has
+ *      to fit completely
+ */
+static void make_room(struct uring *ring, unsigned count) {
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+    if (ring->sq_queued - head + count > ring->sq_entries) {
+        submit(ring, 0, 0, NULL, 0);
+    }
+}
+
+static struct io_uring_sqe *get_sqe(struct uring *ring, int opcode, int file, uint64_t data) {
+    struct io_uring_sqe *sqe;
+
+    make_room(ring, 1);
+    sqe = &ring->sqes[ring->sq_queued & ring->sq_mask];
+    ring->sq_queued++;
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = (unsigned char)opcode;
+    sqe->fd = file;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->user_data = data;
+    return sqe;
+}
+
+void uring_accept(struct uring *ring, int listen_fd, uint64_t data) {
+    struct io_uring_sqe *sqe = get_sqe(ring, IORING_OP_ACCEPT, listen_fd, data);
+
+    sqe->flags = 0;                             // The listener is a regular fd
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->file_index = IORING_FILE_INDEX_ALLOC;  // Result = table slot, not an fd
+}
+
+void uring_poll(struct uring *ring, int fd, uint64_t data) {
+    struct io_uring_sqe *sqe = get_sqe(ring, IORING_OP_POLL_ADD, fd, data);
+
+    sqe->flags = 0;
+    sqe->poll32_events = POLLIN;                // One-shot: queue it again to keep watching
+}
+
+void uring_recv(struct uring *ring, int file, size_t length, uint64_t data) {
+    struct io_uring_sqe *sqe = get_sqe(ring, IORING_OP_RECV, file, data);
+
+    // No buffer given: the kernel picks one from group 0 once data is there
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->len = (unsigned)length;
+}
+
+/*
+ * MSG_WAITALL makes the kernel finish the whole send itself (waiting for
+ * socket buffer space as needed) and makes anything shorter count as a
+ * failure - which is what breaks a link, so a shutdown linked behind a
+ * send can never run before all of it is out.
+ */
+void uring_sendmsg(struct uring *ring, int file, const struct msghdr *message, int link, uint64_t data) {
+    struct io_uring_sqe *sqe;
+
+    make_room(ring, link ? 2 : 1);
+    sqe = get_sqe(ring, IORING_OP_SENDMSG, file, data);
+    sqe->addr = (uint64_t)(uintptr_t)message;
+    sqe->len = 1;
+    sqe->msg_flags = DATA_SEND_FLAGS;
+    if (link) {
+        sqe->flags |= IOSQE_IO_LINK;
+    }
+}
+
+void uring_send(struct uring *ring, int file, const void *buffer, size_t length, int link, uint64_t data) {
+    struct io_uring_sqe *sqe;
+
+    make_room(ring, link ? 2 : 1);
+    sqe = get_sqe(ring, IORING_OP_SEND, file, data);
+    sqe->addr = (uint64_t)(uintptr_t)buffer;
+    sqe->len = (unsigned)length;
+    sqe->msg_flags = DATA_SEND_FLAGS;
+    if (link) {
+        sqe->flags |= IOSQE_IO_LINK;
+    }
+}
+
+void uring_shutdown(struct uring *ring, int file, uint64_t data) {
+    struct io_uring_sqe *sqe = get_sqe(ring, IORING_OP_SHUTDOWN, file, data);
+    sqe->len = SHUT_WR;
+}
+
+void uring_cancel(struct uring *ring, int file) {
+    struct io_uring_sqe *sqe = get_sqe(ring, IORING_OP_ASYNC_CANCEL, file, 0);
+
+    // Every request still running on this descriptor
+    sqe->flags = 0;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_FD_FIXED | IORING_ASYNC_CANCEL_ALL;
+}
+
+void uring_cancel_request(struct uring *ring, uint64_t data) {
+    struct io_uring_sqe *sqe = get_sqe(ring, IORING_OP_ASYNC_CANCEL, -1, 0);
+
+    sqe->flags = 0;
+    sqe->addr = data;           // Matched against user_data
+}
+
+void uring_close(struct uring *ring, int file) {
+    struct io_uring_sqe *sqe = get_sqe(ring, IORING_OP_CLOSE, 0, 0);
+
+    // Frees the table slot; the socket goes once no request uses it any more
+    sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+    sqe->file_index = (unsigned)file + 1;       // 1-based, 0 would mean "fd"
+}
+
+void uring_reject(struct uring *ring, int file, const void *buffer, size_t length) {
+    struct io_uring_sqe *sqe;
+
+    // A hard link: the close runs even if the send fails, or the slot leaks
+    make_room(ring, 2);
+    sqe = get_sqe(ring, IORING_OP_SEND, file, 0);
+    sqe->addr = (uint64_t)(uintptr_t)buffer;
+    sqe->len = (unsigned)length;
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_DONTWAIT;
+    sqe->flags |= IOSQE_IO_HARDLINK | IOSQE_CQE_SKIP_SUCCESS;
+    uring_close(ring, file);
+}
+
+// -----------------------------------------------------------------------------
+// Completion
+// -----------------------------------------------------------------------------
+
+int uring_wait(struct uring *ring, int timeout_ms) {
+    struct io_uring_getevents_arg arg;
+    struct timespec timeout;
+
+    memset(&arg, 0, sizeof(arg));
+    if (timeout_ms >= 0) {
+        timeout.tv_sec = timeout_ms / 1000;
+        timeout.tv_nsec = (long)(timeout_ms % 1000) * 1000000;
+        arg.ts = (uint64_t)(uintptr_t)&timeout;
+    }
+    if (submit(ring, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg)) < 0 &&
+        errno != EINTR && errno != ETIME && errno != EBUSY) {
+        return -1;      // EBUSY: completions pending - reap them, then retry
+    }
+    return 0;
+}
+
+int uring_next(struct uring *ring, struct uring_completion *completion) {
+    unsigned head = *ring->cq_head;
+    const struct io_uring_cqe *cqe;
+
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+    cqe = &ring->cqes[head & ring->cq_mask];
+    completion->data = cqe->user_data;
+    completion->result = cqe->res;
+    completion->more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+    completion->buffer = cqe->flags & IORING_CQE_F_BUFFER ? (int)(cqe->flags >> IORING_CQE_BUFFER_SHIFT) : -1;
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+const char *uring_buffer(const struct uring *ring, int buffer) {
+    return ring->buffer_memory + (size_t)buffer * ring->buffer_size;
+}
+
+void uring_buffer_recycle(struct uring *ring, int buffer) {
+    struct io_uring_buf *slot = &ring->buffers->bufs[ring->buffer_tail & ring->buffer_mask];
+
+    slot->addr = (uint64_t)(uintptr_t)uring_buffer(ring, buffer);
+    slot->len = (unsigned)ring->buffer_size;
+    slot->bid = (unsigned short)buffer;
+    ring->buffer_tail++;
+    __atomic_store_n(&ring->buffers->tail, ring->buffer_tail, __ATOMIC_RELEASE);
+}
+
+#else // Not Linux: no io_uring, the caller stays with the event loop
+
+struct uring *uring_create(size_t buffer_size) {
+    (void)buffer_size;
+    return NULL;
+}
+
+int uring_enable(struct uring *ring) { (void)ring; return -1; }
+void uring_accept(struct uring *ring, int listen_fd, uint64_t data) { (void)ring; (void)listen_fd; (void)data; }
+void uring_poll(struct uring *ring, int fd, uint64_t data) { (void)ring; (void)fd; (void)data; }
+void uring_recv(struct uring *ring, int file, size_t length, uint64_t data) {
+    (void)ring; (void)file; (void)length; (void)data;
+}
+void uring_sendmsg(struct uring *ring, int file, const struct msghdr *message, int link, uint64_t data) {
+    (void)ring; (void)file; (void)message; (void)link; (void)data;
+}
+void uring_send(struct uring *ring, int file, const void *buffer, size_t length, int link, uint64_t data) {
+    (void)ring; (void)file; (void)buffer; (void)length; (void)link; (void)data;
+}
+void uring_shutdown(struct uring *ring, int file, uint64_t data) { (void)ring; (void)file; (void)data; }
+void uring_cancel(struct uring *ring, int file) { (void)ring; (void)file; }
+void uring_cancel_request(struct uring *ring, uint64_t data) { (void)ring; (void)data; }
+void uring_close(struct uring *ring, int file) { (void)ring; (void)file; }
+void uring_reject(struct uring *ring, int file, const void *buffer, size_t length) {
+    (void)ring; (void)file; (void)buffer; (void)length;
+}
+int uring_wait(struct uring *ring, int timeout_ms) { (void)ring; (void)timeout_ms; return -1; }
+int uring_next(struct uring *ring, struct uring_completion *completion) {
+    (void)ring; (void)completion;
+    return 0;
+}
+const char *uring_buffer(const struct uring *ring, int buffer) { (void)ring; (void)buffer; return NULL; }
+void uring_buffer_recycle(struct uring *ring, int buffer) { (void)ring; (void)buffer; }
+
+#endif
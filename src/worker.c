@@ -0,0 +1,712 @@
+/*
+ * =============================================================================
+ * WORKER IMPLEMENTATION - ACCEPT LOOP AND EVENT DISPATCH
+ * =============================================================================
+ */
+
+#if defined(__linux__)
+#define _GNU_SOURCE         // pthread_setaffinity_np, CPU_SET, accept4
+#endif
+
+#include <stdio.h>          // perror
+#include <stdlib.h>         // exit
+#include <string.h>         // strerror
+#include <errno.h>          // errno, EAGAIN
+#include <fcntl.h>          // fcntl, O_NONBLOCK
+#include <unistd.h>         // close
+#include <pthread.h>        // pthread_create, pthread_join
+#include <stddef.h>         // offsetof
+#include <sys/socket.h>     // accept, accept4
+#include <netinet/in.h>     // IPPROTO_TCP
+#include <netinet/tcp.h>    // TCP_NODELAY
+
+#if defined(__linux__)
+#include <sys/eventfd.h>    // eventfd
+#endif
+
+#include "config.h"
+#include "http2.h"          // struct h2_session (sized for its pool)
+#include "proxy.h"          // proxy_collect
+#include "worker.h"
+
+#define ACCEPT_RETRY_MS 100         // Pause after accept() fails for a reason we can't fix
+
+// Connections open in all workers together (--max-connections)
+static int open_connections;
+
+int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) {
+        return -1;
+    }
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/*
+ * FUNCTION: accept_client
+ * PURPOSE: Accept one waiting client as a non-blocking socket, and its address
+ * RETURNS: Client socket, or -1 with errno set
+ * WHY: Linux accept4() sets O_NONBLOCK in the same system call; elsewhere
+ *      it takes an extra fcntl() pair
+ */
+static int accept_client(int listen_fd, struct sockaddr_storage *peer) {
+    socklen_t length = sizeof(*peer);
+#if defined(__linux__)
+    return accept4(listen_fd, (struct sockaddr *)peer, &length, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+    int client = accept(listen_fd, (struct sockaddr *)peer, &length);
+
+    if (client >= 0 && set_nonblocking(client) < 0) {
+        perror("Unable to make client socket non-blocking");
+        close(client);
+        errno = ECONNABORTED;   // Drop just this client, keep accepting
+        return -1;
+    }
+    return client;
+#endif
+}
+
+/*
+ * FUNCTION: admission
+ * PURPOSE: Decide whether one more client may come in
+ * RETURNS: -1 to let it in, else the enum rejection reason to turn it away
+ * WHY: Past these limits every client gets slower, until handshakes and
+ *      requests time out and the work they took is wasted. Refusing the
+ *      newest arrivals keeps the ones already in served at full speed.
+ */
+static int admission(const worker *w) {
+    if (config.worker_connections > 0 && w->connections >= config.worker_connections) {
+        return REJECTED_LIMIT;
+    }
+    if (config.max_connections > 0 &&
+        __atomic_load_n(&open_connections, __ATOMIC_RELAXED) >= config.max_connections) {
+        return REJECTED_LIMIT;
+    }
+    // Handshakes are the expensive part (a signature each), so they get a
+    // limit of their own - plain HTTP has none
+    if (config.use_tls && config.max_handshakes > 0 && w->handshakes >= config.max_handshakes) {
+        return REJECTED_HANDSHAKES;
+    }
+    return -1;
+}
+
+/*
+ * FUNCTION: admitted
+ * PURPOSE: Count and list a connection that was created (worker_forget()
+ *          undoes both)
+ */
+static void admitted(worker *w, connection *conn) {
+    w->connections++;
+    __atomic_add_fetch(&open_connections, 1, __ATOMIC_RELAXED);
+    conn->open_prev = NULL;
+    conn->open_next = w->open;
+    if (w->open) {
+        w->open->open_prev = conn;
+    }
+    w->open = conn;
+}
+
+/*
+ * FUNCTION: reject_client
+ * PURPOSE: Turn a just-accepted client away, as cheaply as possible
+ * WHY: Plain HTTP clients get a 503 with Retry-After - one small write that
+ *      fits any socket buffer. TLS clients are just closed: a 503 would need
+ *      the very handshake we are short of.
+ *      The read first takes whatever the client already sent: closing with
+ *      unread data makes the kernel send a reset, which can destroy the 503
+ *      before the client reads it.
+ */
+static void reject_client(worker *w, int client, enum rejection reason) {
+    metric_add(&w->metrics->rejected[reason], 1);
+    if (!config.use_tls) {
+        char discard[512];
+        ssize_t ignored = recv(client, discard, sizeof(discard), MSG_DONTWAIT);
+        ignored = send(client, response_503.data, response_503.length, MSG_NOSIGNAL | MSG_DONTWAIT);
+        (void)ignored;
+    }
+    close(client);
+}
+
+/*
+ * FUNCTION: pause_accepting
+ * PURPOSE: accept() failed in a way retrying right away won't fix (out of
+ *          memory, say) - stop watching the listener for ACCEPT_RETRY_MS
+ * WHY: The listener stays readable, so a level-triggered loop would spin
+ *      on the failure at full speed. Exiting would drop every client we have.
+ */
+static void pause_accepting(worker *w) {
+    perror("Unable to accept");
+    event_loop_remove(w->loop, &w->listener);
+    timer_start(&w->timers, &w->accept_timer, event_loop_now(w->loop) + ACCEPT_RETRY_MS);
+}
+
+/*
+ * FUNCTION: shed_without_descriptor
+ * PURPOSE: Out of file descriptors: take one client off the queue anyway
+ *          and turn it away
+ * WHY: Otherwise it stays queued, the listener stays readable and the loop
+ *      spins. The reserve descriptor, opened at startup, is given up for
+ *      just long enough to accept and close the client.
+ */
+static void shed_without_descriptor(worker *w) {
+    struct sockaddr_storage peer;
+    int client;
+
+    if (w->reserve_fd < 0) {
+        pause_accepting(w);
+        return;
+    }
+    close(w->reserve_fd);
+    client = accept_client(w->listener.fd, &peer);
+    if (client >= 0) {
+        reject_client(w, client, REJECTED_DESCRIPTORS);
+    }
+    w->reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+}
+
+/*
+ * FUNCTION: on_listener_event
+ * PURPOSE: The listening socket is readable = clients are waiting to be accepted
+ * RULE: Never block here - return to the loop so other clients keep moving
+ * WHY: During a burst many clients wait at once. Taking them all in one
+ *      wakeup (up to --accept-batch) saves an epoll/kevent round per client;
+ *      the cap keeps a flood from starving the connections we already have.
+ *      Whatever is left stays readable and is picked up on the next round.
+ */
+static void on_listener_event(event_handler *handler, int events) {
+    worker *w = (worker *)handler;  // listener is the first member of worker
+    int accepted;
+
+    (void)events;
+
+    for (accepted = 0; accepted < config.accept_batch; accepted++) {
+        struct sockaddr_storage peer;
+        int client = accept_client(handler->fd, &peer);
+        connection *conn;
+        int reason;
+
+        if (client < 0) {
+            // EAGAIN: queue is empty (or another wakeup took the client)
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return;
+            }
+            // ECONNABORTED: client gave up while waiting in the queue
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            // Out of descriptors: one client is shed (or accepting paused) -
+            // the rest of the batch would only fail the same way, and the
+            // next wakeup sheds again
+            if (errno == EMFILE || errno == ENFILE) {
+                shed_without_descriptor(w);
+                return;
+            }
+            pause_accepting(w);
+            return;
+        }
+
+        reason = admission(w);
+        if (reason >= 0) {
+            reject_client(w, client, (enum rejection)reason);
+            continue;
+        }
+        metric_add(&w->metrics->accepts, 1);
+
+        // Responses are corked and sent whole (see output.h), so Nagle's
+        // algorithm would only hold back the last segment for an ACK
+        if (config.tcp_nodelay) {
+            int on = 1;
+            setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        }
+
+        // The connection registers itself with the loop and takes over from here
+        conn = connection_create(w, client, (struct sockaddr *)&peer);
+        if (conn) {
+            admitted(w, conn);
+        }
+    }
+}
+
+/*
+ * FUNCTION: wake_worker
+ * PURPOSE: Make the worker's wake descriptor readable (from any thread)
+ */
+static void wake_worker(worker *w) {
+#if defined(__linux__)
+    uint64_t one = 1;       // An eventfd takes 8-byte counter increments
+#else
+    char one = 1;
+#endif
+    ssize_t ignored = write(w->wake_write_fd, &one, sizeof(one));
+    (void)ignored;          // Full pipe = a wakeup is already pending
+}
+
+/*
+ * FUNCTION: close_remaining
+ * PURPOSE: --drain-timeout is over: close whatever is still open
+ * WHY: Connections away on a crypto thread can't be closed from here -
+ *      handshake_done() closes them when they come back (drain_expired)
+ */
+static void close_remaining(worker *w) {
+    connection *conn = w->open;
+
+    w->drain_expired = 1;
+    while (conn) {
+        connection *next = conn->open_next;
+        if (!conn->offloaded) {
+            connection_close(conn);
+        }
+        conn = next;
+    }
+}
+
+/*
+ * FUNCTION: start_drain
+ * PURPOSE: worker_drain() arrived: stop accepting, let every connection
+ *          wind down, and give them until --drain-timeout
+ */
+static void start_drain(worker *w) {
+    connection *conn = w->open;
+
+    w->draining = 1;
+    if (w->uring) {
+        uring_cancel_request(w->uring, uring_data(w, URING_TAG_ACCEPT));
+    } else if (!timer_pending(&w->accept_timer)) {
+        event_loop_remove(w->loop, &w->listener);   // (Already out while paused)
+    }
+    timer_stop(&w->timers, &w->accept_timer);
+
+    // Our copy only: after an upgrade the new process accepts on the same
+    // socket, otherwise new clients are refused from now on
+    close(w->listener.fd);
+    w->listener.fd = -1;
+
+    while (conn) {
+        connection *next = conn->open_next;     // conn may close right here
+        connection_drain(conn);
+        conn = next;
+    }
+    timer_start(&w->timers, &w->drain_timer,
+                event_loop_now(w->loop) + (uint64_t)config.drain_timeout * 1000);
+}
+
+void worker_drain(worker *w) {
+    __atomic_store_n(&w->drain_requested, 1, __ATOMIC_RELEASE);
+    wake_worker(w);
+}
+
+/*
+ * FUNCTION: on_wake_event
+ * PURPOSE: Crypto threads returned tasks - finish them on this thread
+ */
+static void on_wake_event(event_handler *handler, int events) {
+    worker *w = (worker *)((char *)handler - offsetof(worker, wake));
+    struct crypto_task *task;
+    char drain[64];
+
+    (void)events;
+
+    // Reset the wakeup first, so a task completed from now on wakes us again
+    while (read(handler->fd, drain, sizeof(drain)) > 0) {
+    }
+
+    pthread_mutex_lock(&w->completed_lock);
+    task = w->completed;
+    w->completed = NULL;
+    pthread_mutex_unlock(&w->completed_lock);
+
+    while (task) {
+        struct crypto_task *next = task->next;
+        task->done(task);
+        task = next;
+    }
+
+    if (!w->draining && __atomic_load_n(&w->drain_requested, __ATOMIC_ACQUIRE)) {
+        start_drain(w);
+    }
+}
+
+void worker_complete(worker *w, struct crypto_task *task) {
+    int was_empty;
+
+    pthread_mutex_lock(&w->completed_lock);
+    was_empty = w->completed == NULL;
+    task->next = w->completed;
+    w->completed = task;
+    pthread_mutex_unlock(&w->completed_lock);
+
+    // One wakeup per batch is enough - the worker takes the whole list
+    if (was_empty) {
+        wake_worker(w);
+    }
+}
+
+/*
+ * FUNCTION: create_wake_fd
+ * PURPOSE: Make the file descriptor other threads use to wake this worker
+ * RETURNS: 0 on success, -1 on failure
+ * WHY: The worker sleeps in epoll/kevent, so waking it has to be something
+ *      that makes a watched descriptor readable: an eventfd on Linux, a
+ *      pipe elsewhere
+ */
+static int create_wake_fd(worker *w) {
+#if defined(__linux__)
+    int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    w->wake.fd = fd;
+    w->wake_write_fd = fd;
+#else
+    int fds[2];
+    if (pipe(fds) < 0) {
+        return -1;
+    }
+    set_nonblocking(fds[0]);
+    set_nonblocking(fds[1]);
+    w->wake.fd = fds[0];
+    w->wake_write_fd = fds[1];
+#endif
+    w->wake.on_event = on_wake_event;
+    return 0;
+}
+
+int worker_init(worker *w, int id, int listen_fd) {
+    w->id = id;
+    w->listener.fd = listen_fd;
+    w->listener.on_event = on_listener_event;
+    w->closed = NULL;
+    w->completed = NULL;
+    w->date.length = 0;
+    w->connections = 0;
+    w->handshakes = 0;
+    w->open = NULL;
+    w->drain_requested = 0;
+    w->draining = 0;
+    w->drain_expired = 0;
+
+    // Given up when we run out of descriptors (see shed_without_descriptor)
+    w->reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+    // Sized so one slab is a few hundred KB, not one malloc() per object
+    pool_init(&w->connection_pool, sizeof(connection), 32);
+    pool_init(&w->buffer_pool, BUFFER_SIZE, 64);
+    pool_init(&w->record_pool, TLS_RECORD_SIZE, 16);
+    pool_init(&w->h2_pool, sizeof(struct h2_session), 4);
+    w->proxy = NULL;
+
+    w->metrics = metrics_create();
+    if (!w->metrics) {
+        perror("Unable to allocate worker metrics");
+        return -1;
+    }
+    w->log = access_log_create();
+    if (!w->log) {
+        perror("Unable to allocate access log buffer");
+        return -1;
+    }
+
+    if (set_nonblocking(listen_fd) < 0) {
+        perror("Unable to make listening socket non-blocking");
+        return -1;
+    }
+
+    w->loop = event_loop_create();
+    if (!w->loop) {
+        perror("Unable to create event loop");
+        return -1;
+    }
+    timer_wheel_init(&w->timers, event_loop_now(w->loop));
+    timer_init(&w->accept_timer);
+    timer_init(&w->drain_timer);
+
+    // --io-uring: the ring accepts clients instead, if this kernel can
+    w->uring = NULL;
+    w->accept_paused = 0;
+    w->accept_armed = 0;
+    if (config.io_uring) {
+        static int warned;      // Once, not per worker
+
+        w->uring = uring_create(BUFFER_SIZE);
+        if (!w->uring && !warned) {
+            fprintf(stderr, "io_uring is not available (needs Linux 5.19) - using epoll\n");
+            warned = 1;
+        }
+    }
+
+    if (!w->uring && event_loop_add(w->loop, &w->listener, EVENT_READ) < 0) {
+        perror("Unable to watch listening socket");
+        return -1;
+    }
+
+    pthread_mutex_init(&w->completed_lock, NULL);
+    if (create_wake_fd(w) < 0 || event_loop_add(w->loop, &w->wake, EVENT_READ) < 0) {
+        perror("Unable to set up worker wakeups");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * FUNCTION: free_closed_connections
+ * PURPOSE: Release connections closed during the last batch of events
+ */
+static void free_closed_connections(worker *w) {
+    while (w->closed) {
+        connection *conn = w->closed;
+        w->closed = conn->next_closed;
+        pool_put(&w->connection_pool, conn);
+    }
+}
+
+void worker_deadline(worker *w, connection *conn, uint64_t deadline_ms) {
+    conn->deadline_ms = deadline_ms;
+    if (!timer_pending(&conn->timer) || deadline_ms < timer_expires_ms(&conn->timer)) {
+        timer_start(&w->timers, &conn->timer, deadline_ms);
+    }
+}
+
+void worker_hold(worker *w, connection *conn) {
+    timer_stop(&w->timers, &conn->timer);
+}
+
+void worker_forget(worker *w, connection *conn) {
+    timer_stop(&w->timers, &conn->timer);
+    if (conn->open_prev) {
+        conn->open_prev->open_next = conn->open_next;
+    } else {
+        w->open = conn->open_next;
+    }
+    if (conn->open_next) {
+        conn->open_next->open_prev = conn->open_prev;
+    }
+    w->connections--;
+    __atomic_sub_fetch(&open_connections, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * FUNCTION: expire_connections
+ * PURPOSE: Close connections whose deadline has passed (and resume accepting
+ *          if it was paused)
+ * RETURNS: Milliseconds until the wheel needs another look (-1 = never)
+ */
+static int expire_connections(worker *w) {
+    uint64_t now = event_loop_now(w->loop);
+    struct timer *timer;
+
+    while ((timer = timer_wheel_expire(&w->timers, now))) {
+        connection *conn;
+
+        if (timer == &w->accept_timer) {
+            if (event_loop_add(w->loop, &w->listener, EVENT_READ) < 0) {
+                pause_accepting(w);
+            }
+            continue;
+        }
+        if (timer == &w->drain_timer) {
+            close_remaining(w);
+            continue;
+        }
+        conn = (connection *)((char *)timer - offsetof(connection, timer));
+        if (conn->deadline_ms > now) {
+            // Moved later since the timer was set - see worker_deadline()
+            timer_start(&w->timers, timer, conn->deadline_ms);
+            continue;
+        }
+        if (conn->state == CONN_HANDSHAKE) {
+            metric_add(&w->metrics->handshake_failures[HANDSHAKE_FAILED_TIMEOUT], 1);
+        } else if (conn->header_deadline_ms != 0) {
+            metric_add(&w->metrics->header_timeouts, 1);
+        }
+        connection_close(conn);
+    }
+    return timer_wheel_timeout(&w->timers, now);
+}
+
+/*
+ * FUNCTION: on_uring_accept
+ * PURPOSE: The multishot accept produced a client (or stopped)
+ */
+static void on_uring_accept(worker *w, const struct uring_completion *completion) {
+    if (completion->result >= 0) {
+        int reason = admission(w);
+
+        if (reason >= 0) {
+            // Same as reject_client(), as one linked send + close
+            metric_add(&w->metrics->rejected[reason], 1);
+            uring_reject(w->uring, completion->result, response_503.data, response_503.length);
+        } else {
+            connection *conn = connection_create_uring(w, completion->result);
+
+            metric_add(&w->metrics->accepts, 1);
+            if (conn) {
+                admitted(w, conn);
+            }
+        }
+    }
+    if (completion->more) {
+        return;     // Still armed
+    }
+    w->accept_armed = 0;
+    if (w->draining) {
+        return;     // Cancelled for good (start_drain)
+    }
+    // Table full: waiting for a slot beats failing again right away
+    if (completion->result == -ENFILE || completion->result == -EMFILE) {
+        w->accept_paused = 1;
+        return;
+    }
+    uring_accept(w->uring, w->listener.fd, uring_data(w, URING_TAG_ACCEPT));
+    w->accept_armed = 1;
+}
+
+/*
+ * FUNCTION: start_uring
+ * PURPOSE: Bind the ring to this thread and start accepting
+ * RETURNS: 0 on success, -1 if the worker should use the event loop after all
+ */
+static int start_uring(worker *w) {
+    if (uring_enable(w->uring) < 0) {
+        perror("Unable to start io_uring - using epoll");
+        w->uring = NULL;
+        if (event_loop_add(w->loop, &w->listener, EVENT_READ) < 0) {
+            perror("Unable to watch listening socket");
+            exit(EXIT_FAILURE);
+        }
+        return -1;
+    }
+    uring_accept(w->uring, w->listener.fd, uring_data(w, URING_TAG_ACCEPT));
+    w->accept_armed = 1;
+    // run_uring() only waits on the ring: worker_drain() must wake it there
+    uring_poll(w->uring, w->wake.fd, uring_data(w, URING_TAG_WAKE));
+    // Backend sockets (see proxy.h) stay in the event loop
+    if (config.upstream_count > 0) {
+        uring_poll(w->uring, event_loop_fd(w->loop), uring_data(w, URING_TAG_LOOP));
+    }
+    return 0;
+}
+
+/*
+ * FUNCTION: run_uring
+ * PURPOSE: worker_run() with io_uring: one io_uring_enter() submits every
+ *          queued receive and send and collects whatever completed
+ */
+static void run_uring(worker *w) {
+    struct uring_completion completion;
+    int timeout_ms = -1;
+
+    while (1) {
+        if (uring_wait(w->uring, timeout_ms) < 0) {
+            perror("io_uring failed");
+            exit(EXIT_FAILURE);
+        }
+        event_loop_tick(w->loop);
+
+        while (uring_next(w->uring, &completion)) {
+            switch (uring_tag(completion.data)) {
+            case URING_TAG_NONE:
+                break;      // A cancel or close reporting back - nothing to do
+            case URING_TAG_ACCEPT:
+                on_uring_accept(w, &completion);
+                break;
+            case URING_TAG_WAKE:
+                on_wake_event(&w->wake, EVENT_READ);
+                uring_poll(w->uring, w->wake.fd, uring_data(w, URING_TAG_WAKE));
+                break;
+            case URING_TAG_LOOP:
+                if (event_loop_run_once(w->loop, 0) < 0) {
+                    perror("Event loop failed");
+                    exit(EXIT_FAILURE);
+                }
+                uring_poll(w->uring, event_loop_fd(w->loop), uring_data(w, URING_TAG_LOOP));
+                break;
+            default:
+                connection_on_completion(uring_owner(completion.data), &completion);
+                break;
+            }
+        }
+
+        http_date_update(&w->date, event_loop_wall_time(w->loop));
+        timeout_ms = expire_connections(w);
+        if (w->accept_paused && w->closed && !w->draining) {
+            w->accept_paused = 0;   // Their slots are free again
+            uring_accept(w->uring, w->listener.fd, uring_data(w, URING_TAG_ACCEPT));
+            w->accept_armed = 1;
+        }
+        free_closed_connections(w);
+        proxy_collect(w);
+        // Not before the accept is gone: queued, the cancel isn't even
+        // submitted yet, and an accept left in the ring would keep taking
+        // clients off the (shared) listening socket for nobody
+        if (w->draining && w->connections == 0 && !w->accept_armed) {
+            return;
+        }
+    }
+}
+
+void worker_run(worker *w) {
+    int timeout_ms = -1;
+
+    if (w->uring && start_uring(w) == 0) {
+        run_uring(w);
+        return;
+    }
+
+    while (!w->draining || w->connections > 0) {
+        if (event_loop_run_once(w->loop, timeout_ms) < 0) {
+            perror("Event loop failed");
+            exit(EXIT_FAILURE);
+        }
+        http_date_update(&w->date, event_loop_wall_time(w->loop));
+        timeout_ms = expire_connections(w);
+        free_closed_connections(w);
+        proxy_collect(w);
+    }
+}
+
+/*
+ * FUNCTION: pin_to_core
+ * PURPOSE: Keep the calling thread on one CPU core
+ * WHY: The thread's connections stay warm in that core's caches, and the
+ *      kernel doesn't bounce it between cores under load
+ */
+static void pin_to_core(worker *w) {
+#if defined(__linux__)
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    cpu_set_t set;
+    int error;
+
+    if (cores <= 0) {
+        return;
+    }
+    CPU_ZERO(&set);
+    CPU_SET((int)(w->id % cores), &set);
+    error = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (error != 0) {
+        fprintf(stderr, "Worker %d: unable to pin to core: %s\n", w->id, strerror(error));
+    }
+#else
+    // macOS has no API to pin a thread to a core - the scheduler decides
+    (void)w;
+#endif
+}
+
+static void *worker_thread_main(void *arg) {
+    worker *w = arg;
+    pin_to_core(w);
+    worker_run(w);
+    return NULL;
+}
+
+int worker_start(worker *w) {
+    int error = pthread_create(&w->thread, NULL, worker_thread_main, w);
+    if (error != 0) {
+        fprintf(stderr, "Unable to start worker %d: %s\n", w->id, strerror(error));
+        return -1;
+    }
+    return 0;
+}
+
+void worker_join(worker *w) {
+    pthread_join(w->thread, NULL);
+}